@@ -0,0 +1,375 @@
+// HTTP/1.1 load generator that reports throughput and p50/p99/p999
+// latency. Linux only:
+//
+//   g++ -std=c++17 -O2 -pthread bench/loadgen.cpp -o loadgen
+//
+//   ./loadgen --port 8080 --path / --connections 64 --duration 10
+//       Closed loop against a running server: each connection sends its
+//       next request as soon as the previous response arrives.
+//   ./loadgen --port 8080 --rate 20000
+//       Open loop at 20000 requests/s in total. Latency counts from when a
+//       request was due, not when it was sent, so a stalled server cannot
+//       hide its queueing delay by slowing the client down.
+//   ./loadgen --spawn 4 --close --path /static.html
+//       Forks the bundled server with 4 workers and measures against it.
+//   ./loadgen --matrix 8
+//       Keep-alive and close, static and dynamic routes, 1, 2, 4 and 8
+//       workers, one table row each.
+//
+// Run the client on other cores than the server (taskset) when comparing
+// builds, or the two compete for the same CPUs.
+#define WEBSERVER_NO_MAIN
+#include "../webserver.cpp"
+
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8088;
+    std::string path = "/dynamic/42";
+    size_t connections = 16;
+    double duration = 5;
+    double warmup = 1;
+    // Requests per second over all connections; 0 runs a closed loop.
+    double rate = 0;
+    bool keep_alive = true;
+    // Workers for a server forked by the generator; 0 uses --host/--port as is.
+    size_t spawn = 0;
+    size_t matrix = 0;
+};
+
+struct Sample {
+    std::vector<uint64_t> latencies;  // nanoseconds
+    uint64_t errors = 0;
+};
+
+const char static_file[] = "/tmp/loadgen_static.html";
+
+int connectTo(const sockaddr_storage& address, socklen_t length) {
+    int fd = socket(address.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (const sockaddr*)&address, length) != 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+bool sendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+std::string_view headerValue(std::string_view head, std::string_view name) {
+    size_t line = head.find("\r\n");
+    while (line != std::string_view::npos && line + 2 < head.size()) {
+        size_t start = line + 2;
+        size_t end = head.find("\r\n", start);
+        if (end == std::string_view::npos) end = head.size();
+        std::string_view header = head.substr(start, end - start);
+        size_t colon = header.find(':');
+        if (colon != std::string_view::npos && equalsIgnoreCase(header.substr(0, colon), name)) {
+            std::string_view value = header.substr(colon + 1);
+            while (!value.empty() && value.front() == ' ') value.remove_prefix(1);
+            return value;
+        }
+        line = end;
+    }
+    return std::string_view();
+}
+
+// Reads one response framed by Content-Length or by the connection
+// closing. status is 0 when the bytes were not a response this can frame.
+bool readResponse(int fd, std::string& buffer, int& status, bool& server_closed) {
+    buffer.clear();
+    status = 0;
+    server_closed = false;
+    size_t head_size = std::string::npos;
+    size_t body_size = 0;
+    bool until_close = false;
+    char chunk[16384];
+    for (;;) {
+        if (head_size == std::string::npos) {
+            size_t end = buffer.find("\r\n\r\n");
+            if (end != std::string::npos) {
+                head_size = end + 4;
+                std::string_view head(buffer.data(), head_size);
+                if (head.size() < 12 || head.compare(0, 5, "HTTP/") != 0) return false;
+                std::from_chars(head.data() + 9, head.data() + 12, status);
+                std::string_view length = headerValue(head, "Content-Length");
+                if (!length.empty()) {
+                    std::from_chars(length.data(), length.data() + length.size(), body_size);
+                } else if (!headerValue(head, "Transfer-Encoding").empty()) {
+                    return false;
+                } else if (status != 204 && status != 304) {
+                    until_close = true;
+                }
+                server_closed = equalsIgnoreCase(headerValue(head, "Connection"), "close");
+            }
+        }
+        if (head_size != std::string::npos && !until_close && buffer.size() >= head_size + body_size) {
+            return true;
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0) return false;
+        if (n == 0) {
+            server_closed = true;
+            return until_close;
+        }
+        buffer.append(chunk, (size_t)n);
+    }
+}
+
+// One connection's share of the load. In open loop mode (interval > 0)
+// request k is due at first_due + k * interval.
+void runConnection(const Options& options, const sockaddr_storage& address, socklen_t address_length,
+                   const std::string& request, Clock::time_point first_due, Clock::duration interval,
+                   Clock::time_point record_from, Clock::time_point stop, Sample& sample) {
+    int fd = -1;
+    std::string buffer;
+    Clock::time_point next_due = first_due;
+    for (;;) {
+        Clock::time_point due;
+        if (interval.count() > 0) {
+            if (next_due >= stop) break;
+            std::this_thread::sleep_until(next_due);
+            due = next_due;
+            next_due += interval;
+        } else {
+            due = Clock::now();
+            if (due >= stop) break;
+        }
+
+        if (fd < 0) {
+            fd = connectTo(address, address_length);
+            if (fd < 0) {
+                if (due >= record_from) sample.errors++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+        }
+        int status = 0;
+        bool server_closed = false;
+        bool ok = sendAll(fd, request) && readResponse(fd, buffer, status, server_closed);
+        Clock::time_point done = Clock::now();
+        if (!ok || server_closed || !options.keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+        if (due < record_from) continue;
+        if (!ok || status < 200 || status >= 400) {
+            sample.errors++;
+        } else {
+            sample.latencies.push_back((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(done - due).count());
+        }
+    }
+    if (fd >= 0) close(fd);
+}
+
+void writeStaticFile() {
+    std::ofstream out(static_file, std::ios::binary | std::ios::trunc);
+    out << "<html><body>";
+    for (int i = 0; i < 64; i++) out << "<p>Static benchmark paragraph number " << i << ".</p>\n";
+    out << "</body></html>\n";
+}
+
+// Forks the bundled server: a dynamic JSON route at /dynamic/:id and a
+// static file at /static.html.
+pid_t spawnServer(const Options& options, size_t workers) {
+    writeStaticFile();
+    // The child would otherwise flush a copy of our buffered output.
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) throw std::runtime_error("fork failed");
+    if (pid == 0) {
+        if (freopen("/dev/null", "w", stdout) == nullptr) _exit(1);
+        try {
+            WebServer server(options.port);
+            server.setWorkerCount(workers);
+            server.addRoute("GET", "/dynamic/:id", [](const HTTPRequest& request, HTTPResponse& response) {
+                std::string body = "{\"id\":\"";
+                body.append(request.param("id")).append("\",\"ok\":true}");
+                response.setContent(body, "application/json");
+            });
+            server.addStaticFileRoute("/static.html", static_file);
+            server.start();
+        } catch (const std::exception& e) {
+            std::cerr << "Server error: " << e.what() << std::endl;
+        }
+        _exit(0);
+    }
+    return pid;
+}
+
+void stopServer(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+bool resolve(const Options& options, sockaddr_storage& address, socklen_t& length) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(options.host.c_str(), std::to_string(options.port).c_str(), &hints, &found) != 0) return false;
+    memcpy(&address, found->ai_addr, found->ai_addrlen);
+    length = found->ai_addrlen;
+    freeaddrinfo(found);
+    return true;
+}
+
+bool waitForServer(const sockaddr_storage& address, socklen_t length) {
+    for (int attempt = 0; attempt < 500; attempt++) {
+        int fd = connectTo(address, length);
+        if (fd >= 0) {
+            close(fd);
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+double percentile(std::vector<uint64_t>& values, double fraction) {
+    if (values.empty()) return 0;
+    size_t index = std::min(values.size() - 1, (size_t)(fraction * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index] / 1000.0;
+}
+
+void printHeader() {
+    printf("%-10s %-8s %7s %5s %-22s %12s %10s %10s %10s %10s %8s\n", "mode", "conn", "clients", "wkrs",
+           "path", "req/s", "p50 us", "p99 us", "p999 us", "max us", "errors");
+}
+
+void runOnce(const Options& options) {
+    pid_t server = 0;
+    if (options.spawn > 0) server = spawnServer(options, options.spawn);
+
+    sockaddr_storage address{};
+    socklen_t length = 0;
+    if (!resolve(options, address, length) || !waitForServer(address, length)) {
+        if (server > 0) stopServer(server);
+        throw std::runtime_error("Cannot reach " + options.host + ":" + std::to_string(options.port));
+    }
+
+    std::string request = "GET " + options.path + " HTTP/1.1\r\nHost: " + options.host + "\r\n";
+    request += options.keep_alive ? "\r\n" : "Connection: close\r\n\r\n";
+
+    Clock::time_point start = Clock::now() + std::chrono::milliseconds(10);
+    Clock::time_point record_from = start + std::chrono::duration_cast<Clock::duration>(
+                                                std::chrono::duration<double>(options.warmup));
+    Clock::time_point stop = record_from + std::chrono::duration_cast<Clock::duration>(
+                                               std::chrono::duration<double>(options.duration));
+    Clock::duration interval(0);
+    if (options.rate > 0) {
+        interval = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(options.connections / options.rate));
+    }
+
+    std::vector<Sample> samples(options.connections);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < options.connections; i++) {
+        // Spread the open loop schedules evenly over one interval.
+        Clock::time_point first_due = start + interval * i / options.connections;
+        threads.emplace_back(runConnection, std::cref(options), std::cref(address), length, std::cref(request),
+                             first_due, interval, record_from, stop, std::ref(samples[i]));
+    }
+    for (std::thread& thread : threads) thread.join();
+    if (server > 0) stopServer(server);
+
+    std::vector<uint64_t> all;
+    uint64_t errors = 0;
+    for (Sample& sample : samples) {
+        all.insert(all.end(), sample.latencies.begin(), sample.latencies.end());
+        errors += sample.errors;
+    }
+    double max = all.empty() ? 0 : *std::max_element(all.begin(), all.end()) / 1000.0;
+    double p50 = percentile(all, 0.5);
+    double p99 = percentile(all, 0.99);
+    double p999 = percentile(all, 0.999);
+    std::string mode = options.rate > 0 ? "open" : "closed";
+    std::string workers = options.spawn > 0 ? std::to_string(options.spawn) : "-";
+    printf("%-10s %-8s %7zu %5s %-22s %12.0f %10.1f %10.1f %10.1f %10.1f %8llu\n", mode.c_str(),
+           options.keep_alive ? "keep" : "close", options.connections, workers.c_str(), options.path.c_str(),
+           all.size() / options.duration, p50, p99, p999, max, (unsigned long long)errors);
+    fflush(stdout);
+}
+
+void usage() {
+    std::cerr << "usage: loadgen [--host H] [--port P] [--path /p] [--connections N] [--duration S]\n"
+                 "               [--warmup S] [--rate R] [--close] [--spawn WORKERS] [--matrix MAX_WORKERS]\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                usage();
+                exit(2);
+            }
+            return argv[++i];
+        };
+        if (arg == "--host") options.host = value();
+        else if (arg == "--port") options.port = atoi(value());
+        else if (arg == "--path") options.path = value();
+        else if (arg == "--connections") options.connections = std::max(1, atoi(value()));
+        else if (arg == "--duration") options.duration = std::max(0.1, atof(value()));
+        else if (arg == "--warmup") options.warmup = std::max(0.0, atof(value()));
+        else if (arg == "--rate") options.rate = atof(value());
+        else if (arg == "--close") options.keep_alive = false;
+        else if (arg == "--spawn") options.spawn = atoi(value());
+        else if (arg == "--matrix") options.matrix = atoi(value());
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    try {
+        printHeader();
+        if (options.matrix == 0) {
+            runOnce(options);
+            return 0;
+        }
+        // Powers of two up to the maximum, and the maximum itself.
+        std::vector<size_t> worker_counts;
+        for (size_t workers = 1; workers < options.matrix; workers *= 2) worker_counts.push_back(workers);
+        worker_counts.push_back(options.matrix);
+        for (size_t workers : worker_counts) {
+            for (bool keep_alive : {true, false}) {
+                for (const char* path : {"/static.html", "/dynamic/42"}) {
+                    Options run = options;
+                    run.spawn = workers;
+                    run.keep_alive = keep_alive;
+                    run.path = path;
+                    runOnce(run);
+                }
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
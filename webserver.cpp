@@ -1,140 +1,10422 @@
 #include <iostream>
 #include <string>
-#include <sstream>
-#include <fstream>
 #include <vector>
 #include <unordered_map>
 #include <functional>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <string_view>
+#include <deque>
+#include <ctime>
+#include <cstdio>
+#include <shared_mutex>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <type_traits>
+#include <charconv>
+#include <iterator>
+#include <random>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    #include <coroutine>
+    #include <exception>
+    #include <optional>
+    #define WEBSERVER_HAVE_COROUTINES
+#endif
+
+// Response compression codecs are opt-in because each needs its library
+// at link time: -DWEBSERVER_WITH_ZLIB (-lz) for gzip and deflate,
+// -DWEBSERVER_WITH_BROTLI (-lbrotlienc), -DWEBSERVER_WITH_ZSTD (-lzstd).
+#ifdef WEBSERVER_WITH_ZLIB
+    #include <zlib.h>
+#endif
+#ifdef WEBSERVER_WITH_BROTLI
+    #include <brotli/encode.h>
+#endif
+#ifdef WEBSERVER_WITH_ZSTD
+    #include <zstd.h>
+#endif
+
+// HTTPS needs OpenSSL 1.1.1 or later (or BoringSSL): -DWEBSERVER_WITH_OPENSSL
+// -lssl -lcrypto. Linux kTLS is used when OpenSSL and the kernel support it.
+#ifdef WEBSERVER_WITH_OPENSSL
+    #include <openssl/ssl.h>
+    #include <openssl/err.h>
+    #include <openssl/rand.h>
+#endif
 
 #ifdef _WIN32
     #include <winsock2.h>
     #include <ws2tcpip.h>
+    #include <sys/types.h>
+    #include <sys/stat.h>
     #pragma comment(lib, "ws2_32.lib")
     typedef int socklen_t;
 #else
     #include <sys/socket.h>
+    #include <sys/uio.h>
     #include <netinet/in.h>
+    #include <netinet/tcp.h>
     #include <arpa/inet.h>
     #include <unistd.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <errno.h>
+    #include <netdb.h>
+    #include <pthread.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/resource.h>
+    #include <sys/wait.h>
+    extern char** environ;
     #define SOCKET int
     #define INVALID_SOCKET -1
     #define SOCKET_ERROR -1
     #define closesocket close
 #endif
 
-class HTTPRequest {
-public:
-    std::string method;
-    std::string path;
-    std::string version;
-    std::unordered_map<std::string, std::string> headers;
-    std::string body;
+#if defined(__linux__)
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sys/sendfile.h>
+    #include <sys/syscall.h>
+    #define WEBSERVER_USE_EPOLL
+    #define WEBSERVER_USE_SENDFILE
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+        // Headers from Linux 6.1 or later, the newest flags the backend uses.
+        #ifdef IORING_SETUP_DEFER_TASKRUN
+            #define WEBSERVER_HAVE_IO_URING
+        #endif
+    #endif
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+    #include <sys/event.h>
+    #define WEBSERVER_USE_KQUEUE
+    #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
+        #define WEBSERVER_USE_SENDFILE
+    #endif
+#else
+    #ifndef _WIN32
+        #include <poll.h>
+    #endif
+    #define WEBSERVER_USE_POLL
+#endif
+
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+#endif
+
+// Vector byte scanning for the request parser. Other targets and
+// compilers use the scalar loop.
+#if defined(__GNUC__) || defined(__clang__)
+    #if defined(__AVX2__)
+        #include <immintrin.h>
+        #define WEBSERVER_SCAN_AVX2
+    #elif defined(__SSE2__)
+        #include <emmintrin.h>
+        #define WEBSERVER_SCAN_SSE2
+    #elif defined(__ARM_NEON)
+        #include <arm_neon.h>
+        #define WEBSERVER_SCAN_NEON
+    #endif
+#endif
+
+// Request tracing (WebServer::setTracing()) is compiled in with
+// -DWEBSERVER_WITH_TRACING. Every hook is an `if constexpr` on
+// tracing_built, so without the flag they leave no code behind.
+#ifdef WEBSERVER_WITH_TRACING
+constexpr bool tracing_built = true;
+    #if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        #include <x86intrin.h>
+        #define WEBSERVER_TRACE_TSC
+    #elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        #include <intrin.h>
+        #define WEBSERVER_TRACE_TSC
+    #endif
+#else
+constexpr bool tracing_built = false;
+#endif
+
+// Timestamp for trace spans: the time-stamp counter where there is one,
+// a few nanoseconds to read against tens for steady_clock::now(), and
+// steady_clock nanoseconds elsewhere. The Tracer converts readings to
+// wall time when it writes them out.
+inline uint64_t traceClock() {
+#ifdef WEBSERVER_TRACE_TSC
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+typedef std::pair<std::string_view, std::string_view> HTTPHeader;
+
+// ASCII only, unlike std::tolower, so it is locale-free and constexpr.
+constexpr char asciiLower(char c) {
+    return c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+}
+
+constexpr bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (asciiLower(a[i]) != asciiLower(b[i])) return false;
+    }
+    return true;
+}
+
+// First byte in [p, end) equal to one of Cs, or end. Request lines and
+// header lines are mostly long runs of ordinary bytes, so this checks 32
+// or 16 of them per step.
+template <char... Cs>
+inline const char* findFirstOf(const char* p, const char* end) {
+#if defined(WEBSERVER_SCAN_AVX2)
+    for (; end - p >= 32; p += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hits = _mm256_setzero_si256();
+        ((hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(Cs)))), ...);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+#endif
+#if defined(WEBSERVER_SCAN_AVX2) || defined(WEBSERVER_SCAN_SSE2)
+    for (; end - p >= 16; p += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+        __m128i hits = _mm_setzero_si128();
+        ((hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(Cs)))), ...);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hits);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+#elif defined(WEBSERVER_SCAN_NEON)
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t bytes = vld1q_u8((const uint8_t*)p);
+        uint8x16_t hits = vdupq_n_u8(0);
+        ((hits = vorrq_u8(hits, vceqq_u8(bytes, vdupq_n_u8((uint8_t)Cs)))), ...);
+        // Narrows each byte of the comparison to four bits of one word.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hits), 4)), 0);
+        if (mask != 0) return p + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+    for (; p < end; p++) {
+        if (((*p == Cs) || ...)) return p;
+    }
+    return end;
+}
+
+// Fixed-capacity header list. Entries are views into the request buffer,
+// so filling it never allocates.
+class HTTPHeaders {
+public:
+    static const size_t max_headers = 64;
+    typedef const HTTPHeader* const_iterator;
+
+    // Headers the server reads itself. They are recognized as they are
+    // added, so looking one up is an array index.
+    enum Known : uint8_t {
+        Host,
+        Connection,
+        ContentLength,
+        ContentType,
+        TransferEncoding,
+        AcceptEncoding,
+        Expect,
+        IfNoneMatch,
+        IfModifiedSince,
+        Upgrade,
+        Unknown,
+        known_count = Unknown
+    };
+
+    // Case-insensitive: by length first, then one compare.
+    static constexpr Known classify(std::string_view name) {
+        switch (name.size()) {
+        case 4: return equalsIgnoreCase(name, "host") ? Host : Unknown;
+        case 6: return equalsIgnoreCase(name, "expect") ? Expect : Unknown;
+        case 7: return equalsIgnoreCase(name, "upgrade") ? Upgrade : Unknown;
+        case 10: return equalsIgnoreCase(name, "connection") ? Connection : Unknown;
+        case 12: return equalsIgnoreCase(name, "content-type") ? ContentType : Unknown;
+        case 13: return equalsIgnoreCase(name, "if-none-match") ? IfNoneMatch : Unknown;
+        case 14: return equalsIgnoreCase(name, "content-length") ? ContentLength : Unknown;
+        case 15: return equalsIgnoreCase(name, "accept-encoding") ? AcceptEncoding : Unknown;
+        case 17:
+            if (equalsIgnoreCase(name, "transfer-encoding")) return TransferEncoding;
+            return equalsIgnoreCase(name, "if-modified-since") ? IfModifiedSince : Unknown;
+        default: return Unknown;
+        }
+    }
+
+    const_iterator begin() const { return entries; }
+    const_iterator end() const { return entries + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void clear() {
+        count = 0;
+        memset(slots, 0, sizeof(slots));
+    }
+
+    bool add(std::string_view name, std::string_view value) {
+        return add(name, value, classify(name));
+    }
+
+    // For callers that already classified name.
+    bool add(std::string_view name, std::string_view value, Known kind) {
+        if (count == max_headers) return false;
+        // The first occurrence wins, as with a lookup by name.
+        if (kind != Unknown && slots[kind] == 0) slots[kind] = (uint8_t)(count + 1);
+        entries[count++] = HTTPHeader(name, value);
+        return true;
+    }
+
+    const_iterator find(Known kind) const {
+        if (kind == Unknown) return end();
+        return slots[kind] != 0 ? entries + slots[kind] - 1 : end();
+    }
+
+    // Case-insensitive, as header names are.
+    const_iterator find(std::string_view name) const {
+        Known kind = classify(name);
+        if (kind != Unknown) return find(kind);
+        for (size_t i = 0; i < count; i++) {
+            if (equalsIgnoreCase(entries[i].first, name)) return entries + i;
+        }
+        return end();
+    }
+
+    std::string_view get(Known kind, std::string_view fallback = std::string_view()) const {
+        const_iterator it = find(kind);
+        return it != end() ? it->second : fallback;
+    }
+
+    std::string_view get(std::string_view name, std::string_view fallback = std::string_view()) const {
+        const_iterator it = find(name);
+        return it != end() ? it->second : fallback;
+    }
+
+private:
+    HTTPHeader entries[max_headers];
+    size_t count = 0;
+    // Index + 1 of each known header's first entry, 0 when absent.
+    uint8_t slots[known_count] = {};
+};
+
+// Parameters captured by the router, as views into the request path and
+// the route patterns.
+class RouteParams {
+public:
+    static const size_t max_params = 8;
+    typedef const std::pair<std::string_view, std::string_view>* const_iterator;
+
+    const_iterator begin() const { return entries; }
+    const_iterator end() const { return entries + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void clear() { count = 0; }
+
+    bool push(std::string_view name, std::string_view value) {
+        if (count == max_params) return false;
+        entries[count++] = std::make_pair(name, value);
+        return true;
+    }
+
+    void pop() { count--; }
+
+    std::string_view get(std::string_view name, std::string_view fallback = std::string_view()) const {
+        for (size_t i = 0; i < count; i++) {
+            if (entries[i].first == name) return entries[i].second;
+        }
+        return fallback;
+    }
+
+private:
+    std::pair<std::string_view, std::string_view> entries[max_params];
+    size_t count = 0;
+};
+
+inline int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Percent-decodes text, turning '+' into a space too when plus_as_space
+// is set (form encoding). Text with nothing to decode comes back as is,
+// so the common case copies nothing; otherwise it is decoded into scratch
+// and the result is a view of scratch. A '%' without two hex digits after
+// it is kept literally.
+inline std::string_view percentDecode(std::string_view text, std::string& scratch, bool plus_as_space = false) {
+    const char* end = text.data() + text.size();
+    const char* first = plus_as_space ? findFirstOf<'%', '+'>(text.data(), end) : findFirstOf<'%'>(text.data(), end);
+    if (first == end) return text;
+    scratch.assign(text.data(), first - text.data());
+    for (const char* p = first; p < end; p++) {
+        char c = *p;
+        if (c == '+' && plus_as_space) {
+            c = ' ';
+        } else if (c == '%' && end - p > 2 && hexDigit(p[1]) >= 0 && hexDigit(p[2]) >= 0) {
+            c = (char)(hexDigit(p[1]) * 16 + hexDigit(p[2]));
+            p += 2;
+        }
+        scratch.push_back(c);
+    }
+    return scratch;
+}
+
+// The name=value pairs of a query string or an
+// application/x-www-form-urlencoded body, split on '&' and decoded as the
+// iterator reaches them. A yielded view points into the input unless
+// decoding changed its bytes, in which case it points into the iterator
+// and lasts until the iterator moves on. A pair without '=' has an empty
+// value; empty pairs are skipped.
+class URLParams {
+public:
+    typedef std::pair<std::string_view, std::string_view> value_type;
+
+    class iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef URLParams::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        iterator() : done(true) {}
+        explicit iterator(std::string_view encoded) : rest(encoded), done(false) { ++*this; }
+        // Copies decode afresh, since the views may point into other's scratch.
+        iterator(const iterator& other) : rest(other.rest), done(other.done), encoded(other.encoded) { decode(); }
+        iterator& operator=(const iterator& other) {
+            rest = other.rest;
+            done = other.done;
+            encoded = other.encoded;
+            decode();
+            return *this;
+        }
+
+        reference operator*() const { return current; }
+        pointer operator->() const { return &current; }
+        // The pair as it appears in the input, still encoded.
+        const value_type& raw() const { return encoded; }
+
+        iterator& operator++() {
+            done = !next(rest, encoded);
+            decode();
+            return *this;
+        }
+
+        bool operator==(const iterator& other) const {
+            return done == other.done && (done || rest.data() == other.rest.data());
+        }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+
+    private:
+        std::string_view rest;
+        bool done;
+        value_type encoded;
+        value_type current;
+        std::string name_scratch;
+        std::string value_scratch;
+
+        void decode() {
+            if (done) return;
+            current.first = percentDecode(encoded.first, name_scratch, true);
+            current.second = percentDecode(encoded.second, value_scratch, true);
+        }
+    };
+
+    explicit URLParams(std::string_view encoded = std::string_view()) : encoded(encoded) {}
+
+    iterator begin() const { return iterator(encoded); }
+    iterator end() const { return iterator(); }
+    bool empty() const { return begin() == end(); }
+    std::string_view raw() const { return encoded; }
+
+    // The first value named name, decoded into scratch if it has to be;
+    // fallback when there is none. Only the matching value is decoded.
+    std::string_view get(std::string_view name, std::string& scratch,
+                         std::string_view fallback = std::string_view()) const {
+        std::string_view rest = encoded;
+        value_type pair;
+        while (next(rest, pair)) {
+            if (percentDecode(pair.first, scratch, true) == name) return percentDecode(pair.second, scratch, true);
+        }
+        return fallback;
+    }
+
+    bool has(std::string_view name) const {
+        std::string scratch;
+        std::string_view rest = encoded;
+        value_type pair;
+        while (next(rest, pair)) {
+            if (percentDecode(pair.first, scratch, true) == name) return true;
+        }
+        return false;
+    }
+
+private:
+    std::string_view encoded;
+
+    // Splits the next non-empty pair off the front of rest.
+    static bool next(std::string_view& rest, value_type& pair) {
+        while (!rest.empty()) {
+            size_t amp = rest.find('&');
+            std::string_view item = rest.substr(0, amp);
+            rest = amp == std::string_view::npos ? std::string_view() : rest.substr(amp + 1);
+            if (item.empty()) continue;
+            size_t eq = item.find('=');
+            pair.first = item.substr(0, eq);
+            pair.second = eq == std::string_view::npos ? std::string_view() : item.substr(eq + 1);
+            return true;
+        }
+        return false;
+    }
+};
+
+// All fields are views into the buffer the request was parsed from and
+// stay valid only as long as that buffer is left untouched.
+class HTTPRequest {
+public:
+    std::string_view method;
+    // The target up to any '?', still percent-encoded. Routes match on it.
+    std::string_view path;
+    // What followed the '?', still encoded; empty without one.
+    std::string_view query;
+    std::string_view version;
+    HTTPHeaders headers;
+    std::string_view body;
+    // Filled in by the router for ":name" and "*name" pattern segments.
+    RouteParams params;
+
+    void clear() {
+        method = path = query = version = body = std::string_view();
+        headers.clear();
+        params.clear();
+    }
+
+    std::string_view param(std::string_view name) const {
+        return params.get(name);
+    }
+
+    // The path percent-decoded, in scratch if anything had to change.
+    std::string_view decodedPath(std::string& scratch) const { return percentDecode(path, scratch); }
+
+    URLParams queryParams() const { return URLParams(query); }
+
+    // The body's parameters for an application/x-www-form-urlencoded
+    // request; none for any other body.
+    URLParams formParams() const;
+
+    // Splits a request target into path and query.
+    void setTarget(std::string_view target) {
+        size_t mark = target.find('?');
+        path = target.substr(0, mark);
+        query = mark == std::string_view::npos ? std::string_view() : target.substr(mark + 1);
+    }
+
+    // Parses a complete request from a private copy of request_str.
+    void parse(const std::string& request_str);
+
+    // Makes this a self-contained copy of other, whose views all point
+    // into raw (the bytes it was parsed from).
+    void assign(const HTTPRequest& other, std::string_view raw);
+    // Makes this a self-contained copy of other, wherever its views point.
+    void assign(const HTTPRequest& other);
+
+private:
+    std::string storage;
+};
+
+// Incremental HTTP/1.x request parser. parseHead() is called each time
+// more bytes arrive and resumes where the previous call stopped; it only
+// records offsets until the head is complete, so the caller's buffer may
+// be reallocated between calls as long as the bytes already seen are kept.
+// The body is then either collected with parseBody(), which decodes
+// chunked framing in place so the body ends up contiguous right after the
+// head, or handed out piece by piece with streamBody(). After
+// expectResponse() it parses a response from a proxy backend instead.
+class HTTPRequestParser {
+public:
+    enum Result { Incomplete, Complete, Error };
+
+    static const size_t max_header_size = 64 * 1024;
+
+    HTTPRequestParser() : max_body_size(1024 * 1024) { reset(); }
+
+    void reset() {
+        state = RequestLineMethod;
+        pos = 0;
+        token_start = 0;
+        header_count = 0;
+        chunked = false;
+        content_length = 0;
+        body_start = 0;
+        body_raw = 0;
+        body_size = 0;
+        chunk_state = ChunkSize;
+        chunk_remaining = 0;
+        chunk_digits = 0;
+        error_status = 400;
+        response_mode = false;
+        response_to_head = false;
+        until_close = false;
+        response_status = 0;
+    }
+
+    // Parses a status line in place of a request line, until the next
+    // reset(). request.version and the headers are filled in as usual;
+    // statusCode() and reasonPhrase() give the rest. head_request is set
+    // when the response answers a HEAD, which it then carries no body for.
+    void expectResponse(bool head_request) {
+        response_mode = true;
+        response_to_head = head_request;
+        method = path = query = reason = Span{0, 0};
+    }
+
+    // Upper bound for bodies collected by parseBody(); larger ones fail with 413.
+    void setMaxBodySize(size_t size) { max_body_size = size; }
+
+    bool headComplete() const { return state == Body; }
+    bool isChunked() const { return chunked; }
+    bool hasBody() const { return chunked || content_length > 0 || until_close; }
+    size_t contentLength() const { return content_length; }
+    size_t headSize() const { return body_start; }
+    // A response framed by neither length nor chunks: its body runs until
+    // the peer closes, and the body parsers never return Complete.
+    bool untilClose() const { return until_close; }
+    int statusCode() const { return response_status; }
+    std::string_view reasonPhrase(const char* data) const { return reason.in(data); }
+
+    // Raw bytes of the request (head plus framed body) once the body is
+    // complete. Bytes discarded by the caller during streamBody() are not counted.
+    size_t consumed() const { return body_start + body_raw; }
+
+    // Status code to answer with after a call returned Error.
+    int errorStatus() const { return error_status; }
+
+    Result parseHead(const char* data, size_t size, HTTPRequest& request) {
+        if (state == Body) {
+            return Complete;
+        }
+
+        while (pos < size) {
+            char c = data[pos];
+            switch (state) {
+            case RequestLineMethod:
+                if (c == ' ') {
+                    if (pos == token_start) return fail(400);
+                    if (response_mode) {
+                        version = Span{token_start, pos - token_start};
+                        if (version.length < 8 || std::memcmp(data + version.offset, "HTTP/1.", 7) != 0) {
+                            return fail(502);
+                        }
+                        state = StatusLineCode;
+                    } else {
+                        method = Span{token_start, pos - token_start};
+                        state = RequestLinePath;
+                    }
+                    token_start = pos + 1;
+                } else if (c == '\r' || c == '\n') {
+                    if (pos != token_start) return fail(400);
+                    token_start = pos + 1;  // tolerate stray CRLF before a request
+                }
+                break;
+            case RequestLinePath:
+                if (c == ' ') {
+                    if (pos == token_start) return fail(400);
+                    const char* mark = (const char*)std::memchr(data + token_start, '?', pos - token_start);
+                    size_t path_end = mark != nullptr ? (size_t)(mark - data) : pos;
+                    path = Span{token_start, path_end - token_start};
+                    query = mark != nullptr ? Span{path_end + 1, pos - path_end - 1} : Span{pos, 0};
+                    token_start = pos + 1;
+                    state = RequestLineVersion;
+                } else if (c == '\r' || c == '\n') {
+                    return fail(400);
+                } else {
+                    pos = findFirstOf<' ', '\r', '\n'>(data + pos, data + size) - data;
+                    continue;
+                }
+                break;
+            case RequestLineVersion:
+                if (c == '\r' || c == '\n') {
+                    version = Span{token_start, pos - token_start};
+                    if (version.length < 8 || std::memcmp(data + version.offset, "HTTP/1.", 7) != 0) {
+                        return fail(version.length == 0 ? 400 : 505);
+                    }
+                    state = c == '\r' ? RequestLineEnd : HeaderLineStart;
+                }
+                break;
+            case StatusLineCode:
+                if (c >= '0' && c <= '9') {
+                    if (pos - token_start == 3) return fail(502);
+                    response_status = response_status * 10 + (c - '0');
+                } else if (pos - token_start != 3) {
+                    return fail(502);
+                } else if (c == ' ') {
+                    token_start = pos + 1;
+                    state = StatusLineReason;
+                } else if (c == '\r' || c == '\n') {
+                    state = c == '\r' ? RequestLineEnd : HeaderLineStart;
+                } else {
+                    return fail(502);
+                }
+                break;
+            case StatusLineReason:
+                if (c == '\r' || c == '\n') {
+                    reason = Span{token_start, pos - token_start};
+                    state = c == '\r' ? RequestLineEnd : HeaderLineStart;
+                } else {
+                    pos = findFirstOf<'\r', '\n'>(data + pos, data + size) - data;
+                    continue;
+                }
+                break;
+            case RequestLineEnd:
+            case HeaderLineEnd:
+                if (c != '\n') return fail(400);
+                state = HeaderLineStart;
+                break;
+            case HeaderLineStart:
+                if (c == '\r') {
+                    state = HeadersEnd;
+                } else if (c == '\n') {
+                    pos++;
+                    return finishHead(data, request);
+                } else if (c == ' ' || c == '\t' || c == ':') {
+                    return fail(400);  // obsolete line folding is rejected
+                } else {
+                    token_start = pos;
+                    state = HeaderName;
+                }
+                break;
+            case HeaderName:
+                if (c == ':') {
+                    if (header_count == HTTPHeaders::max_headers) return fail(431);
+                    HeaderSpan& span = spans[header_count];
+                    span.name = Span{token_start, pos - token_start};
+                    span.kind = HTTPHeaders::classify(span.name.in(data));
+                    state = HeaderValueStart;
+                } else if (c == '\r' || c == '\n' || c == ' ' || c == '\t') {
+                    return fail(400);
+                } else {
+                    pos = findFirstOf<':', '\r', '\n', ' ', '\t'>(data + pos, data + size) - data;
+                    continue;
+                }
+                break;
+            case HeaderValueStart:
+                if (c == ' ' || c == '\t') {
+                    break;
+                }
+                token_start = pos;
+                state = HeaderValue;
+                [[fallthrough]];
+            case HeaderValue:
+                if (c == '\r' || c == '\n') {
+                    size_t end = pos;
+                    while (end > token_start && (data[end - 1] == ' ' || data[end - 1] == '\t')) end--;
+                    spans[header_count++].value = Span{token_start, end - token_start};
+                    state = c == '\r' ? HeaderLineEnd : HeaderLineStart;
+                } else {
+                    pos = findFirstOf<'\r', '\n'>(data + pos, data + size) - data;
+                    continue;
+                }
+                break;
+            case HeadersEnd:
+                if (c != '\n') return fail(400);
+                pos++;
+                return finishHead(data, request);
+            case Body:
+                break;
+            }
+            pos++;
+        }
+
+        if (pos > max_header_size) return fail(431);
+        return Incomplete;
+    }
+
+    // Points the head fields of request at data again, e.g. after the
+    // buffer holding the request has been reallocated.
+    void bind(const char* data, HTTPRequest& request) const {
+        request.method = method.in(data);
+        request.path = path.in(data);
+        request.query = query.in(data);
+        request.version = version.in(data);
+        request.headers.clear();
+        for (size_t i = 0; i < header_count; i++) {
+            request.headers.add(spans[i].name.in(data), spans[i].value.in(data), spans[i].kind);
+        }
+        request.body = std::string_view(data + body_start, body_size);
+    }
+
+    // After parseHead(): gathers the body into data[headSize(), ...) and
+    // sets request.body once all of it has arrived.
+    Result parseBody(char* data, size_t size, HTTPRequest& request) {
+        char* body = data + body_start;
+        size_t used = 0;
+        Result result = decode(body + body_raw, size - body_start - body_raw, used,
+                               [this, body](const char* run, size_t length) {
+                                   if (body + body_size != run) {
+                                       std::memmove(body + body_size, run, length);
+                                   }
+                                   body_size += length;
+                               });
+        body_raw += used;
+        if (result != Error && body_size > max_body_size) {
+            return fail(413);
+        }
+        if (result == Complete) {
+            bind(data, request);
+        }
+        return result;
+    }
+
+    // After parseHead(): passes each available run of body bytes in
+    // data[headSize(), size) to sink and sets used to the raw bytes taken,
+    // which the caller should discard before the next call.
+    template <class Sink>
+    Result streamBody(const char* data, size_t size, size_t& used, Sink&& sink) {
+        used = 0;
+        return decode(data + body_start, size - body_start, used,
+                      [this, &sink](const char* run, size_t length) {
+                          body_size += length;
+                          sink(std::string_view(run, length));
+                      });
+    }
+
+private:
+    enum State {
+        RequestLineMethod,
+        RequestLinePath,
+        RequestLineVersion,
+        StatusLineCode,
+        StatusLineReason,
+        RequestLineEnd,
+        HeaderLineStart,
+        HeaderName,
+        HeaderValueStart,
+        HeaderValue,
+        HeaderLineEnd,
+        HeadersEnd,
+        Body
+    };
+
+    enum ChunkState {
+        ChunkSize,
+        ChunkExtension,
+        ChunkSizeLF,
+        ChunkData,
+        ChunkDataCR,
+        ChunkDataLF,
+        TrailerLineStart,
+        TrailerLine,
+        TrailerLF,
+        ChunkDone
+    };
+
+    struct Span {
+        size_t offset;
+        size_t length;
+        std::string_view in(const char* data) const { return std::string_view(data + offset, length); }
+    };
+
+    struct HeaderSpan {
+        Span name;
+        Span value;
+        HTTPHeaders::Known kind;
+    };
+
+    State state;
+    size_t pos;
+    size_t token_start;
+    Span method, path, query, version, reason;
+    HeaderSpan spans[HTTPHeaders::max_headers];
+    size_t header_count;
+    bool chunked;
+    size_t content_length;
+    size_t body_start;
+    size_t body_raw;
+    size_t body_size;
+    ChunkState chunk_state;
+    size_t chunk_remaining;
+    int chunk_digits;
+    size_t max_body_size;
+    int error_status;
+    bool response_mode;
+    bool response_to_head;
+    bool until_close;
+    int response_status;
+
+    Result fail(int status) {
+        error_status = status;
+        return Error;
+    }
+
+    static bool parseSize(std::string_view text, size_t& value) {
+        if (text.empty() || text.size() > 18) return false;
+        size_t result = 0;
+        for (char c : text) {
+            if (c < '0' || c > '9') return false;
+            result = result * 10 + (c - '0');
+        }
+        value = result;
+        return true;
+    }
+
+    Result finishHead(const char* data, HTTPRequest& request) {
+        body_start = pos;
+        bool has_length = false;
+        for (size_t i = 0; i < header_count; i++) {
+            std::string_view value = spans[i].value.in(data);
+            if (spans[i].kind == HTTPHeaders::ContentLength) {
+                size_t length;
+                if (!parseSize(value, length) || (has_length && length != content_length)) return fail(400);
+                content_length = length;
+                has_length = true;
+            } else if (spans[i].kind == HTTPHeaders::TransferEncoding) {
+                if (!equalsIgnoreCase(value, "chunked")) return fail(response_mode ? 502 : 501);
+                chunked = true;
+            }
+        }
+        // Both framings at once is the classic request smuggling vector.
+        if (chunked && has_length) return fail(response_mode ? 502 : 400);
+        if (response_mode) {
+            // RFC 9112, 6.3: these never have a body, whatever the headers say.
+            if (response_to_head || response_status < 200 || response_status == 204 || response_status == 304) {
+                chunked = false;
+                content_length = 0;
+            } else if (!chunked && !has_length) {
+                until_close = true;
+            }
+        }
+        state = Body;
+        bind(data, request);
+        return Complete;
+    }
+
+    template <class Emit>
+    Result decode(const char* data, size_t size, size_t& used, Emit&& emit) {
+        if (until_close) {
+            if (size > 0) emit(data, size);
+            used = size;
+            return Incomplete;
+        }
+        if (!chunked) {
+            size_t remaining = content_length - body_size;
+            size_t take = std::min(remaining, size);
+            if (take > 0) {
+                emit(data, take);
+            }
+            used = take;
+            return body_size == content_length ? Complete : Incomplete;
+        }
+
+        size_t i = 0;
+        while (i < size && chunk_state != ChunkDone) {
+            char c = data[i];
+            switch (chunk_state) {
+            case ChunkSize: {
+                int digit = hexDigit(c);
+                if (digit >= 0) {
+                    if (++chunk_digits > 15) return fail(400);
+                    chunk_remaining = chunk_remaining * 16 + digit;
+                } else if (chunk_digits == 0) {
+                    return fail(400);
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    chunk_state = ChunkExtension;
+                } else if (c == '\r') {
+                    chunk_state = ChunkSizeLF;
+                } else if (c == '\n') {
+                    chunk_state = chunk_remaining > 0 ? ChunkData : TrailerLineStart;
+                } else {
+                    return fail(400);
+                }
+                i++;
+                break;
+            }
+            case ChunkExtension:
+                if (c == '\r') chunk_state = ChunkSizeLF;
+                else if (c == '\n') chunk_state = chunk_remaining > 0 ? ChunkData : TrailerLineStart;
+                i++;
+                break;
+            case ChunkSizeLF:
+                if (c != '\n') return fail(400);
+                chunk_state = chunk_remaining > 0 ? ChunkData : TrailerLineStart;
+                i++;
+                break;
+            case ChunkData: {
+                size_t take = std::min(chunk_remaining, size - i);
+                emit(data + i, take);
+                i += take;
+                chunk_remaining -= take;
+                if (chunk_remaining == 0) chunk_state = ChunkDataCR;
+                break;
+            }
+            case ChunkDataCR:
+                if (c == '\r') {
+                    chunk_state = ChunkDataLF;
+                } else if (c == '\n') {
+                    chunk_state = ChunkSize;
+                    chunk_digits = 0;
+                } else {
+                    return fail(400);
+                }
+                i++;
+                break;
+            case ChunkDataLF:
+                if (c != '\n') return fail(400);
+                chunk_state = ChunkSize;
+                chunk_digits = 0;
+                i++;
+                break;
+            case TrailerLineStart:
+                if (c == '\r') chunk_state = TrailerLF;
+                else if (c == '\n') chunk_state = ChunkDone;
+                else chunk_state = TrailerLine;
+                i++;
+                break;
+            case TrailerLine:
+                if (c == '\n') chunk_state = TrailerLineStart;
+                i++;
+                break;
+            case TrailerLF:
+                if (c != '\n') return fail(400);
+                chunk_state = ChunkDone;
+                i++;
+                break;
+            case ChunkDone:
+                break;
+            }
+        }
+        used = i;
+        return chunk_state == ChunkDone ? Complete : Incomplete;
+    }
+};
+
+inline void HTTPRequest::parse(const std::string& request_str) {
+    HTTPRequestParser parser;
+    clear();
+    storage = request_str;
+    char* data = &storage[0];
+    HTTPRequestParser::Result result = parser.parseHead(data, storage.size(), *this);
+    if (result == HTTPRequestParser::Complete) {
+        result = parser.parseBody(data, storage.size(), *this);
+    }
+    if (result == HTTPRequestParser::Error) {
+        throw std::runtime_error("Malformed HTTP request");
+    }
+    if (result == HTTPRequestParser::Incomplete) {
+        throw std::runtime_error("Incomplete HTTP request");
+    }
+}
+
+inline URLParams HTTPRequest::formParams() const {
+    std::string_view type = headers.get(HTTPHeaders::ContentType);
+    type = type.substr(0, type.find(';'));
+    while (!type.empty() && (type.back() == ' ' || type.back() == '\t')) type.remove_suffix(1);
+    if (!equalsIgnoreCase(type, "application/x-www-form-urlencoded")) return URLParams();
+    return URLParams(body);
+}
+
+inline void HTTPRequest::assign(const HTTPRequest& other, std::string_view raw) {
+    storage.assign(raw.data(), raw.size());
+    uintptr_t from = (uintptr_t)raw.data();
+    auto rebase = [&](std::string_view view) {
+        uintptr_t at = (uintptr_t)view.data();
+        if (at < from || at > from + raw.size()) return view;
+        return std::string_view(storage.data() + (at - from), view.size());
+    };
+    clear();
+    method = rebase(other.method);
+    path = rebase(other.path);
+    query = rebase(other.query);
+    version = rebase(other.version);
+    body = rebase(other.body);
+    for (const HTTPHeader& header : other.headers) {
+        headers.add(rebase(header.first), rebase(header.second));
+    }
+    for (const auto& param : other.params) {
+        params.push(rebase(param.first), rebase(param.second));
+    }
+}
+
+inline void HTTPRequest::assign(const HTTPRequest& other) {
+    // other may be this, so its views are saved before anything changes.
+    std::string_view line[5] = {other.method, other.path, other.query, other.version, other.body};
+    HTTPHeaders source_headers = other.headers;
+    RouteParams source_params = other.params;
+    std::string copy;
+    for (std::string_view view : line) copy.append(view.data(), view.size());
+    for (const HTTPHeader& header : source_headers) copy.append(header.first).append(header.second);
+    for (const auto& param : source_params) copy.append(param.first).append(param.second);
+    // The old storage stays alive in copy until the views are rebuilt.
+    storage.swap(copy);
+    size_t offset = 0;
+    auto next = [&](std::string_view view) {
+        std::string_view out(storage.data() + offset, view.size());
+        offset += view.size();
+        return out;
+    };
+    clear();
+    method = next(line[0]);
+    path = next(line[1]);
+    query = next(line[2]);
+    version = next(line[3]);
+    body = next(line[4]);
+    for (const HTTPHeader& header : source_headers) {
+        std::string_view name = next(header.first);
+        headers.add(name, next(header.second));
+    }
+    for (const auto& param : source_params) {
+        std::string_view name = next(param.first);
+        params.push(name, next(param.second));
+    }
+}
+
+inline const char* httpStatusMessage(int status_code) {
+    switch (status_code) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 414: return "URI Too Long";
+    case 415: return "Unsupported Media Type";
+    case 416: return "Range Not Satisfiable";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Unknown";
+    }
+}
+
+// A regular file opened for sending as a response body. Linux and the
+// BSDs/macOS hand it to the socket with sendfile() so the bytes never pass
+// through user space; Windows and other systems send from a read-only
+// mapping of the file, which still avoids an extra copy.
+class FileBody {
+public:
+    ~FileBody() {
+#ifdef _WIN32
+        if (view != nullptr) UnmapViewOfFile(view);
+        if (mapping != nullptr) CloseHandle(mapping);
+        if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+#else
+#if !defined(WEBSERVER_USE_SENDFILE)
+        if (view != nullptr) munmap(const_cast<char*>(view), length);
+#endif
+#ifdef WEBSERVER_HAVE_IO_URING
+        const char* mapping = ring_view.load(std::memory_order_acquire);
+        if (mapping != nullptr) munmap(const_cast<char*>(mapping), length);
+#endif
+        if (fd != -1) close(fd);
+#endif
+    }
+
+    FileBody(const FileBody&) = delete;
+    FileBody& operator=(const FileBody&) = delete;
+
+    // Returns nullptr unless path names a readable regular file.
+    static std::shared_ptr<FileBody> open(const std::string& path) {
+        std::shared_ptr<FileBody> file(new FileBody());
+#ifdef _WIN32
+        file->handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file->handle == INVALID_HANDLE_VALUE) return nullptr;
+        BY_HANDLE_FILE_INFORMATION info;
+        if (!GetFileInformationByHandle(file->handle, &info) || (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            return nullptr;
+        }
+        file->length = ((size_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+        ULARGE_INTEGER write_time;
+        write_time.LowPart = info.ftLastWriteTime.dwLowDateTime;
+        write_time.HighPart = info.ftLastWriteTime.dwHighDateTime;
+        file->mtime = (time_t)((write_time.QuadPart - 116444736000000000ULL) / 10000000ULL);
+        if (file->length > 0) {
+            file->mapping = CreateFileMappingA(file->handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (file->mapping == nullptr) return nullptr;
+            file->view = static_cast<const char*>(MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0));
+            if (file->view == nullptr) return nullptr;
+        }
+#else
+        file->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file->fd == -1) return nullptr;
+        struct stat info;
+        if (fstat(file->fd, &info) == -1 || !S_ISREG(info.st_mode)) return nullptr;
+        file->length = (size_t)info.st_size;
+        file->mtime = info.st_mtime;
+#if !defined(WEBSERVER_USE_SENDFILE)
+        if (file->length > 0) {
+            void* view = mmap(nullptr, file->length, PROT_READ, MAP_SHARED, file->fd, 0);
+            if (view == MAP_FAILED) return nullptr;
+            file->view = static_cast<const char*>(view);
+        }
+#endif
+#endif
+        return file;
+    }
+
+    size_t size() const { return length; }
+    time_t modifiedTime() const { return mtime; }
+
+#ifdef WEBSERVER_HAVE_IO_URING
+    // The file mapped read-only, for sends the io_uring completes later,
+    // or nullptr if it cannot be. Mapped when first needed; the file may
+    // be shared between workers, so the first mapping wins.
+    const char* mapped() const {
+        const char* current = ring_view.load(std::memory_order_acquire);
+        if (current != nullptr) return current;
+        void* mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) return nullptr;
+        if (!ring_view.compare_exchange_strong(current, static_cast<const char*>(mapping),
+                                               std::memory_order_acq_rel)) {
+            munmap(mapping, length);
+            return current;
+        }
+        return static_cast<const char*>(mapping);
+    }
+#endif
+
+    // Sends up to count bytes starting at offset. Returns the bytes sent,
+    // or -1 with the socket error set (check socketWouldBlock()).
+    long sendTo(SOCKET sock, size_t offset, size_t count) const {
+        count = std::min(count, std::min(length - offset, max_send));
+#if defined(WEBSERVER_USE_SENDFILE) && defined(__linux__)
+        off_t position = (off_t)offset;
+        return (long)::sendfile(sock, fd, &position, count);
+#elif defined(WEBSERVER_USE_SENDFILE) && defined(__APPLE__)
+        off_t sent = (off_t)count;
+        int result = ::sendfile(fd, sock, (off_t)offset, &sent, nullptr, 0);
+        if (sent > 0) return (long)sent;
+        return result == -1 ? -1 : 0;
+#elif defined(WEBSERVER_USE_SENDFILE)
+        off_t sent = 0;
+        int result = ::sendfile(fd, sock, (off_t)offset, count, nullptr, &sent, 0);
+        if (sent > 0) return (long)sent;
+        return result == -1 ? -1 : 0;
+#else
+        return (long)send(sock, view + offset, (int)count, MSG_NOSIGNAL);
+#endif
+    }
+
+    // Copies count bytes starting at offset into out.
+    bool readAt(size_t offset, char* out, size_t count) const {
+        if (offset + count > length) return false;
+#if defined(WEBSERVER_USE_SENDFILE)
+        size_t done = 0;
+        while (done < count) {
+            ssize_t n = pread(fd, out + done, count - done, (off_t)(offset + done));
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                return false;
+            }
+            done += (size_t)n;
+        }
+#else
+        if (count > 0) std::memcpy(out, view + offset, count);
+#endif
+        return true;
+    }
+
+    // Copies the whole file into out, for callers that need it in memory.
+    bool readAll(std::string& out) const {
+        out.resize(length);
+#if defined(WEBSERVER_USE_SENDFILE)
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = pread(fd, &out[done], length - done, (off_t)done);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                out.resize(done);
+                return false;
+            }
+            done += (size_t)n;
+        }
+#else
+        if (length > 0) std::memcpy(&out[0], view, length);
+#endif
+        return true;
+    }
+
+private:
+    static constexpr size_t max_send = 1u << 30;
+
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+    const char* view = nullptr;
+#ifdef WEBSERVER_HAVE_IO_URING
+    mutable std::atomic<const char*> ring_view{nullptr};
+#endif
+    size_t length = 0;
+    time_t mtime = 0;
+
+    FileBody() {}
+};
+
+#ifdef WEBSERVER_WITH_OPENSSL
+// Server TLS settings. Each worker builds its own context so handshakes
+// on different loops do not contend on its locks and session cache; all
+// of them share one set of session ticket keys, so a client can resume
+// on whichever worker SO_REUSEPORT hands its next connection to.
+class TLSContext {
+public:
+    // Ticket name, HMAC secret and AES key, as OpenSSL expects them.
+    struct TicketKeys {
+        unsigned char bytes[80];
+    };
+
+    ~TLSContext() {
+        SSL_CTX_free(ctx);
+    }
+
+    TLSContext(const TLSContext&) = delete;
+    TLSContext& operator=(const TLSContext&) = delete;
+
+    static TicketKeys generateTicketKeys() {
+        TicketKeys keys;
+        if (RAND_bytes(keys.bytes, sizeof(keys.bytes)) != 1) {
+            throw std::runtime_error("Could not generate TLS session ticket keys");
+        }
+        return keys;
+    }
+
+    // Loads a PEM certificate chain and its private key. With http2 the
+    // client may pick h2 by ALPN.
+    static std::unique_ptr<TLSContext> create(const std::string& cert_file, const std::string& key_file,
+                                              const TicketKeys& keys, bool http2 = false) {
+        std::unique_ptr<TLSContext> context(new TLSContext());
+        SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+        if (ctx == nullptr) {
+            throw std::runtime_error("Could not create TLS context");
+        }
+        context->ctx = ctx;
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1) {
+            throw std::runtime_error("Could not load TLS certificate " + cert_file);
+        }
+        if (SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+            throw std::runtime_error("Could not load TLS private key " + key_file);
+        }
+        // Partial writes let the output queue hand over whatever it has,
+        // and idle connections give their record buffers back.
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                  SSL_MODE_RELEASE_BUFFERS);
+        SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+        // Clients routinely hang up without close_notify; HTTP framing
+        // already tells a truncated message apart.
+        SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        static const unsigned char session_context[] = "cpp_webserver";
+        SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+        if (SSL_CTX_set_tlsext_ticket_keys(ctx, const_cast<unsigned char*>(keys.bytes), sizeof(keys.bytes)) != 1) {
+            throw std::runtime_error("Could not set TLS session ticket keys");
+        }
+        if (http2) {
+            SSL_CTX_set_alpn_select_cb(ctx, selectProtocol, nullptr);
+        }
+        return context;
+    }
+
+    SSL_CTX* get() const { return ctx; }
+
+private:
+    SSL_CTX* ctx = nullptr;
+
+    TLSContext() {}
+
+    // h2 first, then http/1.1; a client offering neither gets no ALPN
+    // answer and is spoken to in HTTP/1.1.
+    static int selectProtocol(SSL*, const unsigned char** out, unsigned char* out_size, const unsigned char* in,
+                              unsigned int in_size, void*) {
+        static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+        unsigned char* selected = nullptr;
+        if (SSL_select_next_proto(&selected, out_size, protocols, sizeof(protocols) - 1, in, in_size) !=
+            OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+};
+
+// The TLS side of one non-blocking connection. The handshake and reads
+// always go through OpenSSL. Once kTLS has taken over record encryption
+// for sending, the socket can be written directly, so the output queue
+// keeps using sendmsg() and sendfile(); otherwise write() encrypts here.
+class TLSConnection {
+public:
+    enum Status { Done, WantRead, WantWrite, Failed };
+
+    ~TLSConnection() {
+        SSL_free(ssl);
+    }
+
+    TLSConnection(const TLSConnection&) = delete;
+    TLSConnection& operator=(const TLSConnection&) = delete;
+
+    // Returns nullptr if OpenSSL cannot set up the session.
+    static std::unique_ptr<TLSConnection> create(const TLSContext& context, SOCKET sock) {
+        std::unique_ptr<TLSConnection> tls(new TLSConnection());
+        tls->ssl = SSL_new(context.get());
+        if (tls->ssl == nullptr || SSL_set_fd(tls->ssl, (int)sock) != 1) return nullptr;
+        SSL_set_accept_state(tls->ssl);
+        return tls;
+    }
+
+    Status handshake() {
+        int result = SSL_do_handshake(ssl);
+        if (result == 1) {
+            established = true;
+#ifdef BIO_get_ktls_send
+            kernel_send = BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0;
+#endif
+            return Done;
+        }
+        return status(result);
+    }
+
+    bool handshakeDone() const { return established; }
+    bool resumed() const { return SSL_session_reused(ssl) == 1; }
+    bool kernelSend() const { return kernel_send; }
+
+    // The client picked h2 by ALPN.
+    bool negotiatedHttp2() const {
+        const unsigned char* protocol = nullptr;
+        unsigned int size = 0;
+        SSL_get0_alpn_selected(ssl, &protocol, &size);
+        return size == 2 && memcmp(protocol, "h2", 2) == 0;
+    }
+    // Decrypted bytes OpenSSL holds that the socket no longer signals.
+    bool hasBuffered() const { return SSL_pending(ssl) > 0; }
+
+    // Like recv(): the bytes read, 0 once the peer is done, -1 on error
+    // with would_block set when nothing is available yet.
+    long read(char* buffer, size_t size, bool& would_block) {
+        would_block = false;
+        int result = SSL_read(ssl, buffer, (int)std::min(size, max_io));
+        if (result > 0) return result;
+        Status state = status(result);
+        if (state == WantRead || state == WantWrite) {
+            would_block = true;
+            return -1;
+        }
+        return state == Done ? 0 : -1;
+    }
+
+    // Encrypts and sends up to size bytes; -1 with would_block set when
+    // the socket is full.
+    long write(const char* data, size_t size, bool& would_block) {
+        would_block = false;
+        int result = SSL_write(ssl, data, (int)std::min(size, max_io));
+        if (result > 0) return result;
+        Status state = status(result);
+        would_block = state == WantRead || state == WantWrite;
+        return -1;
+    }
+
+    // Sends close_notify if the socket takes it; never waits for the
+    // peer's answer.
+    void shutdown() {
+        if (established) SSL_shutdown(ssl);
+    }
+
+private:
+    static constexpr size_t max_io = 1u << 30;
+
+    SSL* ssl = nullptr;
+    bool established = false;
+    bool kernel_send = false;
+
+    TLSConnection() {}
+
+    // Maps a failed OpenSSL call; Done means a clean close_notify.
+    Status status(int result) {
+        int error = SSL_get_error(ssl, result);
+        if (error == SSL_ERROR_WANT_READ) return WantRead;
+        if (error == SSL_ERROR_WANT_WRITE) return WantWrite;
+        ERR_clear_error();
+        return error == SSL_ERROR_ZERO_RETURN ? Done : Failed;
+    }
+};
+#endif
+
+// "HTTP/1.1 <code> <reason>\r\n" for every status code, rendered once.
+inline std::string_view cachedStatusLine(int status_code) {
+    static const std::vector<std::string> lines = []() {
+        std::vector<std::string> table(600);
+        for (int code = 100; code < 600; code++) {
+            table[code] = "HTTP/1.1 " + std::to_string(code) + " " + httpStatusMessage(code) + "\r\n";
+        }
+        return table;
+    }();
+    if (status_code < 100 || status_code >= 600) return std::string_view();
+    return lines[status_code];
+}
+
+// Formats t as an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT").
+inline std::string formatHttpDate(time_t t) {
+    static const char* days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    struct tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &t);
+#else
+    gmtime_r(&t, &utc);
+#endif
+    char text[32];
+    int n = snprintf(text, sizeof(text), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                     days[utc.tm_wday], utc.tm_mday, months[utc.tm_mon], utc.tm_year + 1900,
+                     utc.tm_hour, utc.tm_min, utc.tm_sec);
+    return std::string(text, n > 0 ? (size_t)n : 0);
+}
+
+// Parses an IMF-fixdate as sent in If-Modified-Since.
+inline bool parseHttpDate(std::string_view text, time_t& result) {
+    static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (text.size() != 29 || text[3] != ',' || text.substr(26) != "GMT") return false;
+    auto number = [&text](size_t pos, size_t digits, int& value) {
+        value = 0;
+        for (size_t i = pos; i < pos + digits; i++) {
+            if (text[i] < '0' || text[i] > '9') return false;
+            value = value * 10 + (text[i] - '0');
+        }
+        return true;
+    };
+    struct tm utc{};
+    const char* month = std::strstr(months, std::string(text.substr(8, 3)).c_str());
+    if (month == nullptr || (month - months) % 3 != 0) return false;
+    utc.tm_mon = (int)(month - months) / 3;
+    int year;
+    if (!number(5, 2, utc.tm_mday) || !number(12, 4, year) || !number(17, 2, utc.tm_hour) ||
+        !number(20, 2, utc.tm_min) || !number(23, 2, utc.tm_sec)) {
+        return false;
+    }
+    utc.tm_year = year - 1900;
+#ifdef _WIN32
+    result = _mkgmtime(&utc);
+#else
+    result = timegm(&utc);
+#endif
+    return result != (time_t)-1;
+}
+
+// The q-value of an Accept-Encoding entry in thousandths; malformed
+// values count as 0.
+inline int parseQuality(std::string_view value) {
+    size_t first = value.find_first_not_of(" \t");
+    if (first == std::string_view::npos || (value[first] != '0' && value[first] != '1')) return 0;
+    value.remove_prefix(first);
+    int quality = (value[0] - '0') * 1000;
+    if (value.size() > 1 && value[1] == '.') {
+        int scale = 100;
+        for (size_t i = 2; i < value.size() && i < 5 && std::isdigit((unsigned char)value[i]); i++) {
+            quality += (value[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    return std::min(quality, 1000);
+}
+
+// How much an Accept-Encoding value wants coding, from 0 to 1000, or -1
+// when it names neither the coding nor "*". An explicit entry beats "*".
+inline int encodingQuality(std::string_view accept, std::string_view coding) {
+    int wildcard = -1;
+    while (!accept.empty()) {
+        size_t comma = accept.find(',');
+        std::string_view item = accept.substr(0, comma);
+        accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+
+        size_t semicolon = item.find(';');
+        std::string_view name = item.substr(0, semicolon);
+        size_t first = name.find_first_not_of(" \t");
+        if (first == std::string_view::npos) continue;
+        name = name.substr(first, name.find_last_not_of(" \t") - first + 1);
+        bool exact = equalsIgnoreCase(name, coding);
+        if (!exact && name != "*") continue;
+
+        int quality = 1000;
+        if (semicolon != std::string_view::npos) {
+            std::string_view params = item.substr(semicolon + 1);
+            size_t q = params.find("q=");
+            if (q != std::string_view::npos) {
+                quality = parseQuality(params.substr(q + 2));
+            }
+        }
+        if (exact) return quality;
+        wildcard = quality;
+    }
+    return wildcard;
+}
+
+// True if an Accept-Encoding value allows coding (with a non-zero q).
+inline bool acceptsEncoding(std::string_view accept, std::string_view coding) {
+    return encodingQuality(accept, coding) > 0;
+}
+
+// "Date: ...\r\n", re-rendered at most once per second on each thread.
+inline std::string_view cachedDateHeader() {
+    struct DateCache {
+        time_t second = -1;
+        std::string text;
+    };
+    thread_local DateCache cache;
+
+    time_t now = time(nullptr);
+    if (now != cache.second) {
+        cache.text = "Date: " + formatHttpDate(now) + "\r\n";
+        cache.second = now;
+    }
+    return cache.text;
+}
+
+// Monotonic allocator: hands out pieces of large blocks and frees them
+// all at once with reset().
+class Arena {
+public:
+    explicit Arena(size_t block_size = 1024) : block_size(block_size), used(0) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    Arena(Arena&& other) noexcept
+        : blocks(std::move(other.blocks)), block_size(other.block_size), used(other.used) {
+        other.blocks.clear();
+        other.used = 0;
+    }
+
+    Arena& operator=(Arena&& other) noexcept {
+        if (this != &other) {
+            blocks = std::move(other.blocks);
+            block_size = other.block_size;
+            used = other.used;
+            other.blocks.clear();
+            other.used = 0;
+        }
+        return *this;
+    }
+
+    char* allocate(size_t size) {
+        if (blocks.empty() || used + size > blocks.back().size) {
+            size_t capacity = std::max(block_size, size);
+            if (!blocks.empty()) capacity = std::max(capacity, blocks.back().size * 2);
+            blocks.push_back(Block{std::unique_ptr<char[]>(new char[capacity]), capacity});
+            used = 0;
+        }
+        char* out = blocks.back().data.get() + used;
+        used += size;
+        return out;
+    }
+
+    std::string_view copy(std::string_view text) {
+        if (text.empty()) return std::string_view();
+        char* out = allocate(text.size());
+        std::memcpy(out, text.data(), text.size());
+        return std::string_view(out, text.size());
+    }
+
+    // Releases everything handed out. Overflow blocks are merged into one
+    // that holds all of them, so the next round fits without allocating.
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t total = 0;
+            for (const Block& block : blocks) total += block.size;
+            blocks.clear();
+            blocks.push_back(Block{std::unique_ptr<char[]>(new char[total]), total});
+        }
+        used = 0;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t block_size;
+    size_t used;
+};
+
+// Response header list kept in insertion order. Names and values are
+// copied into an arena that clear() rewinds, so a reused response sets
+// its headers without touching malloc. Names compare case-insensitively.
+class ResponseHeaders {
+public:
+    typedef std::vector<HTTPHeader>::const_iterator const_iterator;
+
+    // Lets headers["Name"] = value replace a header as before.
+    class Entry {
+    public:
+        Entry(ResponseHeaders& headers, std::string_view name) : headers(headers), name(name) {}
+        Entry& operator=(std::string_view value) {
+            headers.set(name, value);
+            return *this;
+        }
+        operator std::string_view() const { return headers.get(name); }
+
+    private:
+        ResponseHeaders& headers;
+        std::string_view name;
+    };
+
+    ResponseHeaders() = default;
+    ResponseHeaders(const ResponseHeaders& other) { *this = other; }
+    ResponseHeaders& operator=(const ResponseHeaders& other) {
+        if (this != &other) {
+            clear();
+            for (const HTTPHeader& header : other.entries) add(header.first, header.second);
+        }
+        return *this;
+    }
+    // Arena blocks live on the heap, so the views survive a move.
+    ResponseHeaders(ResponseHeaders&&) = default;
+    ResponseHeaders& operator=(ResponseHeaders&&) = default;
+
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+
+    void clear() {
+        entries.clear();
+        arena.reset();
+    }
+
+    Entry operator[](std::string_view name) { return Entry(*this, name); }
+
+    // Replaces the header called name, or appends it.
+    void set(std::string_view name, std::string_view value) {
+        for (HTTPHeader& header : entries) {
+            if (equalsIgnoreCase(header.first, name)) {
+                header.second = arena.copy(value);
+                return;
+            }
+        }
+        add(name, value);
+    }
+
+    void set(std::string_view name, size_t value) {
+        char digits[24];
+        std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+        set(name, std::string_view(digits, result.ptr - digits));
+    }
+
+    // Appends even if the name exists, for headers such as Set-Cookie.
+    void add(std::string_view name, std::string_view value) {
+        entries.emplace_back(arena.copy(name), arena.copy(value));
+    }
+
+    void remove(std::string_view name) {
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [name](const HTTPHeader& header) { return equalsIgnoreCase(header.first, name); }),
+                      entries.end());
+    }
+
+    const_iterator find(std::string_view name) const {
+        for (const_iterator it = entries.begin(); it != entries.end(); ++it) {
+            if (equalsIgnoreCase(it->first, name)) return it;
+        }
+        return entries.end();
+    }
+
+    std::string_view get(std::string_view name, std::string_view fallback = std::string_view()) const {
+        const_iterator it = find(name);
+        return it != end() ? it->second : fallback;
+    }
+
+private:
+    Arena arena;
+    std::vector<HTTPHeader> entries;
+};
+
+class ResponseStream;
+
+class HTTPResponse {
+public:
+    static const size_t unknown_length = (size_t)-1;
+
+    std::string version;
+    int status_code;
+    std::string status_message;
+    ResponseHeaders headers;
+    std::string body;
+    // When set, the body is this file (or shared buffer) instead of `body`.
+    std::shared_ptr<const FileBody> file;
+    std::shared_ptr<const std::string> shared_body;
+    // Set by startStream(); the body is written through it after the handler returns.
+    std::shared_ptr<ResponseStream> stream;
+
+    HTTPResponse() : version("HTTP/1.1"), status_code(200), status_message("OK") {}
+
+    // Back to a fresh 200 response, keeping the header arena and the body
+    // buffer's capacity for the next request on the connection.
+    void reset() {
+        version.assign("HTTP/1.1");
+        status_code = 200;
+        status_message.assign("OK");
+        headers.clear();
+        body.clear();
+        file.reset();
+        shared_body.reset();
+        stream.reset();
+    }
+
+    void setContent(std::string_view content, std::string_view content_type = "text/html") {
+        body.assign(content.data(), content.size());
+        file.reset();
+        shared_body.reset();
+        stream.reset();
+        headers.set("Content-Type", content_type);
+        headers.set("Content-Length", body.size());
+    }
+
+    // Makes the file at file_path the body; it is sent zero-copy when the
+    // response is written. Returns false if the file cannot be opened.
+    bool setFile(const std::string& file_path, std::string_view content_type) {
+        std::shared_ptr<FileBody> opened = FileBody::open(file_path);
+        if (!opened) return false;
+        body.clear();
+        file = opened;
+        shared_body.reset();
+        stream.reset();
+        headers.set("Content-Type", content_type);
+        headers.set("Content-Length", file->size());
+        return true;
+    }
+
+    // Uses an immutable buffer shared with other responses (e.g. a cached
+    // file) as the body without copying it.
+    void setSharedContent(std::shared_ptr<const std::string> content, std::string_view content_type) {
+        body.clear();
+        file.reset();
+        shared_body = std::move(content);
+        stream.reset();
+        headers.set("Content-Type", content_type);
+        headers.set("Content-Length", shared_body->size());
+    }
+
+    // Sends the body as it is produced instead of all at once. The head
+    // goes out when the handler returns; the body is whatever is written
+    // to the returned stream until end(). Without a content_length it is
+    // sent chunked (or until close to HTTP/1.0 clients).
+    std::shared_ptr<ResponseStream> startStream(std::string_view content_type,
+                                                size_t content_length = unknown_length);
+
+    size_t bodySize() const {
+        return file ? file->size() : shared_body ? shared_body->size() : body.size();
+    }
+
+    // Appends the status line and header block (including the blank line)
+    // to out. Server, Date and Content-Length are filled in when the
+    // handler did not set them.
+    void serializeHead(std::string& out) const {
+        std::string_view status_line;
+        if (version == "HTTP/1.1" && status_message == httpStatusMessage(status_code)) {
+            status_line = cachedStatusLine(status_code);
+        }
+        if (!status_line.empty()) {
+            out.append(status_line.data(), status_line.size());
+        } else {
+            out.append(version).append(" ").append(std::to_string(status_code)).append(" ");
+            out.append(status_message).append("\r\n");
+        }
+
+        bool has_server = false;
+        bool has_date = false;
+        bool has_length = false;
+        for (const HTTPHeader& header : headers) {
+            std::string_view name = header.first;
+            if (equalsIgnoreCase(name, "Server")) has_server = true;
+            else if (equalsIgnoreCase(name, "Date")) has_date = true;
+            else if (equalsIgnoreCase(name, "Content-Length") || equalsIgnoreCase(name, "Transfer-Encoding")) {
+                has_length = true;
+            }
+            out.append(name.data(), name.size()).append(": ");
+            out.append(header.second.data(), header.second.size()).append("\r\n");
+        }
+        if (!has_server) {
+            out.append("Server: cpp_webserver\r\n");
+        }
+        if (!has_date) {
+            std::string_view date = cachedDateHeader();
+            out.append(date.data(), date.size());
+        }
+        if (!has_length && !stream && status_code >= 200 && status_code != 204 && status_code != 304) {
+            out.append("Content-Length: ").append(std::to_string(bodySize())).append("\r\n");
+        }
+        out.append("\r\n");
+    }
+
+    std::string toString() const {
+        std::string out;
+        out.reserve(256 + bodySize());
+        serializeHead(out);
+        if (file) {
+            std::string contents;
+            file->readAll(contents);
+            out.append(contents);
+        } else if (shared_body) {
+            out.append(*shared_body);
+        } else {
+            out.append(body);
+        }
+        return out;
+    }
+};
+
+inline bool setNonBlocking(SOCKET sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) != -1;
+#endif
+}
+
+inline bool socketWouldBlock() {
+#ifdef _WIN32
+    int err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAEINTR;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// Compresses response bodies for one worker. Codec contexts are created
+// on first use and reset between responses rather than rebuilt (brotli
+// has no reset, so its encoder is the one exception). Bodies go through
+// begin()/write()/finish(), so a streamed response can be compressed
+// piece by piece; compress() does a whole body at once. Which codings
+// exist depends on the WEBSERVER_WITH_* build flags.
+class ResponseCompressor {
+public:
+    // Listed in the order preferred when the client rates them equally.
+    enum Coding { Identity, Brotli, Zstd, Gzip, Deflate };
+
+    ResponseCompressor() : active(Identity) {
+#ifdef WEBSERVER_WITH_ZLIB
+        gzip_ready = false;
+        deflate_ready = false;
+#endif
+#ifdef WEBSERVER_WITH_BROTLI
+        brotli = nullptr;
+#endif
+#ifdef WEBSERVER_WITH_ZSTD
+        zstd = nullptr;
+#endif
+    }
+
+    ~ResponseCompressor() {
+#ifdef WEBSERVER_WITH_ZLIB
+        if (gzip_ready) deflateEnd(&gzip_stream);
+        if (deflate_ready) deflateEnd(&deflate_stream);
+#endif
+#ifdef WEBSERVER_WITH_BROTLI
+        if (brotli) BrotliEncoderDestroyInstance(brotli);
+#endif
+#ifdef WEBSERVER_WITH_ZSTD
+        if (zstd) ZSTD_freeCCtx(zstd);
+#endif
+    }
+
+    ResponseCompressor(const ResponseCompressor&) = delete;
+    ResponseCompressor& operator=(const ResponseCompressor&) = delete;
+
+    static bool available(Coding coding) {
+        switch (coding) {
+#ifdef WEBSERVER_WITH_ZLIB
+        case Gzip:
+        case Deflate:
+            return true;
+#endif
+#ifdef WEBSERVER_WITH_BROTLI
+        case Brotli:
+            return true;
+#endif
+#ifdef WEBSERVER_WITH_ZSTD
+        case Zstd:
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    // The Content-Encoding token for coding.
+    static const char* name(Coding coding) {
+        switch (coding) {
+        case Brotli: return "br";
+        case Zstd: return "zstd";
+        case Gzip: return "gzip";
+        case Deflate: return "deflate";
+        default: return "identity";
+        }
+    }
+
+    // The available coding the client rates highest, or Identity.
+    static Coding negotiate(std::string_view accept_encoding) {
+        if (accept_encoding.empty()) return Identity;
+        Coding best = Identity;
+        int best_quality = 0;
+        for (Coding candidate : {Brotli, Zstd, Gzip, Deflate}) {
+            if (!available(candidate)) continue;
+            int quality = encodingQuality(accept_encoding, name(candidate));
+            if (quality > best_quality) {
+                best = candidate;
+                best_quality = quality;
+            }
+        }
+        return best;
+    }
+
+    // Starts a new stream. size_hint, when known, is the whole input size.
+    bool begin(Coding coding, size_t size_hint = 0) {
+        active = Identity;
+        switch (coding) {
+#ifdef WEBSERVER_WITH_ZLIB
+        case Gzip:
+        case Deflate: {
+            bool gzip = coding == Gzip;
+            z_stream& stream = gzip ? gzip_stream : deflate_stream;
+            bool& ready = gzip ? gzip_ready : deflate_ready;
+            if (ready) {
+                if (deflateReset(&stream) != Z_OK) return false;
+            } else {
+                memset(&stream, 0, sizeof(stream));
+                // windowBits 15, plus 16 for the gzip wrapper; "deflate" in HTTP means zlib format.
+                if (deflateInit2(&stream, zlib_level, Z_DEFLATED, gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                    return false;
+                }
+                ready = true;
+            }
+            break;
+        }
+#endif
+#ifdef WEBSERVER_WITH_BROTLI
+        case Brotli:
+            if (brotli) BrotliEncoderDestroyInstance(brotli);
+            brotli = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+            if (!brotli) return false;
+            BrotliEncoderSetParameter(brotli, BROTLI_PARAM_QUALITY, brotli_quality);
+            BrotliEncoderSetParameter(brotli, BROTLI_PARAM_LGWIN, brotli_window);
+            BrotliEncoderSetParameter(brotli, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+            if (size_hint > 0 && size_hint <= (1u << 30)) {
+                BrotliEncoderSetParameter(brotli, BROTLI_PARAM_SIZE_HINT, (uint32_t)size_hint);
+            }
+            break;
+#endif
+#ifdef WEBSERVER_WITH_ZSTD
+        case Zstd:
+            if (!zstd) {
+                zstd = ZSTD_createCCtx();
+                if (!zstd) return false;
+                ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, zstd_level);
+            }
+            ZSTD_CCtx_reset(zstd, ZSTD_reset_session_only);
+            if (size_hint > 0) ZSTD_CCtx_setPledgedSrcSize(zstd, size_hint);
+            break;
+#endif
+        default:
+            (void)size_hint;
+            return false;
+        }
+        active = coding;
+        return true;
+    }
+
+    // Appends the compressed form of input to out. With flush, everything
+    // written so far becomes decodable without waiting for more input.
+    bool write(std::string_view input, std::string& out, bool flush = false) {
+        switch (active) {
+#ifdef WEBSERVER_WITH_ZLIB
+        case Gzip:
+            return deflateInto(gzip_stream, input, out, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        case Deflate:
+            return deflateInto(deflate_stream, input, out, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+#endif
+#ifdef WEBSERVER_WITH_BROTLI
+        case Brotli:
+            return brotliInto(input, out, flush ? BROTLI_OPERATION_FLUSH : BROTLI_OPERATION_PROCESS);
+#endif
+#ifdef WEBSERVER_WITH_ZSTD
+        case Zstd:
+            return zstdInto(input, out, flush ? ZSTD_e_flush : ZSTD_e_continue);
+#endif
+        default:
+            (void)input;
+            (void)out;
+            (void)flush;
+            return false;
+        }
+    }
+
+    // Ends the stream, appending the last of the output to out.
+    bool finish(std::string& out) {
+        Coding coding = active;
+        active = Identity;
+        switch (coding) {
+#ifdef WEBSERVER_WITH_ZLIB
+        case Gzip:
+            return deflateInto(gzip_stream, std::string_view(), out, Z_FINISH);
+        case Deflate:
+            return deflateInto(deflate_stream, std::string_view(), out, Z_FINISH);
+#endif
+#ifdef WEBSERVER_WITH_BROTLI
+        case Brotli:
+            return brotliInto(std::string_view(), out, BROTLI_OPERATION_FINISH);
+#endif
+#ifdef WEBSERVER_WITH_ZSTD
+        case Zstd:
+            return zstdInto(std::string_view(), out, ZSTD_e_end);
+#endif
+        default:
+            (void)out;
+            return false;
+        }
+    }
+
+    // Compresses input into out, replacing what out held.
+    bool compress(Coding coding, std::string_view input, std::string& out) {
+        out.clear();
+        if (!begin(coding, input.size())) return false;
+        if (!write(input, out)) {
+            active = Identity;
+            return false;
+        }
+        return finish(out);
+    }
+
+    // Swaps body for its compressed form. Returns false, leaving body as
+    // it was, when compression fails or does not make it smaller.
+    bool compressInPlace(Coding coding, std::string& body) {
+        bool smaller = compress(coding, body, scratch) && scratch.size() < body.size();
+        if (smaller) body.swap(scratch);
+        // The scratch buffer now holds the old body; keep its capacity unless huge.
+        if (scratch.capacity() > max_scratch) std::string().swap(scratch);
+        return smaller;
+    }
+
+private:
+    // Tuned for dynamic responses, where speed matters more than ratio.
+    static const int zlib_level = 5;
+    static const int brotli_quality = 4;
+    static const int brotli_window = 20;
+    static const int zstd_level = 3;
+    static const size_t max_scratch = 1024 * 1024;
+
+    Coding active;
+    std::string scratch;
+#ifdef WEBSERVER_WITH_ZLIB
+    z_stream gzip_stream;
+    z_stream deflate_stream;
+    bool gzip_ready;
+    bool deflate_ready;
+#endif
+#ifdef WEBSERVER_WITH_BROTLI
+    BrotliEncoderState* brotli;
+#endif
+#ifdef WEBSERVER_WITH_ZSTD
+    ZSTD_CCtx* zstd;
+#endif
+
+    // Room to add to out before the next codec call.
+    static size_t growth(size_t input_size) {
+        return std::max<size_t>(4096, input_size / 2 + 64);
+    }
+
+#ifdef WEBSERVER_WITH_ZLIB
+    static bool deflateInto(z_stream& stream, std::string_view input, std::string& out, int flush) {
+        stream.next_in = (Bytef*)input.data();
+        stream.avail_in = (uInt)input.size();
+        for (;;) {
+            size_t used = out.size();
+            size_t room = growth(stream.avail_in);
+            out.resize(used + room);
+            stream.next_out = (Bytef*)&out[used];
+            stream.avail_out = (uInt)room;
+            int rc = deflate(&stream, flush);
+            out.resize(used + room - stream.avail_out);
+            if (rc == Z_STREAM_END) return true;
+            if (rc != Z_OK && rc != Z_BUF_ERROR) return false;
+            // Spare output room means deflate took all the input it was given.
+            if (flush != Z_FINISH && stream.avail_out != 0) return true;
+        }
+    }
+#endif
+
+#ifdef WEBSERVER_WITH_BROTLI
+    bool brotliInto(std::string_view input, std::string& out, BrotliEncoderOperation op) {
+        size_t available_in = input.size();
+        const uint8_t* next_in = (const uint8_t*)input.data();
+        for (;;) {
+            size_t used = out.size();
+            size_t room = growth(available_in);
+            out.resize(used + room);
+            size_t available_out = room;
+            uint8_t* next_out = (uint8_t*)&out[used];
+            bool ok = BrotliEncoderCompressStream(brotli, op, &available_in, &next_in, &available_out, &next_out, nullptr);
+            out.resize(used + room - available_out);
+            if (!ok) return false;
+            if (available_in == 0 && !BrotliEncoderHasMoreOutput(brotli) &&
+                (op != BROTLI_OPERATION_FINISH || BrotliEncoderIsFinished(brotli))) {
+                return true;
+            }
+        }
+    }
+#endif
+
+#ifdef WEBSERVER_WITH_ZSTD
+    bool zstdInto(std::string_view input, std::string& out, ZSTD_EndDirective mode) {
+        ZSTD_inBuffer in = {input.data(), input.size(), 0};
+        for (;;) {
+            size_t used = out.size();
+            size_t room = growth(in.size - in.pos);
+            out.resize(used + room);
+            ZSTD_outBuffer buffer = {&out[used], room, 0};
+            size_t remaining = ZSTD_compressStream2(zstd, &buffer, &in, mode);
+            out.resize(used + buffer.pos);
+            if (ZSTD_isError(remaining)) return false;
+            if (mode == ZSTD_e_continue ? in.pos == in.size : remaining == 0) return true;
+        }
+    }
+#endif
+};
+
+// Per-worker slab allocator for connection buffers. Blocks come in
+// power-of-two sizes from 4 KiB to 1 MiB and released ones wait on a free
+// list for their size, up to max_idle bytes in all, for the next
+// connection that needs one. Bigger blocks are plain allocations. Small
+// strings used for response heads and bodies are pooled the same way.
+// Only the owning worker's thread may touch it.
+class BufferPool {
+public:
+    static const size_t min_block = 4096;
+    static const size_t max_block = 1024 * 1024;
+
+    explicit BufferPool(size_t max_idle = 8 * 1024 * 1024) : max_idle(max_idle), idle_bytes(0) {}
+
+    ~BufferPool() {
+        for (std::vector<char*>& list : free_lists) {
+            for (char* block : list) delete[] block;
+        }
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // A block of at least size bytes; capacity receives its real size.
+    char* acquire(size_t size, size_t& capacity) {
+        if (size > max_block) {
+            capacity = size;
+            return new char[size];
+        }
+        size_t index = sizeClass(size);
+        capacity = min_block << index;
+        std::vector<char*>& list = free_lists[index];
+        if (list.empty()) {
+            return new char[capacity];
+        }
+        char* block = list.back();
+        list.pop_back();
+        idle_bytes -= capacity;
+        return block;
+    }
+
+    void release(char* block, size_t capacity) {
+        if (block == nullptr) return;
+        if (capacity > max_block || idle_bytes + capacity > max_idle) {
+            delete[] block;
+            return;
+        }
+        free_lists[sizeClass(capacity)].push_back(block);
+        idle_bytes += capacity;
+    }
+
+    // An empty string for a response head or body, reusing old capacity.
+    std::string takeString() {
+        if (strings.empty()) {
+            std::string buffer;
+            buffer.reserve(512);
+            return buffer;
+        }
+        std::string buffer = std::move(strings.back());
+        strings.pop_back();
+        buffer.clear();
+        return buffer;
+    }
+
+    void recycle(std::string&& buffer) {
+        if (strings.size() < max_strings && buffer.capacity() <= max_string_capacity) {
+            strings.push_back(std::move(buffer));
+        }
+    }
+
+private:
+    static const size_t classes = 9;
+    static const size_t max_strings = 256;
+    static const size_t max_string_capacity = 4096;
+
+    std::vector<char*> free_lists[classes];
+    std::vector<std::string> strings;
+    size_t max_idle;
+    size_t idle_bytes;
+
+    static size_t sizeClass(size_t size) {
+        size_t index = 0;
+        while ((min_block << index) < size) index++;
+        return index;
+    }
+};
+
+// Receive buffer whose storage comes from a BufferPool. recv() writes
+// straight into the free tail and consumed requests are erased from the
+// front. It grows by doubling for large requests and hands its block back
+// with release() once the connection has nothing buffered.
+class IOBuffer {
+public:
+    IOBuffer() : pool(nullptr), block(nullptr), block_size(0), length(0) {}
+    ~IOBuffer() { release(); }
+
+    IOBuffer(const IOBuffer&) = delete;
+    IOBuffer& operator=(const IOBuffer&) = delete;
+
+    void setPool(BufferPool* buffer_pool) { pool = buffer_pool; }
+
+    char* data() { return block; }
+    const char* data() const { return block; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+
+    // Makes room for at least min_space bytes past size() and returns
+    // where they start; available receives the room actually there.
+    char* tail(size_t min_space, size_t& available) {
+        if (block_size - length < min_space) {
+            grow(length + min_space);
+        }
+        available = block_size - length;
+        return block + length;
+    }
+
+    void commit(size_t count) { length += count; }
+
+    void erase(size_t pos, size_t count) {
+        if (count == 0) return;
+        std::memmove(block + pos, block + pos + count, length - pos - count);
+        length -= count;
+    }
+
+    void clear() { length = 0; }
+
+    void release() {
+        if (block == nullptr) return;
+        if (pool != nullptr) {
+            pool->release(block, block_size);
+        } else {
+            delete[] block;
+        }
+        block = nullptr;
+        block_size = 0;
+        length = 0;
+    }
+
+private:
+    BufferPool* pool;
+    char* block;
+    size_t block_size;
+    size_t length;
+
+    void grow(size_t min_size) {
+        size_t wanted = std::max(min_size, block_size * 2);
+        size_t capacity = wanted;
+        char* bigger = pool != nullptr ? pool->acquire(wanted, capacity) : new char[wanted];
+        if (length > 0) std::memcpy(bigger, block, length);
+        size_t old_length = length;
+        release();
+        block = bigger;
+        block_size = capacity;
+        length = old_length;
+    }
+};
+
+// Bytes waiting to go out on one connection. Response heads and bodies
+// are queued as separate segments and sent together with one gathering
+// write (sendmsg/WSASend), so bodies are never copied into the head.
+// File segments go out through FileBody::sendTo(). Sent string buffers go
+// back to the worker's BufferPool.
+class OutputQueue {
+public:
+    enum FlushResult { Done, Blocked, Failed };
+
+    // Most buffers gathered into one send.
+    static const size_t max_batch = 64;
+
+    OutputQueue() : pending_bytes(0), pool(nullptr) {}
+
+    void setPool(BufferPool* buffer_pool) { pool = buffer_pool; }
+
+    bool empty() const { return head == segments.size(); }
+    // Bytes queued but not yet accepted by the socket.
+    size_t size() const { return pending_bytes; }
+
+    // An empty buffer for the next response head, reusing old capacity.
+    std::string takeBuffer() {
+        if (pool != nullptr) {
+            return pool->takeString();
+        }
+        std::string buffer;
+        buffer.reserve(512);
+        return buffer;
+    }
+
+    void push(std::string data) {
+        if (data.empty()) return;
+        pending_bytes += data.size();
+        Segment segment;
+        segment.data = std::move(data);
+        segments.push_back(std::move(segment));
+    }
+
+    void push(std::string_view data) {
+        if (data.empty()) return;
+        std::string buffer = takeBuffer();
+        buffer.append(data.data(), data.size());
+        push(std::move(buffer));
+    }
+
+    void push(std::shared_ptr<const std::string> shared) {
+        if (!shared || shared->empty()) return;
+        pending_bytes += shared->size();
+        Segment segment;
+        segment.shared = std::move(shared);
+        segments.push_back(std::move(segment));
+    }
+
+    void push(std::shared_ptr<const FileBody> file) {
+        if (!file || file->size() == 0) return;
+        pending_bytes += file->size();
+        Segment segment;
+        segment.file = std::move(file);
+        segments.push_back(std::move(segment));
+    }
+
+    void clear() {
+        while (!empty()) {
+            popFront();
+        }
+        pending_bytes = 0;
+    }
+
+    // Sends as much as the socket accepts; written is set to the bytes sent.
+    FlushResult flush(SOCKET sock, size_t& written) {
+        written = 0;
+        while (!empty()) {
+            size_t sent;
+            if (segments[head].file) {
+                Segment& front = segments[head];
+                long result = front.file->sendTo(sock, front.offset, front.remaining());
+                if (result < 0) {
+                    return socketWouldBlock() ? Blocked : Failed;
+                }
+                if (result == 0) {
+                    return Failed;  // the file shrank underneath us
+                }
+                sent = (size_t)result;
+            } else {
+                size_t count = 0;
+                bool file_follows = false;
+#ifdef _WIN32
+                WSABUF buffers[max_batch];
+                for (auto it = segments.begin() + head; it != segments.end() && count < max_batch; ++it, ++count) {
+                    if (it->file) {
+                        file_follows = true;
+                        break;
+                    }
+                    buffers[count].buf = const_cast<char*>(it->bytes()) + it->offset;
+                    buffers[count].len = (ULONG)it->remaining();
+                }
+                (void)file_follows;
+                DWORD sent_bytes = 0;
+                if (WSASend(sock, buffers, (DWORD)count, &sent_bytes, 0, nullptr, nullptr) == SOCKET_ERROR) {
+                    return socketWouldBlock() ? Blocked : Failed;
+                }
+                sent = sent_bytes;
+#else
+                iovec buffers[max_batch];
+                for (auto it = segments.begin() + head; it != segments.end() && count < max_batch; ++it, ++count) {
+                    if (it->file) {
+                        file_follows = true;
+                        break;
+                    }
+                    buffers[count].iov_base = const_cast<char*>(it->bytes()) + it->offset;
+                    buffers[count].iov_len = it->remaining();
+                }
+                msghdr message{};
+                message.msg_iov = buffers;
+                message.msg_iovlen = count;
+                int flags = MSG_NOSIGNAL;
+#ifdef MSG_MORE
+                // Let the head share a packet with the start of the file.
+                if (file_follows) flags |= MSG_MORE;
+#endif
+                ssize_t result = sendmsg(sock, &message, flags);
+                if (result < 0) {
+                    return socketWouldBlock() ? Blocked : Failed;
+                }
+                sent = (size_t)result;
+#endif
+            }
+
+            written += sent;
+            consume(sent);
+        }
+        return Done;
+    }
+
+#ifdef WEBSERVER_HAVE_IO_URING
+    // The front of the queue for a send that completes later, on an
+    // io_uring: up to max_batch buffers, files given as their mapping,
+    // with whole set if that is the entire queue. 0 if a file cannot be
+    // mapped. A string short enough to live inside its segment would move
+    // with it should the queue grow while the kernel reads it, so it is
+    // copied to a pooled buffer first. Nothing is dropped until advance().
+    size_t front(iovec* buffers, bool& whole) {
+        size_t count = 0;
+        auto it = segments.begin() + head;
+        for (; it != segments.end() && count < max_batch; ++it, ++count) {
+            const char* bytes;
+            if (it->file) {
+                bytes = it->file->mapped();
+                if (bytes == nullptr) return 0;
+            } else {
+                if (!it->shared && it->data.data() >= (const char*)&*it && it->data.data() < (const char*)(&*it + 1)) {
+                    std::string buffer = takeBuffer();
+                    buffer.reserve(sizeof(Segment) + 1);
+                    buffer.append(it->data);
+                    it->data.swap(buffer);
+                }
+                bytes = it->bytes();
+            }
+            buffers[count].iov_base = const_cast<char*>(bytes) + it->offset;
+            buffers[count].iov_len = it->remaining();
+        }
+        whole = it == segments.end();
+        return count;
+    }
+
+    // Drops count bytes that a send started from front() got out.
+    void advance(size_t count) { consume(count); }
+#endif
+
+#ifdef WEBSERVER_WITH_OPENSSL
+    // Sends through OpenSSL when the kernel does not encrypt for us. The
+    // front of the queue is gathered into one record at a time, so a head
+    // and its body do not each cost a record of their own.
+    FlushResult flush(TLSConnection& tls, size_t& written) {
+        written = 0;
+        char record[tls_record_size];
+        while (!empty()) {
+            size_t count = 0;
+            for (size_t i = head; i < segments.size() && count < sizeof(record); i++) {
+                const Segment& segment = segments[i];
+                size_t take = std::min(segment.remaining(), sizeof(record) - count);
+                if (segment.file) {
+                    if (!segment.file->readAt(segment.offset, record + count, take)) {
+                        return Failed;  // the file shrank underneath us
+                    }
+                } else {
+                    std::memcpy(record + count, segment.bytes() + segment.offset, take);
+                }
+                count += take;
+            }
+            // A retry after WantWrite gathers the same bytes again (or
+            // more, if responses were queued meanwhile), as OpenSSL requires.
+            bool would_block;
+            long result = tls.write(record, count, would_block);
+            if (result < 0) {
+                return would_block ? Blocked : Failed;
+            }
+            written += (size_t)result;
+            consume((size_t)result);
+        }
+        return Done;
+    }
+#endif
+
+private:
+    struct Segment {
+        std::string data;
+        std::shared_ptr<const std::string> shared;
+        std::shared_ptr<const FileBody> file;
+        size_t offset = 0;
+
+        const char* bytes() const { return shared ? shared->data() : data.data(); }
+        size_t remaining() const { return (file ? file->size() : shared ? shared->size() : data.size()) - offset; }
+    };
+
+    static const size_t tls_record_size = 16 * 1024;
+
+    // segments[head] is the next to send. A vector rather than a deque so
+    // a drained queue keeps its storage instead of freeing nodes.
+    std::vector<Segment> segments;
+    size_t head = 0;
+    size_t pending_bytes;
+    BufferPool* pool;
+
+    // Drops the sent bytes from the front of the queue.
+    void consume(size_t sent) {
+        pending_bytes -= sent;
+        while (sent > 0) {
+            Segment& front = segments[head];
+            size_t remaining = front.remaining();
+            if (sent < remaining) {
+                front.offset += sent;
+                break;
+            }
+            sent -= remaining;
+            popFront();
+        }
+    }
+
+    void popFront() {
+        recycle(segments[head]);
+        segments[head] = Segment();
+        if (++head == segments.size()) {
+            segments.clear();
+            head = 0;
+        }
+    }
+
+    void recycle(Segment& segment) {
+        if (pool != nullptr && !segment.file && !segment.shared) {
+            pool->recycle(std::move(segment.data));
+        }
+    }
+};
+
+// Body of a streamed response, from HTTPResponse::startStream(). The
+// handler writes pieces as it produces them and calls end() at the
+// finish. Use it on the worker's loop thread only: in the handler, or
+// later from a timer, a coroutine or the onDrain() callback.
+//
+// Writes are collected and flushed once per loop iteration, framed as
+// one chunk per batch. write() returns false once more than the buffer
+// limit waits to be sent, and onDrain() runs when the socket has taken it
+// all, so a producer that waits for it needs memory for one buffer, not
+// the whole payload:
+//
+//   std::shared_ptr<ResponseStream> stream = res.startStream("text/csv");
+//   auto row = std::make_shared<size_t>(0);
+//   stream->onDrain([stream, row]() {
+//       while (*row < row_count && stream->write(formatRow((*row)++))) {}
+//       if (*row == row_count) stream->end();
+//   });
+class ResponseStream {
+public:
+    explicit ResponseStream(size_t content_length)
+        : length(content_length), remaining(content_length), limit(64 * 1024), framing(Chunked), end_called(false),
+          client_gone(false), terminated(false), flush_requested(false), queue(nullptr) {}
+
+    ResponseStream(const ResponseStream&) = delete;
+    ResponseStream& operator=(const ResponseStream&) = delete;
+
+    // Queues data. Returns false when the caller should wait for onDrain()
+    // before writing more, or when the stream is closed or ended. Bytes
+    // past a declared length are dropped, and reaching it ends the stream.
+    bool write(std::string_view data) {
+        if (client_gone || end_called) return false;
+        if (remaining != HTTPResponse::unknown_length) {
+            data = data.substr(0, remaining);
+            remaining -= data.size();
+            if (remaining == 0) end_called = true;
+        }
+        pending.append(data.data(), data.size());
+        requestFlush();
+        return !end_called && buffered() < limit;
+    }
+
+    void end() {
+        if (client_gone || end_called) return;
+        end_called = true;
+        requestFlush();
+    }
+
+    bool ended() const { return end_called; }
+    // True once the client has gone (or the request was HEAD); writes are dropped.
+    bool closed() const { return client_gone; }
+    // Bytes written but not yet taken by the socket.
+    size_t buffered() const { return pending.size() + (queue ? queue->size() : 0); }
+    void setBufferLimit(size_t bytes) { limit = bytes; }
+
+    // Runs each time everything written so far has been sent.
+    void onDrain(std::function<void()> callback) { on_drain = std::move(callback); }
+    // Runs if the connection closes before the stream ends.
+    void onClose(std::function<void()> callback) { on_close = std::move(callback); }
+
+private:
+    friend class WebServer;
+    enum Framing { Chunked, Raw };
+
+    std::string pending;
+    size_t length;
+    size_t remaining;
+    size_t limit;
+    Framing framing;
+    bool end_called;
+    bool client_gone;
+    bool terminated;
+    bool flush_requested;
+    const OutputQueue* queue;
+    std::function<void()> flush_hook;
+    std::function<void()> on_drain;
+    std::function<void()> on_close;
+
+    void requestFlush() {
+        if (flush_hook && !flush_requested) {
+            flush_requested = true;
+            flush_hook();
+        }
+    }
+
+    // Called by the server once the head is queued. flush_hook schedules
+    // a flush of what the handler writes from then on.
+    void attach(Framing stream_framing, const OutputQueue* output, std::function<void()> hook) {
+        framing = stream_framing;
+        queue = output;
+        flush_hook = std::move(hook);
+    }
+
+    // Appends everything written since the last call to out, framed.
+    void takePending(std::string& out) {
+        flush_requested = false;
+        if (!pending.empty()) {
+            if (framing == Chunked) {
+                char digits[16];
+                std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), pending.size(), 16);
+                out.append(digits, result.ptr - digits).append("\r\n");
+                out.append(pending).append("\r\n");
+            } else {
+                out.append(pending);
+            }
+            pending.clear();
+            // A writer that ignored write()'s result may have grown it far past the limit.
+            if (pending.capacity() > 4 * limit) std::string().swap(pending);
+        }
+        if (end_called && !terminated) {
+            if (framing == Chunked) out.append("0\r\n\r\n");
+            terminated = true;
+        }
+    }
+
+    bool hasPending() const { return !pending.empty() || (end_called && !terminated); }
+    bool finished() const { return terminated; }
+    // The body fell short of its Content-Length, so the connection cannot be reused.
+    bool incomplete() const { return remaining != HTTPResponse::unknown_length && remaining > 0; }
+
+    // Drops the connection side: pending output, hooks and callbacks (which
+    // often hold the stream itself). aborted runs onClose() first.
+    void detach(bool aborted) {
+        client_gone = client_gone || aborted || !terminated;
+        queue = nullptr;
+        pending.clear();
+        flush_hook = nullptr;
+        on_drain = nullptr;
+        std::function<void()> closed_callback = std::move(on_close);
+        on_close = nullptr;
+        if (aborted && closed_callback) {
+            try {
+                closed_callback();
+            } catch (const std::exception& e) {
+                std::cerr << "Handler error: " << e.what() << std::endl;
+            }
+        }
+    }
+};
+
+inline std::shared_ptr<ResponseStream> HTTPResponse::startStream(std::string_view content_type,
+                                                                 size_t content_length) {
+    body.clear();
+    file.reset();
+    shared_body.reset();
+    headers.set("Content-Type", content_type);
+    headers.remove("Content-Length");
+    stream = std::make_shared<ResponseStream>(content_length);
+    return stream;
+}
+
+// HPACK header compression for HTTP/2 (RFC 7541).
+
+// The static table, indexed from 1.
+constexpr std::pair<std::string_view, std::string_view> hpack_static_table[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""},
+    {"cache-control", ""}, {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+    {"content-length", ""}, {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+constexpr size_t hpack_static_count = sizeof(hpack_static_table) / sizeof(hpack_static_table[0]);
+
+// Code lengths of the Huffman code (Appendix B) for each byte value and
+// EOS. The code is canonical, so the lengths are enough to rebuild it.
+constexpr uint8_t hpack_huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// The HPACK string Huffman code, rebuilt from hpack_huffman_lengths on
+// first use.
+class HPACKHuffman {
+public:
+    static const HPACKHuffman& get() {
+        static const HPACKHuffman table;
+        return table;
+    }
+
+    size_t encodedSize(std::string_view text) const {
+        size_t bits = 0;
+        for (unsigned char c : text) bits += hpack_huffman_lengths[c];
+        return (bits + 7) / 8;
+    }
+
+    void encode(std::string_view text, std::string& out) const {
+        uint64_t bits = 0;
+        int pending = 0;
+        for (unsigned char c : text) {
+            bits = (bits << hpack_huffman_lengths[c]) | codes[c];
+            pending += hpack_huffman_lengths[c];
+            while (pending >= 8) {
+                pending -= 8;
+                out.push_back((char)(bits >> pending));
+            }
+            bits &= (1ull << pending) - 1;
+        }
+        // Padded with the most significant bits of EOS, which are all ones.
+        if (pending > 0) out.push_back((char)((bits << (8 - pending)) | (0xffu >> pending)));
+    }
+
+    // A bit at a time: the codes of each length are consecutive, so one
+    // comparison per bit tells whether a symbol is complete.
+    bool decode(const uint8_t* p, size_t size, std::string& out) const {
+        uint32_t code = 0;
+        int length = 0;
+        for (size_t i = 0; i < size; i++) {
+            for (int bit = 7; bit >= 0; bit--) {
+                code = (code << 1) | ((p[i] >> bit) & 1);
+                length++;
+                uint32_t offset = code - first_code[length];
+                if (offset < count[length]) {
+                    uint16_t symbol = symbols[first_symbol[length] + offset];
+                    if (symbol == 256) return false;
+                    out.push_back((char)symbol);
+                    code = 0;
+                    length = 0;
+                } else if (length == max_length) {
+                    return false;
+                }
+            }
+        }
+        // At most 7 bits of padding, and they must be a prefix of EOS.
+        return length < 8 && code == (1u << length) - 1;
+    }
+
+private:
+    static constexpr int max_length = 30;
+
+    uint32_t codes[257];
+    uint32_t first_code[max_length + 1];
+    uint16_t first_symbol[max_length + 1];
+    uint16_t count[max_length + 1];
+    // Symbols ordered by code length, then value.
+    uint16_t symbols[257];
+
+    HPACKHuffman() {
+        uint32_t code = 0;
+        uint16_t index = 0;
+        for (int length = 0; length <= max_length; length++) {
+            first_code[length] = code;
+            first_symbol[length] = index;
+            count[length] = 0;
+            for (int symbol = 0; symbol < 257; symbol++) {
+                if (hpack_huffman_lengths[symbol] != length) continue;
+                codes[symbol] = code++;
+                symbols[index++] = (uint16_t)symbol;
+                count[length]++;
+            }
+            code <<= 1;
+        }
+    }
+};
+
+// The dynamic table both ends keep in step. Entry 0 is the newest, which
+// HPACK numbers right after the static table.
+class HPACKTable {
+public:
+    // Per-entry overhead the size limit counts (Section 4.1).
+    static constexpr size_t entry_overhead = 32;
+
+    explicit HPACKTable(size_t max_size = 4096) : max_size(max_size), used(0) {}
+
+    size_t size() const { return entries.size(); }
+    size_t maxSize() const { return max_size; }
+    const std::pair<std::string, std::string>& at(size_t index) const { return entries[index]; }
+
+    void setMaxSize(size_t size) {
+        max_size = size;
+        evict(0);
+    }
+
+    // An entry larger than the whole table just empties it. name may
+    // point into an entry this evicts, so it is copied first.
+    void insert(std::string_view name, std::string_view value) {
+        size_t size = name.size() + value.size() + entry_overhead;
+        std::pair<std::string, std::string> entry;
+        if (size <= max_size) entry = std::make_pair(std::string(name), std::string(value));
+        evict(size);
+        if (size > max_size) return;
+        entries.push_front(std::move(entry));
+        used += size;
+    }
+
+private:
+    std::deque<std::pair<std::string, std::string>> entries;
+    size_t max_size;
+    size_t used;
+
+    // Makes room for an entry of the given size.
+    void evict(size_t room) {
+        while (!entries.empty() && used + room > max_size) {
+            used -= entries.back().first.size() + entries.back().second.size() + entry_overhead;
+            entries.pop_back();
+        }
+    }
+};
+
+// An HPACK integer (RFC 7541, 5.1) with flags in the bits above the prefix.
+inline void hpackEncodeInteger(std::string& out, uint32_t value, int prefix_bits, uint8_t flags) {
+    uint32_t limit = (1u << prefix_bits) - 1;
+    if (value < limit) {
+        out.push_back((char)(flags | value));
+        return;
+    }
+    out.push_back((char)(flags | limit));
+    value -= limit;
+    while (value >= 0x80) {
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+// Decodes one connection's header blocks, in the order they arrive.
+class HPACKDecoder {
+public:
+    // The most the peer may make the table (our SETTINGS_HEADER_TABLE_SIZE).
+    static constexpr size_t table_limit = 4096;
+
+    // Calls field(name, value) for each entry of a complete header block;
+    // the views last only for the call. Returns false on a malformed
+    // block, which breaks the table for good (a connection error).
+    template <class Field>
+    bool decode(const uint8_t* p, size_t size, Field&& field) {
+        const uint8_t* end = p + size;
+        bool fields_seen = false;
+        while (p < end) {
+            uint8_t first = *p;
+            uint32_t index;
+            if (first & 0x80) {
+                if (!readInteger(p, end, 7, index) || index == 0) return false;
+                std::string_view name, value;
+                if (!lookup(index, name, value)) return false;
+                field(name, value);
+            } else if ((first & 0xe0) == 0x20) {
+                // Size updates come only at the start of a block.
+                if (fields_seen || !readInteger(p, end, 5, index) || index > table_limit) return false;
+                table.setMaxSize(index);
+                continue;
+            } else {
+                bool indexed = (first & 0x40) != 0;
+                if (!readInteger(p, end, indexed ? 6 : 4, index)) return false;
+                std::string_view name, value;
+                if (index != 0) {
+                    std::string_view unused;
+                    if (!lookup(index, name, unused)) return false;
+                } else if (!readString(p, end, name_buffer, name)) {
+                    return false;
+                }
+                if (!readString(p, end, value_buffer, value)) return false;
+                field(name, value);
+                if (indexed) table.insert(name, value);
+            }
+            fields_seen = true;
+        }
+        return true;
+    }
+
+private:
+    HPACKTable table{table_limit};
+    std::string name_buffer;
+    std::string value_buffer;
+
+    bool lookup(uint32_t index, std::string_view& name, std::string_view& value) const {
+        if (index <= hpack_static_count) {
+            name = hpack_static_table[index - 1].first;
+            value = hpack_static_table[index - 1].second;
+            return true;
+        }
+        index -= hpack_static_count + 1;
+        if (index >= table.size()) return false;
+        name = table.at(index).first;
+        value = table.at(index).second;
+        return true;
+    }
+
+    static bool readInteger(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint32_t& value) {
+        uint32_t limit = (1u << prefix_bits) - 1;
+        value = *p++ & limit;
+        if (value < limit) return true;
+        uint64_t total = value;
+        for (int shift = 0; p < end && shift <= 28; shift += 7) {
+            uint8_t byte = *p++;
+            total += (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                if (total > 0xffffffu) return false;
+                value = (uint32_t)total;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool readString(const uint8_t*& p, const uint8_t* end, std::string& buffer, std::string_view& out) {
+        if (p == end) return false;
+        bool huffman = (*p & 0x80) != 0;
+        uint32_t length;
+        if (!readInteger(p, end, 7, length) || length > (size_t)(end - p)) return false;
+        if (huffman) {
+            buffer.clear();
+            if (!HPACKHuffman::get().decode(p, length, buffer)) return false;
+            out = buffer;
+        } else {
+            out = std::string_view((const char*)p, length);
+        }
+        p += length;
+        return true;
+    }
+};
+
+// Encodes one connection's response header blocks. Fields repeated from
+// response to response (content types, cache headers, the current date)
+// go into the dynamic table once and cost a byte or two after that.
+class HPACKEncoder {
+public:
+    // The largest table we use, whatever the peer allows.
+    static constexpr size_t table_limit = 4096;
+
+    // From the peer's SETTINGS_HEADER_TABLE_SIZE; takes effect with the
+    // next block.
+    void setMaxTableSize(size_t size) {
+        size = std::min(size, table_limit);
+        if (size == table.maxSize()) return;
+        smallest_update = std::min(smallest_update, size);
+        table.setMaxSize(size);
+        update_pending = true;
+    }
+
+    // Starts a header block, announcing any table size change first.
+    void begin(std::string& out) {
+        if (!update_pending) return;
+        // A shrink then a grow must both be signalled, smallest first.
+        if (smallest_update < table.maxSize()) hpackEncodeInteger(out, (uint32_t)smallest_update, 5, 0x20);
+        hpackEncodeInteger(out, (uint32_t)table.maxSize(), 5, 0x20);
+        update_pending = false;
+        smallest_update = SIZE_MAX;
+    }
+
+    // name must be lowercase.
+    void encode(std::string_view name, std::string_view value, std::string& out) {
+        uint32_t name_index = 0;
+        for (size_t i = 0; i < hpack_static_count; i++) {
+            if (hpack_static_table[i].first != name) continue;
+            if (hpack_static_table[i].second == value) {
+                hpackEncodeInteger(out, (uint32_t)(i + 1), 7, 0x80);
+                return;
+            }
+            if (name_index == 0) name_index = (uint32_t)(i + 1);
+        }
+        for (size_t i = 0; i < table.size(); i++) {
+            const std::pair<std::string, std::string>& entry = table.at(i);
+            if (entry.first != name) continue;
+            uint32_t index = (uint32_t)(hpack_static_count + 1 + i);
+            if (entry.second == value) {
+                hpackEncodeInteger(out, index, 7, 0x80);
+                return;
+            }
+            if (name_index == 0) name_index = index;
+        }
+
+        if (name == "set-cookie") {
+            // Never indexed, so intermediaries do not compress it either.
+            hpackEncodeInteger(out, name_index, 4, 0x10);
+        } else if (name == "content-length" ||
+                   name.size() + value.size() + HPACKTable::entry_overhead > table.maxSize() / 4) {
+            // Values unlikely to repeat would only push useful entries out.
+            hpackEncodeInteger(out, name_index, 4, 0x00);
+        } else {
+            hpackEncodeInteger(out, name_index, 6, 0x40);
+            table.insert(name, value);
+        }
+        if (name_index == 0) writeString(name, out);
+        writeString(value, out);
+    }
+
+private:
+    HPACKTable table{table_limit};
+    size_t smallest_update = SIZE_MAX;
+    bool update_pending = false;
+
+    static void writeString(std::string_view text, std::string& out) {
+        const HPACKHuffman& huffman = HPACKHuffman::get();
+        size_t encoded = huffman.encodedSize(text);
+        if (encoded < text.size()) {
+            hpackEncodeInteger(out, (uint32_t)encoded, 7, 0x80);
+            huffman.encode(text, out);
+        } else {
+            hpackEncodeInteger(out, (uint32_t)text.size(), 7, 0x00);
+            out.append(text.data(), text.size());
+        }
+    }
+};
+
+// Decodes base64url without padding (RFC 4648, 5), as the HTTP2-Settings
+// header carries it. Returns false on any other character.
+inline bool decodeBase64Url(std::string_view text, std::string& out) {
+    uint32_t bits = 0;
+    int count = 0;
+    for (char c : text) {
+        int value = c >= 'A' && c <= 'Z'   ? c - 'A'
+                    : c >= 'a' && c <= 'z' ? c - 'a' + 26
+                    : c >= '0' && c <= '9' ? c - '0' + 52
+                    : c == '-'             ? 62
+                    : c == '_'             ? 63
+                                           : -1;
+        if (value < 0) return false;
+        bits = bits << 6 | (uint32_t)value;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out.push_back((char)(bits >> count));
+        }
+    }
+    return count < 6;
+}
+
+// HTTP/2 framing and stream state for one connection (RFC 9113), kept
+// apart from the socket. receive() consumes bytes from the client and
+// collects the streams whose request is complete in ready(); respond()
+// and queueData() give a stream its answer, and produce() frames as much
+// of the queued bodies into output as flow control allows.
+class Http2Session {
+public:
+    enum ErrorCode : uint32_t {
+        NoError = 0x0,
+        ProtocolError = 0x1,
+        InternalError = 0x2,
+        FlowControlError = 0x3,
+        StreamClosed = 0x5,
+        FrameSizeError = 0x6,
+        RefusedStream = 0x7,
+        CompressionError = 0x9,
+        EnhanceYourCalm = 0xb,
+    };
+
+    static constexpr std::string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    // Streams a client may have open at once (SETTINGS_MAX_CONCURRENT_STREAMS).
+    static constexpr uint32_t max_streams = 100;
+
+    struct Stream {
+        uint32_t id = 0;
+        // Views into arena and body.
+        HTTPRequest request;
+        Arena arena{512};
+        std::string body;
+        std::chrono::steady_clock::time_point start;
+        // With tracing: when the stream opened, its trace id (0 unless
+        // sampled) and when its running phase began.
+        uint64_t trace_start = 0;
+        uint64_t trace_id = 0;
+        uint64_t trace_mark = 0;
+        // Non-zero: the request is answered with this error status
+        // instead of reaching its handler.
+        int status = 0;
+        size_t content_length = HTTPResponse::unknown_length;
+        bool remote_closed = false;
+        bool local_closed = false;
+        bool queued = false;
+        // The response body still to send: data from data_offset, then
+        // shared or file from source_offset. While data_complete is false
+        // a streamed body appends to data as it is produced.
+        std::string data;
+        size_t data_offset = 0;
+        std::shared_ptr<const std::string> shared;
+        std::shared_ptr<const FileBody> file;
+        size_t source_offset = 0;
+        bool data_complete = true;
+        // The handler's ResponseStream, when it streams; the server owns it.
+        std::shared_ptr<ResponseStream> producer;
+        int64_t send_window = 0;
+        int64_t receive_window = 0;
+        uint32_t receive_credit = 0;
+
+        size_t queuedBytes() const {
+            size_t source = file ? file->size() : shared ? shared->size() : 0;
+            return data.size() - data_offset + source - source_offset;
+        }
+    };
+
+    // Frames waiting to be written to the socket.
+    std::string output;
+    // Runs before a stream is dropped; aborted when it did not finish.
+    std::function<void(Stream&, bool aborted)> on_close;
+
+    explicit Http2Session(size_t max_body_size)
+        : max_body_size(max_body_size), last_stream_id(0), continuation_stream(0), send_window(default_window),
+          receive_window(connection_window), receive_credit(0), peer_initial_window(default_window),
+          peer_max_frame(default_frame_size), preface_done(false), settings_received(false), failed(false),
+          peer_going_away(false), credit_pending(false) {}
+
+    ~Http2Session() {
+        closeAll();
+    }
+
+    Http2Session(const Http2Session&) = delete;
+    Http2Session& operator=(const Http2Session&) = delete;
+
+    // Queues the server preface: our SETTINGS, and a larger window for
+    // the connection as a whole than the protocol starts with.
+    void start() {
+        size_t at = beginFrame(Settings, 0, 0);
+        writeSetting(SettingsMaxConcurrentStreams, max_streams);
+        writeSetting(SettingsInitialWindowSize, stream_window);
+        writeSetting(SettingsMaxHeaderListSize, max_header_list);
+        endFrame(at);
+        writeWindowUpdate(0, connection_window - default_window);
+    }
+
+    // An h2c upgrade: the HTTP2-Settings header holds the client's first
+    // SETTINGS, and the upgraded request becomes stream 1 (RFC 7540, 3.2).
+    bool applySettings(std::string_view payload) {
+        if (payload.size() % 6 != 0) return false;
+        applySettingsPayload((const uint8_t*)payload.data(), payload.size());
+        return !failed;
+    }
+
+    Stream& upgrade(const HTTPRequest& request) {
+        Stream& stream = openStream(1);
+        stream.request.assign(request);
+        stream.remote_closed = true;
+        ready_streams.push_back(1);
+        return stream;
+    }
+
+    // Parses as many whole frames as data holds; returns the bytes used.
+    // After a connection error the rest is discarded and a GOAWAY queued.
+    size_t receive(const char* data, size_t size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        size_t used = 0;
+        if (!preface_done) {
+            size_t count = std::min(size, preface.size());
+            if (memcmp(data, preface.data(), count) != 0) {
+                fail(ProtocolError);
+                return size;
+            }
+            if (count < preface.size()) return 0;
+            preface_done = true;
+            used = count;
+        }
+        while (!failed && size - used >= frame_header_size) {
+            const uint8_t* p = bytes + used;
+            uint32_t length = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+            if (length > default_frame_size) {
+                fail(FrameSizeError);
+                break;
+            }
+            if (size - used - frame_header_size < length) break;
+            handleFrame(p[3], p[4], read32(p + 5) & 0x7fffffff, p + frame_header_size, length);
+            used += frame_header_size + length;
+        }
+        if (failed) return size;
+        sendCredit();
+        return used;
+    }
+
+    // Streams whose request is complete, for the server to dispatch.
+    std::vector<uint32_t>& ready() { return ready_streams; }
+
+    Stream* find(uint32_t id) {
+        auto it = streams.find(id);
+        return it != streams.end() ? it->second.get() : nullptr;
+    }
+
+    // Sends the response head. Unless no_body, the body moves into the
+    // stream; with stream.producer set the server adds to it later
+    // through queueData(). The stream may be gone when this returns.
+    void respond(Stream& stream, HTTPResponse& response, bool no_body) {
+        bool streamed = stream.producer != nullptr;
+        bool empty = no_body || (!streamed && response.bodySize() == 0);
+        writeHeaders(stream, response, empty);
+        if (empty) {
+            finishSending(stream);
+            return;
+        }
+        if (response.file) {
+            stream.file = std::move(response.file);
+        } else if (response.shared_body) {
+            stream.shared = std::move(response.shared_body);
+        } else {
+            stream.data.swap(response.body);
+        }
+        stream.data_complete = !streamed;
+        schedule(stream);
+    }
+
+    // More of a streamed body; complete once it has ended.
+    void queueData(Stream& stream, std::string_view data, bool complete) {
+        if (stream.data_offset > 0 && stream.data_offset == stream.data.size()) {
+            stream.data.clear();
+            stream.data_offset = 0;
+        }
+        stream.data.append(data.data(), data.size());
+        stream.data_complete = complete;
+        schedule(stream);
+    }
+
+    // Appends DATA frames for up to about budget bytes, taking the
+    // streams in turn so one large body does not hold up the others.
+    void produce(size_t budget) {
+        size_t produced = 0;
+        while (produced < budget && send_window > 0 && !sending.empty()) {
+            uint32_t id = sending.front();
+            sending.pop_front();
+            Stream* stream = find(id);
+            if (stream == nullptr) continue;
+            size_t available = stream->queuedBytes();
+            size_t count = (size_t)std::min<int64_t>(
+                {(int64_t)available, send_window, stream->send_window, (int64_t)peer_max_frame,
+                 (int64_t)(budget - produced)});
+            bool last = stream->data_complete && count == available;
+            if (count == 0 && !last) {
+                // Waiting for a WINDOW_UPDATE on the stream, or for the producer.
+                stream->queued = false;
+                continue;
+            }
+            size_t at = beginFrame(Data, last ? FlagEndStream : 0, id);
+            if (!takeData(*stream, count)) {
+                output.resize(at);
+                resetStream(*stream, InternalError);
+                continue;
+            }
+            endFrame(at);
+            send_window -= (int64_t)count;
+            stream->send_window -= (int64_t)count;
+            produced += frame_header_size + count;
+            if (last) {
+                finishSending(*stream);
+            } else {
+                sending.push_back(id);
+            }
+        }
+    }
+
+    // Tells the client the connection is going away; with an error code,
+    // nothing more is read.
+    void goAway(ErrorCode code) {
+        size_t at = beginFrame(GoAway, 0, 0);
+        write32(last_stream_id);
+        write32(code);
+        endFrame(at);
+        if (code != NoError) failed = true;
+    }
+
+    void resetStream(Stream& stream, ErrorCode code) {
+        writeRstStream(stream.id, code);
+        closeStream(stream, true);
+    }
+
+    // Ends every stream, as when the connection closes.
+    void closeAll() {
+        while (!streams.empty()) {
+            closeStream(*streams.begin()->second, true);
+        }
+    }
+
+    template <class F>
+    void forEachStream(F&& callback) {
+        for (auto& entry : streams) callback(*entry.second);
+    }
+
+    bool hasFailed() const { return failed; }
+    bool awaitingPreface() const { return !settings_received; }
+    // The client sent GOAWAY: finish what is open, then close.
+    bool peerGoingAway() const { return peer_going_away; }
+    bool idle() const { return streams.empty(); }
+
+    // Some stream still has a request body coming in.
+    bool receiving() const {
+        for (const auto& entry : streams) {
+            if (!entry.second->remote_closed) return true;
+        }
+        return false;
+    }
+
+    // Response bytes are queued but the client has not opened the window.
+    bool blocked() const {
+        for (const auto& entry : streams) {
+            const Stream& stream = *entry.second;
+            if (stream.queuedBytes() > 0 && (send_window <= 0 || stream.send_window <= 0)) return true;
+        }
+        return false;
+    }
+
+private:
+    enum FrameType : uint8_t {
+        Data = 0x0,
+        Headers = 0x1,
+        Priority = 0x2,
+        RstStream = 0x3,
+        Settings = 0x4,
+        PushPromise = 0x5,
+        Ping = 0x6,
+        GoAway = 0x7,
+        WindowUpdate = 0x8,
+        Continuation = 0x9,
+    };
+    enum Flags : uint8_t {
+        FlagEndStream = 0x1,
+        FlagAck = 0x1,
+        FlagEndHeaders = 0x4,
+        FlagPadded = 0x8,
+        FlagPriority = 0x20,
+    };
+    enum Setting : uint16_t {
+        SettingsHeaderTableSize = 0x1,
+        SettingsEnablePush = 0x2,
+        SettingsMaxConcurrentStreams = 0x3,
+        SettingsInitialWindowSize = 0x4,
+        SettingsMaxFrameSize = 0x5,
+        SettingsMaxHeaderListSize = 0x6,
+    };
+
+    static constexpr size_t frame_header_size = 9;
+    static constexpr uint32_t default_frame_size = 16384;
+    static constexpr int64_t default_window = 65535;
+    static constexpr int64_t max_window = 0x7fffffff;
+    // Receive windows: requests are buffered whole, so these only need to
+    // keep a fast upload from stalling on round trips.
+    static constexpr uint32_t stream_window = 1u << 20;
+    static constexpr uint32_t connection_window = 16u << 20;
+    static constexpr uint32_t max_header_list = 64 * 1024;
+    // Encoded header block bytes accepted across CONTINUATION frames.
+    static constexpr size_t max_header_block = 256 * 1024;
+
+    size_t max_body_size;
+    std::unordered_map<uint32_t, std::unique_ptr<Stream>> streams;
+    std::vector<uint32_t> ready_streams;
+    // Streams with body bytes to send, in turn.
+    std::deque<uint32_t> sending;
+    HPACKDecoder decoder;
+    HPACKEncoder encoder;
+    std::string header_block;
+    std::string name_buffer;
+    uint32_t last_stream_id;
+    uint32_t continuation_stream;
+    bool block_end_stream = false;
+    int64_t send_window;
+    int64_t receive_window;
+    uint32_t receive_credit;
+    int64_t peer_initial_window;
+    uint32_t peer_max_frame;
+    bool preface_done;
+    bool settings_received;
+    bool failed;
+    bool peer_going_away;
+    bool credit_pending;
+
+    static uint32_t read32(const uint8_t* p) {
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+
+    void write32(uint32_t value) {
+        char bytes[4] = {(char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+        output.append(bytes, 4);
+    }
+
+    // Appends a frame header with a zero length; endFrame() fills it in.
+    size_t beginFrame(uint8_t type, uint8_t flags, uint32_t id) {
+        size_t at = output.size();
+        char header[frame_header_size] = {0, 0, 0, (char)type, (char)flags,
+                                          (char)(id >> 24), (char)(id >> 16), (char)(id >> 8), (char)id};
+        output.append(header, frame_header_size);
+        return at;
+    }
+
+    void endFrame(size_t at) {
+        size_t length = output.size() - at - frame_header_size;
+        output[at] = (char)(length >> 16);
+        output[at + 1] = (char)(length >> 8);
+        output[at + 2] = (char)length;
+    }
+
+    void writeSetting(uint16_t id, uint32_t value) {
+        output.push_back((char)(id >> 8));
+        output.push_back((char)id);
+        write32(value);
+    }
+
+    void writeWindowUpdate(uint32_t id, uint32_t increment) {
+        size_t at = beginFrame(WindowUpdate, 0, id);
+        write32(increment);
+        endFrame(at);
+    }
+
+    void writeRstStream(uint32_t id, ErrorCode code) {
+        size_t at = beginFrame(RstStream, 0, id);
+        write32(code);
+        endFrame(at);
+    }
+
+    void fail(ErrorCode code) {
+        if (!failed) goAway(code);
+    }
+
+    Stream& openStream(uint32_t id) {
+        std::unique_ptr<Stream> stream(new Stream());
+        stream->id = id;
+        stream->start = std::chrono::steady_clock::now();
+        if constexpr (tracing_built) stream->trace_start = traceClock();
+        stream->send_window = peer_initial_window;
+        stream->receive_window = stream_window;
+        stream->request.version = "HTTP/2.0";
+        Stream& result = *stream;
+        streams[id] = std::move(stream);
+        last_stream_id = std::max(last_stream_id, id);
+        return result;
+    }
+
+    void closeStream(Stream& stream, bool aborted) {
+        auto it = streams.find(stream.id);
+        if (it == streams.end()) return;
+        // Kept alive until the callback is done with it.
+        std::unique_ptr<Stream> owned = std::move(it->second);
+        streams.erase(it);
+        if (on_close) on_close(*owned, aborted || !owned->local_closed);
+    }
+
+    void schedule(Stream& stream) {
+        if (stream.queued || stream.local_closed) return;
+        stream.queued = true;
+        sending.push_back(stream.id);
+    }
+
+    // The last frame of the response is queued. A client still sending a
+    // body it no longer needs to is told to stop (Section 8.1).
+    void finishSending(Stream& stream) {
+        stream.local_closed = true;
+        if (!stream.remote_closed) writeRstStream(stream.id, NoError);
+        closeStream(stream, false);
+    }
+
+    // Appends count bytes of the stream's queued body to output.
+    bool takeData(Stream& stream, size_t count) {
+        size_t from_data = std::min(count, stream.data.size() - stream.data_offset);
+        output.append(stream.data, stream.data_offset, from_data);
+        stream.data_offset += from_data;
+        count -= from_data;
+        if (count == 0) return true;
+        if (stream.shared) {
+            output.append(*stream.shared, stream.source_offset, count);
+        } else if (stream.file) {
+            size_t at = output.size();
+            output.resize(at + count);
+            if (!stream.file->readAt(stream.source_offset, &output[at], count)) return false;
+        }
+        stream.source_offset += count;
+        return true;
+    }
+
+    void handleFrame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t length) {
+        if (!settings_received && type != Settings) {
+            fail(ProtocolError);
+            return;
+        }
+        if (continuation_stream != 0 && (type != Continuation || id != continuation_stream)) {
+            fail(ProtocolError);
+            return;
+        }
+        switch (type) {
+        case Data: handleData(flags, id, payload, length); break;
+        case Headers: handleHeaders(flags, id, payload, length); break;
+        case Priority:
+            if (id == 0) fail(ProtocolError);
+            else if (length != 5) fail(FrameSizeError);
+            break;
+        case RstStream: handleRstStream(id, payload, length); break;
+        case Settings: handleSettings(flags, id, payload, length); break;
+        case PushPromise: fail(ProtocolError); break;
+        case Ping: handlePing(flags, id, payload, length); break;
+        case GoAway:
+            if (id != 0) fail(ProtocolError);
+            else peer_going_away = true;
+            break;
+        case WindowUpdate: handleWindowUpdate(id, payload, length); break;
+        case Continuation: handleContinuation(flags, id, payload, length); break;
+        default: break;  // unknown frame types are ignored
+        }
+    }
+
+    // Strips the padding of a PADDED frame.
+    bool unpad(uint8_t flags, const uint8_t*& payload, uint32_t& length) {
+        if (!(flags & FlagPadded)) return true;
+        if (length == 0 || payload[0] >= length) {
+            fail(ProtocolError);
+            return false;
+        }
+        length -= 1 + payload[0];
+        payload++;
+        return true;
+    }
+
+    void handleData(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t length) {
+        if (id == 0) {
+            fail(ProtocolError);
+            return;
+        }
+        // Flow control counts the whole frame, padding included.
+        receive_window -= length;
+        receive_credit += length;
+        if (receive_window < 0) {
+            fail(FlowControlError);
+            return;
+        }
+        if (!unpad(flags, payload, length)) return;
+        Stream* stream = find(id);
+        if (stream == nullptr) {
+            // Idle streams cannot carry data; closed ones may still have some in flight.
+            if (id > last_stream_id) fail(ProtocolError);
+            return;
+        }
+        if (stream->remote_closed) {
+            resetStream(*stream, StreamClosed);
+            return;
+        }
+        stream->receive_window -= length;
+        if (stream->receive_window < 0) {
+            resetStream(*stream, FlowControlError);
+            return;
+        }
+        if (stream->status == 0) {
+            if (stream->body.size() + length > max_body_size) {
+                stream->status = 413;
+                std::string().swap(stream->body);
+            } else {
+                stream->body.append((const char*)payload, length);
+            }
+        }
+        if (flags & FlagEndStream) {
+            endRequest(*stream);
+        } else {
+            stream->receive_credit += length;
+            credit_pending = true;
+        }
+    }
+
+    void handleHeaders(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t length) {
+        if (id == 0 || id % 2 == 0) {
+            fail(ProtocolError);
+            return;
+        }
+        if (!unpad(flags, payload, length)) return;
+        if (flags & FlagPriority) {
+            if (length < 5) {
+                fail(FrameSizeError);
+                return;
+            }
+            payload += 5;
+            length -= 5;
+        }
+        header_block.assign((const char*)payload, length);
+        block_end_stream = (flags & FlagEndStream) != 0;
+        if (flags & FlagEndHeaders) {
+            finishHeaderBlock(id);
+        } else {
+            continuation_stream = id;
+        }
+    }
+
+    void handleContinuation(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t length) {
+        if (continuation_stream == 0 || id != continuation_stream) {
+            fail(ProtocolError);
+            return;
+        }
+        if (header_block.size() + length > max_header_block) {
+            fail(EnhanceYourCalm);
+            return;
+        }
+        header_block.append((const char*)payload, length);
+        if (flags & FlagEndHeaders) {
+            continuation_stream = 0;
+            finishHeaderBlock(id);
+        }
+    }
+
+    // Decodes a complete header block: a new request, its trailers, or a
+    // block for a stream we are not keeping, which still has to go
+    // through the decoder to keep its table in step.
+    void finishHeaderBlock(uint32_t id) {
+        const uint8_t* block = (const uint8_t*)header_block.data();
+        Stream* stream = find(id);
+        bool opening = stream == nullptr && id > last_stream_id;
+        if (stream != nullptr || !opening || streams.size() >= max_streams) {
+            bool decoded = decoder.decode(block, header_block.size(), [](std::string_view, std::string_view) {});
+            if (!decoded) {
+                fail(CompressionError);
+            } else if (stream != nullptr) {
+                // Trailers: they must end the stream; their fields are dropped.
+                if (stream->remote_closed) resetStream(*stream, StreamClosed);
+                else if (!block_end_stream) resetStream(*stream, ProtocolError);
+                else endRequest(*stream);
+            } else if (opening) {
+                last_stream_id = id;
+                writeRstStream(id, RefusedStream);
+            }
+            return;
+        }
+
+        Stream& opened = openStream(id);
+        HeaderState state;
+        bool decoded = decoder.decode(block, header_block.size(), [&](std::string_view name, std::string_view value) {
+            addField(opened, state, name, value);
+        });
+        if (!decoded) {
+            fail(CompressionError);
+            return;
+        }
+        HTTPRequest& request = opened.request;
+        if (!state.cookie.empty()) {
+            request.headers.add("cookie", opened.arena.copy(state.cookie));
+        }
+        if (state.malformed || !state.has_scheme || request.method.empty() || request.path.empty()) {
+            resetStream(opened, ProtocolError);
+            return;
+        }
+        if (state.list_size > max_header_list || state.too_many) {
+            opened.status = 431;
+        } else if (opened.content_length != HTTPResponse::unknown_length && opened.content_length > max_body_size) {
+            opened.status = 413;
+        }
+        if (block_end_stream) endRequest(opened);
+    }
+
+    struct HeaderState {
+        std::string cookie;
+        size_t list_size = 0;
+        bool regular_seen = false;
+        bool has_scheme = false;
+        bool malformed = false;
+        bool too_many = false;
+    };
+
+    // Checks a request field against Section 8.2 and adds it: pseudo
+    // headers become the request line, :authority becomes Host, and
+    // cookie crumbs are joined back into one header.
+    void addField(Stream& stream, HeaderState& state, std::string_view name, std::string_view value) {
+        HTTPRequest& request = stream.request;
+        state.list_size += name.size() + value.size() + HPACKTable::entry_overhead;
+        if (state.malformed || state.list_size > max_header_list) return;
+        if (!name.empty() && name[0] == ':') {
+            if (state.regular_seen) {
+                state.malformed = true;
+            } else if (name == ":method" && request.method.empty()) {
+                request.method = stream.arena.copy(value);
+            } else if (name == ":path" && request.path.empty()) {
+                request.setTarget(stream.arena.copy(value));
+            } else if (name == ":scheme" && !state.has_scheme) {
+                state.has_scheme = true;
+            } else if (name == ":authority") {
+                if (!request.headers.add("host", stream.arena.copy(value), HTTPHeaders::Host)) state.too_many = true;
+            } else {
+                state.malformed = true;
+            }
+            return;
+        }
+        state.regular_seen = true;
+        for (char c : name) {
+            if (c >= 'A' && c <= 'Z') {
+                state.malformed = true;
+                return;
+            }
+        }
+        HTTPHeaders::Known kind = HTTPHeaders::classify(name);
+        if (kind == HTTPHeaders::Connection || kind == HTTPHeaders::TransferEncoding || kind == HTTPHeaders::Upgrade ||
+            name == "keep-alive" || name == "proxy-connection" || (name == "te" && value != "trailers")) {
+            state.malformed = true;
+            return;
+        }
+        if (name == "cookie") {
+            if (!state.cookie.empty()) state.cookie.append("; ");
+            state.cookie.append(value.data(), value.size());
+            return;
+        }
+        if (kind == HTTPHeaders::ContentLength) {
+            size_t length = 0;
+            std::from_chars_result parsed = std::from_chars(value.data(), value.data() + value.size(), length);
+            if (value.empty() || parsed.ec != std::errc() || parsed.ptr != value.data() + value.size()) {
+                state.malformed = true;
+                return;
+            }
+            stream.content_length = length;
+        }
+        if (!request.headers.add(stream.arena.copy(name), stream.arena.copy(value), kind)) state.too_many = true;
+    }
+
+    // The client's END_STREAM: the request is ready for its handler.
+    void endRequest(Stream& stream) {
+        stream.remote_closed = true;
+        if (stream.status == 0 && stream.content_length != HTTPResponse::unknown_length &&
+            stream.content_length != stream.body.size()) {
+            resetStream(stream, ProtocolError);
+            return;
+        }
+        stream.request.body = stream.body;
+        ready_streams.push_back(stream.id);
+    }
+
+    void handleRstStream(uint32_t id, const uint8_t*, uint32_t length) {
+        if (id == 0) {
+            fail(ProtocolError);
+            return;
+        }
+        if (length != 4) {
+            fail(FrameSizeError);
+            return;
+        }
+        Stream* stream = find(id);
+        if (stream != nullptr) {
+            closeStream(*stream, true);
+        } else if (id > last_stream_id) {
+            fail(ProtocolError);
+        }
+    }
+
+    void handleSettings(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t length) {
+        if (id != 0) {
+            fail(ProtocolError);
+            return;
+        }
+        if (flags & FlagAck) {
+            if (length != 0) fail(FrameSizeError);
+            return;
+        }
+        if (length % 6 != 0) {
+            fail(FrameSizeError);
+            return;
+        }
+        applySettingsPayload(payload, length);
+        if (failed) return;
+        settings_received = true;
+        size_t at = beginFrame(Settings, FlagAck, 0);
+        endFrame(at);
+    }
+
+    void applySettingsPayload(const uint8_t* payload, size_t length) {
+        for (size_t i = 0; i + 6 <= length; i += 6) {
+            uint16_t setting = (uint16_t)(payload[i] << 8 | payload[i + 1]);
+            uint32_t value = read32(payload + i + 2);
+            switch (setting) {
+            case SettingsHeaderTableSize: encoder.setMaxTableSize(value); break;
+            case SettingsEnablePush:
+                if (value > 1) fail(ProtocolError);
+                break;
+            case SettingsInitialWindowSize: {
+                if (value > max_window) {
+                    fail(FlowControlError);
+                    return;
+                }
+                // Applies to every open stream, retroactively (Section 6.9.2).
+                int64_t delta = (int64_t)value - peer_initial_window;
+                peer_initial_window = value;
+                for (auto& entry : streams) {
+                    Stream& stream = *entry.second;
+                    stream.send_window += delta;
+                    if (stream.send_window > max_window) {
+                        fail(FlowControlError);
+                        return;
+                    }
+                    if (delta > 0 && stream.queuedBytes() > 0) schedule(stream);
+                }
+                break;
+            }
+            case SettingsMaxFrameSize:
+                if (value < default_frame_size || value > 0xffffff) fail(ProtocolError);
+                else peer_max_frame = value;
+                break;
+            default: break;
+            }
+        }
+    }
+
+    void handlePing(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t length) {
+        if (id != 0) {
+            fail(ProtocolError);
+            return;
+        }
+        if (length != 8) {
+            fail(FrameSizeError);
+            return;
+        }
+        if (flags & FlagAck) return;
+        size_t at = beginFrame(Ping, FlagAck, 0);
+        output.append((const char*)payload, 8);
+        endFrame(at);
+    }
+
+    void handleWindowUpdate(uint32_t id, const uint8_t* payload, uint32_t length) {
+        if (length != 4) {
+            fail(FrameSizeError);
+            return;
+        }
+        uint32_t increment = read32(payload) & 0x7fffffff;
+        if (id == 0) {
+            send_window += increment;
+            if (increment == 0) fail(ProtocolError);
+            else if (send_window > max_window) fail(FlowControlError);
+            return;
+        }
+        Stream* stream = find(id);
+        if (stream == nullptr) {
+            if (id > last_stream_id) fail(ProtocolError);
+            return;
+        }
+        stream->send_window += increment;
+        if (increment == 0) {
+            resetStream(*stream, ProtocolError);
+        } else if (stream->send_window > max_window) {
+            resetStream(*stream, FlowControlError);
+        } else if (stream->queuedBytes() > 0 || !stream->data_complete) {
+            schedule(*stream);
+        }
+    }
+
+    // Hands back receive window once half of it is used, so uploads keep
+    // flowing without a WINDOW_UPDATE per frame.
+    void sendCredit() {
+        if (receive_credit >= connection_window / 2) {
+            writeWindowUpdate(0, receive_credit);
+            receive_window += receive_credit;
+            receive_credit = 0;
+        }
+        if (!credit_pending) return;
+        credit_pending = false;
+        for (auto& entry : streams) {
+            Stream& stream = *entry.second;
+            if (stream.receive_credit >= stream_window / 2) {
+                writeWindowUpdate(stream.id, stream.receive_credit);
+                stream.receive_window += stream.receive_credit;
+                stream.receive_credit = 0;
+            } else if (stream.receive_credit > 0) {
+                credit_pending = true;
+            }
+        }
+    }
+
+    // The response head as HEADERS and, past the peer's frame size,
+    // CONTINUATION frames. Server, Date and Content-Length are filled in
+    // as serializeHead() does; HTTP/1 connection headers are dropped.
+    void writeHeaders(Stream& stream, const HTTPResponse& response, bool end_stream) {
+        std::string block;
+        encoder.begin(block);
+        char status[4];
+        std::to_chars_result digits = std::to_chars(status, status + sizeof(status), response.status_code);
+        encoder.encode(":status", std::string_view(status, digits.ptr - status), block);
+
+        bool has_server = false;
+        bool has_date = false;
+        bool has_length = false;
+        for (const HTTPHeader& header : response.headers) {
+            name_buffer.assign(header.first.data(), header.first.size());
+            for (char& c : name_buffer) c = asciiLower(c);
+            std::string_view name = name_buffer;
+            if (name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+                name == "transfer-encoding" || name == "upgrade") {
+                continue;
+            }
+            if (name == "server") has_server = true;
+            else if (name == "date") has_date = true;
+            else if (name == "content-length") has_length = true;
+            encoder.encode(name, header.second, block);
+        }
+        if (!has_server) encoder.encode("server", "cpp_webserver", block);
+        if (!has_date) {
+            std::string_view date = cachedDateHeader();
+            encoder.encode("date", date.substr(6, date.size() - 8), block);
+        }
+        int code = response.status_code;
+        if (!has_length && !stream.producer && code >= 200 && code != 204 && code != 304) {
+            char length[24];
+            std::to_chars_result written = std::to_chars(length, length + sizeof(length), response.bodySize());
+            encoder.encode("content-length", std::string_view(length, written.ptr - length), block);
+        }
+
+        size_t offset = 0;
+        bool first = true;
+        do {
+            size_t count = std::min(block.size() - offset, (size_t)peer_max_frame);
+            bool last = offset + count == block.size();
+            uint8_t flags = (last ? FlagEndHeaders : 0) | (first && end_stream ? FlagEndStream : 0);
+            size_t at = beginFrame(first ? Headers : Continuation, flags, stream.id);
+            output.append(block, offset, count);
+            endFrame(at);
+            offset += count;
+            first = false;
+        } while (offset < block.size());
+    }
+};
+
+// A socket registered with an EventLoop. The owner keeps the watcher alive
+// until it has been removed and the current poll() has returned, and on
+// io_uring until in_flight is back to 0.
+struct IOWatcher {
+    // On io_uring the ring itself reads a Stream and accepts on a
+    // Listener: Readable then means a recv or accept completed, whose
+    // result EventLoop::receive() or accept() hands over, and a Stream's
+    // writes go through EventLoop::send(). Everywhere else, and for
+    // Polled watchers, events only report readiness.
+    enum Kind : uint8_t { Polled, Stream, Listener };
+
+    SOCKET fd = INVALID_SOCKET;
+    uint32_t events = 0;
+    bool active = false;
+    Kind kind = Polled;
+    // Ring operations on the socket not completed yet; the memory of a
+    // send stays in use until then.
+    uint32_t in_flight = 0;
+    size_t slot = 0;
+    std::function<void(uint32_t)> callback;
+};
+
+class EventLoop;
+
+// A deadline on an EventLoop, embedded in its owner so that re-arming it
+// never allocates. The callback runs from poll() on the loop's thread.
+class LoopTimer {
+public:
+    std::function<void()> callback;
+
+    LoopTimer() = default;
+    LoopTimer(const LoopTimer&) = delete;
+    LoopTimer& operator=(const LoopTimer&) = delete;
+    ~LoopTimer();
+
+    bool armed() const { return pprev != nullptr; }
+
+private:
+    friend class EventLoop;
+    EventLoop* loop = nullptr;
+    LoopTimer* next = nullptr;
+    // The pointer that points at this timer while it is in a slot.
+    LoopTimer** pprev = nullptr;
+    uint64_t expires = 0;
+    // Allocated by addTimer() and freed once it has fired.
+    bool owned = false;
+};
+
+// Readiness-based reactor: epoll on Linux, kqueue on the BSDs/macOS and
+// WSAPoll/poll everywhere else. All methods except wakeup() must be called
+// from the thread running poll().
+class EventLoop {
+public:
+    static constexpr uint32_t Readable = 1u << 0;
+    static constexpr uint32_t Writable = 1u << 1;
+    static constexpr uint32_t Closed = 1u << 2;
+
+private:
+    // Hierarchical timing wheel with 1 ms ticks. Level l holds deadlines
+    // less than 64^(l+1) ticks away in 64 slots of 64^l ticks each; when
+    // the wheel reaches a slot of an upper level, its timers move down.
+    // Four levels cover about 4.6 hours. Later deadlines wait in the top
+    // level and are filed again each time it turns. Arming, moving and
+    // cancelling a timer are O(1) whatever the number of timers.
+    static constexpr int wheel_bits = 6;
+    static constexpr size_t wheel_slots = (size_t)1 << wheel_bits;
+    static constexpr int wheel_levels = 4;
+
+    std::atomic<bool> wakeup_pending;
+    LoopTimer* wheel[wheel_levels][wheel_slots] = {};
+    // Bit i is set when slot i of the level may hold timers.
+    uint64_t wheel_occupied[wheel_levels] = {};
+    std::chrono::steady_clock::time_point wheel_start;
+    // Last tick processed, in milliseconds since wheel_start.
+    uint64_t wheel_tick = 0;
+    size_t timer_count = 0;
+    std::vector<std::function<void()>> deferred;
+
+    static inline thread_local EventLoop* current_loop = nullptr;
+
+#ifdef WEBSERVER_HAVE_IO_URING
+    // The io_uring backend, selected at runtime on Linux. Polled watchers get
+    // a one-shot IORING_OP_POLL_ADD that is re-armed after it fires, which
+    // keeps epoll's level-triggered behaviour. For a Stream the ring does
+    // the I/O itself: one multishot IORING_OP_RECV picks buffers from a
+    // ring the loop refills as it copies them out, so idle connections
+    // still hold none, and IORING_OP_SENDMSG sends the queued buffers,
+    // files included (mapped), with an IORING_OP_CLOSE linked behind a
+    // connection's last send. A Listener accepts with one multishot
+    // IORING_OP_ACCEPT. Completions find their slot through the tag. Where
+    // the kernel has DEFER_TASKRUN (6.1) they only run inside the worker's
+    // own io_uring_enter(), which carries a loop iteration's requests and
+    // its wait in one call. The rings are mapped with the raw syscalls, so
+    // liburing is not needed.
+    class IoUringPoller {
+    public:
+        // nullptr when the kernel lacks io_uring, timed waits or buffer
+        // rings (5.19), or forbids it.
+        static std::unique_ptr<IoUringPoller> create(int wakeup_fd) {
+            std::unique_ptr<IoUringPoller> poller(new IoUringPoller(wakeup_fd));
+            if (!poller->setup(4096) || !poller->registerBuffers()) return nullptr;
+            poller->armWakeup();
+            return poller;
+        }
+
+        ~IoUringPoller() {
+            for (Slot& slot : slots) {
+                for (size_t i = slot.accepted_head; i < slot.accepted.size(); i++) close(slot.accepted[i]);
+            }
+            if (buffer_ring != MAP_FAILED) munmap(buffer_ring, buffer_ring_size);
+            if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+            if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+            if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+            if (ring_fd != -1) close(ring_fd);
+        }
+
+        IoUringPoller(const IoUringPoller&) = delete;
+        IoUringPoller& operator=(const IoUringPoller&) = delete;
+
+        void add(IOWatcher& watcher) {
+            uint32_t index;
+            if (!free_slots.empty()) {
+                index = free_slots.back();
+                free_slots.pop_back();
+            } else {
+                index = (uint32_t)slots.size();
+                if (index >> index_bits) throw std::runtime_error("Too many io_uring watchers");
+                slots.push_back(Slot());
+            }
+            slots[index].watcher = &watcher;
+            watcher.slot = index;
+            arm(index);
+        }
+
+        // After watcher.events changed.
+        void modify(IOWatcher& watcher) {
+            uint32_t index = (uint32_t)watcher.slot;
+            if (watcher.kind == IOWatcher::Polled) {
+                disarm(index);
+                arm(index);
+            } else if (watcher.events & Readable) {
+                arm(index);
+            } else if (watcher.kind == IOWatcher::Listener) {
+                disarm(index);
+            }
+            // A Stream's recv stays queued; what it brings waits in the slot
+            // until the watcher wants to read again, up to max_held buffers.
+        }
+
+        // Cancels whatever is queued for the watcher. The slot is reused once
+        // the last of it has completed, and until then the watcher must stay.
+        void remove(IOWatcher& watcher) {
+            uint32_t index = (uint32_t)watcher.slot;
+            Slot& slot = slots[index];
+            uint32_t generation = slot.generation;
+            disarm(index);
+            // A linked close is cancelled with its send.
+            if (slot.sending) cancel(tag(index, generation, SendOp));
+            slot.removed = true;
+            if (watcher.in_flight == 0) release(index);
+        }
+
+        // Copies out what the recv brought, oldest first, like recv() would.
+        long receive(IOWatcher& watcher, char* buffer, size_t size, bool& would_block) {
+            Slot& slot = slots[watcher.slot];
+            would_block = slot.received_head == slot.received.size();
+            if (would_block) return -1;
+            const Received& front = slot.received[slot.received_head];
+            if (front.result <= 0) {
+                int result = front.result;
+                popReceived(slot);
+                if (result == 0) return 0;
+                errno = -result;
+                return -1;
+            }
+            size_t count = std::min(size, (size_t)front.result - slot.recv_taken);
+            std::memcpy(buffer, receive_buffers.get() + (size_t)front.buffer * buffer_size + slot.recv_taken, count);
+            slot.recv_taken += count;
+            if (slot.recv_taken == (size_t)front.result) {
+                provide(front.buffer);
+                popReceived(slot);
+            }
+            return (long)count;
+        }
+
+        SOCKET accept(IOWatcher& watcher) {
+            Slot& slot = slots[watcher.slot];
+            if (slot.accept_error != 0) {
+                errno = slot.accept_error;
+                slot.accept_error = 0;
+                return INVALID_SOCKET;
+            }
+            if (slot.accepted_head == slot.accepted.size()) {
+                errno = EAGAIN;
+                return INVALID_SOCKET;
+            }
+            SOCKET sock = slot.accepted[slot.accepted_head++];
+            if (slot.accepted_head == slot.accepted.size()) {
+                slot.accepted.clear();
+                slot.accepted_head = 0;
+            }
+            return sock;
+        }
+
+        // With then_close, an IORING_OP_CLOSE follows the send once it got
+        // every byte out, and the socket is the ring's to close from then on.
+        void send(IOWatcher& watcher, const iovec* buffers, size_t count, bool then_close) {
+            uint32_t index = (uint32_t)watcher.slot;
+            Slot& slot = slots[index];
+            // On the heap, so the kernel's pointer survives slots growing.
+            if (!slot.message) slot.message.reset(new msghdr());
+            slot.iov.assign(buffers, buffers + count);
+            *slot.message = msghdr();
+            slot.message->msg_iov = slot.iov.data();
+            slot.message->msg_iovlen = count;
+            reserve(then_close ? 2 : 1);
+            io_uring_sqe* sqe = nextSqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = watcher.fd;
+            sqe->addr = (uint64_t)(uintptr_t)slot.message.get();
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = tag(index, slot.generation, SendOp);
+            if (then_close) {
+                // WAITALL makes a short send fail the link instead of closing early.
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->msg_flags |= MSG_WAITALL;
+                sqe = nextSqe();
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = watcher.fd;
+                sqe->user_data = tag(index, slot.generation, CloseOp);
+                slot.closing = true;
+                watcher.in_flight++;
+            }
+            slot.sending = true;
+            watcher.in_flight++;
+        }
+
+        bool sending(const IOWatcher& watcher) const { return slots[watcher.slot].sending; }
+
+        // A send with then_close was queued; the owner must not close the socket.
+        bool closing(const IOWatcher& watcher) const { return slots[watcher.slot].closing; }
+
+        // Takes the result of the last send once it finished: the bytes
+        // sent, or -1 with errno set.
+        bool sendFinished(IOWatcher& watcher, long& result) {
+            Slot& slot = slots[watcher.slot];
+            if (!slot.finished) return false;
+            slot.finished = false;
+            result = slot.send_result;
+            if (result < 0) {
+                errno = (int)-result;
+                result = -1;
+            }
+            return true;
+        }
+
+        // Submits queued requests, waits up to timeout_ms for completions and
+        // calls dispatch(watcher, events) for each watcher they concern, or
+        // with a null watcher once the wakeup eventfd fired. Watchers still
+        // interested afterwards are re-armed.
+        template <class Dispatch>
+        void wait(int timeout_ms, Dispatch dispatch) {
+            enter(again.empty() ? timeout_ms : 0);
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            completions.clear();
+            for (; head != tail; head++) {
+                completions.push_back(cqes[head & cq_mask]);
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            for (const io_uring_cqe& cqe : completions) {
+                if (cqe.user_data == ignore_tag) continue;
+                if (cqe.user_data == wakeup_tag) {
+                    dispatch(nullptr, 0);
+                    armWakeup();
+                    continue;
+                }
+                uint32_t index = (uint32_t)cqe.user_data & index_mask;
+                uint32_t generation = (uint32_t)(cqe.user_data >> 32);
+                Op op = (Op)((cqe.user_data >> index_bits) & 0xff);
+                if (index >= slots.size()) continue;
+                uint32_t events = op == PollOp ? polled(index, generation, cqe.res) : complete(index, generation, op, cqe);
+                if (events != 0) deliver(index, events, dispatch);
+            }
+
+            // Results that waited for the watcher to want them.
+            retrying.swap(again);
+            for (uint32_t index : retrying) {
+                slots[index].again = false;
+                if (slots[index].watcher == nullptr || slots[index].removed) continue;
+                uint32_t events = pendingEvents(slots[index]);
+                if (events != 0) {
+                    deliver(index, events, dispatch);
+                } else {
+                    arm(index);
+                }
+            }
+            retrying.clear();
+        }
+
+    private:
+        // What a completion is for, kept in its tag beside the slot index.
+        enum Op : uint32_t { PollOp, RecvOp, SendOp, CloseOp, AcceptOp };
+
+        // A recv result and, when it brought bytes, the buffer holding them.
+        struct Received {
+            int result;
+            int buffer;
+        };
+
+        struct Slot {
+            IOWatcher* watcher = nullptr;
+            uint32_t generation = 0;
+            // The poll, recv or accept serving the watcher's interest is queued.
+            bool armed = false;
+            // remove() ran; the slot is reused once nothing is in flight.
+            bool removed = false;
+            // Listed in again.
+            bool again = false;
+            bool sending = false;
+            // The last send finished with send_result, not yet taken.
+            bool finished = false;
+            long send_result = 0;
+            // A send linked to a close is queued.
+            bool closing = false;
+            // Completed recvs, oldest first, and how much of the front one
+            // receive() already took.
+            std::vector<Received> received;
+            size_t received_head = 0;
+            size_t recv_taken = 0;
+            std::vector<SOCKET> accepted;
+            size_t accepted_head = 0;
+            int accept_error = 0;
+            std::unique_ptr<msghdr> message;
+            std::vector<iovec> iov;
+        };
+
+        static constexpr uint64_t wakeup_tag = ~0ull;
+        // Completions nothing waits for: removals, cancellations, returned buffers.
+        static constexpr uint64_t ignore_tag = ~0ull - 1;
+        static constexpr int index_bits = 24;
+        static constexpr uint32_t index_mask = (1u << index_bits) - 1;
+        static constexpr uint16_t buffer_group = 0;
+        static constexpr size_t buffer_size = 16 * 1024;
+        static constexpr unsigned buffer_count = 256;
+        // Completed recvs a slot holds for a watcher not reading before its
+        // recv is cancelled, so one slow reader cannot take every buffer.
+        static constexpr size_t max_held = 4;
+
+        int wakeup_fd;
+        int ring_fd;
+        void* sq_ring;
+        void* cq_ring;
+        io_uring_sqe* sqes;
+        size_t sq_ring_size;
+        size_t cq_ring_size;
+        size_t sqes_size;
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned* sq_array;
+        unsigned sq_mask;
+        unsigned sq_entries;
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned cq_mask;
+        io_uring_cqe* cqes;
+        unsigned sqe_tail;
+        bool multishot_accept = true;
+        bool multishot_recv = true;
+        // Completions run only inside io_uring_enter(GETEVENTS).
+        bool deferred = false;
+        // Created disabled, so the worker's first submit makes it the owner.
+        bool disabled = false;
+        std::unique_ptr<char[]> receive_buffers;
+        io_uring_buf_ring* buffer_ring;
+        size_t buffer_ring_size;
+        uint16_t buffer_tail;
+        std::vector<Slot> slots;
+        std::vector<uint32_t> free_slots;
+        std::vector<uint32_t> again;
+        std::vector<uint32_t> retrying;
+        std::vector<io_uring_cqe> completions;
+
+        explicit IoUringPoller(int wakeup_fd)
+            : wakeup_fd(wakeup_fd), ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED),
+              sqes((io_uring_sqe*)MAP_FAILED), sq_ring_size(0), cq_ring_size(0), sqes_size(0), sqe_tail(0),
+              buffer_ring((io_uring_buf_ring*)MAP_FAILED), buffer_ring_size(0), buffer_tail(0) {}
+
+        bool setup(unsigned entries) {
+            io_uring_params params{};
+            // Only the worker submits, so completions can wait for its enter.
+            params.flags = IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                           IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+            ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+            if (ring_fd >= 0) {
+                deferred = disabled = true;
+            } else {
+                params = io_uring_params{};
+                params.flags = IORING_SETUP_CLAMP;
+                ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+                if (ring_fd < 0) return false;
+            }
+            if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) return false;
+
+            sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) {
+                sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+            }
+            sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                           IORING_OFF_SQ_RING);
+            if (sq_ring == MAP_FAILED) return false;
+            cq_ring = single_mmap ? sq_ring
+                                  : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED) return false;
+            sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                                       IORING_OFF_SQES);
+            if (sqes == MAP_FAILED) return false;
+
+            char* sq = (char*)sq_ring;
+            sq_head = (unsigned*)(sq + params.sq_off.head);
+            sq_tail = (unsigned*)(sq + params.sq_off.tail);
+            sq_array = (unsigned*)(sq + params.sq_off.array);
+            sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+            sq_entries = params.sq_entries;
+            char* cq = (char*)cq_ring;
+            cq_head = (unsigned*)(cq + params.cq_off.head);
+            cq_tail = (unsigned*)(cq + params.cq_off.tail);
+            cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+            sqe_tail = *sq_tail;
+            return true;
+        }
+
+        // Registers a ring of receive buffers the kernel picks from and the
+        // loop refills without a system call (Linux 5.19), and fills it.
+        bool registerBuffers() {
+            receive_buffers.reset(new char[buffer_count * buffer_size]);
+            buffer_ring_size = buffer_count * sizeof(io_uring_buf);
+            void* memory = mmap(nullptr, buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) return false;
+            buffer_ring = (io_uring_buf_ring*)memory;
+            io_uring_buf_reg reg{};
+            reg.ring_addr = (uint64_t)(uintptr_t)memory;
+            reg.ring_entries = buffer_count;
+            reg.bgid = buffer_group;
+            if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) return false;
+            for (unsigned i = 0; i < buffer_count; i++) provide((int)i);
+            return true;
+        }
+
+        // Returns a receive buffer for the next recv to pick.
+        void provide(int buffer) {
+            io_uring_buf& entry = buffer_ring->bufs[buffer_tail & (buffer_count - 1)];
+            entry.addr = (uint64_t)(uintptr_t)(receive_buffers.get() + (size_t)buffer * buffer_size);
+            entry.len = (uint32_t)buffer_size;
+            entry.bid = (uint16_t)buffer;
+            __atomic_store_n(&buffer_ring->tail, ++buffer_tail, __ATOMIC_RELEASE);
+        }
+
+        static void popReceived(Slot& slot) {
+            slot.recv_taken = 0;
+            if (++slot.received_head == slot.received.size()) {
+                slot.received.clear();
+                slot.received_head = 0;
+            }
+        }
+
+        static uint32_t toEvents(int result) {
+            if (result < 0) return Closed | Readable;
+            uint32_t events = 0;
+            if (result & (POLLIN | POLLRDHUP)) events |= Readable;
+            if (result & POLLOUT) events |= Writable;
+            if (result & (POLLERR | POLLHUP)) events |= Closed | Readable;
+            return events;
+        }
+
+        static uint64_t tag(uint32_t index, uint32_t generation, Op op) {
+            return ((uint64_t)generation << 32) | ((uint64_t)op << index_bits) | index;
+        }
+
+        // Room for count more requests, submitting the queued ones if need
+        // be, so that a linked chain goes to the kernel whole.
+        void reserve(unsigned count) {
+            if (sqe_tail + count - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_entries) {
+                enter(0);
+            }
+        }
+
+        io_uring_sqe* nextSqe() {
+            reserve(1);
+            unsigned index = sqe_tail & sq_mask;
+            io_uring_sqe* sqe = &sqes[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sq_array[index] = index;
+            sqe_tail++;
+            return sqe;
+        }
+
+        // Queues what serves the watcher's interest, unless it is queued
+        // already: a poll, or for a Stream a recv and for a Listener an
+        // accept, with earlier results not yet taken listed in again.
+        void arm(uint32_t index) {
+            Slot& slot = slots[index];
+            IOWatcher& watcher = *slot.watcher;
+            if (slot.armed || watcher.events == 0) return;
+            if (watcher.kind == IOWatcher::Polled) {
+                io_uring_sqe* sqe = nextSqe();
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = watcher.fd;
+                uint32_t mask = 0;
+                if (watcher.events & Readable) mask |= POLLIN | POLLRDHUP;
+                if (watcher.events & Writable) mask |= POLLOUT;
+                sqe->poll32_events = mask;
+                sqe->user_data = tag(index, slot.generation, PollOp);
+                slot.armed = true;
+                return;
+            }
+            if (!(watcher.events & Readable)) return;
+            // Results queue in order behind those waiting, so the recv can go too.
+            if (pendingEvents(slot) != 0) retry(index);
+            io_uring_sqe* sqe = nextSqe();
+            sqe->fd = watcher.fd;
+            if (watcher.kind == IOWatcher::Stream) {
+                sqe->opcode = IORING_OP_RECV;
+                sqe->flags = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = buffer_group;
+                if (multishot_recv) {
+                    sqe->ioprio = IORING_RECV_MULTISHOT;
+                } else {
+                    sqe->len = (uint32_t)buffer_size;
+                }
+                sqe->user_data = tag(index, slot.generation, RecvOp);
+            } else {
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+                if (multishot_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+                sqe->user_data = tag(index, slot.generation, AcceptOp);
+            }
+            slot.armed = true;
+            watcher.in_flight++;
+        }
+
+        // Cancels the queued poll, recv or accept. Its completion may still
+        // arrive, so the slot moves to a new generation and a stale poll
+        // result is ignored.
+        void disarm(uint32_t index) {
+            Slot& slot = slots[index];
+            if (!slot.armed) return;
+            IOWatcher::Kind kind = slot.watcher->kind;
+            if (kind == IOWatcher::Polled) {
+                io_uring_sqe* sqe = nextSqe();
+                sqe->opcode = IORING_OP_POLL_REMOVE;
+                sqe->addr = tag(index, slot.generation, PollOp);
+                sqe->user_data = ignore_tag;
+            } else {
+                cancel(tag(index, slot.generation, kind == IOWatcher::Stream ? RecvOp : AcceptOp));
+            }
+            slot.armed = false;
+            slot.generation++;
+        }
+
+        void cancel(uint64_t target) {
+            io_uring_sqe* sqe = nextSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = target;
+            sqe->user_data = ignore_tag;
+        }
+
+        void retry(uint32_t index) {
+            if (slots[index].again) return;
+            slots[index].again = true;
+            again.push_back(index);
+        }
+
+        void release(uint32_t index) {
+            Slot& slot = slots[index];
+            for (size_t i = slot.received_head; i < slot.received.size(); i++) {
+                if (slot.received[i].result > 0) provide(slot.received[i].buffer);
+            }
+            for (size_t i = slot.accepted_head; i < slot.accepted.size(); i++) close(slot.accepted[i]);
+            uint32_t generation = slot.generation + 1;
+            slot = Slot();
+            slot.generation = generation;
+            free_slots.push_back(index);
+        }
+
+        static uint32_t pendingEvents(const Slot& slot) {
+            uint32_t events = 0;
+            if (slot.received_head < slot.received.size()) {
+                events |= slot.received.back().result < 0 ? Readable | Closed : Readable;
+            }
+            if (slot.accepted_head < slot.accepted.size() || slot.accept_error != 0) events |= Readable;
+            return events;
+        }
+
+        uint32_t polled(uint32_t index, uint32_t generation, int result) {
+            Slot& slot = slots[index];
+            if (slot.generation != generation || slot.watcher == nullptr || slot.removed) {
+                return 0;  // removed or re-armed since this poll was queued
+            }
+            slot.armed = false;
+            return toEvents(result);
+        }
+
+        // Books a finished recv, send, close or accept in its slot and
+        // returns the events it brings the watcher. The slot cannot have
+        // been reused meanwhile: it waits for its last completion.
+        uint32_t complete(uint32_t index, uint32_t generation, Op op, const io_uring_cqe& cqe) {
+            Slot& slot = slots[index];
+            IOWatcher* watcher = slot.watcher;
+            if (!(cqe.flags & IORING_CQE_F_MORE)) watcher->in_flight--;
+            uint32_t events = 0;
+            switch (op) {
+            case RecvOp: {
+                if (!(cqe.flags & IORING_CQE_F_MORE) && generation == slot.generation) slot.armed = false;
+                bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+                int buffer = (int)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (cqe.res == -EINVAL && multishot_recv) {
+                    multishot_recv = false;  // before Linux 6.0; one recv at a time
+                    if (!slot.removed) retry(index);
+                    break;
+                }
+                if (slot.removed || cqe.res == -ECANCELED || cqe.res == -ENOBUFS) {
+                    if (has_buffer) provide(buffer);
+                    // Every buffer was taken: try again after those returned meanwhile.
+                    if (cqe.res == -ENOBUFS && !slot.removed) retry(index);
+                    break;
+                }
+                slot.received.push_back({cqe.res, buffer});
+                // A watcher not reading holds on to buffers; stop filling more.
+                if (!(watcher->events & Readable) && slot.received.size() - slot.received_head >= max_held) {
+                    disarm(index);
+                }
+                events = cqe.res < 0 ? Readable | Closed : Readable;
+                break;
+            }
+            case SendOp:
+                slot.sending = false;
+                slot.finished = true;
+                slot.send_result = cqe.res;
+                events = Writable;
+                break;
+            case CloseOp:
+                // Cancelled behind a short or failed send: the socket is
+                // still open, and the owner's again unless it is gone.
+                if (cqe.res < 0) {
+                    slot.closing = false;
+                    if (slot.removed) close(watcher->fd);
+                }
+                break;
+            case AcceptOp:
+                if (!(cqe.flags & IORING_CQE_F_MORE) && generation == slot.generation) slot.armed = false;
+                if (cqe.res >= 0) {
+                    if (slot.removed) {
+                        close(cqe.res);
+                    } else {
+                        slot.accepted.push_back(cqe.res);
+                        events = Readable;
+                    }
+                } else if (cqe.res == -EINVAL && multishot_accept) {
+                    multishot_accept = false;  // before Linux 5.19; one accept at a time
+                    if (!slot.removed) retry(index);
+                } else if (cqe.res != -ECANCELED && !slot.removed) {
+                    slot.accept_error = -cqe.res;
+                    events = Readable;
+                }
+                break;
+            case PollOp:
+                break;
+            }
+            if (slot.removed) {
+                if (watcher->in_flight == 0) release(index);
+                return 0;
+            }
+            return events;
+        }
+
+        // Calls the watcher unless it wants none of events; a result it does
+        // not want yet stays in the slot. Then queues what it wants next.
+        template <class Dispatch>
+        void deliver(uint32_t index, uint32_t events, Dispatch& dispatch) {
+            IOWatcher* watcher = slots[index].watcher;
+            uint32_t generation = slots[index].generation;
+            if (!(events & (watcher->events | Closed))) return;
+            dispatch(watcher, events);
+            if (slots[index].watcher == watcher && slots[index].generation == generation && !slots[index].removed &&
+                watcher->active) {
+                arm(index);
+            }
+        }
+
+        void armWakeup() {
+            io_uring_sqe* sqe = nextSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = wakeup_fd;
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = wakeup_tag;
+        }
+
+        // A ring made with SINGLE_ISSUER belongs to the thread enabling it.
+        void enable() {
+            disabled = false;
+            syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_ENABLE_RINGS, nullptr, 0);
+        }
+
+        // Publishes queued SQEs and, unless timeout_ms is 0, waits for at
+        // least one completion, all in one system call.
+        void enter(int timeout_ms) {
+            __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+            unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (disabled) enable();
+            if (timeout_ms == 0) {
+                // Deferred completions need GETEVENTS to run even with nothing to submit.
+                if (to_submit > 0 || deferred) {
+                    syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, deferred ? IORING_ENTER_GETEVENTS : 0,
+                            nullptr, 0);
+                }
+                return;
+            }
+            __kernel_timespec ts{};
+            io_uring_getevents_arg arg{};
+            if (timeout_ms > 0) {
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+            }
+            syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                    sizeof(arg));
+        }
+    };
+#endif
+
+
+    static int lowestBit(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(bits);
+#else
+        int index = 0;
+        while (!(bits & 1)) {
+            bits >>= 1;
+            index++;
+        }
+        return index;
+#endif
+    }
+
+    uint64_t tickAt(std::chrono::steady_clock::time_point time) const {
+        if (time <= wheel_start) return 0;
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(time - wheel_start).count();
+    }
+
+    void link(LoopTimer& timer) {
+        uint64_t delta = timer.expires > wheel_tick ? timer.expires - wheel_tick : 0;
+        int level = 0;
+        while (level < wheel_levels - 1 && delta >> (wheel_bits * (level + 1)) != 0) level++;
+        uint64_t at = wheel_tick + delta;
+        uint64_t span = (uint64_t)1 << (wheel_bits * wheel_levels);
+        if (delta >= span) at = wheel_tick + span - 1;
+        size_t index = (size_t)(at >> (wheel_bits * level)) & (wheel_slots - 1);
+        LoopTimer*& head = wheel[level][index];
+        timer.next = head;
+        if (head != nullptr) head->pprev = &timer.next;
+        timer.pprev = &head;
+        head = &timer;
+        wheel_occupied[level] |= (uint64_t)1 << index;
+    }
+
+    static void unlink(LoopTimer& timer) {
+        *timer.pprev = timer.next;
+        if (timer.next != nullptr) timer.next->pprev = timer.pprev;
+        timer.next = nullptr;
+        timer.pprev = nullptr;
+    }
+
+    // Ticks from now until the first occupied slot comes up, which for an
+    // upper level is when its timers move down. -1 without timers.
+    int64_t ticksUntilNextSlot(uint64_t now_tick) {
+        if (timer_count == 0) return -1;
+        uint64_t first = UINT64_MAX;
+        for (int level = 0; level < wheel_levels; level++) {
+            int shift = wheel_bits * level;
+            uint64_t current = wheel_tick >> shift;
+            while (wheel_occupied[level] != 0) {
+                // Slots in the order the wheel reaches them from the current one.
+                size_t start = (size_t)(current + 1) & (wheel_slots - 1);
+                uint64_t bits = wheel_occupied[level];
+                uint64_t rotated = start == 0 ? bits : (bits >> start) | (bits << (wheel_slots - start));
+                int ahead = lowestBit(rotated);
+                size_t index = (start + ahead) & (wheel_slots - 1);
+                if (wheel[level][index] == nullptr) {
+                    // Emptied by cancellations since it was marked.
+                    wheel_occupied[level] &= ~((uint64_t)1 << index);
+                    continue;
+                }
+                first = std::min(first, (current + 1 + ahead) << shift);
+                break;
+            }
+        }
+        if (first == UINT64_MAX) return -1;
+        return first > now_tick ? (int64_t)(first - now_tick) : 0;
+    }
+
+    // Shortens timeout_ms so poll() returns when the next timer is due.
+    int timerTimeout(int timeout_ms) {
+        int64_t due = ticksUntilNextSlot(tickAt(std::chrono::steady_clock::now()));
+        if (due < 0) return timeout_ms;
+        return timeout_ms < 0 || due < timeout_ms ? (int)due : timeout_ms;
+    }
+
+    void runTimers() {
+        uint64_t target = tickAt(std::chrono::steady_clock::now());
+        while (wheel_tick < target) {
+            if (timer_count == 0) {
+                wheel_tick = target;
+                break;
+            }
+            wheel_tick++;
+            // Where the lower levels wrap, the next upper slot is due: its
+            // timers are filed again relative to the new tick.
+            for (int level = 1; level < wheel_levels; level++) {
+                int shift = wheel_bits * level;
+                if ((wheel_tick & (((uint64_t)1 << shift) - 1)) != 0) break;
+                size_t index = (size_t)(wheel_tick >> shift) & (wheel_slots - 1);
+                LoopTimer* timer = wheel[level][index];
+                wheel[level][index] = nullptr;
+                wheel_occupied[level] &= ~((uint64_t)1 << index);
+                while (timer != nullptr) {
+                    LoopTimer* next = timer->next;
+                    link(*timer);
+                    timer = next;
+                }
+            }
+
+            size_t index = (size_t)wheel_tick & (wheel_slots - 1);
+            LoopTimer* due = wheel[0][index];
+            if (due == nullptr) continue;
+            // Detached so callbacks may arm or cancel timers safely.
+            wheel[0][index] = nullptr;
+            wheel_occupied[0] &= ~((uint64_t)1 << index);
+            due->pprev = &due;
+            while (due != nullptr) {
+                LoopTimer* timer = due;
+                unlink(*timer);
+                if (timer->expires > wheel_tick) {
+                    link(*timer);
+                    continue;
+                }
+                timer_count--;
+                if (timer->owned) {
+                    std::function<void()> callback = std::move(timer->callback);
+                    delete timer;
+                    callback();
+                } else {
+                    // May re-arm the timer or free its owner.
+                    timer->callback();
+                }
+            }
+        }
+    }
+
+    void runDeferred() {
+        std::vector<std::function<void()>> batch;
+        batch.swap(deferred);
+        for (std::function<void()>& callback : batch) {
+            callback();
+        }
+    }
+
+    void dispatchReady(int timeout_ms) {
+#if defined(WEBSERVER_USE_EPOLL)
+#ifdef WEBSERVER_HAVE_IO_URING
+        if (uring) {
+            uring->wait(timeout_ms, [this](IOWatcher* watcher, uint32_t events) {
+                if (watcher == nullptr) {
+                    drainWakeup();
+                    wakeup_pending.store(false, std::memory_order_release);
+                    return;
+                }
+                if (watcher->active) watcher->callback(events);
+            });
+            return;
+        }
+#endif
+        int n = epoll_wait(epoll_fd, ready.data(), (int)ready.size(), timeout_ms);
+        for (int i = 0; i < n; i++) {
+            IOWatcher* watcher = static_cast<IOWatcher*>(ready[i].data.ptr);
+            if (watcher == nullptr) {
+                drainWakeup();
+                wakeup_pending.store(false, std::memory_order_release);
+                continue;
+            }
+            if (!watcher->active) continue;
+            uint32_t native = ready[i].events;
+            uint32_t events = 0;
+            if (native & (EPOLLIN | EPOLLRDHUP)) events |= Readable;
+            if (native & EPOLLOUT) events |= Writable;
+            if (native & (EPOLLERR | EPOLLHUP)) events |= Closed | Readable;
+            watcher->callback(events);
+        }
+#elif defined(WEBSERVER_USE_KQUEUE)
+        struct timespec ts;
+        struct timespec* tsp = nullptr;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            tsp = &ts;
+        }
+        int n = kevent(kqueue_fd, nullptr, 0, ready.data(), (int)ready.size(), tsp);
+        for (int i = 0; i < n; i++) {
+            if (ready[i].filter == EVFILT_USER) {
+                wakeup_pending.store(false, std::memory_order_release);
+                continue;
+            }
+            IOWatcher* watcher = static_cast<IOWatcher*>(ready[i].udata);
+            if (watcher == nullptr || !watcher->active) continue;
+            uint32_t events = ready[i].filter == EVFILT_WRITE ? Writable : Readable;
+            if (ready[i].flags & (EV_EOF | EV_ERROR)) events |= Closed;
+            watcher->callback(events);
+        }
+#else
+        if (needs_compaction) compact();
+#ifdef _WIN32
+        int n = WSAPoll(poll_fds.data(), (ULONG)poll_fds.size(), timeout_ms);
+#else
+        int n = ::poll(poll_fds.data(), (nfds_t)poll_fds.size(), timeout_ms);
+#endif
+        if (n <= 0) return;
+        if (poll_fds[0].revents & POLLIN) {
+            char drain[64];
+            while (recv(wakeup_socket, drain, sizeof(drain), 0) > 0) {
+            }
+            wakeup_pending.store(false, std::memory_order_release);
+        }
+        size_t count = poll_fds.size();
+        for (size_t i = 1; i < count; i++) {
+            short revents = poll_fds[i].revents;
+            IOWatcher* watcher = watchers[i];
+            if (revents == 0 || watcher == nullptr || !watcher->active) continue;
+            uint32_t events = 0;
+            if (revents & POLLIN) events |= Readable;
+            if (revents & POLLOUT) events |= Writable;
+            if (revents & (POLLERR | POLLHUP | POLLNVAL)) events |= Closed | Readable;
+            watcher->callback(events);
+        }
+#endif
+    }
+
+#if defined(WEBSERVER_USE_EPOLL)
+    int epoll_fd;
+    int wakeup_fd;
+    std::vector<epoll_event> ready;
+#ifdef WEBSERVER_HAVE_IO_URING
+    std::unique_ptr<IoUringPoller> uring;
+#endif
+
+    static uint32_t toNative(uint32_t events) {
+        uint32_t native = 0;
+        if (events & Readable) native |= EPOLLIN | EPOLLRDHUP;
+        if (events & Writable) native |= EPOLLOUT;
+        return native;
+    }
+
+    void drainWakeup() {
+        uint64_t value;
+        while (read(wakeup_fd, &value, sizeof(value)) > 0) {
+        }
+    }
+#elif defined(WEBSERVER_USE_KQUEUE)
+    int kqueue_fd;
+    std::vector<struct kevent> ready;
+
+    void applyFilters(IOWatcher& watcher, uint32_t events, uint32_t old_events) {
+        struct kevent changes[2];
+        int n = 0;
+        if ((events & Readable) != (old_events & Readable)) {
+            EV_SET(&changes[n++], watcher.fd, EVFILT_READ,
+                   (events & Readable) ? (EV_ADD | EV_ENABLE) : EV_DELETE, 0, 0, &watcher);
+        }
+        if ((events & Writable) != (old_events & Writable)) {
+            EV_SET(&changes[n++], watcher.fd, EVFILT_WRITE,
+                   (events & Writable) ? (EV_ADD | EV_ENABLE) : EV_DELETE, 0, 0, &watcher);
+        }
+        if (n > 0 && kevent(kqueue_fd, changes, n, nullptr, 0, nullptr) == -1 && errno != ENOENT) {
+            throw std::runtime_error("kevent registration failed");
+        }
+    }
+#else
+    std::vector<pollfd> poll_fds;
+    std::vector<IOWatcher*> watchers;
+    SOCKET wakeup_socket;
+    bool needs_compaction;
+
+    static short toNative(uint32_t events) {
+        short native = 0;
+        if (events & Readable) native |= POLLIN;
+        if (events & Writable) native |= POLLOUT;
+        return native;
+    }
+
+    void compact() {
+        size_t out = 1;
+        for (size_t i = 1; i < watchers.size(); i++) {
+            if (watchers[i] == nullptr) continue;
+            watchers[out] = watchers[i];
+            poll_fds[out] = poll_fds[i];
+            watchers[out]->slot = out;
+            out++;
+        }
+        watchers.resize(out);
+        poll_fds.resize(out);
+        needs_compaction = false;
+    }
+#endif
+
+public:
+    // use_io_uring picks the io_uring backend on Linux when the kernel
+    // allows it; otherwise, and on other systems, it is ignored.
+    explicit EventLoop(bool use_io_uring = false)
+        : wakeup_pending(false), wheel_start(std::chrono::steady_clock::now()) {
+#if defined(WEBSERVER_USE_EPOLL)
+        wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_fd == -1) {
+            throw std::runtime_error("eventfd failed");
+        }
+        epoll_fd = -1;
+#ifdef WEBSERVER_HAVE_IO_URING
+        if (use_io_uring) {
+            uring = IoUringPoller::create(wakeup_fd);
+            if (uring) return;
+        }
+#else
+        (void)use_io_uring;
+#endif
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1) {
+            close(wakeup_fd);
+            throw std::runtime_error("epoll_create1 failed");
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev);
+        ready.resize(1024);
+#elif defined(WEBSERVER_USE_KQUEUE)
+        (void)use_io_uring;
+        kqueue_fd = kqueue();
+        if (kqueue_fd == -1) {
+            throw std::runtime_error("kqueue failed");
+        }
+        struct kevent change;
+        EV_SET(&change, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+        if (kevent(kqueue_fd, &change, 1, nullptr, 0, nullptr) == -1) {
+            close(kqueue_fd);
+            throw std::runtime_error("kevent EVFILT_USER failed");
+        }
+        ready.resize(1024);
+#else
+        // A UDP socket connected to itself doubles as a portable self-pipe:
+        // WSAPoll cannot wait on anything but sockets.
+        (void)use_io_uring;
+        needs_compaction = false;
+        wakeup_socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (wakeup_socket == INVALID_SOCKET) {
+            throw std::runtime_error("Could not create wakeup socket");
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t addr_len = sizeof(addr);
+        if (bind(wakeup_socket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            getsockname(wakeup_socket, (struct sockaddr*)&addr, &addr_len) == SOCKET_ERROR ||
+            connect(wakeup_socket, (struct sockaddr*)&addr, addr_len) == SOCKET_ERROR ||
+            !setNonBlocking(wakeup_socket)) {
+            closesocket(wakeup_socket);
+            throw std::runtime_error("Could not set up wakeup socket");
+        }
+        pollfd pfd{};
+        pfd.fd = wakeup_socket;
+        pfd.events = POLLIN;
+        poll_fds.push_back(pfd);
+        watchers.push_back(nullptr);
+#endif
+    }
+
+    ~EventLoop() {
+        for (auto& level : wheel) {
+            for (LoopTimer*& head : level) {
+                while (head != nullptr) {
+                    LoopTimer* timer = head;
+                    unlink(*timer);
+                    if (timer->owned) delete timer;
+                }
+            }
+        }
+#if defined(WEBSERVER_USE_EPOLL)
+#ifdef WEBSERVER_HAVE_IO_URING
+        uring.reset();
+#endif
+        close(wakeup_fd);
+        if (epoll_fd != -1) close(epoll_fd);
+#elif defined(WEBSERVER_USE_KQUEUE)
+        close(kqueue_fd);
+#else
+        closesocket(wakeup_socket);
+#endif
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // True when this loop runs on io_uring rather than epoll.
+    bool usingIoUring() const {
+#ifdef WEBSERVER_HAVE_IO_URING
+        return uring != nullptr;
+#else
+        return false;
+#endif
+    }
+
+#ifdef WEBSERVER_HAVE_IO_URING
+    // The ring's side of IOWatcher::Stream and Listener, while usingIoUring().
+
+    // Copies out what the ring received, like recv(): 0 once the peer
+    // has closed, or -1 with errno set, or with would_block set when
+    // nothing has come.
+    long receive(IOWatcher& watcher, char* buffer, size_t size, bool& would_block) {
+        return uring->receive(watcher, buffer, size, would_block);
+    }
+
+    // The next connection the ring accepted, already non-blocking, or
+    // INVALID_SOCKET with errno set (EAGAIN once there are no more).
+    SOCKET accept(IOWatcher& watcher) { return uring->accept(watcher); }
+
+    // Starts sending buffers, whose bytes must stay put until the send has
+    // finished; the watcher then gets Writable. One send at a time. With
+    // then_close the ring closes the socket once every byte went out.
+    void send(IOWatcher& watcher, const iovec* buffers, size_t count, bool then_close) {
+        uring->send(watcher, buffers, count, then_close);
+    }
+
+    bool sending(const IOWatcher& watcher) const { return uring->sending(watcher); }
+
+    // A send with then_close is queued, so the socket is not ours to close.
+    bool closing(const IOWatcher& watcher) const { return uring->closing(watcher); }
+
+    // Takes the result of a finished send: the bytes sent, or -1 with errno set.
+    bool sendFinished(IOWatcher& watcher, long& result) { return uring->sendFinished(watcher, result); }
+#endif
+
+    void add(IOWatcher& watcher) {
+#if defined(WEBSERVER_USE_EPOLL)
+#ifdef WEBSERVER_HAVE_IO_URING
+        if (uring) {
+            uring->add(watcher);
+            watcher.active = true;
+            return;
+        }
+#endif
+        epoll_event ev{};
+        ev.events = toNative(watcher.events);
+        ev.data.ptr = &watcher;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watcher.fd, &ev) == -1) {
+            throw std::runtime_error("epoll_ctl add failed");
+        }
+#elif defined(WEBSERVER_USE_KQUEUE)
+        applyFilters(watcher, watcher.events, 0);
+#else
+        pollfd pfd{};
+        pfd.fd = watcher.fd;
+        pfd.events = toNative(watcher.events);
+        watcher.slot = poll_fds.size();
+        poll_fds.push_back(pfd);
+        watchers.push_back(&watcher);
+#endif
+        watcher.active = true;
+    }
+
+    void modify(IOWatcher& watcher, uint32_t events) {
+        if (!watcher.active || watcher.events == events) {
+            watcher.events = events;
+            return;
+        }
+#if defined(WEBSERVER_USE_EPOLL)
+#ifdef WEBSERVER_HAVE_IO_URING
+        if (uring) {
+            watcher.events = events;
+            uring->modify(watcher);
+            return;
+        }
+#endif
+        epoll_event ev{};
+        ev.events = toNative(events);
+        ev.data.ptr = &watcher;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, watcher.fd, &ev) == -1) {
+            throw std::runtime_error("epoll_ctl modify failed");
+        }
+#elif defined(WEBSERVER_USE_KQUEUE)
+        applyFilters(watcher, events, watcher.events);
+#else
+        poll_fds[watcher.slot].events = toNative(events);
+#endif
+        watcher.events = events;
+    }
+
+    void remove(IOWatcher& watcher) {
+        if (!watcher.active) return;
+#if defined(WEBSERVER_USE_EPOLL)
+#ifdef WEBSERVER_HAVE_IO_URING
+        if (uring) {
+            uring->remove(watcher);
+            watcher.active = false;
+            return;
+        }
+#endif
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watcher.fd, nullptr);
+#elif defined(WEBSERVER_USE_KQUEUE)
+        applyFilters(watcher, 0, watcher.events);
+#else
+        watchers[watcher.slot] = nullptr;
+        needs_compaction = true;
+#endif
+        watcher.active = false;
+    }
+
+    // Waits up to timeout_ms (-1 blocks) and dispatches ready watchers,
+    // then due timers and deferred calls.
+    void poll(int timeout_ms) {
+        dispatchReady(deferred.empty() ? timerTimeout(timeout_ms) : 0);
+        runTimers();
+        runDeferred();
+    }
+
+    // Runs callback from poll() once delay has passed.
+    void addTimer(std::chrono::milliseconds delay, std::function<void()> callback) {
+        LoopTimer* timer = new LoopTimer();
+        timer->owned = true;
+        timer->callback = std::move(callback);
+        schedule(*timer, std::chrono::steady_clock::now() + delay);
+    }
+
+    // Arms timer to run its callback from poll() once deadline has
+    // passed, moving it if it is already armed.
+    void schedule(LoopTimer& timer, std::chrono::steady_clock::time_point deadline) {
+        // The tick after the one holding deadline, so it never fires early.
+        uint64_t expires = std::max(tickAt(deadline) + 1, wheel_tick + 1);
+        if (timer.armed()) {
+            if (timer.expires == expires) return;
+            unlink(timer);
+        } else {
+            timer.loop = this;
+            timer_count++;
+        }
+        timer.expires = expires;
+        link(timer);
+    }
+
+    void cancel(LoopTimer& timer) {
+        if (!timer.armed()) return;
+        unlink(timer);
+        timer_count--;
+    }
+
+    // Runs callback from poll() after every ready watcher has been
+    // dispatched, so it may free objects that own watchers.
+    void defer(std::function<void()> callback) {
+        deferred.push_back(std::move(callback));
+    }
+
+    // The loop whose poll() runs on the calling thread, if any.
+    static EventLoop* current() { return current_loop; }
+    void makeCurrent() { current_loop = this; }
+
+    // Interrupts a blocked poll(). Safe to call from any thread.
+    void wakeup() {
+        if (wakeup_pending.exchange(true, std::memory_order_acq_rel)) return;
+#if defined(WEBSERVER_USE_EPOLL)
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeup_fd, &one, sizeof(one));
+        (void)ignored;
+#elif defined(WEBSERVER_USE_KQUEUE)
+        struct kevent change;
+        EV_SET(&change, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+        kevent(kqueue_fd, &change, 1, nullptr, 0, nullptr);
+#else
+        char byte = 1;
+        send(wakeup_socket, &byte, 1, 0);
+#endif
+    }
+};
+
+inline LoopTimer::~LoopTimer() {
+    if (armed()) loop->cancel(*this);
+}
+
+struct MimeType {
+    std::string_view extension;
+    std::string_view type;
+};
+
+// Sorted by extension so lookups are a binary search; checked at compile time.
+constexpr MimeType mime_types[] = {
+    {"7z", "application/x-7z-compressed"},
+    {"aac", "audio/aac"},
+    {"apng", "image/apng"},
+    {"atom", "application/atom+xml"},
+    {"avi", "video/x-msvideo"},
+    {"avif", "image/avif"},
+    {"bin", "application/octet-stream"},
+    {"bmp", "image/bmp"},
+    {"bz2", "application/x-bzip2"},
+    {"cjs", "application/javascript"},
+    {"css", "text/css"},
+    {"csv", "text/csv"},
+    {"doc", "application/msword"},
+    {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"epub", "application/epub+zip"},
+    {"flac", "audio/flac"},
+    {"gif", "image/gif"},
+    {"gz", "application/gzip"},
+    {"htm", "text/html"},
+    {"html", "text/html"},
+    {"ico", "image/x-icon"},
+    {"ics", "text/calendar"},
+    {"jar", "application/java-archive"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"js", "application/javascript"},
+    {"json", "application/json"},
+    {"jsonld", "application/ld+json"},
+    {"m4a", "audio/mp4"},
+    {"m4v", "video/mp4"},
+    {"manifest", "text/cache-manifest"},
+    {"map", "application/json"},
+    {"md", "text/markdown"},
+    {"mid", "audio/midi"},
+    {"midi", "audio/midi"},
+    {"mjs", "application/javascript"},
+    {"mkv", "video/x-matroska"},
+    {"mov", "video/quicktime"},
+    {"mp3", "audio/mpeg"},
+    {"mp4", "video/mp4"},
+    {"mpeg", "video/mpeg"},
+    {"oga", "audio/ogg"},
+    {"ogg", "audio/ogg"},
+    {"ogv", "video/ogg"},
+    {"opus", "audio/opus"},
+    {"otf", "font/otf"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {"rar", "application/vnd.rar"},
+    {"rss", "application/rss+xml"},
+    {"rtf", "application/rtf"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+    {"tar", "application/x-tar"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"ts", "video/mp2t"},
+    {"ttf", "font/ttf"},
+    {"txt", "text/plain"},
+    {"wasm", "application/wasm"},
+    {"wav", "audio/wav"},
+    {"weba", "audio/webm"},
+    {"webm", "video/webm"},
+    {"webmanifest", "application/manifest+json"},
+    {"webp", "image/webp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"xhtml", "application/xhtml+xml"},
+    {"xls", "application/vnd.ms-excel"},
+    {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {"xml", "application/xml"},
+    {"yaml", "application/yaml"},
+    {"yml", "application/yaml"},
+    {"zip", "application/zip"},
+};
+
+constexpr bool mimeTableSorted() {
+    for (size_t i = 1; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+        if (!(mime_types[i - 1].extension < mime_types[i].extension)) return false;
+    }
+    return true;
+}
+static_assert(mimeTableSorted(), "mime_types must be sorted by extension");
+
+// Content type for a file name, by its (case-insensitive) extension.
+inline std::string_view mimeTypeFor(std::string_view file_name, std::string_view fallback = "text/plain") {
+    size_t dot = file_name.find_last_of("./\\");
+    if (dot == std::string_view::npos || file_name[dot] != '.') return fallback;
+    std::string_view extension = file_name.substr(dot + 1);
+
+    char lower[16];
+    if (extension.empty() || extension.size() > sizeof(lower)) return fallback;
+    for (size_t i = 0; i < extension.size(); i++) {
+        lower[i] = (char)std::tolower((unsigned char)extension[i]);
+    }
+    std::string_view key(lower, extension.size());
+
+    const MimeType* begin = mime_types;
+    const MimeType* end = mime_types + sizeof(mime_types) / sizeof(mime_types[0]);
+    const MimeType* it = std::lower_bound(begin, end, key,
+                                          [](const MimeType& entry, std::string_view k) { return entry.extension < k; });
+    return it != end && it->extension == key ? it->type : fallback;
+}
+
+// Turns the path of a request under a mounted directory into a relative
+// file path: drops the query, percent-decodes, collapses "//" and "." and
+// resolves "..". Returns false for anything that would escape the
+// directory or that cannot name a file.
+inline bool normalizeRelativePath(std::string_view url_path, std::string& out) {
+    size_t query = url_path.find_first_of("?#");
+    if (query != std::string_view::npos) url_path = url_path.substr(0, query);
+
+    std::string decoded;
+    decoded.reserve(url_path.size());
+    for (size_t i = 0; i < url_path.size(); i++) {
+        char c = url_path[i];
+        if (c == '%') {
+            if (i + 2 >= url_path.size()) return false;
+            int hi = hexDigit(url_path[i + 1]);
+            int lo = hexDigit(url_path[i + 2]);
+            if (hi < 0 || lo < 0) return false;
+            c = (char)(hi * 16 + lo);
+            i += 2;
+        }
+        if (c == '\0' || c == '\\') return false;
+        decoded.push_back(c);
+    }
+
+    std::vector<std::string_view> segments;
+    std::string_view rest = decoded;
+    while (!rest.empty()) {
+        size_t slash = rest.find('/');
+        std::string_view segment = rest.substr(0, slash);
+        rest = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
+        if (segment.empty() || segment == ".") continue;
+        if (segment == "..") {
+            if (segments.empty()) return false;
+            segments.pop_back();
+            continue;
+        }
+#ifdef _WIN32
+        if (segment.find(':') != std::string_view::npos) return false;
+#endif
+        segments.push_back(segment);
+    }
+
+    out.clear();
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (i > 0) out.push_back('/');
+        out.append(segments[i].data(), segments[i].size());
+    }
+    if (decoded.empty() || decoded.back() == '/') {
+        if (!out.empty()) out.push_back('/');
+        out.append("index.html");
+    }
+    return true;
+}
+
+// Hot static files kept in memory, shared by all workers. Entries hold
+// the file bytes plus any precompressed "<file>.gz"/"<file>.br" siblings
+// and the validators for conditional requests. A hit is served without
+// touching the filesystem; each entry is re-validated against the file's
+// mtime and size at most once per second. Least recently used entries
+// are evicted once the total exceeds the capacity.
+class StaticFileCache {
+public:
+    struct Entry {
+        std::shared_ptr<const std::string> data;
+        std::shared_ptr<const std::string> gzip;
+        std::shared_ptr<const std::string> brotli;
+        std::string content_type;
+        std::string etag;
+        std::string last_modified;
+        time_t mtime = 0;
+        size_t size = 0;
+        std::atomic<int64_t> validated_at{0};
+        std::atomic<uint64_t> last_used{0};
+
+        size_t cost() const {
+            return size + (gzip ? gzip->size() : 0) + (brotli ? brotli->size() : 0);
+        }
+    };
+
+    StaticFileCache(size_t capacity, size_t max_entry_size)
+        : capacity(capacity), max_entry_size(max_entry_size), used(0), tick(0) {}
+
+    void setCapacity(size_t bytes) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        capacity = bytes;
+        evict();
+    }
+
+    // Returns the cached file, loading it on a miss. Returns nullptr when
+    // the file is missing, too large to cache, or caching is disabled.
+    std::shared_ptr<const Entry> get(const std::string& path, const std::string& content_type) {
+        int64_t now = nowMillis();
+        std::shared_ptr<Entry> entry;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            if (capacity == 0) return nullptr;
+            auto it = entries.find(path);
+            if (it != entries.end()) {
+                entry = it->second;
+            }
+        }
+
+        if (entry) {
+            entry->last_used.store(tick.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+            int64_t validated = entry->validated_at.load(std::memory_order_relaxed);
+            // One thread re-checks the file each second; the rest keep serving the entry.
+            if (now - validated < 1000 ||
+                !entry->validated_at.compare_exchange_strong(validated, now, std::memory_order_relaxed)) {
+                return entry;
+            }
+            struct stat info;
+            if (stat(path.c_str(), &info) == 0 && info.st_mtime == entry->mtime && (size_t)info.st_size == entry->size) {
+                return entry;
+            }
+        }
+
+        std::shared_ptr<Entry> loaded = load(path, content_type, now);
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+            used -= it->second->cost();
+            entries.erase(it);
+        }
+        if (!loaded) return nullptr;
+        loaded->last_used.store(tick.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+        entries[path] = loaded;
+        used += loaded->cost();
+        evict();
+        return loaded;
+    }
+
+    static std::string makeETag(size_t size, time_t mtime) {
+        char text[48];
+        snprintf(text, sizeof(text), "\"%llx-%llx\"", (unsigned long long)mtime, (unsigned long long)size);
+        return text;
+    }
+
+private:
+    std::shared_mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<Entry>> entries;
+    size_t capacity;
+    size_t max_entry_size;
+    size_t used;
+    std::atomic<uint64_t> tick;
+
+    static int64_t nowMillis() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::shared_ptr<Entry> load(const std::string& path, const std::string& content_type, int64_t now) {
+        std::shared_ptr<FileBody> file = FileBody::open(path);
+        if (!file || file->size() > max_entry_size || file->size() > capacity) return nullptr;
+
+        std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+        std::shared_ptr<std::string> data = std::make_shared<std::string>();
+        if (!file->readAll(*data)) return nullptr;
+        entry->data = data;
+        entry->content_type = content_type;
+        entry->size = file->size();
+        entry->mtime = file->modifiedTime();
+        entry->etag = makeETag(entry->size, entry->mtime);
+        entry->last_modified = formatHttpDate(entry->mtime);
+        entry->gzip = loadVariant(path + ".gz", entry->mtime);
+        entry->brotli = loadVariant(path + ".br", entry->mtime);
+        entry->validated_at.store(now, std::memory_order_relaxed);
+        return entry;
+    }
+
+    // A precompressed sibling only counts if it is not older than the original.
+    std::shared_ptr<const std::string> loadVariant(const std::string& path, time_t mtime) {
+        std::shared_ptr<FileBody> file = FileBody::open(path);
+        if (!file || file->modifiedTime() < mtime || file->size() > max_entry_size) return nullptr;
+        std::shared_ptr<std::string> data = std::make_shared<std::string>();
+        if (!file->readAll(*data)) return nullptr;
+        return data;
+    }
+
+    void evict() {
+        while (used > capacity && !entries.empty()) {
+            auto oldest = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->second->last_used.load(std::memory_order_relaxed) <
+                    oldest->second->last_used.load(std::memory_order_relaxed)) {
+                    oldest = it;
+                }
+            }
+            used -= oldest->second->cost();
+            entries.erase(oldest);
+        }
+    }
+};
+
+// How a route added with WebServer::addCachedRoute() keeps its responses.
+struct CacheOptions {
+    // How long a stored response is served without running the handler.
+    std::chrono::milliseconds ttl{1000};
+    // Request headers besides the method and target that pick the entry,
+    // e.g. "Accept" or "Authorization".
+    std::vector<std::string> vary;
+    // Bytes of response bodies and headers the route's cache may hold.
+    size_t max_size = 16 * 1024 * 1024;
+    // Run the handler on the handler pool, as addOffloadedRoute() does.
+    bool offload = false;
+};
+
+// Responses of one cached route, shared by all workers. An entry is the
+// response as it goes out, compressed body included, so a hit costs a
+// header copy and no body bytes. Concurrent misses on a key are folded
+// into one fill: the first request runs the handler and the rest are
+// parked with wait() until complete() hands them the result; while an
+// expired entry is being refilled it is served as it is. Least recently
+// used entries are evicted once the total exceeds max_size.
+class ResponseCache {
+public:
+    struct Entry {
+        int status_code = 200;
+        std::string status_message;
+        ResponseHeaders headers;
+        std::shared_ptr<const std::string> body;
+        int64_t stored_at = 0;
+        int64_t expires_at = 0;
+        size_t cost = 0;
+        std::atomic<uint64_t> last_used{0};
+    };
+
+    enum Result { Hit, Fill, Wait, Miss };
+    // Called with the entry a fill produced, or nullptr when its response
+    // could not be kept; from whichever thread completed the fill.
+    typedef std::function<void(std::shared_ptr<const Entry>)> Waiter;
+
+    explicit ResponseCache(const CacheOptions& options) : options(options), used(0), tick(0) {}
+
+    const CacheOptions options;
+
+    // The entry key: method, target, the vary headers and the content
+    // coding the response would be compressed with. HEAD shares the GET
+    // entry.
+    std::string key(const HTTPRequest& request, std::string_view coding) const {
+        std::string key(request.method == "HEAD" ? std::string_view("GET") : request.method);
+        key.append(" ").append(request.path.data(), request.path.size());
+        if (!request.query.empty()) key.append("?").append(request.query.data(), request.query.size());
+        key.append("\n").append(coding.data(), coding.size());
+        for (const std::string& name : options.vary) {
+            std::string_view value = request.headers.get(name);
+            key.append("\n").append(value.data(), value.size());
+        }
+        return key;
+    }
+
+    // Returns Hit with entry set when key holds a fresh response, or a
+    // stale one whose refill is under way. Otherwise, with lead set, the
+    // caller gets Fill and must end it with complete(), or Wait when
+    // another request is filling it already; Miss without lead.
+    Result lookup(const std::string& key, bool lead, std::shared_ptr<const Entry>& entry) {
+        int64_t now = nowMillis();
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        bool filling = fills.find(key) != fills.end();
+        if (it != entries.end() && (it->second->expires_at > now || filling)) {
+            it->second->last_used.store(tick++, std::memory_order_relaxed);
+            entry = it->second;
+            return Hit;
+        }
+        if (!lead) return Miss;
+        if (filling) return Wait;
+        fills[key];
+        return Fill;
+    }
+
+    // Parks waiter on the fill of key. Returns false when that fill has
+    // already completed, for the caller to look key up again.
+    bool wait(const std::string& key, Waiter waiter) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = fills.find(key);
+        if (it == fills.end()) return false;
+        it->second.push_back(std::move(waiter));
+        return true;
+    }
+
+    // Ends the fill of key, storing entry unless it is nullptr, and passes
+    // it to the requests that waited on it.
+    void complete(const std::string& key, std::shared_ptr<Entry> entry) {
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto fill = fills.find(key);
+            if (fill != fills.end()) {
+                waiters.swap(fill->second);
+                fills.erase(fill);
+            }
+            auto it = entries.find(key);
+            if (it != entries.end()) {
+                used -= it->second->cost;
+                entries.erase(it);
+            }
+            if (entry && entry->cost <= options.max_size) {
+                entry->last_used.store(tick++, std::memory_order_relaxed);
+                used += entry->cost;
+                entries[key] = entry;
+                evict();
+            }
+        }
+        for (const Waiter& waiter : waiters) waiter(entry);
+    }
+
+    // An entry for response, whose body moves into a buffer the entry
+    // shares with it; nullptr for a response that must not be reused:
+    // streamed, a file, setting cookies, marked no-store, no-cache or
+    // private, or with a status that is not cacheable by default
+    // (RFC 9110, 15.1).
+    std::shared_ptr<Entry> makeEntry(HTTPResponse& response) const {
+        static const int statuses[] = {200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501};
+        if (response.stream || response.file ||
+            std::find(std::begin(statuses), std::end(statuses), response.status_code) == std::end(statuses) ||
+            response.headers.find("Set-Cookie") != response.headers.end()) {
+            return nullptr;
+        }
+        std::string_view control = response.headers.get("Cache-Control");
+        if (hasDirective(control, "no-store") || hasDirective(control, "no-cache") ||
+            hasDirective(control, "private")) {
+            return nullptr;
+        }
+        if (!response.shared_body) {
+            response.shared_body = std::make_shared<const std::string>(std::move(response.body));
+            response.body.clear();
+        }
+        std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+        entry->status_code = response.status_code;
+        entry->status_message = response.status_message;
+        entry->headers = response.headers;
+        entry->body = response.shared_body;
+        entry->stored_at = nowMillis();
+        entry->expires_at = entry->stored_at + options.ttl.count();
+        entry->cost = entry->body->size() + 256;
+        for (const HTTPHeader& header : entry->headers) entry->cost += header.first.size() + header.second.size();
+        return entry;
+    }
+
+    // Makes response a copy of entry, with an Age header.
+    static void fill(HTTPResponse& response, const Entry& entry) {
+        response.status_code = entry.status_code;
+        response.status_message = entry.status_message;
+        response.headers = entry.headers;
+        response.body.clear();
+        response.file.reset();
+        response.shared_body = entry.body;
+        response.headers.set("Age", (size_t)((nowMillis() - entry.stored_at) / 1000));
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<Entry>> entries;
+    std::unordered_map<std::string, std::vector<Waiter>> fills;
+    size_t used;
+    uint64_t tick;
+
+    static int64_t nowMillis() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool hasDirective(std::string_view list, std::string_view directive) {
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string_view item = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            item = item.substr(0, item.find('='));
+            size_t first = item.find_first_not_of(" \t");
+            if (first == std::string_view::npos) continue;
+            item = item.substr(first, item.find_last_not_of(" \t") - first + 1);
+            if (equalsIgnoreCase(item, directive)) return true;
+        }
+        return false;
+    }
+
+    void evict() {
+        while (used > options.max_size && !entries.empty()) {
+            auto oldest = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->second->last_used.load(std::memory_order_relaxed) <
+                    oldest->second->last_used.load(std::memory_order_relaxed)) {
+                    oldest = it;
+                }
+            }
+            used -= oldest->second->cost;
+            entries.erase(oldest);
+        }
+    }
+};
+
+// Compressed radix tree keyed by path pattern, holding one T per method.
+// Patterns may contain ":name" segments, which capture one path segment,
+// and a trailing "*name", which captures the rest of the path (possibly
+// empty). Static segments win over parameters, which win over wildcards.
+// find() does not allocate; the tree must not change while it is in use.
+template <class T>
+class Router {
+public:
+    Router() : root(new Node()) {}
+
+    // An empty method matches any method not registered explicitly.
+    void add(const std::string& method, const std::string& pattern, T value) {
+        if (pattern.empty() || pattern[0] != '/') {
+            throw std::runtime_error("Route pattern must start with '/': " + pattern);
+        }
+        Node* node = root.get();
+        std::string_view rest = pattern;
+        size_t param_count = 0;
+        while (!rest.empty()) {
+            if (rest[0] == ':' || rest[0] == '*') {
+                bool wildcard = rest[0] == '*';
+                size_t end = wildcard ? rest.size() : rest.find('/');
+                if (end == std::string_view::npos) end = rest.size();
+                std::string name(rest.substr(1, end - 1));
+                if (name.empty()) {
+                    throw std::runtime_error("Route parameter needs a name: " + pattern);
+                }
+                if (++param_count > RouteParams::max_params) {
+                    throw std::runtime_error("Too many route parameters: " + pattern);
+                }
+                std::unique_ptr<Node>& child = wildcard ? node->wildcard_child : node->param_child;
+                if (!child) {
+                    child.reset(new Node());
+                    child->param_name = name;
+                } else if (child->param_name != name) {
+                    throw std::runtime_error("Conflicting route parameter names in " + pattern);
+                }
+                node = child.get();
+                rest = rest.substr(end);
+                continue;
+            }
+            size_t end = rest.find_first_of(":*");
+            if (end == std::string_view::npos) end = rest.size();
+            node = insertStatic(node, rest.substr(0, end));
+            rest = rest.substr(end);
+        }
+
+        for (auto& entry : node->values) {
+            if (entry.first == method) {
+                entry.second = std::move(value);
+                return;
+            }
+        }
+        node->values.emplace_back(method, std::move(value));
+    }
+
+    // Looks up path for method. On a hit the captured parameters are left
+    // in params. path_found is set when the path matched a pattern but
+    // no handler exists for the method. HEAD falls back to GET.
+    const T* find(std::string_view method, std::string_view path, RouteParams& params, bool& path_found) const {
+        params.clear();
+        path_found = false;
+        const Node* node = match(root.get(), path, params);
+        if (node == nullptr) return nullptr;
+        path_found = true;
+        const T* any = nullptr;
+        const T* get = nullptr;
+        for (const auto& entry : node->values) {
+            if (entry.first == method) return &entry.second;
+            if (entry.first.empty()) any = &entry.second;
+            if (entry.first == "GET") get = &entry.second;
+        }
+        if (method == "HEAD" && get != nullptr) return get;
+        return any;
+    }
+
+    // Comma-separated methods registered for path, for an Allow header.
+    std::string allowedMethods(std::string_view path) const {
+        RouteParams params;
+        const Node* node = match(root.get(), path, params);
+        std::string allow;
+        if (node == nullptr) return allow;
+        bool has_get = false, has_head = false;
+        for (const auto& entry : node->values) {
+            if (!allow.empty()) allow += ", ";
+            allow += entry.first;
+            has_get = has_get || entry.first == "GET";
+            has_head = has_head || entry.first == "HEAD";
+        }
+        if (has_get && !has_head) allow += ", HEAD";
+        return allow;
+    }
+
+private:
+    struct Node {
+        std::string prefix;
+        std::string indices;  // first byte of each static child, in order
+        std::vector<std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> param_child;
+        std::unique_ptr<Node> wildcard_child;
+        std::string param_name;
+        std::vector<std::pair<std::string, T>> values;
+    };
+
+    std::unique_ptr<Node> root;
+
+    static Node* insertStatic(Node* node, std::string_view segment) {
+        while (!segment.empty()) {
+            size_t index = node->indices.find(segment[0]);
+            if (index == std::string::npos) {
+                std::unique_ptr<Node> child(new Node());
+                child->prefix = std::string(segment);
+                Node* raw = child.get();
+                node->indices.push_back(segment[0]);
+                node->children.push_back(std::move(child));
+                return raw;
+            }
+
+            Node* child = node->children[index].get();
+            size_t common = 0;
+            while (common < segment.size() && common < child->prefix.size() &&
+                   segment[common] == child->prefix[common]) {
+                common++;
+            }
+            if (common < child->prefix.size()) {
+                // Split the edge: the shared part becomes a new parent.
+                std::unique_ptr<Node> parent(new Node());
+                parent->prefix = child->prefix.substr(0, common);
+                child->prefix.erase(0, common);
+                parent->indices.push_back(child->prefix[0]);
+                parent->children.push_back(std::move(node->children[index]));
+                node->children[index] = std::move(parent);
+                child = node->children[index].get();
+            }
+            node = child;
+            segment = segment.substr(common);
+        }
+        return node;
+    }
+
+    static const Node* match(const Node* node, std::string_view path, RouteParams& params) {
+        if (path.empty()) {
+            if (!node->values.empty()) return node;
+            if (node->wildcard_child && !node->wildcard_child->values.empty() &&
+                params.push(node->wildcard_child->param_name, path)) {
+                return node->wildcard_child.get();
+            }
+            return nullptr;
+        }
+
+        size_t index = node->indices.find(path[0]);
+        if (index != std::string::npos) {
+            const Node* child = node->children[index].get();
+            if (path.compare(0, child->prefix.size(), child->prefix) == 0) {
+                const Node* found = match(child, path.substr(child->prefix.size()), params);
+                if (found != nullptr) return found;
+            }
+        }
+
+        if (node->param_child) {
+            size_t end = path.find('/');
+            if (end == std::string_view::npos) end = path.size();
+            if (end > 0 && params.push(node->param_child->param_name, path.substr(0, end))) {
+                const Node* found = match(node->param_child.get(), path.substr(end), params);
+                if (found != nullptr) return found;
+                params.pop();
+            }
+        }
+
+        if (node->wildcard_child && !node->wildcard_child->values.empty() &&
+            params.push(node->wildcard_child->param_name, path)) {
+            return node->wildcard_child.get();
+        }
+        return nullptr;
+    }
+};
+
+// Runs blocking handlers off the event-loop threads. Every pool thread
+// owns a deque: it takes its own work from the back, newest first, and
+// once that is empty steals the oldest task from the front of another
+// thread's deque. Tasks submitted from outside the pool are dealt
+// round-robin across the deques.
+class WorkStealingPool {
+public:
+    typedef std::function<void()> Task;
+
+    WorkStealingPool() : stopping(false), pending(0), next_queue(0) {}
+
+    ~WorkStealingPool() { stop(); }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    void start(size_t thread_count) {
+        if (!threads.empty() || thread_count == 0) return;
+        stopping = false;
+        queues.clear();
+        for (size_t i = 0; i < thread_count; i++) {
+            queues.emplace_back(new Queue());
+        }
+        for (size_t i = 0; i < thread_count; i++) {
+            threads.emplace_back([this, i]() { run(i); });
+        }
+    }
+
+    // Runs whatever is still queued, then joins the threads.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            stopping = true;
+        }
+        idle.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    bool running() const { return !threads.empty(); }
+
+    // Tasks submitted and not yet picked up by a thread.
+    size_t queued() const { return pending.load(std::memory_order_relaxed); }
+
+    void submit(Task task) {
+        size_t index = current_pool == this ? current_index
+                                             : next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+        // Counted before it is visible, so a busy thread that takes it at
+        // once cannot decrement first and wrap queued() around.
+        pending.fetch_add(1, std::memory_order_acq_rel);
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        {
+            // Pairs with the predicate check in run() so the wakeup is not lost.
+            std::lock_guard<std::mutex> lock(idle_mutex);
+        }
+        idle.notify_one();
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex idle_mutex;
+    std::condition_variable idle;
+    bool stopping;
+    std::atomic<size_t> pending;
+    std::atomic<size_t> next_queue;
+
+    static inline thread_local WorkStealingPool* current_pool = nullptr;
+    static inline thread_local size_t current_index = 0;
+
+    bool popLocal(size_t index, Task& task) {
+        Queue& queue = *queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t index, Task& task) {
+        for (size_t i = 1; i < queues.size(); i++) {
+            Queue& victim = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tasks.empty()) continue;
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t index) {
+        current_pool = this;
+        current_index = index;
+        Task task;
+        while (true) {
+            if (popLocal(index, task) || steal(index, task)) {
+                pending.fetch_sub(1, std::memory_order_acq_rel);
+                try {
+                    task();
+                } catch (const std::exception& e) {
+                    std::cerr << "Task error: " << e.what() << std::endl;
+                }
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_mutex);
+            idle.wait(lock, [this]() { return stopping || pending.load(std::memory_order_acquire) > 0; });
+            if (stopping && pending.load(std::memory_order_acquire) == 0) {
+                return;
+            }
+        }
+    }
+};
+
+#ifdef WEBSERVER_HAVE_COROUTINES
+template <class T>
+class Task;
+
+// Shared by every Task promise: a task starts suspended, resumes whoever
+// awaited it when it finishes, and keeps an escaping exception for them.
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            return handle.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <class T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+    T take() {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void take() {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+// Lazily started coroutine returning T. Awaiting it runs it to
+// completion on the awaiting thread and yields its result.
+template <class T = void>
+class Task {
+public:
+    typedef TaskPromise<T> promise_type;
+
+    Task() = default;
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return !handle || handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() { return handle.promise().take(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <class T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Fire-and-forget coroutine: runs eagerly and frees its own frame.
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Suspends the awaiting coroutine for delay on the current event loop.
+struct SleepFor {
+    std::chrono::milliseconds delay;
+
+    bool await_ready() const noexcept { return delay.count() <= 0; }
+    void await_suspend(std::coroutine_handle<> handle) const {
+        EventLoop::current()->addTimer(delay, [handle]() { handle.resume(); });
+    }
+    void await_resume() const noexcept {}
+};
+
+inline SleepFor sleepFor(std::chrono::milliseconds delay) {
+    return SleepFor{delay};
+}
+
+// Non-blocking TCP socket for coroutine handlers. Operations suspend the
+// caller until the socket is ready and resume it from the event loop of
+// the thread that first used the socket.
+class AsyncSocket {
+public:
+    AsyncSocket() : sock(INVALID_SOCKET), loop(nullptr), fired(0) {}
+    ~AsyncSocket() { close(); }
+
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+    bool isOpen() const { return sock != INVALID_SOCKET; }
+
+    // Resolves host (IPv4; name lookups block) and connects to it.
+    Task<bool> connect(std::string host, int port) {
+        close();
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0 || result == nullptr) {
+            co_return false;
+        }
+        sockaddr_in addr;
+        std::memcpy(&addr, result->ai_addr, sizeof(addr));
+        freeaddrinfo(result);
+
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET || !setNonBlocking(sock)) {
+            close();
+            co_return false;
+        }
+#ifdef SO_NOSIGPIPE
+        int opt = 1;
+        setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&opt, sizeof(opt));
+#endif
+        if (::connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            co_return true;
+        }
+#ifdef _WIN32
+        bool in_progress = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        bool in_progress = errno == EINPROGRESS;
+#endif
+        if (!in_progress) {
+            close();
+            co_return false;
+        }
+        co_await ready(EventLoop::Writable);
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == SOCKET_ERROR || error != 0) {
+            close();
+            co_return false;
+        }
+        co_return true;
+    }
+
+    // Reads up to size bytes; returns 0 at end of stream and -1 on error.
+    Task<int> read(char* buffer, size_t size) {
+        while (isOpen()) {
+            int received = recv(sock, buffer, (int)size, 0);
+            if (received >= 0) co_return received;
+            if (!socketWouldBlock()) break;
+            co_await ready(EventLoop::Readable);
+        }
+        co_return -1;
+    }
+
+    // Writes all of data; false if the connection failed first.
+    Task<bool> write(std::string_view data) {
+        while (!data.empty() && isOpen()) {
+            int sent = send(sock, data.data(), (int)data.size(), MSG_NOSIGNAL);
+            if (sent > 0) {
+                data.remove_prefix(sent);
+                continue;
+            }
+            if (sent < 0 && !socketWouldBlock()) co_return false;
+            co_await ready(EventLoop::Writable);
+        }
+        co_return data.empty();
+    }
+
+    void close() {
+        if (loop != nullptr) {
+            loop->remove(watcher);
+        }
+        if (sock != INVALID_SOCKET) {
+            ::closesocket(sock);
+            sock = INVALID_SOCKET;
+        }
+    }
+
+private:
+    struct Readiness {
+        AsyncSocket& socket;
+        uint32_t events;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { socket.arm(events, handle); }
+        uint32_t await_resume() const noexcept { return socket.fired; }
+    };
+
+    SOCKET sock;
+    EventLoop* loop;
+    IOWatcher watcher;
+    uint32_t fired;
+
+    Readiness ready(uint32_t events) { return Readiness{*this, events}; }
+
+    // The coroutine is resumed from a deferred call rather than from the
+    // watcher callback, so it may destroy this socket when it resumes.
+    void arm(uint32_t events, std::coroutine_handle<> handle) {
+        if (loop == nullptr) loop = EventLoop::current();
+        watcher.callback = [this, handle](uint32_t triggered) {
+            fired = triggered;
+            loop->modify(watcher, 0);
+            loop->defer([handle]() { handle.resume(); });
+        };
+        if (!watcher.active) {
+            watcher.fd = sock;
+            watcher.events = events;
+            loop->add(watcher);
+        } else {
+            loop->modify(watcher, events);
+        }
+    }
+};
+#endif
+
+// A counter that only its owning thread increments. A relaxed load and
+// store instead of a locked add keeps the hot path as cheap as a plain
+// increment, while other threads can still read it at any time.
+class LocalCounter {
+public:
+    void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t load() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Latency histogram in the spirit of HdrHistogram: every power of two of
+// microseconds is split into 8 linear buckets, so a recorded value is
+// known to within 12.5% from 1 us up to hours, in a fixed 2 KiB. Like
+// LocalCounter it has a single writer.
+class LatencyHistogram {
+public:
+    static const size_t sub_buckets = 8;
+    static const size_t bucket_count = 32 * sub_buckets;
+
+    void record(std::chrono::steady_clock::duration elapsed) {
+        int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        uint64_t value = micros > 0 ? (uint64_t)micros : 0;
+        buckets[bucketFor(value)].add();
+        total.add();
+        sum_micros.add(value);
+    }
+
+    uint64_t count() const { return total.load(); }
+    uint64_t sumMicros() const { return sum_micros.load(); }
+    uint64_t bucket(size_t index) const { return buckets[index].load(); }
+
+    static size_t bucketFor(uint64_t micros) {
+        if (micros < sub_buckets) return (size_t)micros;
+#if defined(__GNUC__) || defined(__clang__)
+        int top = 63 - __builtin_clzll(micros);
+#else
+        int top = 63;
+        while (!(micros >> top)) top--;
+#endif
+        // top >= 3: the three bits below the leading one pick the sub-bucket.
+        size_t index = (size_t)(top - 2) * sub_buckets + ((micros >> (top - 3)) & (sub_buckets - 1));
+        return std::min(index, bucket_count - 1);
+    }
+
+    // Exclusive upper bound of a bucket, in microseconds.
+    static uint64_t bucketLimit(size_t index) {
+        if (index < sub_buckets) return index + 1;
+        size_t top = index / sub_buckets + 2;
+        return (sub_buckets + index % sub_buckets + 1) << (top - 3);
+    }
+
+private:
+    LocalCounter buckets[bucket_count];
+    LocalCounter total;
+    LocalCounter sum_micros;
+};
+
+// Time spent per request in each phase: parsing (from its first byte to
+// the end of its body), the handler, and writing (from queueing the
+// response until the socket took its last byte).
+struct RouteMetrics {
+    LatencyHistogram parse;
+    LatencyHistogram handler;
+    LatencyHistogram write;
+};
+
+// Everything one worker counts. Its loop thread is the only writer; a
+// /metrics scrape reads all workers and adds them up.
+struct WorkerMetrics {
+    static const int min_status = 100;
+    static const int max_status = 599;
+
+    LocalCounter accepts;
+    LocalCounter closes;
+    LocalCounter bytes_received;
+    LocalCounter bytes_sent;
+    LocalCounter idle_timeouts;
+    LocalCounter header_timeouts;
+    LocalCounter body_timeouts;
+    LocalCounter write_timeouts;
+    LocalCounter shed_connections;
+    LocalCounter shed_requests;
+    LocalCounter accept_pauses;
+    LocalCounter tls_handshakes;
+    LocalCounter tls_resumptions;
+    LocalCounter tls_failures;
+    LocalCounter ktls_connections;
+    LocalCounter http2_connections;
+    LocalCounter http2_streams;
+    LocalCounter proxy_requests;
+    LocalCounter upstream_connects;
+    LocalCounter upstream_reuses;
+    LocalCounter upstream_connect_errors;
+    LocalCounter upstream_timeouts;
+    LocalCounter upstream_errors;
+    LocalCounter cache_hits;
+    LocalCounter cache_misses;
+    LocalCounter cache_coalesced;
+    LocalCounter accept_errors;
+    LocalCounter parse_errors;
+    LocalCounter handler_errors;
+    LocalCounter connection_errors;
+    LocalCounter statuses[max_status - min_status + 1];
+    // Indexed by Route::metrics_slot; only allocated when metrics are on.
+    std::unique_ptr<RouteMetrics[]> routes;
+
+    void countStatus(int status) {
+        if (status >= min_status && status <= max_status) statuses[status - min_status].add();
+    }
+};
+
+// Single-producer, single-consumer ring of fixed-size log lines. The
+// worker that owns it formats lines straight into its slots, with no lock
+// and no allocation, and the log thread drains them. A full ring drops
+// lines (and counts them) instead of making the worker wait.
+class LogRing {
+public:
+    static constexpr size_t slot_size = 256;
+    static constexpr size_t line_capacity = slot_size - sizeof(uint16_t);
+
+    // slot_count must be a power of two. The default (4 MiB) holds what a
+    // saturated worker logs while the writer waits for a time slice.
+    explicit LogRing(size_t slot_count = 16384)
+        : mask(slot_count - 1), slots(new char[slot_count * slot_size]) {}
+
+    LogRing(const LogRing&) = delete;
+    LogRing& operator=(const LogRing&) = delete;
+
+    // Room for one line of up to line_capacity bytes, or nullptr if full.
+    char* reserve() {
+        uint64_t head = write_index.load(std::memory_order_relaxed);
+        if (head - read_index.load(std::memory_order_acquire) > mask) {
+            lost.add();
+            return nullptr;
+        }
+        return slot(head) + sizeof(uint16_t);
+    }
+
+    // Publishes the line written into the last reserve()d slot.
+    void commit(size_t length) {
+        uint64_t head = write_index.load(std::memory_order_relaxed);
+        uint16_t stored = (uint16_t)length;
+        memcpy(slot(head), &stored, sizeof(stored));
+        write_index.store(head + 1, std::memory_order_release);
+    }
+
+    // Consumer side: appends every published line to out.
+    size_t drain(std::string& out) {
+        uint64_t tail = read_index.load(std::memory_order_relaxed);
+        uint64_t head = write_index.load(std::memory_order_acquire);
+        for (uint64_t i = tail; i != head; i++) {
+            uint16_t length;
+            memcpy(&length, slot(i), sizeof(length));
+            out.append(slot(i) + sizeof(length), length);
+        }
+        read_index.store(head, std::memory_order_release);
+        return (size_t)(head - tail);
+    }
+
+    uint64_t dropped() const { return lost.load(); }
+
+private:
+    // Producer and consumer indexes on separate cache lines.
+    alignas(64) std::atomic<uint64_t> write_index{0};
+    alignas(64) std::atomic<uint64_t> read_index{0};
+    LocalCounter lost;
+    size_t mask;
+    std::unique_ptr<char[]> slots;
+
+    char* slot(uint64_t index) { return &slots[(index & mask) * slot_size]; }
+};
+
+// Access log written by a background thread. Each worker owns one ring;
+// the thread wakes every few milliseconds, drains all rings into one
+// buffer and writes it with a single call, rotating the file by size.
+class AccessLog {
+public:
+    // Info logs every response (subject to sampling), Warning only 4xx
+    // and 5xx, Error only 5xx.
+    enum Level { Info, Warning, Error };
+
+    // An empty path or "-" logs to stdout, which is never rotated.
+    AccessLog(const std::string& path, size_t max_file_size, size_t max_files)
+        : path(path), max_file_size(max_file_size), max_files(max_files), level(Info), sample_every(1),
+          file(nullptr), file_size(0), stopping(false) {}
+
+    ~AccessLog() { stop(); }
+
+    // Successful responses are logged one in sample_every; errors at or
+    // above level always are.
+    void setFilter(Level min_level, uint32_t sample) {
+        level = min_level;
+        sample_every = sample == 0 ? 1 : sample;
+    }
+
+    // Whether a response with this status is logged. counter is the
+    // calling worker's own sampling state.
+    bool wants(int status, uint32_t& counter) const {
+        if (status >= 500) return true;
+        if (status >= 400) return level <= Warning;
+        if (level != Info) return false;
+        if (sample_every == 1) return true;
+        if (++counter < sample_every) return false;
+        counter = 0;
+        return true;
+    }
+
+    // Opens the file and starts the writer with one ring per worker.
+    void start(size_t ring_count) {
+        stop();
+        if (path.empty() || path == "-") {
+            file = stdout;
+        } else {
+            file = fopen(path.c_str(), "a");
+            if (file == nullptr) {
+                throw std::runtime_error("Could not open access log " + path);
+            }
+            fseek(file, 0, SEEK_END);
+            long position = ftell(file);
+            file_size = position > 0 ? (size_t)position : 0;
+        }
+        rings.clear();
+        for (size_t i = 0; i < ring_count; i++) {
+            rings.emplace_back(new LogRing());
+        }
+        stopping = false;
+        writer = std::thread([this]() { run(); });
+    }
+
+    // Writes out what is left and closes the file.
+    void stop() {
+        if (!writer.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        writer.join();
+        if (file != nullptr && file != stdout) fclose(file);
+        file = nullptr;
+    }
+
+    LogRing* ring(size_t index) { return rings[index].get(); }
+
+    uint64_t dropped() const {
+        uint64_t sum = 0;
+        for (const auto& ring : rings) sum += ring->dropped();
+        return sum;
+    }
+
+private:
+    static constexpr int flush_interval_ms = 10;
+    static constexpr size_t busy_batch = 256;
+
+    std::string path;
+    size_t max_file_size;
+    size_t max_files;
+    Level level;
+    uint32_t sample_every;
+    std::vector<std::unique_ptr<LogRing>> rings;
+    FILE* file;
+    size_t file_size;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping;
+
+    void run() {
+        std::string batch;
+        bool busy = false;
+        for (;;) {
+            bool last;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                // Under a burst the next batch is already waiting, so drain
+                // again straight away rather than letting the rings fill.
+                if (!busy) {
+                    wakeup.wait_for(lock, std::chrono::milliseconds(flush_interval_ms), [this]() { return stopping; });
+                }
+                last = stopping;
+            }
+            batch.clear();
+            size_t lines = 0;
+            for (const auto& ring : rings) lines += ring->drain(batch);
+            if (!batch.empty()) write(batch);
+            busy = lines >= busy_batch;
+            if (last) return;
+        }
+    }
+
+    void write(const std::string& batch) {
+        if (file != stdout && max_file_size > 0 && file_size > 0 && file_size + batch.size() > max_file_size) {
+            rotate();
+        }
+        if (file == nullptr) return;
+        fwrite(batch.data(), 1, batch.size(), file);
+        fflush(file);
+        file_size += batch.size();
+    }
+
+    // path -> path.1 -> path.2 ... keeping max_files old files.
+    void rotate() {
+        fclose(file);
+        if (max_files > 0) {
+            std::remove((path + "." + std::to_string(max_files)).c_str());
+            for (size_t i = max_files; i > 1; i--) {
+                std::rename((path + "." + std::to_string(i - 1)).c_str(), (path + "." + std::to_string(i)).c_str());
+            }
+            std::rename(path.c_str(), (path + ".1").c_str());
+        }
+        file = fopen(path.c_str(), max_files > 0 ? "a" : "w");
+        file_size = 0;
+        if (file == nullptr) {
+            std::cerr << "Could not reopen access log " << path << std::endl;
+        }
+    }
+};
+
+// "[10/Oct/2026:13:55:36 +0000]", re-rendered at most once per second on
+// each thread like the Date header.
+inline std::string_view cachedLogTime() {
+    struct TimeCache {
+        time_t second = -1;
+        char text[32];
+        size_t length = 0;
+    };
+    thread_local TimeCache cache;
+
+    time_t now = time(nullptr);
+    if (now != cache.second) {
+        static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                       "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+        struct tm utc;
+#ifdef _WIN32
+        gmtime_s(&utc, &now);
+#else
+        gmtime_r(&now, &utc);
+#endif
+        int n = snprintf(cache.text, sizeof(cache.text), "[%02d/%s/%04d:%02d:%02d:%02d +0000]", utc.tm_mday,
+                         months[utc.tm_mon], utc.tm_year + 1900, utc.tm_hour, utc.tm_min, utc.tm_sec);
+        cache.length = n > 0 ? (size_t)n : 0;
+        cache.second = now;
+    }
+    return std::string_view(cache.text, cache.length);
+}
+
+// One timed phase of a sampled request. Times are traceClock() readings.
+struct TraceSpan {
+    enum Phase : uint8_t { Request, Accept, Receive, Parse, Route, Handler, Serialize, Send };
+
+    uint64_t trace_id;
+    // The connection's serial in the high half, the HTTP/2 stream in the low.
+    uint64_t track;
+    uint64_t start;
+    uint64_t end;
+    uint32_t worker;
+    // Request spans only: the response status and "GET /path?query",
+    // cut short to fit.
+    uint16_t status;
+    Phase phase;
+    uint8_t label_size;
+    char label[48];
+
+    static const char* phaseName(Phase phase) {
+        static const char* const names[] = {"request", "accept", "receive", "parse",
+                                            "route",   "handler", "serialize", "send"};
+        return names[phase];
+    }
+};
+
+// Single-producer, single-consumer ring of spans, like LogRing: the
+// worker fills slots in place and the trace writer drains them. A full
+// ring drops spans and counts them.
+class TraceRing {
+public:
+    // span_count must be a power of two; the default takes about 700 KiB.
+    explicit TraceRing(size_t span_count = 8192) : mask(span_count - 1), spans(new TraceSpan[span_count]) {}
+
+    TraceRing(const TraceRing&) = delete;
+    TraceRing& operator=(const TraceRing&) = delete;
+
+    // The next free slot, or nullptr if full.
+    TraceSpan* reserve() {
+        uint64_t head = write_index.load(std::memory_order_relaxed);
+        if (head - read_index.load(std::memory_order_acquire) > mask) {
+            lost.add();
+            return nullptr;
+        }
+        return &spans[head & mask];
+    }
+
+    void commit() { write_index.store(write_index.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Consumer side: appends every published span to out.
+    size_t drain(std::vector<TraceSpan>& out) {
+        uint64_t tail = read_index.load(std::memory_order_relaxed);
+        uint64_t head = write_index.load(std::memory_order_acquire);
+        for (uint64_t i = tail; i != head; i++) out.push_back(spans[i & mask]);
+        read_index.store(head, std::memory_order_release);
+        return (size_t)(head - tail);
+    }
+
+    uint64_t dropped() const { return lost.load(); }
+
+private:
+    alignas(64) std::atomic<uint64_t> write_index{0};
+    alignas(64) std::atomic<uint64_t> read_index{0};
+    LocalCounter lost;
+    size_t mask;
+    std::unique_ptr<TraceSpan[]> spans;
+};
+
+// Writes the spans of sampled requests to a file from a background
+// thread, as the access log does its lines. ChromeTrace is the JSON array
+// of the Trace Event Format, for chrome://tracing and Perfetto: one
+// process per worker, one thread per connection. OpenTelemetry writes
+// one OTLP/JSON ExportTraceServiceRequest per line, which the collector's
+// otlpjsonfile receiver reads; each request is a trace whose phases are
+// children of its request span.
+class Tracer {
+public:
+    enum Format { ChromeTrace, OpenTelemetry };
+
+    Tracer(const std::string& path, Format format, uint32_t sample_every)
+        : path(path), format(format), sample_every(sample_every == 0 ? 1 : sample_every), file(nullptr),
+          events_written(0), stopping(false) {}
+
+    ~Tracer() { stop(); }
+
+    // Whether the request now starting is traced: one in sample_every.
+    // counter is the calling worker's own sampling state.
+    bool sample(uint32_t& counter) const {
+        if (++counter < sample_every) return false;
+        counter = 0;
+        return true;
+    }
+
+    // A fresh non-zero trace id; sequence is the calling worker's own.
+    uint64_t newTraceId(size_t worker, uint64_t& sequence) const {
+        uint64_t id = mix(id_seed + ((uint64_t)worker << 48) + ++sequence);
+        return id != 0 ? id : 1;
+    }
+
+    // Opens the file and starts the writer with one ring per worker.
+    void start(size_t ring_count) {
+        stop();
+        file = fopen(path.c_str(), format == ChromeTrace ? "w" : "a");
+        if (file == nullptr) {
+            throw std::runtime_error("Could not open trace file " + path);
+        }
+        if (format == ChromeTrace) fputs("[\n", file);
+        events_written = 0;
+        rings.clear();
+        for (size_t i = 0; i < ring_count; i++) {
+            rings.emplace_back(new TraceRing());
+        }
+        std::random_device random;
+        id_seed = ((uint64_t)random() << 32) ^ random() ^ (uint64_t)time(nullptr);
+        trace_id_high = mix(id_seed);
+        anchor_ticks = traceClock();
+        anchor_steady = std::chrono::steady_clock::now();
+        anchor_unix_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::system_clock::now().time_since_epoch()).count();
+        ns_per_tick = 1.0;
+        stopping = false;
+        writer = std::thread([this]() { run(); });
+    }
+
+    // Writes out what is left and closes the file. A ChromeTrace file
+    // is only valid JSON after this, though the viewers accept it without
+    // the closing bracket.
+    void stop() {
+        if (!writer.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        writer.join();
+        if (format == ChromeTrace) fputs("\n]\n", file);
+        fclose(file);
+        file = nullptr;
+    }
+
+    TraceRing* ring(size_t index) { return rings[index].get(); }
+
+    uint64_t dropped() const {
+        uint64_t sum = 0;
+        for (const auto& ring : rings) sum += ring->dropped();
+        return sum;
+    }
+
+private:
+    static constexpr int flush_interval_ms = 50;
+
+    std::string path;
+    Format format;
+    uint32_t sample_every;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    FILE* file;
+    uint64_t events_written;
+    uint64_t id_seed = 0;
+    // The high half of every OpenTelemetry trace id.
+    uint64_t trace_id_high = 0;
+    // A traceClock() reading taken together with both clocks at start();
+    // the tick rate is measured against steady_clock from there.
+    uint64_t anchor_ticks = 0;
+    std::chrono::steady_clock::time_point anchor_steady;
+    uint64_t anchor_unix_ns = 0;
+    double ns_per_tick;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping;
+
+    // splitmix64's finalizer.
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    void run() {
+        std::vector<TraceSpan> spans;
+        std::string batch;
+        for (;;) {
+            bool last;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeup.wait_for(lock, std::chrono::milliseconds(flush_interval_ms), [this]() { return stopping; });
+                last = stopping;
+            }
+            calibrate();
+            spans.clear();
+            for (const auto& ring : rings) ring->drain(spans);
+            if (!spans.empty()) {
+                batch.clear();
+                if (format == ChromeTrace) {
+                    formatChrome(spans, batch);
+                } else {
+                    formatOtlp(spans, batch);
+                }
+                fwrite(batch.data(), 1, batch.size(), file);
+                fflush(file);
+            }
+            if (last) return;
+        }
+    }
+
+    // The longer the server runs, the closer this gets to the true rate.
+    void calibrate() {
+        uint64_t ticks = traceClock() - anchor_ticks;
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                          anchor_steady).count();
+        if (ticks > 0 && ns > 0) ns_per_tick = (double)ns / (double)ticks;
+    }
+
+    // Nanoseconds since start().
+    uint64_t sinceStart(uint64_t ticks) const {
+        return ticks > anchor_ticks ? (uint64_t)((double)(ticks - anchor_ticks) * ns_per_tick) : 0;
+    }
+
+    static void appendHex(std::string& out, uint64_t value) {
+        char digits[17];
+        snprintf(digits, sizeof(digits), "%016llx", (unsigned long long)value);
+        out.append(digits, 16);
+    }
+
+    // The label as a JSON string body; quotes, backslashes and control
+    // characters become '?', as in the access log.
+    static void appendLabel(std::string& out, std::string_view label) {
+        for (char c : label) {
+            unsigned char u = (unsigned char)c;
+            out.push_back(u < 0x20 || u == 0x7f || c == '"' || c == '\\' ? '?' : c);
+        }
+    }
+
+    void formatChrome(const std::vector<TraceSpan>& spans, std::string& out) {
+        char number[64];
+        for (const TraceSpan& span : spans) {
+            uint64_t start = sinceStart(span.start);
+            uint64_t end = std::max(start, sinceStart(span.end));
+            if (events_written++ > 0) out.append(",\n");
+            out.append("{\"name\":\"").append(TraceSpan::phaseName(span.phase)).append("\",\"cat\":\"http\",\"ph\":\"X\"");
+            snprintf(number, sizeof(number), ",\"pid\":%u,\"tid\":%llu", span.worker,
+                     (unsigned long long)span.track);
+            out.append(number);
+            snprintf(number, sizeof(number), ",\"ts\":%.3f,\"dur\":%.3f", start / 1000.0, (end - start) / 1000.0);
+            out.append(number);
+            out.append(",\"args\":{\"trace_id\":\"");
+            appendHex(out, span.trace_id);
+            out.append("\"");
+            if (span.phase == TraceSpan::Request) {
+                out.append(",\"request\":\"");
+                appendLabel(out, std::string_view(span.label, span.label_size));
+                snprintf(number, sizeof(number), "\",\"status\":%u", span.status);
+                out.append(number);
+            }
+            out.append("}}");
+        }
+    }
+
+    void formatOtlp(const std::vector<TraceSpan>& spans, std::string& out) {
+        char number[32];
+        out.append("{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\",\"value\":"
+                   "{\"stringValue\":\"webserver\"}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"webserver\"},\"spans\":[");
+        for (size_t i = 0; i < spans.size(); i++) {
+            const TraceSpan& span = spans[i];
+            uint64_t start = anchor_unix_ns + sinceStart(span.start);
+            uint64_t end = std::max(start, anchor_unix_ns + sinceStart(span.end));
+            bool root = span.phase == TraceSpan::Request;
+            if (i > 0) out.push_back(',');
+            out.append("{\"traceId\":\"");
+            appendHex(out, trace_id_high);
+            appendHex(out, span.trace_id);
+            // The request span's id is the trace id; a phase's is derived
+            // from the trace id and its start, which no sibling shares.
+            out.append("\",\"spanId\":\"");
+            appendHex(out, root ? span.trace_id : mix(span.trace_id + span.start * 8 + span.phase));
+            if (!root) {
+                out.append("\",\"parentSpanId\":\"");
+                appendHex(out, span.trace_id);
+            }
+            out.append("\",\"name\":\"").append(TraceSpan::phaseName(span.phase));
+            // SPAN_KIND_SERVER for the request, SPAN_KIND_INTERNAL for its phases.
+            out.append(root ? "\",\"kind\":2" : "\",\"kind\":1");
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)start);
+            out.append(",\"startTimeUnixNano\":\"").append(number);
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)end);
+            out.append("\",\"endTimeUnixNano\":\"").append(number).append("\"");
+            if (root) {
+                std::string_view label(span.label, span.label_size);
+                size_t space = label.find(' ');
+                out.append(",\"attributes\":[{\"key\":\"http.request.method\",\"value\":{\"stringValue\":\"");
+                appendLabel(out, label.substr(0, space));
+                std::string_view target = space != std::string_view::npos ? label.substr(space + 1) : std::string_view();
+                size_t mark = target.find('?');
+                out.append("\"}},{\"key\":\"url.path\",\"value\":{\"stringValue\":\"");
+                appendLabel(out, target.substr(0, mark));
+                if (mark != std::string_view::npos) {
+                    out.append("\"}},{\"key\":\"url.query\",\"value\":{\"stringValue\":\"");
+                    appendLabel(out, target.substr(mark + 1));
+                }
+                snprintf(number, sizeof(number), "%u", span.status);
+                out.append("\"}},{\"key\":\"http.response.status_code\",\"value\":{\"intValue\":\"")
+                    .append(number)
+                    .append("\"}}]");
+            }
+            out.push_back('}');
+        }
+        out.append("]}]}]}\n");
+    }
+};
+
+// Consumer for a request body that is too large (or too slow) to buffer.
+// on_data sees the decoded body piece by piece as it arrives; the views
+// are only valid during the call. on_complete then fills in the response.
+struct BodyStream {
+    std::function<void(std::string_view)> on_data;
+    std::function<void(const HTTPRequest&, HTTPResponse&)> on_complete;
+};
+
+// Backends and policy for a route added with WebServer::addProxyRoute().
+struct ProxyOptions {
+    enum Balance { RoundRobin, LeastConnections };
+
+    // "host:port" of each backend, IPv4; names are resolved once, by start().
+    std::vector<std::string> backends;
+    // LeastConnections counts the requests each worker has in flight to
+    // a backend, not those of the other workers.
+    Balance balance = RoundRobin;
+    // With a path, the first worker sends every backend a GET for it each
+    // health_interval, and a backend takes requests only while it answers
+    // 2xx or 3xx. Either way a backend that refuses a connection sits out
+    // for health_interval.
+    std::string health_path;
+    std::chrono::milliseconds health_interval{5000};
+    std::chrono::milliseconds connect_timeout{2000};
+    // Longest the backend may take to make progress once connected:
+    // reading the request, starting its response or sending more of it.
+    std::chrono::milliseconds response_timeout{30000};
+    // Keep-alive connections each worker holds on to per backend, and how
+    // long one may sit unused; keep this under the backends' own timeout.
+    size_t max_idle = 16;
+    std::chrono::milliseconds idle_timeout{4000};
+};
+
+class WebServer {
+private:
+    struct Worker;
+    struct Upstream;
+
+    // A backend of a proxy route. Workers keep their own connections to
+    // it and share only its health.
+    struct ProxyBackend {
+        std::string name;
+        sockaddr_in address{};
+        // Cleared while health checks fail.
+        std::atomic<bool> healthy{true};
+        // Milliseconds on the steady clock until which the backend is
+        // skipped because it refused a connection.
+        std::atomic<int64_t> down_until{0};
+    };
+
+    struct ProxyGroup {
+        ProxyOptions options;
+        std::vector<std::unique_ptr<ProxyBackend>> backends;
+        // Index of the group's pools in Worker::proxy_pools.
+        size_t index = 0;
+    };
+
+    struct Route {
+        std::function<void(const HTTPRequest&, HTTPResponse&)> handler;
+        std::function<BodyStream(const HTTPRequest&)> stream_handler;
+        // Run on the handler pool instead of the event loop.
+        bool offload = false;
+        // Index of the route's histograms in WorkerMetrics::routes.
+        size_t metrics_slot = 0;
+        // Set for routes added with addProxyRoute().
+        std::shared_ptr<ProxyGroup> proxy;
+        // Set for routes added with addCachedRoute().
+        std::shared_ptr<ResponseCache> cache;
+#ifdef WEBSERVER_HAVE_COROUTINES
+        std::function<Task<>(const HTTPRequest&, HTTPResponse&)> async_handler;
+#endif
+    };
+
+    // A request handed to the handler pool or a coroutine handler, and
+    // the response it produced.
+    struct Completion {
+        SOCKET socket;
+        uint64_t serial;
+        HTTPRequest request;
+        HTTPResponse response;
+        bool failed = false;
+        // Set for a request that came in on an HTTP/2 stream.
+        uint32_t stream_id = 0;
+        size_t metrics_slot = 0;
+        std::chrono::steady_clock::time_point handler_start;
+        const Route* route = nullptr;
+        // The cache entry this request's response is to fill.
+        std::string cache_key;
+        // Parked on another request's fill, which leaves its entry in cached.
+        bool cache_wait = false;
+        std::shared_ptr<const ResponseCache::Entry> cached;
+    };
+
+    // The limit a connection's timer currently enforces.
+    enum Deadline { NoDeadline, IdleDeadline, HeaderDeadline, BodyDeadline, WriteDeadline };
+
+    // The current request's trace while tracing is on: its id, 0 unless
+    // sampled, when it began and when its running phase did. Until a
+    // request claims them it also holds the connection's accept() and the
+    // last readable event's reads.
+    struct RequestTrace {
+        uint64_t id = 0;
+        bool decided = false;
+        TraceSpan::Phase phase = TraceSpan::Parse;
+        uint64_t start = 0;
+        uint64_t mark = 0;
+        uint64_t accept_start = 0;
+        uint64_t accept_end = 0;
+        uint64_t read_start = 0;
+        uint64_t read_end = 0;
+    };
+
+    struct Connection {
+        Worker* worker;
+        SOCKET socket;
+        IOWatcher watcher;
+        IOBuffer input;
+        HTTPRequestParser parser;
+        HTTPRequest request;
+        // Reused for every response on the connection.
+        HTTPResponse response;
+        const Route* route = nullptr;
+        BodyStream body_stream;
+        bool streaming = false;
+        OutputQueue output;
+        size_t requests_served = 0;
+        // Time of the last read or write that made progress.
+        std::chrono::steady_clock::time_point last_active;
+        LoopTimer timeout;
+        Deadline deadline = NoDeadline;
+        // When the head now being received began to arrive.
+        std::chrono::steady_clock::time_point head_start;
+        uint64_t serial = 0;
+        // Set while an offloaded or coroutine handler owns the current request.
+        bool waiting = false;
+        // The streamed body being sent; later requests wait until it ends.
+        std::shared_ptr<ResponseStream> stream;
+        // Phase timing while metrics are on: when the current request's
+        // first byte was parsed and when its handler started, then the
+        // queue time of each response not yet fully written.
+        bool timing = false;
+        size_t metrics_slot = 0;
+        std::chrono::steady_clock::time_point request_start;
+        std::chrono::steady_clock::time_point handler_start;
+        std::vector<std::pair<size_t, std::chrono::steady_clock::time_point>> unsent;
+        RequestTrace trace;
+        // Request spans of traced responses not yet fully written, their
+        // end set to when the response was queued.
+        std::vector<TraceSpan> traced_unsent;
+        // Filled in only when the access log is on.
+        char client_ip[INET_ADDRSTRLEN] = {};
+#ifdef WEBSERVER_WITH_OPENSSL
+        std::unique_ptr<TLSConnection> tls;
+#endif
+        // The exchange forwarding the current request to a proxy backend.
+        Upstream* upstream = nullptr;
+        // Set once the connection speaks HTTP/2; requests then arrive as
+        // its streams and none of the HTTP/1 state above is used.
+        std::unique_ptr<Http2Session> h2;
+        bool close_after_write = false;
+        bool closed = false;
+    };
+
+    // A worker's connections to the backends of one proxy route.
+    struct ProxyPool {
+        struct Backend {
+            // Most recently used last.
+            std::vector<Upstream*> idle;
+            // Requests in flight, for LeastConnections.
+            size_t active = 0;
+            bool probing = false;
+        };
+        std::unique_ptr<Backend[]> backends;
+        // Where the next round-robin pick starts.
+        size_t next = 0;
+        // Health checks run on the first worker only.
+        LoopTimer health_timer;
+    };
+
+    // A connection to a proxy backend and the request it is carrying.
+    // In between requests it waits in its pool, watched only for the
+    // backend closing it.
+    struct Upstream {
+        enum State { Connecting, Sending, Receiving, Idle };
+
+        Worker* worker;
+        ProxyGroup* group;
+        size_t backend = 0;
+        uint64_t id = 0;
+        SOCKET socket = INVALID_SOCKET;
+        IOWatcher watcher;
+        LoopTimer timer;
+        State state = Connecting;
+        IOBuffer input;
+        OutputQueue output;
+        HTTPRequestParser parser;
+        // The response head, as parsed from input.
+        HTTPRequest head;
+        // A copy of the client's request head, and where the answer goes:
+        // the client connection and, over HTTP/2, its stream.
+        HTTPRequest request;
+        SOCKET client = INVALID_SOCKET;
+        uint64_t client_serial = 0;
+        uint32_t stream_id = 0;
+        size_t metrics_slot = 0;
+        std::chrono::steady_clock::time_point handler_start;
+        // A health check rather than a client's request.
+        bool probe = false;
+        // Everything of the request, body included, is in output.
+        bool request_queued = false;
+        // The client's body chunks are re-framed as chunks.
+        bool chunked_body = false;
+        // The client stopped being read while output is over max_pending_output.
+        bool client_paused = false;
+        bool flush_scheduled = false;
+        size_t connect_attempts = 0;
+        // Taken from the pool rather than freshly connected.
+        bool reused = false;
+        // The request can be sent again from the copy above.
+        bool replayable = false;
+        // Takes the response body to the client once its head is out.
+        std::shared_ptr<ResponseStream> producer;
+        bool closed = false;
+    };
+
+    // One event loop with its own listening socket. Workers share nothing
+    // but the (read-only once started) route table.
+    struct Worker {
+        size_t index = 0;
+        SOCKET server_socket = INVALID_SOCKET;
+        bool owns_socket = true;
+        std::unique_ptr<EventLoop> loop;
+        IOWatcher listener;
+        // Declared before the connections so it outlives their buffers.
+        BufferPool buffers;
+        ResponseCompressor compressor;
+#ifdef WEBSERVER_WITH_OPENSSL
+        std::unique_ptr<TLSContext> tls;
+#endif
+        WorkerMetrics metrics;
+        LogRing* log_ring = nullptr;
+        uint32_t log_sample = 0;
+        TraceRing* trace_ring = nullptr;
+        uint32_t trace_sample = 0;
+        uint64_t trace_sequence = 0;
+        std::unordered_map<SOCKET, std::unique_ptr<Connection>> connections;
+        std::vector<std::unique_ptr<Connection>> closed_connections;
+        // Indexed by ProxyGroup::index.
+        std::unique_ptr<ProxyPool[]> proxy_pools;
+        std::unordered_map<uint64_t, std::unique_ptr<Upstream>> upstreams;
+        std::vector<std::unique_ptr<Upstream>> closed_upstreams;
+        uint64_t next_serial = 0;
+        // Requests handed to the handler pool or a coroutine and not yet answered.
+        size_t inflight = 0;
+        bool accept_paused = false;
+        LoopTimer admission_timer;
+        // Filled by handler threads, drained by the loop after each poll().
+        std::mutex completions_mutex;
+        std::vector<std::shared_ptr<Completion>> completions;
+        std::thread thread;
+    };
+
+    static const size_t stream_batch_size = 64 * 1024;
+    static const size_t read_chunk_size = 16 * 1024;
+    // Bytes read per readiness event before yielding to other connections;
+    // the rest stays in the socket until the next poll().
+    static const size_t max_read_per_event = 256 * 1024;
+    // Pipelined requests wait while this much output is still unsent, so
+    // a client that does not read cannot make the server buffer answers.
+    static const size_t max_pending_output = 256 * 1024;
+
+    SOCKET server_socket;
+    int port;
+    // Written by stop() from any thread, read by every worker.
+    std::atomic<bool> running;
+    // Guards workers against stop() and restart() from other threads.
+    std::mutex lifecycle_mutex;
+    std::chrono::milliseconds drain_timeout;
+    // Listening sockets taken over from the process that started this one.
+    std::vector<SOCKET> inherited_listeners;
+    int ready_fd;
+    size_t worker_count;
+    bool pin_workers;
+    std::chrono::milliseconds keep_alive_timeout;
+    std::chrono::milliseconds header_timeout;
+    std::chrono::milliseconds body_timeout;
+    std::chrono::milliseconds write_timeout;
+    size_t max_connections;
+    size_t max_inflight_requests;
+    size_t max_queue_depth;
+    std::chrono::seconds retry_after;
+#ifdef WEBSERVER_WITH_OPENSSL
+    std::string tls_cert_file;
+    std::string tls_key_file;
+    TLSContext::TicketKeys tls_ticket_keys;
+#endif
+    size_t max_requests_per_connection;
+    size_t max_body_size;
+    size_t handler_threads;
+    bool use_io_uring;
+    bool http2;
+    bool compression;
+    size_t compress_min_size;
+    size_t compress_max_size;
+    std::vector<std::string> compressible_types;
+    bool metrics_enabled;
+    std::unique_ptr<AccessLog> access_log;
+    AccessLog::Level access_log_level;
+    uint32_t access_log_sample;
+    std::unique_ptr<Tracer> tracer;
+    std::shared_ptr<StaticFileCache> static_cache;
+    Router<Route> routes;
+    // Method and pattern of each Route::metrics_slot; slot 0 gathers
+    // requests no route matched.
+    std::vector<std::pair<std::string, std::string>> route_labels;
+    Route method_not_allowed;
+    std::vector<std::shared_ptr<ProxyGroup>> proxy_groups;
+    std::vector<std::shared_ptr<ResponseCache>> response_caches;
+    std::vector<std::unique_ptr<Worker>> workers;
+    WorkStealingPool handler_pool;
+
+    void initializeSocket() {
+#ifdef _WIN32
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            throw std::runtime_error("WSAStartup failed");
+        }
+#endif
+        resolveBackends();
+
+#ifdef WEBSERVER_WITH_OPENSSL
+        if (tlsEnabled()) {
+            tls_ticket_keys = TLSContext::generateTicketKeys();
+            // Fails here, before the port is taken, if the files are bad.
+            TLSContext::create(tls_cert_file, tls_key_file, tls_ticket_keys);
+        }
+#endif
+
+        if (!adoptListeners()) {
+            server_socket = createListener(worker_count > 1);
+        }
+        std::cout << (tlsEnabled() ? "HTTPS server started on port " : "Server started on port ") << port
+                  << (inherited_listeners.empty() ? "" : " (sockets taken over)") << std::endl;
+    }
+
+    // A server started by restart() finds the listening sockets it takes
+    // over in WEBSERVER_LISTEN_FDS, and in WEBSERVER_READY_FD the pipe on
+    // which it tells the old process that it is serving. Neither is passed
+    // on to processes the handlers start.
+    bool adoptListeners() {
+#ifdef _WIN32
+        return false;
+#else
+        const char* ready = getenv("WEBSERVER_READY_FD");
+        if (ready != nullptr) {
+            ready_fd = atoi(ready);
+            fcntl(ready_fd, F_SETFD, FD_CLOEXEC);
+        }
+        const char* listen_fds = getenv("WEBSERVER_LISTEN_FDS");
+        std::string list = listen_fds != nullptr ? listen_fds : "";
+        unsetenv("WEBSERVER_LISTEN_FDS");
+        unsetenv("WEBSERVER_READY_FD");
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string item = list.substr(0, comma);
+            list = comma == std::string::npos ? std::string() : list.substr(comma + 1);
+            SOCKET fd = atoi(item.c_str());
+            sockaddr_in address{};
+            socklen_t address_size = sizeof(address);
+            int listening = 0;
+            socklen_t listening_size = sizeof(listening);
+            if (getsockname(fd, (struct sockaddr*)&address, &address_size) != 0 || address.sin_family != AF_INET ||
+                ntohs(address.sin_port) != port ||
+                getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, (char*)&listening, &listening_size) != 0 || !listening) {
+                throw std::runtime_error("Inherited socket " + item + " is not listening on port " +
+                                         std::to_string(port));
+            }
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            inherited_listeners.push_back(fd);
+        }
+        if (inherited_listeners.empty()) return false;
+        server_socket = inherited_listeners[0];
+        return true;
+#endif
+    }
+
+    static bool reusesPort(SOCKET sock) {
+#ifdef SO_REUSEPORT
+        int opt = 0;
+        socklen_t size = sizeof(opt);
+        return getsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char*)&opt, &size) == 0 && opt != 0;
+#else
+        (void)sock;
+        return false;
+#endif
+    }
+
+    // Looks up the address of every proxy backend, once, before the
+    // workers need them.
+    void resolveBackends() {
+        for (const std::shared_ptr<ProxyGroup>& group : proxy_groups) {
+            for (const std::unique_ptr<ProxyBackend>& backend : group->backends) {
+                size_t colon = backend->name.rfind(':');
+                addrinfo hints{};
+                hints.ai_family = AF_INET;
+                hints.ai_socktype = SOCK_STREAM;
+                addrinfo* result = nullptr;
+                if (colon == std::string::npos ||
+                    getaddrinfo(backend->name.substr(0, colon).c_str(), backend->name.c_str() + colon + 1, &hints,
+                                &result) != 0 ||
+                    result == nullptr) {
+                    throw std::runtime_error("Could not resolve proxy backend " + backend->name);
+                }
+                std::memcpy(&backend->address, result->ai_addr, sizeof(backend->address));
+                freeaddrinfo(result);
+            }
+        }
+    }
+
+    SOCKET createListener(bool reuse_port) {
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+            throw std::runtime_error("Could not create socket");
+        }
+
+        try {
+            int opt = 1;
+            if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)) == SOCKET_ERROR) {
+                throw std::runtime_error("setsockopt failed");
+            }
+#ifdef SO_REUSEPORT
+            if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&opt, sizeof(opt)) == SOCKET_ERROR) {
+                throw std::runtime_error("setsockopt SO_REUSEPORT failed");
+            }
+#else
+            (void)reuse_port;
+#endif
+
+            sockaddr_in server_addr;
+            server_addr.sin_family = AF_INET;
+            server_addr.sin_addr.s_addr = INADDR_ANY;
+            server_addr.sin_port = htons(port);
+
+            if (bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+                throw std::runtime_error("Bind failed");
+            }
+
+            if (listen(sock, SOMAXCONN) == SOCKET_ERROR) {
+                throw std::runtime_error("Listen failed");
+            }
+
+            if (!setNonBlocking(sock)) {
+                throw std::runtime_error("Could not make listening socket non-blocking");
+            }
+        } catch (...) {
+            closesocket(sock);
+            throw;
+        }
+        return sock;
+    }
+
+    // With SO_REUSEPORT every worker gets its own listener and the kernel
+    // spreads incoming connections across them; otherwise all workers poll
+    // the one shared socket. Sockets taken over from an older process are
+    // used first, and one it shared between its workers is shared here too.
+    void createWorkers() {
+        bool shared = false;
+        for (size_t i = 0; i < worker_count; i++) {
+            std::unique_ptr<Worker> worker(new Worker());
+            worker->index = i;
+#ifdef SO_REUSEPORT
+            if (i == 0 || (i >= inherited_listeners.size() && !reusesPort(server_socket))) {
+                worker->server_socket = server_socket;
+                worker->owns_socket = false;
+                shared = i != 0;
+            } else {
+                worker->server_socket = i < inherited_listeners.size() ? inherited_listeners[i] : createListener(true);
+                worker->owns_socket = true;
+            }
+#else
+            worker->server_socket = server_socket;
+            worker->owns_socket = false;
+            shared = i != 0;
+#endif
+            worker->loop.reset(new EventLoop(use_io_uring));
+#ifdef WEBSERVER_WITH_OPENSSL
+            if (tlsEnabled()) {
+                worker->tls = TLSContext::create(tls_cert_file, tls_key_file, tls_ticket_keys, http2);
+            }
+#endif
+            if (metrics_enabled) {
+                worker->metrics.routes.reset(new RouteMetrics[route_labels.size()]);
+            }
+            createProxyPools(*worker);
+            if (use_io_uring && i == 0) {
+                std::cout << (worker->loop->usingIoUring() ? "I/O backend: io_uring"
+                                                           : "io_uring unavailable, falling back to the default backend")
+                          << std::endl;
+            }
+            Worker* raw = worker.get();
+            worker->listener.fd = worker->server_socket;
+            worker->listener.kind = IOWatcher::Listener;
+            worker->listener.events = EventLoop::Readable;
+            worker->listener.callback = [this, raw](uint32_t) { acceptConnections(*raw); };
+            worker->admission_timer.callback = [this, raw]() { updateAdmission(*raw); };
+            worker->loop->add(worker->listener);
+            workers.push_back(std::move(worker));
+        }
+        // The first worker closes the main socket as it drains, unless others poll it too.
+        workers[0]->owns_socket = !shared;
+        for (size_t i = worker_count; i < inherited_listeners.size(); i++) {
+            std::cerr << "Closing an inherited listening socket: this server runs fewer workers" << std::endl;
+            closesocket(inherited_listeners[i]);
+        }
+    }
+
+    void createProxyPools(Worker& worker) {
+        worker.proxy_pools.reset(new ProxyPool[proxy_groups.size()]);
+        for (const std::shared_ptr<ProxyGroup>& group : proxy_groups) {
+            ProxyPool& pool = worker.proxy_pools[group->index];
+            pool.backends.reset(new ProxyPool::Backend[group->backends.size()]);
+            if (worker.index == 0 && !group->options.health_path.empty()) {
+                Worker* raw = &worker;
+                ProxyGroup* checked = group.get();
+                pool.health_timer.callback = [this, raw, checked]() { checkBackends(*raw, *checked); };
+                worker.loop->schedule(pool.health_timer, std::chrono::steady_clock::now());
+            }
+        }
+    }
+
+    static void pinToCpu(size_t index) {
+#if defined(__linux__)
+        unsigned cpus = std::thread::hardware_concurrency();
+        if (cpus == 0) return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cpus, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)index;
+#endif
+    }
+
+    void runWorker(Worker& worker) {
+        if (pin_workers && workers.size() > 1) {
+            pinToCpu(worker.index);
+        }
+        worker.loop->makeCurrent();
+#ifndef _WIN32
+        // sendfile() and splice() take no MSG_NOSIGNAL, so writing a file to
+        // a reset peer raises SIGPIPE in this thread; keep it pending here.
+        sigset_t pipe_signal, old_signals;
+        sigemptyset(&pipe_signal);
+        sigaddset(&pipe_signal, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_signals);
+#endif
+        try {
+            while (running) {
+                worker.loop->poll(1000);
+                drainCompletions(worker);
+                updateAdmission(worker);
+                freeClosed(worker);
+                worker.closed_upstreams.clear();
+            }
+            drainWorker(worker);
+        } catch (const std::exception& e) {
+            std::cerr << "Worker " << worker.index << " error: " << e.what() << std::endl;
+            stop();
+        }
+
+        while (!worker.connections.empty()) {
+            closeConnection(*worker.connections.begin()->second);
+        }
+        // Their cancelled ring requests complete on the next few polls.
+        for (int i = 0; i < 100 && !worker.closed_connections.empty(); i++) {
+            worker.loop->poll(10);
+            freeClosed(worker);
+        }
+        worker.closed_connections.clear();
+        while (!worker.upstreams.empty()) {
+            closeUpstream(*worker.upstreams.begin()->second);
+        }
+        worker.closed_upstreams.clear();
+        for (size_t i = 0; i < proxy_groups.size(); i++) {
+            worker.loop->cancel(worker.proxy_pools[i].health_timer);
+        }
+        worker.loop->cancel(worker.admission_timer);
+        worker.loop->remove(worker.listener);
+#ifndef _WIN32
+        // Worker 0 runs on the caller's thread: drop what was raised here
+        // before restoring its mask.
+        timespec no_wait{};
+        while (sigtimedwait(&pipe_signal, nullptr, &no_wait) > 0) {}
+        pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+#endif
+    }
+
+    // Frees the connections closed during the last poll(), except those
+    // with ring requests still in flight, which may yet read their output.
+    static void freeClosed(Worker& worker) {
+        std::vector<std::unique_ptr<Connection>>& closed = worker.closed_connections;
+        closed.erase(std::remove_if(closed.begin(), closed.end(),
+                                    [](const std::unique_ptr<Connection>& conn) { return conn->watcher.in_flight == 0; }),
+                     closed.end());
+    }
+
+    // After stop(): the worker takes no new connections and lets the open
+    // ones finish, for up to drain_timeout. Idle keep-alive connections
+    // close at once and HTTP/2 clients get a GOAWAY; responses still to
+    // come go out with Connection: close, since finishRequest() no longer
+    // keeps connections open. Its listening socket closes first, so a
+    // connection it would never accept is refused rather than left queued.
+    void drainWorker(Worker& worker) {
+        worker.loop->remove(worker.listener);
+        if (worker.owns_socket) {
+            closesocket(worker.server_socket);
+            if (worker.server_socket == server_socket) server_socket = INVALID_SOCKET;
+            worker.server_socket = INVALID_SOCKET;
+            worker.owns_socket = false;
+        }
+        std::vector<Connection*> open;
+        for (const auto& entry : worker.connections) open.push_back(entry.second.get());
+        for (Connection* conn : open) {
+            if (conn->h2) {
+                conn->h2->goAway(Http2Session::NoError);
+                conn->close_after_write = true;
+                flushOutput(*conn);
+                updateTimeout(*conn);
+            } else if (conn->deadline == IdleDeadline) {
+                closeConnection(*conn);
+            }
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + drain_timeout;
+        while (!worker.connections.empty()) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) break;
+            worker.loop->poll((int)std::min<int64_t>(remaining.count() + 1, 1000));
+            drainCompletions(worker);
+            freeClosed(worker);
+            worker.closed_upstreams.clear();
+        }
+        if (!worker.connections.empty()) {
+            std::cerr << "Worker " << worker.index << " closing " << worker.connections.size()
+                      << " connections still open at the drain deadline" << std::endl;
+        }
+    }
+
+    // Stops taking connections while the handler pool's queue is over
+    // max_queue_depth and resumes once it is down to half, so the kernel
+    // backlog rather than the queue absorbs a burst. Paused workers poll
+    // the depth on a short timer, since the jobs draining may be another
+    // worker's and wake nobody here.
+    void updateAdmission(Worker& worker) {
+        if (max_queue_depth == 0 || !running) return;
+        size_t depth = handler_pool.queued();
+        if (!worker.accept_paused && depth >= max_queue_depth) {
+            worker.accept_paused = true;
+            worker.metrics.accept_pauses.add();
+            worker.loop->modify(worker.listener, 0);
+        } else if (worker.accept_paused && depth <= max_queue_depth / 2) {
+            worker.accept_paused = false;
+            worker.loop->modify(worker.listener, EventLoop::Readable);
+        }
+        if (worker.accept_paused && !worker.admission_timer.armed()) {
+            worker.loop->schedule(worker.admission_timer,
+                                  std::chrono::steady_clock::now() + std::chrono::milliseconds(10));
+        }
+    }
+
+    // TLS records and HTTP/2 frames for different streams go out in
+    // separate sends, which Nagle would hold behind the client's delayed ACK.
+    static void setNoDelay(SOCKET sock) {
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&opt, sizeof(opt));
+    }
+
+    bool tlsEnabled() const {
+#ifdef WEBSERVER_WITH_OPENSSL
+        return !tls_cert_file.empty();
+#else
+        return false;
+#endif
+    }
+
+    // Answers a connection over max_connections with a canned 503 and
+    // closes it at once, without allocating any per-connection state.
+    // A TLS client is just closed: the 503 would cost a full handshake.
+    void shedConnection(Worker& worker, SOCKET client_socket) {
+        if (tlsEnabled()) {
+            closesocket(client_socket);
+            worker.metrics.shed_connections.add();
+            return;
+        }
+        std::string response = "HTTP/1.1 503 Service Unavailable\r\nServer: cpp_webserver\r\n";
+        response.append(cachedDateHeader());
+        response.append("Retry-After: ").append(std::to_string(retry_after.count()));
+        response.append("\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        send(client_socket, response.data(), (int)response.size(), MSG_NOSIGNAL);
+        closesocket(client_socket);
+        worker.metrics.shed_connections.add();
+        worker.metrics.countStatus(503);
+    }
+
+    // The worker's next connection: accept() on its listener or, on
+    // io_uring, one the ring accepted, which comes non-blocking already
+    // and without the peer's address.
+    SOCKET acceptClient(Worker& worker, sockaddr_in& address, bool& nonblocking) {
+        socklen_t address_size = sizeof(address);
+#ifdef WEBSERVER_HAVE_IO_URING
+        if (worker.loop->usingIoUring()) {
+            SOCKET sock = worker.loop->accept(worker.listener);
+            nonblocking = true;
+            if (sock != INVALID_SOCKET && access_log) getpeername(sock, (struct sockaddr*)&address, &address_size);
+            return sock;
+        }
+#endif
+        nonblocking = false;
+        return accept(worker.server_socket, (struct sockaddr*)&address, &address_size);
+    }
+
+    void acceptConnections(Worker& worker) {
+        while (running) {
+            sockaddr_in client_addr;
+            uint64_t accept_start = 0;
+            if constexpr (tracing_built) {
+                if (tracer) accept_start = traceClock();
+            }
+
+            bool nonblocking;
+            SOCKET client_socket = acceptClient(worker, client_addr, nonblocking);
+            if (client_socket == INVALID_SOCKET) {
+                if (!socketWouldBlock()) {
+                    worker.metrics.accept_errors.add();
+                    std::cerr << "Accept failed" << std::endl;
+                }
+                return;
+            }
+
+            if (!nonblocking && !setNonBlocking(client_socket)) {
+                closesocket(client_socket);
+                continue;
+            }
+#ifdef SO_NOSIGPIPE
+            int opt = 1;
+            setsockopt(client_socket, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&opt, sizeof(opt));
+#endif
+            if (max_connections != 0 && worker.connections.size() >= max_connections) {
+                shedConnection(worker, client_socket);
+                continue;
+            }
+
+            std::unique_ptr<Connection> conn(new Connection());
+            conn->watcher.kind = IOWatcher::Stream;
+#ifdef WEBSERVER_WITH_OPENSSL
+            if (worker.tls) {
+                conn->tls = TLSConnection::create(*worker.tls, client_socket);
+                if (!conn->tls) {
+                    worker.metrics.tls_failures.add();
+                    closesocket(client_socket);
+                    continue;
+                }
+                setNoDelay(client_socket);
+                // OpenSSL does its own reads and writes on the socket.
+                conn->watcher.kind = IOWatcher::Polled;
+            }
+#endif
+            if (access_log) {
+                inet_ntop(AF_INET, &client_addr.sin_addr, conn->client_ip, INET_ADDRSTRLEN);
+            }
+            Connection* raw = conn.get();
+            conn->worker = &worker;
+            conn->socket = client_socket;
+            conn->serial = ++worker.next_serial;
+            conn->input.setPool(&worker.buffers);
+            conn->output.setPool(&worker.buffers);
+            conn->watcher.fd = client_socket;
+            conn->watcher.events = EventLoop::Readable;
+            conn->last_active = std::chrono::steady_clock::now();
+            conn->parser.setMaxBodySize(max_body_size);
+            conn->watcher.callback = [this, raw](uint32_t events) { onConnectionEvent(*raw, events); };
+            conn->timeout.callback = [this, raw]() { onTimeout(*raw); };
+            worker.loop->add(conn->watcher);
+            worker.connections[client_socket] = std::move(conn);
+            worker.metrics.accepts.add();
+            updateTimeout(*raw);
+            if constexpr (tracing_built) {
+                if (tracer) {
+                    raw->trace.accept_start = accept_start;
+                    raw->trace.accept_end = traceClock();
+                }
+            }
+        }
+    }
+
+    void onConnectionEvent(Connection& conn, uint32_t events) {
+        // Nothing is read while a handler runs, so only a dead socket gets here.
+        if (conn.waiting) {
+            if (events & EventLoop::Closed) {
+                closeConnection(conn);
+            }
+            return;
+        }
+#ifdef WEBSERVER_WITH_OPENSSL
+        if (conn.tls && !conn.tls->handshakeDone()) {
+            continueHandshake(conn);
+            updateTimeout(conn);
+            return;
+        }
+#endif
+        if (events & EventLoop::Readable) {
+            onReadable(conn);
+        }
+        if (!conn.closed && (events & EventLoop::Writable)) {
+            flushOutput(conn);
+        }
+        updateTimeout(conn);
+    }
+
+    // Points conn.timeout at the limit for what the connection is doing:
+    // none while its own handler or stream producer has the next move;
+    // otherwise the write timeout while output is queued, the body timeout
+    // between reads of a body, the header timeout from the first byte of
+    // a head (however slowly the rest trickles in), and the keep-alive
+    // timeout between requests. An HTTP/2 connection counts as writing
+    // while the client holds its windows shut, as receiving while any
+    // stream's body is still coming, and as idle with no streams open.
+    void updateTimeout(Connection& conn) {
+        if (conn.closed) return;
+        Deadline deadline;
+        if (conn.h2) {
+            Http2Session& h2 = *conn.h2;
+            deadline = !conn.output.empty() || h2.blocked() ? WriteDeadline
+                       : h2.awaitingPreface()              ? HeaderDeadline
+                       : h2.receiving()                    ? BodyDeadline
+                       : h2.idle()                         ? IdleDeadline
+                                                           : NoDeadline;
+        } else if (conn.waiting || (conn.stream && conn.output.empty())) {
+            deadline = NoDeadline;
+        } else if (!conn.output.empty()) {
+            deadline = WriteDeadline;
+        } else if (conn.parser.headComplete()) {
+            deadline = BodyDeadline;
+        } else if (!conn.input.empty() || conn.requests_served == 0) {
+            deadline = HeaderDeadline;
+        } else {
+            deadline = IdleDeadline;
+        }
+
+        EventLoop& loop = *conn.worker->loop;
+        if (deadline == NoDeadline) {
+            loop.cancel(conn.timeout);
+        } else if (deadline == HeaderDeadline) {
+            if (conn.deadline != HeaderDeadline) conn.head_start = conn.last_active;
+            loop.schedule(conn.timeout, conn.head_start + header_timeout);
+        } else {
+            std::chrono::milliseconds limit = deadline == WriteDeadline  ? write_timeout
+                                              : deadline == BodyDeadline ? body_timeout
+                                                                         : keep_alive_timeout;
+            loop.schedule(conn.timeout, conn.last_active + limit);
+        }
+        conn.deadline = deadline;
+    }
+
+    void onTimeout(Connection& conn) {
+        Deadline deadline = conn.deadline;
+        conn.deadline = NoDeadline;
+        WorkerMetrics& metrics = conn.worker->metrics;
+        switch (deadline) {
+        case IdleDeadline: metrics.idle_timeouts.add(); break;
+        case HeaderDeadline: metrics.header_timeouts.add(); break;
+        case BodyDeadline: metrics.body_timeouts.add(); break;
+        case WriteDeadline: metrics.write_timeouts.add(); break;
+        case NoDeadline: return;
+        }
+        // HTTP/2 clients get a GOAWAY instead; streams still open are cut off.
+        if (conn.h2 && deadline != WriteDeadline) {
+            conn.h2->closeAll();
+            conn.h2->goAway(Http2Session::NoError);
+            conn.close_after_write = true;
+            flushOutput(conn);
+            updateTimeout(conn);
+            return;
+        }
+        // A client part way through a request is told why it is cut off.
+        if ((deadline == HeaderDeadline && !conn.input.empty()) || deadline == BodyDeadline) {
+            respondWithError(conn, 408);
+            flushOutput(conn);
+            updateTimeout(conn);
+            return;
+        }
+        if (deadline == WriteDeadline) {
+            // Reset rather than leave the kernel retrying what this client will not take.
+            linger reset{1, 0};
+            setsockopt(conn.socket, SOL_SOCKET, SO_LINGER, (const char*)&reset, sizeof(reset));
+        }
+        closeConnection(conn);
+    }
+
+#ifdef WEBSERVER_WITH_OPENSSL
+    // Runs until the handshake completes (the header timeout bounds it),
+    // then reads whatever request came along with the client's Finished.
+    void continueHandshake(Connection& conn) {
+        TLSConnection& tls = *conn.tls;
+        WorkerMetrics& metrics = conn.worker->metrics;
+        switch (tls.handshake()) {
+        case TLSConnection::WantRead:
+            conn.worker->loop->modify(conn.watcher, EventLoop::Readable);
+            return;
+        case TLSConnection::WantWrite:
+            conn.worker->loop->modify(conn.watcher, EventLoop::Writable);
+            return;
+        case TLSConnection::Failed:
+            metrics.tls_failures.add();
+            closeConnection(conn);
+            return;
+        case TLSConnection::Done:
+            break;
+        }
+        conn.last_active = std::chrono::steady_clock::now();
+        metrics.tls_handshakes.add();
+        if (tls.resumed()) metrics.tls_resumptions.add();
+        if (tls.kernelSend()) metrics.ktls_connections.add();
+        if (http2 && tls.negotiatedHttp2()) startHttp2(conn);
+        conn.worker->loop->modify(conn.watcher, EventLoop::Readable);
+        onReadable(conn);
+    }
+#endif
+
+#ifdef WEBSERVER_HAVE_IO_URING
+    // The worker's io_uring does the connection's reads and writes.
+    static bool ringIO(const Connection& conn) {
+        return conn.watcher.kind == IOWatcher::Stream && conn.worker->loop->usingIoUring();
+    }
+#endif
+
+    // recv() on the connection, decrypting when it is TLS, or what the
+    // ring received. Returns -1 with would_block set when nothing is
+    // available yet.
+    static long receive(Connection& conn, char* buffer, size_t size, bool& would_block) {
+#ifdef WEBSERVER_WITH_OPENSSL
+        if (conn.tls) return conn.tls->read(buffer, size, would_block);
+#endif
+#ifdef WEBSERVER_HAVE_IO_URING
+        if (ringIO(conn)) return conn.worker->loop->receive(conn.watcher, buffer, size, would_block);
+#endif
+        long result = recv(conn.socket, buffer, (int)size, 0);
+        would_block = result < 0 && socketWouldBlock();
+        return result;
+    }
+
+    // Bytes already taken off the socket that nothing would wake us for.
+    static bool hasBufferedInput(const Connection& conn) {
+#ifdef WEBSERVER_WITH_OPENSSL
+        return conn.tls && conn.tls->hasBuffered();
+#else
+        (void)conn;
+        return false;
+#endif
+    }
+
+    void onReadable(Connection& conn) {
+        bool peer_closed = false;
+        size_t read_total = 0;
+        uint64_t read_start = 0;
+        if constexpr (tracing_built) {
+            if (tracer) read_start = traceClock();
+        }
+
+        while (read_total < max_read_per_event || hasBufferedInput(conn)) {
+            size_t available;
+            char* tail = conn.input.tail(read_chunk_size, available);
+            bool would_block;
+            long bytes_received = receive(conn, tail, available, would_block);
+            if (bytes_received > 0) {
+                conn.input.commit(bytes_received);
+                read_total += bytes_received;
+                conn.worker->metrics.bytes_received.add(bytes_received);
+                // Hand streamed bodies over as they arrive rather than buffering the upload.
+                if (conn.streaming && conn.input.size() >= stream_batch_size) {
+                    processInput(conn);
+                }
+                continue;
+            }
+            if (would_block) {
+                break;
+            }
+            if (bytes_received < 0) {
+                conn.worker->metrics.connection_errors.add();
+            }
+            peer_closed = true;
+            break;
+        }
+        conn.last_active = std::chrono::steady_clock::now();
+        if constexpr (tracing_built) {
+            if (tracer && read_total > 0) {
+                conn.trace.read_start = read_start;
+                conn.trace.read_end = traceClock();
+            }
+        }
+
+        processInput(conn);
+        // A half-closed peer may still be waiting for answers to what it sent.
+        if (peer_closed) {
+            conn.close_after_write = true;
+        }
+
+        // Requests pipelined behind a streamed response wait in the buffer; stop
+        // reading once it holds as much as the output queue may.
+        if (conn.stream && conn.input.size() >= max_pending_output) {
+            conn.worker->loop->modify(conn.watcher, conn.watcher.events & EventLoop::Writable);
+        }
+
+        // HTTP/2 frames such as WINDOW_UPDATE free output without adding any.
+        if (!conn.output.empty() || conn.h2) {
+            flushOutput(conn);
+            return;
+        }
+        if (peer_closed && !conn.waiting) {
+            closeConnection(conn);
+        }
+    }
+
+    // Answers every complete request at the front of conn.input, appending
+    // the responses in order so pipelined requests go out in one send().
+    void processInput(Connection& conn) {
+        if (!conn.h2 && http2 && conn.requests_served == 0 && !conn.parser.headComplete() && !conn.input.empty()) {
+            // A client with prior knowledge opens with the connection preface.
+            std::string_view start(conn.input.data(), std::min(conn.input.size(), Http2Session::preface.size()));
+            if (Http2Session::preface.substr(0, start.size()) == start) {
+                if (start.size() < Http2Session::preface.size()) return;
+                startHttp2(conn);
+            }
+        }
+        if (conn.h2) {
+            processHttp2(conn);
+            return;
+        }
+
+        size_t offset = 0;
+        while (!conn.close_after_write && !conn.waiting && !conn.stream && offset < conn.input.size() &&
+               conn.output.size() < max_pending_output) {
+            HTTPRequest& request = conn.request;
+            HTTPRequestParser& parser = conn.parser;
+            char* data = conn.input.data() + offset;
+            size_t size = conn.input.size() - offset;
+            HTTPRequestParser::Result result;
+
+            if constexpr (tracing_built) {
+                if (conn.trace.decided && conn.trace.read_end != 0) traceReads(conn);
+            }
+            if (!parser.headComplete()) {
+                if ((metrics_enabled || access_log) && !conn.timing) {
+                    conn.timing = true;
+                    conn.request_start = std::chrono::steady_clock::now();
+                }
+                if constexpr (tracing_built) {
+                    if (tracer && !conn.trace.decided) startTrace(conn);
+                }
+                result = parser.parseHead(data, size, request);
+                if (result == HTTPRequestParser::Incomplete) {
+                    break;
+                }
+                if (result == HTTPRequestParser::Error) {
+                    rejectRequest(conn, parser.errorStatus());
+                    return;
+                }
+                if (!beginRequest(conn)) {
+                    return;
+                }
+            }
+
+            HTTPResponse& response = conn.response;
+            response.reset();
+            if (conn.streaming) {
+                // The buffer may have moved since the head was parsed.
+                parser.bind(data, request);
+                bool path_found;
+                routes.find(request.method, request.path, request.params, path_found);
+                size_t used = 0;
+                BodyStream& stream = conn.body_stream;
+                bool failed = false;
+                result = parser.streamBody(data, size, used, [&](std::string_view chunk) {
+                    if (failed || !stream.on_data) return;
+                    try {
+                        stream.on_data(chunk);
+                    } catch (const std::exception& e) {
+                        std::cerr << "Handler error: " << e.what() << std::endl;
+                        failed = true;
+                    }
+                });
+                conn.input.erase(offset + parser.headSize(), used);
+                if (failed) {
+                    conn.worker->metrics.handler_errors.add();
+                    respondWithError(conn, 500);
+                    return;
+                }
+                if (result == HTTPRequestParser::Error) {
+                    rejectRequest(conn, parser.errorStatus());
+                    return;
+                }
+                if (result == HTTPRequestParser::Incomplete) {
+                    break;
+                }
+                markParsed(conn);
+                if (!runHandler(stream.on_complete, request, response)) {
+                    conn.worker->metrics.handler_errors.add();
+                }
+            } else {
+                result = parser.parseBody(data, size, request);
+                if (result == HTTPRequestParser::Error) {
+                    rejectRequest(conn, parser.errorStatus());
+                    return;
+                }
+                if (result == HTTPRequestParser::Incomplete) {
+                    break;
+                }
+                markParsed(conn);
+                if (upgradeToHttp2(conn)) {
+                    // The request is answered as stream 1.
+                } else if (usesCache(conn.route, request)) {
+                    runCached(conn, nullptr, std::string_view(data, parser.consumed()), conn.route, request, response,
+                              conn.handler_start);
+                } else if (overloaded(*conn.worker, conn.route)) {
+                    shedRequest(conn, response);
+                } else if (!handOff(conn, std::string_view(data, parser.consumed())) &&
+                           !dispatch(conn.route, request, response)) {
+                    conn.worker->metrics.handler_errors.add();
+                }
+            }
+
+            offset += parser.consumed();
+            parser.reset();
+            conn.route = nullptr;
+            conn.body_stream = BodyStream();
+            conn.streaming = false;
+            if (conn.h2) {
+                break;
+            }
+            if (!conn.waiting) {
+                finishRequest(conn, request, response);
+            }
+        }
+        conn.request.clear();
+        conn.input.erase(0, offset);
+        // Idle connections hold no receive buffer; the pool lends it out again.
+        if (conn.input.empty()) {
+            conn.input.release();
+        }
+        // What follows an h2c upgrade is the client's preface.
+        if (conn.h2) {
+            processHttp2(conn);
+        }
+    }
+
+    // Decides whether the connection stays open and queues the response.
+    void finishRequest(Connection& conn, const HTTPRequest& request, HTTPResponse& response) {
+        uint64_t serialize_start = 0;
+        if constexpr (tracing_built) {
+            if (conn.trace.id != 0) serialize_start = tracePhase(conn, TraceSpan::Serialize);
+        }
+        conn.requests_served++;
+        bool keep_alive = running && !conn.close_after_write && wantsKeepAlive(request) &&
+                          conn.requests_served < max_requests_per_connection;
+        bool chunked = false;
+        if (response.stream) {
+            if (response.stream->length != HTTPResponse::unknown_length) {
+                response.headers.set("Content-Length", response.stream->length);
+            } else if (request.version == "HTTP/1.1") {
+                response.headers.set("Transfer-Encoding", "chunked");
+                chunked = true;
+            } else {
+                // Nothing else can mark the end of the body for an HTTP/1.0 client.
+                keep_alive = false;
+            }
+        }
+        if (!keep_alive) {
+            response.headers["Connection"] = "close";
+            conn.close_after_write = true;
+        } else if (request.version == "HTTP/1.0") {
+            response.headers["Connection"] = "keep-alive";
+        }
+        if (compression) {
+            compressResponse(conn.worker->compressor, request, response);
+        }
+        bool head_only = request.method == "HEAD";
+        size_t body_bytes = head_only ? 0
+                            : !response.stream ? response.bodySize()
+                                               : response.stream->length;
+        queueResponse(conn, response, head_only);
+        conn.worker->metrics.countStatus(response.status_code);
+        if constexpr (tracing_built) {
+            if (conn.trace.id != 0) {
+                uint64_t queued = traceClock();
+                traceSpan(*conn.worker, TraceSpan::Serialize, conn.trace.id, traceTrack(conn), serialize_start, queued);
+                conn.traced_unsent.push_back(
+                    requestSpan(conn.trace.id, traceTrack(conn), conn.trace.start, queued, request, response.status_code));
+            }
+            conn.trace.id = 0;
+            conn.trace.decided = false;
+        }
+        if (conn.timing) {
+            auto now = std::chrono::steady_clock::now();
+            if (metrics_enabled) {
+                conn.worker->metrics.routes[conn.metrics_slot].handler.record(now - conn.handler_start);
+                conn.unsent.emplace_back(conn.metrics_slot, now);
+            }
+            if (access_log) {
+                logAccess(conn, &request, response.status_code, body_bytes, now - conn.request_start);
+            }
+            conn.timing = false;
+        }
+        if (response.stream) {
+            bool no_body = head_only || response.status_code == 204 || response.status_code == 304;
+            startStreaming(conn, std::move(response.stream), chunked, no_body);
+        }
+    }
+
+    // The request is complete: its parse phase ends and its handler's begins.
+    void markParsed(Connection& conn) {
+        if constexpr (tracing_built) {
+            if (conn.trace.id != 0) tracePhase(conn, TraceSpan::Handler);
+        }
+        if (!conn.timing || !metrics_enabled) return;
+        conn.handler_start = std::chrono::steady_clock::now();
+        conn.worker->metrics.routes[conn.metrics_slot].parse.record(conn.handler_start - conn.request_start);
+    }
+
+    // Tracing hooks. Their callers sit behind if constexpr (tracing_built).
+
+    static uint64_t traceTrack(const Connection& conn, uint32_t stream_id = 0) {
+        return conn.serial << 32 | stream_id;
+    }
+
+    static void traceSpan(Worker& worker, const TraceSpan& span) {
+        TraceSpan* slot = worker.trace_ring->reserve();
+        if (slot == nullptr) return;
+        *slot = span;
+        slot->worker = (uint32_t)worker.index;
+        worker.trace_ring->commit();
+    }
+
+    static void traceSpan(Worker& worker, TraceSpan::Phase phase, uint64_t id, uint64_t track, uint64_t start,
+                          uint64_t end) {
+        TraceSpan span;
+        span.trace_id = id;
+        span.track = track;
+        span.start = start;
+        span.end = end;
+        span.status = 0;
+        span.phase = phase;
+        span.label_size = 0;
+        traceSpan(worker, span);
+    }
+
+    // The span covering a whole request, labelled with its request line.
+    static TraceSpan requestSpan(uint64_t id, uint64_t track, uint64_t start, uint64_t end, const HTTPRequest& request,
+                                 int status) {
+        TraceSpan span;
+        span.trace_id = id;
+        span.track = track;
+        span.start = start;
+        span.end = end;
+        span.status = (uint16_t)status;
+        span.phase = TraceSpan::Request;
+        size_t used = 0;
+        auto put = [&](std::string_view text) {
+            size_t count = std::min(text.size(), sizeof(span.label) - used);
+            memcpy(span.label + used, text.data(), count);
+            used += count;
+        };
+        put(request.method);
+        put(" ");
+        put(request.path);
+        if (!request.query.empty()) {
+            put("?");
+            put(request.query);
+        }
+        span.label_size = (uint8_t)used;
+        return span;
+    }
+
+    // Decides whether the request starting on conn is traced. A traced
+    // one takes the connection's accept(), if no request has yet, and
+    // the reads that brought its first bytes; either way they are used up.
+    void startTrace(Connection& conn) {
+        Worker& worker = *conn.worker;
+        RequestTrace& trace = conn.trace;
+        uint64_t now = traceClock();
+        trace.decided = true;
+        trace.id = tracer->sample(worker.trace_sample) ? tracer->newTraceId(worker.index, worker.trace_sequence) : 0;
+        trace.phase = TraceSpan::Parse;
+        trace.start = trace.mark = now;
+        if (trace.id != 0 && trace.read_end != 0) {
+            trace.start = trace.read_start;
+            traceReads(conn);
+        }
+        if (trace.id != 0 && trace.accept_end != 0) {
+            trace.start = trace.accept_start;
+            traceSpan(worker, TraceSpan::Accept, trace.id, traceTrack(conn), trace.accept_start, trace.accept_end);
+        }
+        trace.read_end = 0;
+        trace.accept_end = 0;
+    }
+
+    // The reads of the last readable event, for the request being received.
+    void traceReads(Connection& conn) {
+        RequestTrace& trace = conn.trace;
+        if (trace.id != 0) {
+            traceSpan(*conn.worker, TraceSpan::Receive, trace.id, traceTrack(conn), trace.read_start, trace.read_end);
+        }
+        trace.read_end = 0;
+    }
+
+    // Ends the running phase of the traced request now and starts next.
+    uint64_t tracePhase(Connection& conn, TraceSpan::Phase next) {
+        RequestTrace& trace = conn.trace;
+        uint64_t now = traceClock();
+        traceSpan(*conn.worker, trace.phase, trace.id, traceTrack(conn), trace.mark, now);
+        trace.phase = next;
+        trace.mark = now;
+        return now;
+    }
+
+    // Ends the request's trace early, at an error page or an h2c upgrade,
+    // where the request line may be all there is to label it with.
+    void endTrace(Connection& conn, int status) {
+        RequestTrace& trace = conn.trace;
+        if (trace.id != 0) {
+            uint64_t now = tracePhase(conn, TraceSpan::Request);
+            traceSpan(*conn.worker, requestSpan(trace.id, traceTrack(conn), trace.start, now, conn.request, status));
+        }
+        trace.id = 0;
+        trace.decided = false;
+    }
+
+    // The traced responses queued on conn are all written.
+    void traceSent(Connection& conn) {
+        uint64_t now = traceClock();
+        for (TraceSpan& span : conn.traced_unsent) {
+            traceSpan(*conn.worker, TraceSpan::Send, span.trace_id, span.track, span.end, now);
+            span.end = now;
+            traceSpan(*conn.worker, span);
+        }
+        conn.traced_unsent.clear();
+    }
+
+    // dispatchStream()'s startTrace(): a stream's reads are the
+    // connection's, so only its parse phase, from the stream opening, and
+    // the connection's accept() are recorded.
+    void startStreamTrace(Connection& conn, Http2Session::Stream& stream) {
+        Worker& worker = *conn.worker;
+        uint64_t now = traceClock();
+        if (tracer->sample(worker.trace_sample)) {
+            stream.trace_id = tracer->newTraceId(worker.index, worker.trace_sequence);
+            uint64_t track = traceTrack(conn, stream.id);
+            traceSpan(worker, TraceSpan::Parse, stream.trace_id, track, stream.trace_start, now);
+            if (conn.trace.accept_end != 0) {
+                traceSpan(worker, TraceSpan::Accept, stream.trace_id, track, conn.trace.accept_start,
+                          conn.trace.accept_end);
+                stream.trace_start = conn.trace.accept_start;
+            }
+        }
+        stream.trace_mark = now;
+        conn.trace.accept_end = 0;
+    }
+
+    // Gives the connection's output over to a streamed body once its head
+    // is queued. What the handler wrote so far goes right behind it.
+    void startStreaming(Connection& conn, std::shared_ptr<ResponseStream> stream, bool chunked, bool no_body) {
+        if (no_body) {
+            stream->detach(false);
+            return;
+        }
+        Worker* worker = conn.worker;
+        SOCKET socket = conn.socket;
+        uint64_t serial = conn.serial;
+        // Writes only schedule the flush, so a burst of them costs one send().
+        stream->attach(chunked ? ResponseStream::Chunked : ResponseStream::Raw, &conn.output,
+                       [this, worker, socket, serial]() {
+                           worker->loop->defer([this, worker, socket, serial]() { flushStream(*worker, socket, serial); });
+                       });
+        conn.stream = std::move(stream);
+        queueStreamOutput(conn);
+    }
+
+    void queueStreamOutput(Connection& conn) {
+        if (!conn.stream->hasPending()) return;
+        std::string data = conn.output.takeBuffer();
+        conn.stream->takePending(data);
+        conn.output.push(std::move(data));
+    }
+
+    // Sends what a streamed response's handler wrote during this loop
+    // iteration, if the connection is still there.
+    void flushStream(Worker& worker, SOCKET socket, uint64_t serial) {
+        auto it = worker.connections.find(socket);
+        if (it == worker.connections.end() || it->second->serial != serial) return;
+        Connection& conn = *it->second;
+        if (!conn.stream && !conn.h2) return;
+        if (conn.stream) queueStreamOutput(conn);
+        flushOutput(conn);
+        updateTimeout(conn);
+    }
+
+    // Everything written so far is sent: let the producer write more.
+    void drainStream(Connection& conn) {
+        std::function<void()> callback = conn.stream->on_drain;
+        if (!callback) return;
+        try {
+            callback();
+        } catch (const std::exception& e) {
+            // The head is long gone, so there is no way left to report it.
+            std::cerr << "Handler error: " << e.what() << std::endl;
+            closeConnection(conn);
+        }
+    }
+
+    // Switches the connection to HTTP/2 and queues the server preface.
+    void startHttp2(Connection& conn) {
+        setNoDelay(conn.socket);
+        conn.h2.reset(new Http2Session(max_body_size));
+        // A stream's producer is let go once the stream is done with it.
+        conn.h2->on_close = [](Http2Session::Stream& stream, bool aborted) {
+            if (stream.producer) stream.producer->detach(aborted);
+        };
+        conn.h2->start();
+        conn.worker->metrics.http2_connections.add();
+    }
+
+    // An HTTP/1.1 request asking to go on in h2c (RFC 7540, 3.2): the 101
+    // goes out, then the server preface, and the request is answered as
+    // stream 1. TLS connections choose HTTP/2 by ALPN instead.
+    bool upgradeToHttp2(Connection& conn) {
+        const HTTPRequest& request = conn.request;
+        if (!http2 || tlsEnabled() || request.version != "HTTP/1.1" ||
+            !hasToken(request.headers.get(HTTPHeaders::Upgrade), "h2c") ||
+            !hasToken(request.headers.get(HTTPHeaders::Connection), "HTTP2-Settings")) {
+            return false;
+        }
+        std::string settings;
+        auto header = request.headers.find("HTTP2-Settings");
+        if (header == request.headers.end() || !decodeBase64Url(header->second, settings) || settings.size() % 6 != 0) {
+            return false;
+        }
+        conn.output.push(std::string_view("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"));
+        startHttp2(conn);
+        conn.h2->applySettings(settings);
+        conn.h2->upgrade(request);
+        conn.timing = false;
+        if constexpr (tracing_built) {
+            // The request goes on as stream 1, which is traced on its own.
+            endTrace(conn, 101);
+        }
+        return true;
+    }
+
+    // Whether a comma-separated header value lists token, ignoring case.
+    static bool hasToken(std::string_view list, std::string_view token) {
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string_view item = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            size_t first = item.find_first_not_of(" \t");
+            if (first == std::string_view::npos) continue;
+            item = item.substr(first, item.find_last_not_of(" \t") - first + 1);
+            if (equalsIgnoreCase(item, token)) return true;
+        }
+        return false;
+    }
+
+    // Feeds conn.input to the HTTP/2 session and answers the streams whose
+    // requests it completed. Like pipelined HTTP/1 requests, frames wait
+    // in the buffer while max_pending_output is still unsent.
+    void processHttp2(Connection& conn) {
+        Http2Session& h2 = *conn.h2;
+        if (conn.output.size() + h2.output.size() >= max_pending_output) return;
+        if (!conn.input.empty()) {
+            conn.input.erase(0, h2.receive(conn.input.data(), conn.input.size()));
+            if (conn.input.empty()) {
+                conn.input.release();
+            }
+        }
+        std::vector<uint32_t> ready;
+        ready.swap(h2.ready());
+        for (uint32_t id : ready) {
+            Http2Session::Stream* stream = h2.find(id);
+            if (stream != nullptr) dispatchStream(conn, *stream);
+        }
+    }
+
+    // Runs the route for a stream whose request is complete. Routes that
+    // stream request bodies get the whole body in one piece, since the
+    // session has already buffered it.
+    void dispatchStream(Connection& conn, Http2Session::Stream& stream) {
+        Worker& worker = *conn.worker;
+        worker.metrics.http2_streams.add();
+        HTTPRequest& request = stream.request;
+        HTTPResponse& response = conn.response;
+        response.reset();
+        std::chrono::steady_clock::time_point handler_start = std::chrono::steady_clock::now();
+        if constexpr (tracing_built) {
+            if (tracer) startStreamTrace(conn, stream);
+        }
+        if (stream.status != 0) {
+            worker.metrics.parse_errors.add();
+            setErrorPage(response, stream.status);
+            respondStream(conn, stream, request, response, 0, handler_start);
+            return;
+        }
+
+        const Route* route = findRoute(request);
+        if constexpr (tracing_built) {
+            if (stream.trace_id != 0) {
+                uint64_t now = traceClock();
+                traceSpan(worker, TraceSpan::Route, stream.trace_id, traceTrack(conn, stream.id), stream.trace_mark, now);
+                stream.trace_mark = now;
+            }
+        }
+        size_t slot = route != nullptr ? route->metrics_slot : 0;
+        if (metrics_enabled) {
+            worker.metrics.routes[slot].parse.record(handler_start - stream.start);
+        }
+        if (route != nullptr && route->proxy) {
+            if (proxyStream(conn, stream, *route, handler_start)) return;
+            setErrorPage(response, 502);
+        } else if (route != nullptr && route->stream_handler) {
+            bool ok;
+            try {
+                BodyStream body_stream = route->stream_handler(request);
+                if (body_stream.on_data && !request.body.empty()) body_stream.on_data(request.body);
+                ok = runHandler(body_stream.on_complete, request, response);
+            } catch (const std::exception& e) {
+                std::cerr << "Handler error: " << e.what() << std::endl;
+                setInternalError(response);
+                ok = false;
+            }
+            if (!ok) worker.metrics.handler_errors.add();
+        } else if (usesCache(route, request)) {
+            if (runCached(conn, &stream, std::string_view(), route, request, response, handler_start)) return;
+        } else if (overloaded(worker, route)) {
+            shedRequest(conn, response);
+        } else if (runsOffLoop(route)) {
+            handOffStream(conn, stream, route, handler_start);
+            return;
+        } else if (!dispatch(route, request, response)) {
+            worker.metrics.handler_errors.add();
+        }
+        respondStream(conn, stream, request, response, slot, handler_start);
+    }
+
+    // Like handOff(), but the connection goes on serving its other streams.
+    void handOffStream(Connection& conn, Http2Session::Stream& stream, const Route* route,
+                       std::chrono::steady_clock::time_point handler_start, std::string cache_key = std::string()) {
+        std::shared_ptr<Completion> job = std::make_shared<Completion>();
+        job->socket = conn.socket;
+        job->serial = conn.serial;
+        job->stream_id = stream.id;
+        job->metrics_slot = route->metrics_slot;
+        job->handler_start = handler_start;
+        job->route = route;
+        job->cache_key = std::move(cache_key);
+        // A copy, since the client may reset the stream while the handler runs.
+        job->request.assign(stream.request);
+        startJob(conn.worker, route, std::move(job));
+    }
+
+    // finishRequest() for an HTTP/2 stream. A streamed body's producer is
+    // attached to the stream, and its writes schedule a flush as they do
+    // over HTTP/1.
+    void respondStream(Connection& conn, Http2Session::Stream& stream, const HTTPRequest& request,
+                       HTTPResponse& response, size_t metrics_slot,
+                       std::chrono::steady_clock::time_point handler_start) {
+        Worker& worker = *conn.worker;
+        uint64_t serialize_start = 0;
+        uint64_t trace_id = stream.trace_id;
+        if constexpr (tracing_built) {
+            if (trace_id != 0) {
+                serialize_start = traceClock();
+                traceSpan(worker, TraceSpan::Handler, trace_id, traceTrack(conn, stream.id), stream.trace_mark,
+                          serialize_start);
+            }
+        }
+        if (compression) {
+            compressResponse(worker.compressor, request, response);
+        }
+        int status = response.status_code;
+        bool no_body = request.method == "HEAD" || status == 204 || status == 304;
+        size_t body_bytes = no_body ? 0 : !response.stream ? response.bodySize() : response.stream->length;
+        worker.metrics.countStatus(status);
+        if (metrics_enabled || access_log) {
+            auto now = std::chrono::steady_clock::now();
+            if (metrics_enabled) worker.metrics.routes[metrics_slot].handler.record(now - handler_start);
+            if (access_log) logAccess(conn, &request, status, body_bytes, now - stream.start);
+        }
+        if (response.stream) {
+            std::shared_ptr<ResponseStream> producer = std::move(response.stream);
+            if (producer->length != HTTPResponse::unknown_length) {
+                response.headers.set("Content-Length", producer->length);
+            }
+            if (no_body) {
+                producer->detach(false);
+            } else {
+                Worker* owner = conn.worker;
+                SOCKET socket = conn.socket;
+                uint64_t serial = conn.serial;
+                producer->attach(ResponseStream::Raw, nullptr, [this, owner, socket, serial]() {
+                    owner->loop->defer([this, owner, socket, serial]() { flushStream(*owner, socket, serial); });
+                });
+                stream.producer = std::move(producer);
+            }
+        }
+        // Made first: the stream, and the request with it, may be gone once responded.
+        TraceSpan request_span{};
+        if constexpr (tracing_built) {
+            if (trace_id != 0) {
+                request_span = requestSpan(trace_id, traceTrack(conn, stream.id), stream.trace_start, 0, request, status);
+            }
+        }
+        conn.h2->respond(stream, response, no_body);
+        if constexpr (tracing_built) {
+            if (trace_id != 0) {
+                request_span.end = traceClock();
+                traceSpan(worker, TraceSpan::Serialize, trace_id, request_span.track, serialize_start, request_span.end);
+                traceSpan(worker, request_span);
+            }
+        }
+    }
+
+    // Moves the session's frames to the socket, framing queued bodies as
+    // fast as the socket, the client's windows and max_pending_output
+    // allow. A streamed body is taken from its producer only when the
+    // stream has little left queued, so ResponseStream::write() still
+    // pushes back on a handler that outruns the client.
+    void flushHttp2(Connection& conn) {
+        Http2Session& h2 = *conn.h2;
+        OutputQueue::FlushResult result = OutputQueue::Done;
+        while (true) {
+            h2.forEachStream([&h2](Http2Session::Stream& stream) {
+                ResponseStream* producer = stream.producer.get();
+                if (producer == nullptr || !producer->hasPending() || stream.queuedBytes() >= stream_batch_size) return;
+                std::string data;
+                producer->takePending(data);
+                h2.queueData(stream, data, producer->finished());
+            });
+            if (conn.output.size() < max_pending_output) {
+                h2.produce(max_pending_output - conn.output.size());
+            }
+            if (!h2.output.empty()) {
+                std::string frames = conn.output.takeBuffer();
+                frames.swap(h2.output);
+                conn.output.push(std::move(frames));
+            }
+            if (conn.output.empty()) break;
+            result = sendOutput(conn);
+            if (result != OutputQueue::Done) break;
+        }
+        if (result == OutputQueue::Failed) {
+            conn.worker->metrics.connection_errors.add();
+            closeConnection(conn);
+            return;
+        }
+
+        bool reading = !conn.close_after_write && !h2.hasFailed() && conn.output.size() < max_pending_output;
+        if (result == OutputQueue::Blocked) {
+            conn.worker->loop->modify(conn.watcher, EventLoop::Writable | (reading ? EventLoop::Readable : 0));
+            return;
+        }
+        // A client that sent GOAWAY or hung up still gets its open streams answered.
+        if (h2.hasFailed() || ((conn.close_after_write || h2.peerGoingAway()) && h2.idle())) {
+            closeConnection(conn);
+            return;
+        }
+        conn.worker->loop->modify(conn.watcher, reading ? EventLoop::Readable : 0);
+        drainProducers(conn);
+
+        // Frames held back while the output was over its limit.
+        if (reading && !conn.input.empty()) {
+            processHttp2(conn);
+        }
+        if (!h2.output.empty()) {
+            flushHttp2(conn);
+        }
+    }
+
+    // drainStream() for each stream whose producer has had everything it
+    // wrote sent.
+    void drainProducers(Connection& conn) {
+        std::vector<std::pair<uint32_t, std::function<void()>>> callbacks;
+        conn.h2->forEachStream([&callbacks](Http2Session::Stream& stream) {
+            ResponseStream* producer = stream.producer.get();
+            if (producer != nullptr && producer->on_drain && !producer->ended() && !producer->hasPending() &&
+                stream.queuedBytes() == 0) {
+                callbacks.emplace_back(stream.id, producer->on_drain);
+            }
+        });
+        for (const auto& callback : callbacks) {
+            try {
+                callback.second();
+            } catch (const std::exception& e) {
+                std::cerr << "Handler error: " << e.what() << std::endl;
+                Http2Session::Stream* stream = conn.h2->find(callback.first);
+                if (stream != nullptr) conn.h2->resetStream(*stream, Http2Session::InternalError);
+            }
+        }
+    }
+
+    // Response filter: replaces an in-memory body with the compressed form
+    // the client prefers. File and shared bodies pass through untouched;
+    // static files come with their own precompressed variants.
+    void compressResponse(ResponseCompressor& compressor, const HTTPRequest& request, HTTPResponse& response) {
+        if (response.file || response.shared_body || response.stream) return;
+        int status = response.status_code;
+        if (status < 200 || status == 204 || status == 206 || status == 304) return;
+        size_t size = response.body.size();
+        if (size < compress_min_size || size > compress_max_size) return;
+        if (response.headers.find("Content-Encoding") != response.headers.end() ||
+            response.headers.find("Transfer-Encoding") != response.headers.end() ||
+            response.headers.get("Cache-Control").find("no-transform") != std::string_view::npos ||
+            !isCompressibleType(response.headers.get("Content-Type"))) {
+            return;
+        }
+
+        // The body depends on Accept-Encoding from here on, compressed or not.
+        std::string_view vary = response.headers.get("Vary");
+        if (vary.empty()) {
+            response.headers.set("Vary", "Accept-Encoding");
+        } else if (vary != "*" && vary.find("Accept-Encoding") == std::string_view::npos) {
+            response.headers.set("Vary", std::string(vary) + ", Accept-Encoding");
+        }
+
+        ResponseCompressor::Coding coding = ResponseCompressor::negotiate(request.headers.get(HTTPHeaders::AcceptEncoding));
+        if (coding == ResponseCompressor::Identity || !compressor.compressInPlace(coding, response.body)) return;
+        response.headers.set("Content-Encoding", ResponseCompressor::name(coding));
+        response.headers.set("Content-Length", response.body.size());
+        // The bytes differ from the identity body, so a strong validator would lie.
+        std::string_view etag = response.headers.get("ETag");
+        if (!etag.empty() && etag.substr(0, 2) != "W/") {
+            response.headers.set("ETag", "W/" + std::string(etag));
+        }
+    }
+
+    // Media types match compressible_types entries exactly, by prefix
+    // ("text/") or by suffix ("+json"), ignoring parameters and case.
+    bool isCompressibleType(std::string_view content_type) const {
+        std::string_view media = content_type.substr(0, content_type.find(';'));
+        size_t last = media.find_last_not_of(" \t");
+        if (last == std::string_view::npos) return false;
+        media = media.substr(0, last + 1);
+        for (const std::string& type : compressible_types) {
+            if (type.empty()) continue;
+            if (type.back() == '/') {
+                if (media.size() > type.size() && equalsIgnoreCase(media.substr(0, type.size()), type)) return true;
+            } else if (type.front() == '+') {
+                if (media.size() > type.size() && equalsIgnoreCase(media.substr(media.size() - type.size()), type)) {
+                    return true;
+                }
+            } else if (equalsIgnoreCase(media, type)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool offloaded(const Route* route) const {
+        return route != nullptr && route->offload && handler_pool.running();
+    }
+
+    bool runsOffLoop(const Route* route) const {
+#ifdef WEBSERVER_HAVE_COROUTINES
+        if (route != nullptr && route->async_handler) return true;
+#endif
+        return offloaded(route);
+    }
+
+    // Inline handlers finish before the next request is read, so only
+    // requests that would wait on the handler pool or a coroutine are
+    // turned away: past the worker's in-flight cap, or while the pool's
+    // queue is over its depth limit.
+    bool overloaded(const Worker& worker, const Route* route) const {
+        if (!runsOffLoop(route)) return false;
+        if (max_inflight_requests != 0 && worker.inflight >= max_inflight_requests) return true;
+        return max_queue_depth != 0 && offloaded(route) && handler_pool.queued() >= max_queue_depth;
+    }
+
+    // A 503 in place of the handler's answer; the connection stays open.
+    void shedRequest(Connection& conn, HTTPResponse& response) {
+        conn.worker->metrics.shed_requests.add();
+        response.status_code = 503;
+        response.status_message = "Service Unavailable";
+        response.headers.set("Retry-After", (size_t)retry_after.count());
+        response.setContent("<html><body><h1>503 Service Unavailable</h1></body></html>");
+    }
+
+    // Gives the request to an offloaded or coroutine handler with its own
+    // copy of the bytes. The connection stops reading until the response
+    // comes back, which keeps answers to pipelined requests in order.
+    // Returns false when the route runs inline.
+    bool handOff(Connection& conn, std::string_view raw, std::string cache_key = std::string()) {
+        const Route* route = conn.route;
+        if (!runsOffLoop(route)) return false;
+
+        std::shared_ptr<Completion> job = std::make_shared<Completion>();
+        job->socket = conn.socket;
+        job->serial = conn.serial;
+        job->route = route;
+        job->cache_key = std::move(cache_key);
+        job->request.assign(conn.request, raw);
+        conn.waiting = true;
+        conn.worker->loop->modify(conn.watcher, 0);
+        startJob(conn.worker, route, std::move(job));
+        return true;
+    }
+
+    // Runs job on the handler pool or as a coroutine; completeJob() takes
+    // the response back on the worker's loop.
+    void startJob(Worker* worker, const Route* route, std::shared_ptr<Completion> job) {
+        worker->inflight++;
+        if (offloaded(route)) {
+            submitJob(worker, route, std::move(job));
+        }
+#ifdef WEBSERVER_HAVE_COROUTINES
+        else {
+            runAsyncHandler(route, worker, job);
+        }
+#endif
+    }
+
+    void submitJob(Worker* worker, const Route* route, std::shared_ptr<Completion> job) {
+        handler_pool.submit([route, worker, job]() {
+            job->failed = !runHandler(route->handler, job->request, job->response);
+            postCompletion(worker, job);
+        });
+    }
+
+    // Hands job to worker's loop from any thread.
+    static void postCompletion(Worker* worker, std::shared_ptr<Completion> job) {
+        {
+            std::lock_guard<std::mutex> lock(worker->completions_mutex);
+            worker->completions.push_back(std::move(job));
+        }
+        worker->loop->wakeup();
+    }
+
+#ifdef WEBSERVER_HAVE_COROUTINES
+    // Drives a coroutine handler on the worker's loop. The response is
+    // queued from a deferred call, so a handler that never suspends does
+    // not re-enter processInput().
+    DetachedTask runAsyncHandler(const Route* route, Worker* worker, std::shared_ptr<Completion> job) {
+        try {
+            co_await route->async_handler(job->request, job->response);
+        } catch (const std::exception& e) {
+            std::cerr << "Handler error: " << e.what() << std::endl;
+            setInternalError(job->response);
+            job->failed = true;
+        }
+        worker->loop->defer([this, worker, job]() { completeJob(*worker, *job); });
+    }
+#endif
+
+    // Sends the response of a handed-off request, unless its connection
+    // closed in the meantime.
+    void completeJob(Worker& worker, Completion& job) {
+        worker.inflight--;
+        if (!job.cache_key.empty()) {
+            // Others may be waiting on the fill even if this client left.
+            storeResponse(worker, *job.route->cache, job.cache_key, job.request, job.response);
+        }
+        auto it = worker.connections.find(job.socket);
+        if (it == worker.connections.end() || it->second->serial != job.serial) return;
+        Connection& conn = *it->second;
+        conn.last_active = std::chrono::steady_clock::now();
+        if (job.cache_wait) {
+            if (job.cached) {
+                ResponseCache::fill(job.response, *job.cached);
+            } else if (!offloaded(job.route)) {
+                job.failed = !dispatch(job.route, job.request, job.response);
+            }
+        }
+        if (job.failed) {
+            worker.metrics.handler_errors.add();
+        }
+        if (job.stream_id != 0) {
+            // The client may have reset the stream in the meantime.
+            Http2Session::Stream* stream = conn.h2->find(job.stream_id);
+            if (stream == nullptr) return;
+            respondStream(conn, *stream, job.request, job.response, job.metrics_slot, job.handler_start);
+        } else {
+            conn.waiting = false;
+            finishRequest(conn, job.request, job.response);
+        }
+        flushOutput(conn);
+        updateTimeout(conn);
+    }
+
+    // Queues the responses handler threads finished since the last poll().
+    void drainCompletions(Worker& worker) {
+        std::vector<std::shared_ptr<Completion>> done;
+        {
+            std::lock_guard<std::mutex> lock(worker.completions_mutex);
+            if (worker.completions.empty()) return;
+            done.swap(worker.completions);
+        }
+        for (const std::shared_ptr<Completion>& job : done) {
+            completeJob(worker, *job);
+        }
+    }
+
+    // GET and HEAD on a route added with addCachedRoute() go through its
+    // cache; other methods run the handler as usual.
+    static bool usesCache(const Route* route, const HTTPRequest& request) {
+        return route != nullptr && route->cache && (request.method == "GET" || request.method == "HEAD");
+    }
+
+    // Answers a request on a cached route: from the cache on a hit, by
+    // running the handler and storing its response on a miss, or, while
+    // another request fills the entry, once that one is done. Returns
+    // true when the answer comes later through completeJob(), as for a
+    // handed-off request; otherwise it is in response. A HEAD only reads
+    // the cache, since its handler need not produce the GET body.
+    bool runCached(Connection& conn, Http2Session::Stream* stream, std::string_view raw, const Route* route,
+                   HTTPRequest& request, HTTPResponse& response, std::chrono::steady_clock::time_point handler_start) {
+        Worker& worker = *conn.worker;
+        ResponseCache& cache = *route->cache;
+        std::string_view coding;
+        if (compression) {
+            coding = ResponseCompressor::name(ResponseCompressor::negotiate(request.headers.get(HTTPHeaders::AcceptEncoding)));
+        }
+        std::string key = cache.key(request, coding);
+        bool lead = request.method != "HEAD";
+        std::shared_ptr<const ResponseCache::Entry> entry;
+        ResponseCache::Result result;
+        while ((result = cache.lookup(key, lead, entry)) == ResponseCache::Wait) {
+            std::shared_ptr<Completion> job = std::make_shared<Completion>();
+            job->socket = conn.socket;
+            job->serial = conn.serial;
+            job->stream_id = stream != nullptr ? stream->id : 0;
+            job->metrics_slot = route->metrics_slot;
+            job->handler_start = handler_start;
+            job->route = route;
+            job->cache_wait = true;
+            if (stream != nullptr) {
+                job->request.assign(request);
+            } else {
+                job->request.assign(request, raw);
+            }
+            // An uncacheable answer leaves each waiter to run the handler itself.
+            Worker* owner = &worker;
+            ResponseCache::Waiter waiter = [this, owner, job](std::shared_ptr<const ResponseCache::Entry> filled) {
+                job->cached = std::move(filled);
+                if (!job->cached && offloaded(job->route)) {
+                    submitJob(owner, job->route, job);
+                } else {
+                    postCompletion(owner, job);
+                }
+            };
+            if (!cache.wait(key, std::move(waiter))) continue;
+            worker.metrics.cache_coalesced.add();
+            worker.inflight++;
+            if (stream == nullptr) {
+                conn.waiting = true;
+                worker.loop->modify(conn.watcher, 0);
+            }
+            return true;
+        }
+        if (result == ResponseCache::Hit) {
+            worker.metrics.cache_hits.add();
+            ResponseCache::fill(response, *entry);
+            return false;
+        }
+
+        worker.metrics.cache_misses.add();
+        if (result == ResponseCache::Fill) {
+            if (overloaded(worker, route)) {
+                cache.complete(key, nullptr);
+                shedRequest(conn, response);
+                return false;
+            }
+        } else {
+            key.clear();
+            if (overloaded(worker, route)) {
+                shedRequest(conn, response);
+                return false;
+            }
+        }
+        if (runsOffLoop(route)) {
+            if (stream != nullptr) {
+                handOffStream(conn, *stream, route, handler_start, std::move(key));
+            } else {
+                handOff(conn, raw, std::move(key));
+            }
+            return true;
+        }
+        if (!dispatch(route, request, response)) worker.metrics.handler_errors.add();
+        if (!key.empty()) storeResponse(worker, cache, key, request, response);
+        return false;
+    }
+
+    // Ends the fill a cache miss started, with the handler's response as
+    // it will be sent. The body moves into the entry and is shared from it.
+    void storeResponse(Worker& worker, ResponseCache& cache, const std::string& key, const HTTPRequest& request,
+                       HTTPResponse& response) {
+        if (compression) {
+            compressResponse(worker.compressor, request, response);
+        }
+        cache.complete(key, cache.makeEntry(response));
+    }
+
+    // Runs once the request head is parsed: picks the route and decides
+    // whether the body is buffered or streamed to the handler.
+    bool beginRequest(Connection& conn) {
+        HTTPRequest& request = conn.request;
+        uint64_t route_start = 0;
+        if constexpr (tracing_built) {
+            if (conn.trace.id != 0) route_start = traceClock();
+        }
+        conn.route = findRoute(conn.request);
+        if constexpr (tracing_built) {
+            if (conn.trace.id != 0) {
+                traceSpan(*conn.worker, TraceSpan::Route, conn.trace.id, traceTrack(conn), route_start, traceClock());
+            }
+        }
+        conn.metrics_slot = conn.route != nullptr ? conn.route->metrics_slot : 0;
+
+        if (conn.route != nullptr && conn.route->proxy) {
+            beginProxy(conn);
+            conn.streaming = true;
+        } else if (conn.route != nullptr && conn.route->stream_handler) {
+            try {
+                conn.body_stream = conn.route->stream_handler(request);
+            } catch (const std::exception& e) {
+                std::cerr << "Handler error: " << e.what() << std::endl;
+                conn.worker->metrics.handler_errors.add();
+                respondWithError(conn, 500);
+                return false;
+            }
+            conn.streaming = true;
+        } else if (!conn.parser.isChunked() && conn.parser.contentLength() > max_body_size) {
+            rejectRequest(conn, 413);
+            return false;
+        }
+
+        auto expect = request.headers.find(HTTPHeaders::Expect);
+        if (expect != request.headers.end() && conn.parser.hasBody() && request.version == "HTTP/1.1" &&
+            equalsIgnoreCase(expect->second, "100-continue")) {
+            conn.output.push(std::string_view("HTTP/1.1 100 Continue\r\n\r\n"));
+        }
+        return true;
+    }
+
+    // Reverse proxy. A proxied request is an exchange on an Upstream: the
+    // head goes into its output when the request head is parsed and the
+    // body follows as it arrives; the response head, once parsed, becomes
+    // the client's response, with a ResponseStream carrying the body. The
+    // client is not read while the backend is behind on the body, and the
+    // backend is not read while the client is behind on the response. The
+    // upstream side reaches the client only from its own events and
+    // deferred calls, never from inside processInput().
+
+    static int64_t steadyMillis(std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+    }
+
+    static bool backendUp(const ProxyBackend& backend, int64_t now) {
+        return backend.healthy.load(std::memory_order_relaxed) &&
+               backend.down_until.load(std::memory_order_relaxed) <= now;
+    }
+
+    // The backend the group's next request goes to, skipping those that
+    // are down; group.backends.size() when all of them are.
+    static size_t pickBackend(Worker& worker, const ProxyGroup& group) {
+        ProxyPool& pool = worker.proxy_pools[group.index];
+        size_t count = group.backends.size();
+        int64_t now = steadyMillis(std::chrono::steady_clock::now());
+        size_t best = count;
+        for (size_t i = 0; i < count; i++) {
+            size_t candidate = (pool.next + i) % count;
+            if (!backendUp(*group.backends[candidate], now)) continue;
+            if (group.options.balance == ProxyOptions::RoundRobin) {
+                best = candidate;
+                break;
+            }
+            // Ties go to the first in round-robin order, which spreads them.
+            if (best == count || pool.backends[candidate].active < pool.backends[best].active) best = candidate;
+        }
+        if (best != count) pool.next = best + 1;
+        return best;
+    }
+
+    // A backend that refused a connection sits out for health_interval.
+    static void markBackendDown(ProxyGroup& group, size_t index) {
+        ProxyBackend& backend = *group.backends[index];
+        int64_t now = steadyMillis(std::chrono::steady_clock::now());
+        int64_t until = now + group.options.health_interval.count();
+        if (backend.down_until.exchange(until, std::memory_order_relaxed) <= now) {
+            std::cerr << "Proxy backend " << backend.name << " refused a connection" << std::endl;
+        }
+    }
+
+    static void setBackendHealth(ProxyGroup& group, size_t index, bool healthy) {
+        ProxyBackend& backend = *group.backends[index];
+        if (healthy) backend.down_until.store(0, std::memory_order_relaxed);
+        if (backend.healthy.exchange(healthy, std::memory_order_relaxed) != healthy) {
+            std::cerr << "Proxy backend " << backend.name << (healthy ? " passed" : " failed") << " its health check"
+                      << std::endl;
+        }
+    }
+
+    // Sends every backend of group a health check, from the first
+    // worker's loop. A check still running from the last round is left
+    // to finish.
+    void checkBackends(Worker& worker, ProxyGroup& group) {
+        ProxyPool& pool = worker.proxy_pools[group.index];
+        for (size_t i = 0; i < group.backends.size(); i++) {
+            if (pool.backends[i].probing) continue;
+            pool.backends[i].probing = true;
+            Upstream* up = createUpstream(worker, group, i);
+            up->probe = true;
+            up->request_queued = true;
+            std::string head = up->output.takeBuffer();
+            head.append("GET ").append(group.options.health_path).append(" HTTP/1.1\r\nHost: ");
+            head.append(group.backends[i]->name).append("\r\nConnection: close\r\n\r\n");
+            up->output.push(std::move(head));
+            scheduleUpstream(*up);
+        }
+        worker.loop->schedule(pool.health_timer, std::chrono::steady_clock::now() + group.options.health_interval);
+    }
+
+    Upstream* createUpstream(Worker& worker, ProxyGroup& group, size_t backend) {
+        std::unique_ptr<Upstream> up(new Upstream());
+        Upstream* raw = up.get();
+        up->worker = &worker;
+        up->group = &group;
+        up->backend = backend;
+        up->id = ++worker.next_serial;
+        up->input.setPool(&worker.buffers);
+        up->output.setPool(&worker.buffers);
+        up->watcher.callback = [this, raw](uint32_t events) { onUpstreamEvent(*raw, events); };
+        up->timer.callback = [this, raw]() { onUpstreamTimeout(*raw); };
+        worker.upstreams[raw->id] = std::move(up);
+        return raw;
+    }
+
+    // Starts an exchange with a backend of group that is up, on one of
+    // its idle connections when the pool has any. nullptr when all are down.
+    Upstream* acquireUpstream(Worker& worker, ProxyGroup& group) {
+        size_t backend = pickBackend(worker, group);
+        if (backend == group.backends.size()) return nullptr;
+        worker.metrics.proxy_requests.add();
+        ProxyPool::Backend& pool = worker.proxy_pools[group.index].backends[backend];
+        pool.active++;
+        if (pool.idle.empty()) {
+            return createUpstream(worker, group, backend);
+        }
+        Upstream* up = pool.idle.back();
+        pool.idle.pop_back();
+        worker.loop->cancel(up->timer);
+        up->state = Upstream::Sending;
+        up->reused = true;
+        worker.metrics.upstream_reuses.add();
+        return up;
+    }
+
+    static Upstream* findUpstream(Worker& worker, uint64_t id) {
+        auto it = worker.upstreams.find(id);
+        return it != worker.upstreams.end() ? it->second.get() : nullptr;
+    }
+
+    // The client connection up answers, if it is still open.
+    static Connection* findClient(const Upstream& up) {
+        auto it = up.worker->connections.find(up.client);
+        if (it == up.worker->connections.end() || it->second->serial != up.client_serial) return nullptr;
+        return it->second.get();
+    }
+
+    // Hop-by-hop headers (RFC 9110, 7.6.1) describe one connection, not
+    // the message, and go no further than it.
+    static bool isHopByHop(std::string_view name) {
+        static const char* const names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE",
+                                            "Trailer",    "Transfer-Encoding", "Upgrade"};
+        for (const char* hop : names) {
+            if (equalsIgnoreCase(name, hop)) return true;
+        }
+        return false;
+    }
+
+    // Methods a request may be repeated with (RFC 9110, 9.2.2).
+    static bool isIdempotent(std::string_view method) {
+        return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "PUT" || method == "DELETE" ||
+               method == "TRACE";
+    }
+
+    // Starts forwarding an HTTP/1 request on a proxy route once its head
+    // is parsed. The body follows through conn.body_stream as it arrives;
+    // after that the connection stops reading, as for a handed-off
+    // request, until the response head is back. With every backend down
+    // the body is read and dropped, and a 502 answers it.
+    void beginProxy(Connection& conn) {
+        Upstream* up = acquireUpstream(*conn.worker, *conn.route->proxy);
+        if (up == nullptr) {
+            conn.body_stream.on_complete = [](const HTTPRequest&, HTTPResponse& response) {
+                setErrorPage(response, 502);
+            };
+            return;
+        }
+        up->client = conn.socket;
+        up->client_serial = conn.serial;
+        up->request.assign(conn.request);
+        up->chunked_body = conn.parser.isChunked();
+        up->replayable = !conn.parser.hasBody();
+        queueProxyHead(conn, *up, conn.parser.contentLength());
+        conn.upstream = up;
+        Connection* raw = &conn;
+        conn.body_stream.on_data = [this, raw](std::string_view chunk) { forwardBody(*raw, chunk); };
+        conn.body_stream.on_complete = [this, raw](const HTTPRequest&, HTTPResponse& response) {
+            endProxyRequest(*raw, response);
+        };
+        scheduleUpstream(*up);
+    }
+
+    // A piece of the client's body, on its way to the backend.
+    void forwardBody(Connection& conn, std::string_view chunk) {
+        Upstream* up = conn.upstream;
+        if (up == nullptr || chunk.empty()) return;
+        if (up->chunked_body) {
+            char digits[16];
+            std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), chunk.size(), 16);
+            std::string framed = up->output.takeBuffer();
+            framed.append(digits, result.ptr - digits).append("\r\n");
+            framed.append(chunk.data(), chunk.size()).append("\r\n");
+            up->output.push(std::move(framed));
+        } else {
+            up->output.push(chunk);
+        }
+        scheduleUpstream(*up);
+        if (up->output.size() >= max_pending_output) {
+            up->client_paused = true;
+            conn.worker->loop->modify(conn.watcher, 0);
+        }
+    }
+
+    // The client's request is all in; the connection waits for the answer.
+    void endProxyRequest(Connection& conn, HTTPResponse& response) {
+        Upstream* up = conn.upstream;
+        if (up == nullptr) {
+            setErrorPage(response, 502);
+            return;
+        }
+        if (up->chunked_body) {
+            up->output.push(std::string_view("0\r\n\r\n"));
+        }
+        up->request_queued = true;
+        conn.waiting = true;
+        conn.worker->loop->modify(conn.watcher, 0);
+        scheduleUpstream(*up);
+    }
+
+    // Forwards a complete HTTP/2 request. Returns false, for a 502, when
+    // every backend is down.
+    bool proxyStream(Connection& conn, Http2Session::Stream& stream, const Route& route,
+                     std::chrono::steady_clock::time_point handler_start) {
+        Upstream* up = acquireUpstream(*conn.worker, *route.proxy);
+        if (up == nullptr) return false;
+        up->client = conn.socket;
+        up->client_serial = conn.serial;
+        up->stream_id = stream.id;
+        up->metrics_slot = route.metrics_slot;
+        up->handler_start = handler_start;
+        up->request.assign(stream.request);
+        up->replayable = true;
+        queueProxyHead(conn, *up, up->request.body.size());
+        up->output.push(up->request.body);
+        up->request_queued = true;
+        scheduleUpstream(*up);
+        return true;
+    }
+
+    // Queues the request head as the backend gets it: hop-by-hop headers
+    // and those Connection names dropped, X-Forwarded-For and
+    // X-Forwarded-Proto added, Host passed through, and the body framed
+    // afresh (chunked stays chunked, anything else gets a Content-Length).
+    void queueProxyHead(Connection& conn, Upstream& up, size_t body_length) {
+        const HTTPRequest& request = up.request;
+        std::string_view connection = request.headers.get(HTTPHeaders::Connection);
+        std::string_view forwarded_for;
+        bool has_host = false;
+        std::string head = up.output.takeBuffer();
+        head.append(request.method.data(), request.method.size()).append(" ");
+        head.append(request.path.data(), request.path.size());
+        if (!request.query.empty()) head.append("?").append(request.query.data(), request.query.size());
+        head.append(" HTTP/1.1\r\n");
+        for (const HTTPHeader& header : request.headers) {
+            std::string_view name = header.first;
+            if (isHopByHop(name) || hasToken(connection, name) || equalsIgnoreCase(name, "Content-Length") ||
+                equalsIgnoreCase(name, "Expect") || equalsIgnoreCase(name, "HTTP2-Settings") ||
+                equalsIgnoreCase(name, "X-Forwarded-Proto")) {
+                continue;
+            }
+            if (equalsIgnoreCase(name, "X-Forwarded-For")) {
+                forwarded_for = header.second;
+                continue;
+            }
+            has_host = has_host || equalsIgnoreCase(name, "Host");
+            head.append(name.data(), name.size()).append(": ");
+            head.append(header.second.data(), header.second.size()).append("\r\n");
+        }
+        if (!has_host) {
+            head.append("Host: ").append(up.group->backends[up.backend]->name).append("\r\n");
+        }
+        if (conn.client_ip[0] == '\0') {
+            sockaddr_in peer;
+            socklen_t peer_size = sizeof(peer);
+            if (getpeername(conn.socket, (struct sockaddr*)&peer, &peer_size) == 0) {
+                inet_ntop(AF_INET, &peer.sin_addr, conn.client_ip, INET_ADDRSTRLEN);
+            }
+        }
+        head.append("X-Forwarded-For: ");
+        if (!forwarded_for.empty()) head.append(forwarded_for.data(), forwarded_for.size()).append(", ");
+        head.append(conn.client_ip[0] ? conn.client_ip : "unknown").append("\r\n");
+        head.append("X-Forwarded-Proto: ").append(tlsEnabled() ? "https" : "http").append("\r\n");
+        if (up.chunked_body) {
+            head.append("Transfer-Encoding: chunked\r\n");
+        } else if (body_length > 0 || request.headers.find(HTTPHeaders::ContentLength) != request.headers.end()) {
+            head.append("Content-Length: ").append(std::to_string(body_length)).append("\r\n");
+        }
+        head.append("\r\n");
+        up.output.push(std::move(head));
+    }
+
+    // Upstream work runs from a deferred call, so a burst of body chunks
+    // costs one send() and a failure never reaches the client from inside
+    // processInput().
+    void scheduleUpstream(Upstream& up) {
+        if (up.flush_scheduled) return;
+        up.flush_scheduled = true;
+        Worker* worker = up.worker;
+        uint64_t id = up.id;
+        worker->loop->defer([this, worker, id]() {
+            Upstream* up = findUpstream(*worker, id);
+            if (up == nullptr) return;
+            up->flush_scheduled = false;
+            if (up->state != Upstream::Connecting) {
+                flushUpstream(*up);
+            } else if (up->socket == INVALID_SOCKET) {
+                connectUpstream(*up);
+            }
+        });
+    }
+
+    // Opens up's connection to its backend. One that refuses at once is
+    // marked down and the exchange moves on to another.
+    void connectUpstream(Upstream& up) {
+        Worker& worker = *up.worker;
+        while (true) {
+            const ProxyBackend& backend = *up.group->backends[up.backend];
+            up.connect_attempts++;
+            SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+            if (sock != INVALID_SOCKET && setNonBlocking(sock)) {
+#ifdef SO_NOSIGPIPE
+                int opt = 1;
+                setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&opt, sizeof(opt));
+#endif
+                // The head and each piece of the body go out in separate sends.
+                setNoDelay(sock);
+                bool started = ::connect(sock, (const struct sockaddr*)&backend.address, sizeof(backend.address)) == 0;
+#ifdef _WIN32
+                started = started || WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+                started = started || errno == EINPROGRESS;
+#endif
+                if (started) {
+                    up.socket = sock;
+                    up.watcher.fd = sock;
+                    up.watcher.events = EventLoop::Writable;
+                    worker.loop->add(up.watcher);
+                    worker.loop->schedule(up.timer, std::chrono::steady_clock::now() + up.group->options.connect_timeout);
+                    return;
+                }
+            }
+            if (sock != INVALID_SOCKET) closesocket(sock);
+            if (!retryUpstream(up)) return;
+        }
+    }
+
+    void dropUpstreamSocket(Upstream& up) {
+        up.worker->loop->remove(up.watcher);
+        up.worker->loop->cancel(up.timer);
+        closesocket(up.socket);
+        up.socket = INVALID_SOCKET;
+    }
+
+    // After a connection to up's backend failed: marks the backend down
+    // and picks another, since nothing of the request has been sent yet.
+    // Returns false, having failed the exchange, when none is left to try.
+    bool retryUpstream(Upstream& up) {
+        Worker& worker = *up.worker;
+        ProxyGroup& group = *up.group;
+        worker.metrics.upstream_connect_errors.add();
+        if (up.probe) {
+            failUpstream(up, 502);
+            return false;
+        }
+        markBackendDown(group, up.backend);
+        size_t backend = up.connect_attempts < group.backends.size() ? pickBackend(worker, group) : group.backends.size();
+        if (backend == group.backends.size()) {
+            failUpstream(up, 502);
+            return false;
+        }
+        ProxyPool& pool = worker.proxy_pools[group.index];
+        pool.backends[up.backend].active--;
+        pool.backends[backend].active++;
+        up.backend = backend;
+        return true;
+    }
+
+    // The backend may close a pooled connection just as it is reused.
+    // When that happens before any of the response arrived, a request with
+    // an idempotent method and no streamed body is sent once more, on a
+    // new connection to the same backend.
+    bool replayUpstream(Upstream& up) {
+        if (!up.reused || !up.replayable || !up.input.empty() || !isIdempotent(up.request.method)) return false;
+        Connection* conn = findClient(up);
+        if (conn == nullptr) return false;
+        up.reused = false;
+        dropUpstreamSocket(up);
+        up.output.clear();
+        up.state = Upstream::Connecting;
+        up.connect_attempts = 0;
+        queueProxyHead(*conn, up, up.request.body.size());
+        up.output.push(up.request.body);
+        connectUpstream(up);
+        return true;
+    }
+
+    void onUpstreamEvent(Upstream& up, uint32_t events) {
+        switch (up.state) {
+        case Upstream::Connecting: {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(up.socket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == SOCKET_ERROR || error != 0) {
+                dropUpstreamSocket(up);
+                if (retryUpstream(up)) connectUpstream(up);
+                return;
+            }
+            up.worker->metrics.upstream_connects.add();
+            up.state = Upstream::Sending;
+            flushUpstream(up);
+            return;
+        }
+        case Upstream::Sending:
+            if ((events & EventLoop::Closed) && up.output.empty()) {
+                if (replayUpstream(up)) return;
+                up.worker->metrics.upstream_errors.add();
+                failUpstream(up, 502);
+                return;
+            }
+            flushUpstream(up);
+            return;
+        case Upstream::Receiving:
+            readUpstream(up);
+            return;
+        case Upstream::Idle:
+            // The backend closed it, or sent something nobody asked for.
+            closeUpstream(up);
+            return;
+        }
+    }
+
+    void onUpstreamTimeout(Upstream& up) {
+        switch (up.state) {
+        case Upstream::Connecting:
+            dropUpstreamSocket(up);
+            if (retryUpstream(up)) connectUpstream(up);
+            return;
+        case Upstream::Idle:
+            closeUpstream(up);
+            return;
+        case Upstream::Sending:
+        case Upstream::Receiving:
+            up.worker->metrics.upstream_timeouts.add();
+            failUpstream(up, 504);
+            return;
+        }
+    }
+
+    // Sends what up's output holds. Once all of the request is out, the
+    // upstream waits for the response.
+    void flushUpstream(Upstream& up) {
+        if (up.state != Upstream::Sending) return;
+        EventLoop& loop = *up.worker->loop;
+        size_t written = 0;
+        OutputQueue::FlushResult result = up.output.flush(up.socket, written);
+        if (result == OutputQueue::Failed) {
+            if (replayUpstream(up)) return;
+            up.worker->metrics.upstream_errors.add();
+            failUpstream(up, 502);
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (written > 0 || !up.timer.armed()) {
+            loop.schedule(up.timer, now + up.group->options.response_timeout);
+        }
+        if (result == OutputQueue::Blocked) {
+            loop.modify(up.watcher, EventLoop::Writable);
+            return;
+        }
+        if (!up.request_queued) {
+            // Waiting on the client for more of the body.
+            loop.modify(up.watcher, 0);
+            resumeClient(up);
+            return;
+        }
+        up.state = Upstream::Receiving;
+        up.parser.reset();
+        up.parser.expectResponse(up.request.method == "HEAD");
+        loop.modify(up.watcher, EventLoop::Readable);
+        loop.schedule(up.timer, now + up.group->options.response_timeout);
+    }
+
+    // Reads from the client again once the body it sent has gone out.
+    void resumeClient(Upstream& up) {
+        if (!up.client_paused) return;
+        up.client_paused = false;
+        Connection* conn = findClient(up);
+        if (conn == nullptr || conn->waiting) return;
+        conn->worker->loop->modify(conn->watcher, EventLoop::Readable);
+        if (!conn->input.empty()) {
+            processInput(*conn);
+            if (!conn->output.empty()) flushOutput(*conn);
+        }
+        updateTimeout(*conn);
+    }
+
+    // The client took what the response stream held: read the backend again.
+    void resumeUpstream(Worker& worker, uint64_t id) {
+        Upstream* up = findUpstream(worker, id);
+        if (up == nullptr || up->state != Upstream::Receiving || up->watcher.events != 0) return;
+        worker.loop->modify(up->watcher, EventLoop::Readable);
+        worker.loop->schedule(up->timer, std::chrono::steady_clock::now() + up->group->options.response_timeout);
+    }
+
+    void readUpstream(Upstream& up) {
+        size_t read_total = 0;
+        while (read_total < max_read_per_event) {
+            size_t available;
+            char* tail = up.input.tail(read_chunk_size, available);
+            long received = recv(up.socket, tail, (int)available, 0);
+            if (received < 0 && socketWouldBlock()) return;
+            if (received > 0) {
+                up.input.commit(received);
+                read_total += received;
+                up.worker->loop->schedule(up.timer,
+                                          std::chrono::steady_clock::now() + up.group->options.response_timeout);
+            }
+            bool peer_closed = received <= 0;
+            if (!processUpstream(up, peer_closed) || peer_closed) return;
+        }
+    }
+
+    // Takes what up.input holds of the response: the head first, handed
+    // on with deliverHead(), then the body into the client's stream.
+    // Returns false once up should not be read further for now.
+    bool processUpstream(Upstream& up, bool peer_closed) {
+        Worker& worker = *up.worker;
+        HTTPRequestParser& parser = up.parser;
+        if (!parser.headComplete()) {
+            while (true) {
+                HTTPRequestParser::Result result = parser.parseHead(up.input.data(), up.input.size(), up.head);
+                if (result == HTTPRequestParser::Incomplete && !peer_closed) return true;
+                if (result == HTTPRequestParser::Incomplete && replayUpstream(up)) return false;
+                if (result != HTTPRequestParser::Complete || parser.statusCode() == 101) {
+                    worker.metrics.upstream_errors.add();
+                    failUpstream(up, 502);
+                    return false;
+                }
+                if (parser.statusCode() >= 200) break;
+                // Interim responses such as 100 Continue go no further.
+                up.input.erase(0, parser.headSize());
+                parser.reset();
+                parser.expectResponse(up.request.method == "HEAD");
+            }
+            if (up.probe) {
+                int status = parser.statusCode();
+                setBackendHealth(*up.group, up.backend, status >= 200 && status < 400);
+                closeUpstream(up);
+                return false;
+            }
+            if (!deliverHead(up)) return false;
+        }
+
+        ResponseStream& producer = *up.producer;
+        bool accepted = true;
+        size_t used = 0;
+        HTTPRequestParser::Result result =
+            parser.streamBody(up.input.data(), up.input.size(), used, [&producer, &accepted](std::string_view chunk) {
+                if (!producer.write(chunk)) accepted = false;
+            });
+        up.input.erase(parser.headSize(), used);
+        if (result == HTTPRequestParser::Complete || (peer_closed && parser.untilClose())) {
+            bool reusable = result == HTTPRequestParser::Complete && up.input.size() == parser.headSize() &&
+                            wantsKeepAlive(up.head);
+            producer.end();
+            finishExchange(up, reusable);
+            return false;
+        }
+        if (result == HTTPRequestParser::Error || peer_closed) {
+            worker.metrics.upstream_errors.add();
+            failUpstream(up, 502);
+            return false;
+        }
+        if (!accepted) {
+            // resumeUpstream() picks up from the stream's onDrain().
+            worker.loop->modify(up.watcher, 0);
+            worker.loop->cancel(up.timer);
+            return false;
+        }
+        return true;
+    }
+
+    // Passes the response head on to the client: its status and headers
+    // without the hop-by-hop ones, and a ResponseStream for the body.
+    // Returns false when there is no body to stream, or nobody left to
+    // take it.
+    bool deliverHead(Upstream& up) {
+        Connection* conn = findClient(up);
+        Http2Session::Stream* stream = nullptr;
+        if (conn != nullptr && up.stream_id != 0) {
+            stream = conn->h2 ? conn->h2->find(up.stream_id) : nullptr;
+            if (stream == nullptr) conn = nullptr;
+        }
+        if (conn == nullptr) {
+            closeUpstream(up);
+            return false;
+        }
+
+        const HTTPRequestParser& parser = up.parser;
+        HTTPResponse& response = conn->response;
+        response.reset();
+        response.status_code = parser.statusCode();
+        std::string_view reason = parser.reasonPhrase(up.input.data());
+        response.status_message.assign(reason.empty() ? std::string_view(httpStatusMessage(response.status_code)) : reason);
+        bool has_body = parser.hasBody();
+        std::string_view connection = up.head.headers.get(HTTPHeaders::Connection);
+        for (const HTTPHeader& header : up.head.headers) {
+            if (isHopByHop(header.first) || hasToken(connection, header.first) ||
+                (has_body && equalsIgnoreCase(header.first, "Content-Length"))) {
+                continue;
+            }
+            response.headers.add(header.first, header.second);
+        }
+        if (has_body) {
+            std::string_view type = up.head.headers.get(HTTPHeaders::ContentType);
+            up.producer = response.startStream(type, parser.isChunked() || parser.untilClose()
+                                                         ? HTTPResponse::unknown_length
+                                                         : parser.contentLength());
+            if (type.empty()) response.headers.remove("Content-Type");
+            Worker* worker = up.worker;
+            uint64_t id = up.id;
+            up.producer->onDrain([this, worker, id]() { resumeUpstream(*worker, id); });
+            up.producer->onClose([this, worker, id]() {
+                Upstream* gone = findUpstream(*worker, id);
+                if (gone != nullptr) closeUpstream(*gone);
+            });
+        }
+        bool reusable = wantsKeepAlive(up.head) && up.input.size() == parser.headSize();
+
+        conn->last_active = std::chrono::steady_clock::now();
+        if (stream != nullptr) {
+            respondStream(*conn, *stream, up.request, response, up.metrics_slot, up.handler_start);
+        } else {
+            conn->waiting = false;
+            finishRequest(*conn, up.request, response);
+        }
+        if (!has_body) {
+            finishExchange(up, reusable);
+        }
+        flushOutput(*conn);
+        updateTimeout(*conn);
+        return has_body && !up.closed;
+    }
+
+    // Ends an exchange that went wrong. A client still waiting for the
+    // head gets status; one whose response has started is cut off, since
+    // nothing else would tell it the body is short.
+    void failUpstream(Upstream& up, int status) {
+        if (up.probe) {
+            setBackendHealth(*up.group, up.backend, false);
+            closeUpstream(up);
+            return;
+        }
+        bool started = up.producer != nullptr;
+        Connection* conn = findClient(up);
+        if (conn != nullptr && up.stream_id == 0 && conn->upstream != &up) conn = nullptr;
+        closeUpstream(up);
+        if (conn == nullptr) return;
+
+        if (up.stream_id != 0) {
+            Http2Session::Stream* stream = conn->h2 ? conn->h2->find(up.stream_id) : nullptr;
+            if (stream == nullptr) return;
+            if (started) {
+                conn->h2->resetStream(*stream, Http2Session::InternalError);
+            } else {
+                conn->response.reset();
+                setErrorPage(conn->response, status);
+                respondStream(*conn, *stream, up.request, conn->response, up.metrics_slot, up.handler_start);
+            }
+        } else if (started) {
+            closeConnection(*conn);
+            return;
+        } else if (conn->waiting) {
+            conn->waiting = false;
+            conn->response.reset();
+            setErrorPage(conn->response, status);
+            finishRequest(*conn, up.request, conn->response);
+        } else {
+            // Still sending the body.
+            respondWithError(*conn, status);
+        }
+        flushOutput(*conn);
+        updateTimeout(*conn);
+    }
+
+    // Cuts the ties between up and its client.
+    static void releaseClient(Upstream& up) {
+        if (up.producer) {
+            up.producer->onDrain(nullptr);
+            up.producer->onClose(nullptr);
+            up.producer.reset();
+        }
+        if (up.stream_id == 0 && !up.probe) {
+            Connection* conn = findClient(up);
+            if (conn != nullptr && conn->upstream == &up) conn->upstream = nullptr;
+        }
+    }
+
+    // The exchange is over: up goes back to its pool when the backend
+    // keeps the connection open and the pool has room, and is closed
+    // otherwise.
+    void finishExchange(Upstream& up, bool reusable) {
+        Worker& worker = *up.worker;
+        releaseClient(up);
+        ProxyPool::Backend& pool = worker.proxy_pools[up.group->index].backends[up.backend];
+        if (!reusable || !running || pool.idle.size() >= up.group->options.max_idle) {
+            closeUpstream(up);
+            return;
+        }
+        pool.active--;
+        up.state = Upstream::Idle;
+        up.input.release();
+        up.head.clear();
+        up.request.clear();
+        up.client = INVALID_SOCKET;
+        up.stream_id = 0;
+        up.request_queued = false;
+        up.chunked_body = false;
+        up.replayable = false;
+        up.connect_attempts = 0;
+        worker.loop->modify(up.watcher, EventLoop::Readable);
+        worker.loop->schedule(up.timer, std::chrono::steady_clock::now() + up.group->options.idle_timeout);
+        pool.idle.push_back(&up);
+    }
+
+    void closeUpstream(Upstream& up) {
+        if (up.closed) return;
+        up.closed = true;
+        Worker& worker = *up.worker;
+        releaseClient(up);
+        ProxyPool::Backend& pool = worker.proxy_pools[up.group->index].backends[up.backend];
+        if (up.probe) {
+            pool.probing = false;
+        } else if (up.state == Upstream::Idle) {
+            pool.idle.erase(std::remove(pool.idle.begin(), pool.idle.end(), &up), pool.idle.end());
+        } else {
+            pool.active--;
+        }
+        worker.loop->remove(up.watcher);
+        worker.loop->cancel(up.timer);
+        if (up.socket != INVALID_SOCKET) {
+            closesocket(up.socket);
+            up.socket = INVALID_SOCKET;
+        }
+        auto it = worker.upstreams.find(up.id);
+        if (it != worker.upstreams.end()) {
+            // Freed after the current poll(), like a closed Connection.
+            worker.closed_upstreams.push_back(std::move(it->second));
+            worker.upstreams.erase(it);
+        }
+    }
+
+    // Prometheus text format, summed over all workers.
+    void renderMetrics(std::string& out) const {
+        auto total = [this](LocalCounter WorkerMetrics::*counter) {
+            uint64_t sum = 0;
+            for (const auto& worker : workers) sum += (worker->metrics.*counter).load();
+            return sum;
+        };
+        auto family = [&out](const char* name, const char* type, const char* help) {
+            out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+            out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+        };
+        auto sample = [&out](const char* name, std::string_view labels, uint64_t value) {
+            out.append(name);
+            if (!labels.empty()) out.append("{").append(labels.data(), labels.size()).append("}");
+            out.append(" ").append(std::to_string(value)).append("\n");
+        };
 
-    void parse(const std::string& request_str) {
-        std::istringstream iss(request_str);
-        std::string line;
+        uint64_t accepts = total(&WorkerMetrics::accepts);
+        uint64_t closes = total(&WorkerMetrics::closes);
+        family("webserver_connections_accepted_total", "counter", "Connections accepted.");
+        sample("webserver_connections_accepted_total", "", accepts);
+        family("webserver_connections_open", "gauge", "Connections currently open.");
+        sample("webserver_connections_open", "", accepts >= closes ? accepts - closes : 0);
+        family("webserver_timeouts_total", "counter", "Connections closed by a timeout, by the limit that expired.");
+        sample("webserver_timeouts_total", "kind=\"idle\"", total(&WorkerMetrics::idle_timeouts));
+        sample("webserver_timeouts_total", "kind=\"header\"", total(&WorkerMetrics::header_timeouts));
+        sample("webserver_timeouts_total", "kind=\"body\"", total(&WorkerMetrics::body_timeouts));
+        sample("webserver_timeouts_total", "kind=\"write\"", total(&WorkerMetrics::write_timeouts));
+        family("webserver_shed_total", "counter", "Connections and requests turned away with a 503 under overload.");
+        sample("webserver_shed_total", "kind=\"connection\"", total(&WorkerMetrics::shed_connections));
+        sample("webserver_shed_total", "kind=\"request\"", total(&WorkerMetrics::shed_requests));
+        family("webserver_accept_pauses_total", "counter", "Times a worker stopped accepting because the handler queue was full.");
+        sample("webserver_accept_pauses_total", "", total(&WorkerMetrics::accept_pauses));
+        if (tlsEnabled()) {
+            family("webserver_tls_handshakes_total", "counter", "TLS handshakes by outcome.");
+            sample("webserver_tls_handshakes_total", "kind=\"full\"",
+                   total(&WorkerMetrics::tls_handshakes) - total(&WorkerMetrics::tls_resumptions));
+            sample("webserver_tls_handshakes_total", "kind=\"resumed\"", total(&WorkerMetrics::tls_resumptions));
+            sample("webserver_tls_handshakes_total", "kind=\"failed\"", total(&WorkerMetrics::tls_failures));
+            family("webserver_ktls_connections_total", "counter", "TLS connections whose sends the kernel encrypts.");
+            sample("webserver_ktls_connections_total", "", total(&WorkerMetrics::ktls_connections));
+        }
+        if (http2) {
+            family("webserver_http2_connections_total", "counter", "Connections that switched to HTTP/2.");
+            sample("webserver_http2_connections_total", "", total(&WorkerMetrics::http2_connections));
+            family("webserver_http2_streams_total", "counter", "Requests received as HTTP/2 streams.");
+            sample("webserver_http2_streams_total", "", total(&WorkerMetrics::http2_streams));
+        }
+        if (!proxy_groups.empty()) {
+            family("webserver_proxy_requests_total", "counter", "Requests forwarded to proxy backends.");
+            sample("webserver_proxy_requests_total", "", total(&WorkerMetrics::proxy_requests));
+            family("webserver_upstream_connections_total", "counter", "Backend connections used, new or from the pool.");
+            sample("webserver_upstream_connections_total", "kind=\"new\"", total(&WorkerMetrics::upstream_connects));
+            sample("webserver_upstream_connections_total", "kind=\"reused\"", total(&WorkerMetrics::upstream_reuses));
+            family("webserver_upstream_errors_total", "counter", "Failed exchanges with proxy backends, by kind.");
+            sample("webserver_upstream_errors_total", "kind=\"connect\"", total(&WorkerMetrics::upstream_connect_errors));
+            sample("webserver_upstream_errors_total", "kind=\"timeout\"", total(&WorkerMetrics::upstream_timeouts));
+            sample("webserver_upstream_errors_total", "kind=\"response\"", total(&WorkerMetrics::upstream_errors));
+        }
+        if (!response_caches.empty()) {
+            family("webserver_response_cache_requests_total", "counter", "Requests on cached routes, by outcome.");
+            sample("webserver_response_cache_requests_total", "result=\"hit\"", total(&WorkerMetrics::cache_hits));
+            sample("webserver_response_cache_requests_total", "result=\"miss\"", total(&WorkerMetrics::cache_misses));
+            sample("webserver_response_cache_requests_total", "result=\"coalesced\"",
+                   total(&WorkerMetrics::cache_coalesced));
+        }
+        family("webserver_received_bytes_total", "counter", "Bytes read from clients.");
+        sample("webserver_received_bytes_total", "", total(&WorkerMetrics::bytes_received));
+        family("webserver_sent_bytes_total", "counter", "Bytes written to clients.");
+        sample("webserver_sent_bytes_total", "", total(&WorkerMetrics::bytes_sent));
 
-        if (std::getline(iss, line)) {
-            std::istringstream line_stream(line);
-            line_stream >> method >> path >> version;
+        family("webserver_responses_total", "counter", "Responses by status code.");
+        for (int status = WorkerMetrics::min_status; status <= WorkerMetrics::max_status; status++) {
+            uint64_t count = 0;
+            for (const auto& worker : workers) {
+                count += worker->metrics.statuses[status - WorkerMetrics::min_status].load();
+            }
+            if (count > 0) sample("webserver_responses_total", "code=\"" + std::to_string(status) + "\"", count);
         }
 
-        while (std::getline(iss, line) && !line.empty() && line != "\r") {
-            if (line.back() == '\r') {
-                line.pop_back();
+        if (access_log) {
+            family("webserver_access_log_dropped_total", "counter", "Access log lines lost to a full ring.");
+            sample("webserver_access_log_dropped_total", "", access_log->dropped());
+        }
+        if constexpr (tracing_built) {
+            if (tracer) {
+                family("webserver_trace_spans_dropped_total", "counter", "Trace spans lost to a full ring.");
+                sample("webserver_trace_spans_dropped_total", "", tracer->dropped());
             }
-            auto pos = line.find(':');
-            if (pos != std::string::npos) {
-                std::string key = line.substr(0, pos);
-                std::string value = line.substr(pos + 1);
-                while (!value.empty() && (value[0] == ' ' || value[0] == '\t')) {
-                    value.erase(0, 1);
+        }
+
+        family("webserver_errors_total", "counter", "Failures by kind.");
+        sample("webserver_errors_total", "kind=\"accept\"", total(&WorkerMetrics::accept_errors));
+        sample("webserver_errors_total", "kind=\"parse\"", total(&WorkerMetrics::parse_errors));
+        sample("webserver_errors_total", "kind=\"handler\"", total(&WorkerMetrics::handler_errors));
+        sample("webserver_errors_total", "kind=\"connection\"", total(&WorkerMetrics::connection_errors));
+
+        if (!metrics_enabled) return;
+        family("webserver_request_phase_seconds", "histogram", "Time per request in each phase, per route.");
+        static const char* const phases[] = {"parse", "handler", "write"};
+        LatencyHistogram RouteMetrics::*const histograms[] = {&RouteMetrics::parse, &RouteMetrics::handler,
+                                                              &RouteMetrics::write};
+        for (size_t slot = 0; slot < route_labels.size(); slot++) {
+            for (size_t phase = 0; phase < 3; phase++) {
+                uint64_t buckets[LatencyHistogram::bucket_count] = {};
+                uint64_t count = 0;
+                uint64_t sum = 0;
+                for (const auto& worker : workers) {
+                    const LatencyHistogram& histogram = worker->metrics.routes[slot].*histograms[phase];
+                    for (size_t i = 0; i < LatencyHistogram::bucket_count; i++) buckets[i] += histogram.bucket(i);
+                    count += histogram.count();
+                    sum += histogram.sumMicros();
+                }
+                if (count == 0) continue;
+
+                std::string labels = "route=\"";
+                appendLabelValue(labels, route_labels[slot].second);
+                labels.append("\",method=\"");
+                appendLabelValue(labels, route_labels[slot].first.empty() ? "*" : route_labels[slot].first);
+                labels.append("\",phase=\"").append(phases[phase]).append("\"");
+                // Exported bounds step by 4x (1 us, 4 us, ... 16.8 s); each falls on an internal bucket edge.
+                uint64_t cumulative = 0;
+                size_t next = 0;
+                for (uint64_t bound = 1; bound <= (1ull << 24); bound <<= 2) {
+                    while (next < LatencyHistogram::bucket_count && LatencyHistogram::bucketLimit(next) <= bound) {
+                        cumulative += buckets[next++];
+                    }
+                    char le[32];
+                    snprintf(le, sizeof(le), "%.9g", bound / 1e6);
+                    sample("webserver_request_phase_seconds_bucket", labels + ",le=\"" + le + "\"", cumulative);
                 }
-                headers[key] = value;
+                sample("webserver_request_phase_seconds_bucket", labels + ",le=\"+Inf\"", count);
+                char seconds[32];
+                snprintf(seconds, sizeof(seconds), "%.6f", sum / 1e6);
+                out.append("webserver_request_phase_seconds_sum{").append(labels).append("} ").append(seconds).append("\n");
+                sample("webserver_request_phase_seconds_count", labels, count);
             }
         }
+    }
 
-        if (headers.find("Content-Length") != headers.end()) {
-            int content_length = std::stoi(headers["Content-Length"]);
-            std::vector<char> body_buffer(content_length);
-            iss.read(body_buffer.data(), content_length);
-            body = std::string(body_buffer.data(), content_length);
+    static void appendLabelValue(std::string& out, std::string_view value) {
+        for (char c : value) {
+            if (c == '\\' || c == '"') out.push_back('\\');
+            if (c == '\n') {
+                out.append("\\n");
+                continue;
+            }
+            out.push_back(c);
         }
     }
-};
 
-class HTTPResponse {
-public:
-    std::string version;
-    int status_code;
-    std::string status_message;
-    std::unordered_map<std::string, std::string> headers;
-    std::string body;
+    void addRouteEntry(const std::string& method, const std::string& pattern, Route route) {
+        route.metrics_slot = route_labels.size();
+        route_labels.emplace_back(method, pattern);
+        routes.add(method, pattern, route);
+    }
 
-    HTTPResponse() : version("HTTP/1.1"), status_code(200), status_message("OK") {}
+    // Matches the request against the router, leaving captured parameters
+    // in request.params. A known path with the wrong method gets the 405 route.
+    const Route* findRoute(HTTPRequest& request) const {
+        bool path_found = false;
+        const Route* route = routes.find(request.method, request.path, request.params, path_found);
+        if (route == nullptr && path_found) {
+            return &method_not_allowed;
+        }
+        return route;
+    }
+
+    // Formats a line of the access log into the worker's ring:
+    //   127.0.0.1 - - [14/Oct/2026:06:15:31 +0000] "GET /a HTTP/1.1" 200 512 87
+    // in Common Log Format with the latency in microseconds appended.
+    void logAccess(Connection& conn, const HTTPRequest* request, int status, size_t body_bytes,
+                   std::chrono::steady_clock::duration elapsed) {
+        Worker& worker = *conn.worker;
+        if (!access_log->wants(status, worker.log_sample)) return;
+        char* line = worker.log_ring->reserve();
+        if (line == nullptr) return;
+
+        // One byte stays free for the newline; whatever does not fit is cut.
+        size_t used = 0;
+        auto put = [&](std::string_view text) {
+            size_t count = std::min(text.size(), LogRing::line_capacity - 1 - used);
+            memcpy(line + used, text.data(), count);
+            used += count;
+        };
+        auto putNumber = [&](uint64_t value) {
+            char digits[24];
+            std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+            put(std::string_view(digits, result.ptr - digits));
+        };
+        // Keeps quotes and control characters in the target from breaking the line apart.
+        auto putTarget = [&](std::string_view text) {
+            for (size_t i = 0; i < text.size() && used < LogRing::line_capacity - 1; i++) {
+                unsigned char c = (unsigned char)text[i];
+                line[used++] = c < 0x20 || c == 0x7f || c == '"' ? '?' : (char)c;
+            }
+        };
+
+        put(conn.client_ip[0] ? std::string_view(conn.client_ip) : std::string_view("-"));
+        put(" - - ");
+        put(cachedLogTime());
+        if (request != nullptr) {
+            put(" \"");
+            put(request->method);
+            put(" ");
+            putTarget(request->path);
+            if (!request->query.empty()) {
+                put("?");
+                putTarget(request->query);
+            }
+            put(" ");
+            put(request->version);
+            put("\" ");
+        } else {
+            put(" \"-\" ");
+        }
+        putNumber(status);
+        put(" ");
+        if (body_bytes == HTTPResponse::unknown_length) {
+            put("-");
+        } else {
+            putNumber(body_bytes);
+        }
+        put(" ");
+        putNumber((uint64_t)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+        line[used++] = '\n';
+        worker.log_ring->commit(used);
+    }
 
-    void setContent(const std::string& content, const std::string& content_type = "text/html") {
-        body = content;
-        headers["Content-Type"] = content_type;
-        headers["Content-Length"] = std::to_string(body.size());
+    // A request the parser or the size limit turned down.
+    void rejectRequest(Connection& conn, int status) {
+        conn.worker->metrics.parse_errors.add();
+        respondWithError(conn, status);
     }
 
-    std::string toString() const {
-        std::ostringstream oss;
-        oss << version << " " << status_code << " " << status_message << "\r\n";
-        
-        for (const auto& header : headers) {
-            oss << header.first << ": " << header.second << "\r\n";
+    // Answers with an error page and drops whatever else the client sent.
+    void respondWithError(Connection& conn, int status) {
+        if (conn.upstream != nullptr) {
+            closeUpstream(*conn.upstream);
         }
-        
-        oss << "\r\n" << body;
-        return oss.str();
+        HTTPResponse response;
+        setErrorPage(response, status);
+        response.headers["Connection"] = "close";
+        size_t body_bytes = response.body.size();
+        queueResponse(conn, response);
+        conn.worker->metrics.countStatus(status);
+        if (access_log) {
+            auto elapsed = conn.timing ? std::chrono::steady_clock::now() - conn.request_start
+                                       : std::chrono::steady_clock::duration::zero();
+            // The request may be half parsed, so its line is not logged.
+            logAccess(conn, nullptr, status, body_bytes, elapsed);
+        }
+        conn.timing = false;
+        if constexpr (tracing_built) {
+            endTrace(conn, status);
+        }
+        conn.close_after_write = true;
+        conn.request.clear();
+        conn.input.release();
+        conn.parser.reset();
+        conn.route = nullptr;
+        conn.body_stream = BodyStream();
+        conn.streaming = false;
     }
-};
 
-class WebServer {
-private:
-    SOCKET server_socket;
-    int port;
-    bool running;
-    std::unordered_map<std::string, std::function<void(const HTTPRequest&, HTTPResponse&)>> routes;
+    static void setErrorPage(HTTPResponse& response, int status) {
+        response.status_code = status;
+        response.status_message = httpStatusMessage(status);
+        response.setContent("<html><body><h1>" + std::to_string(status) + " " + response.status_message +
+                            "</h1></body></html>");
+    }
 
-    void initializeSocket() {
-#ifdef _WIN32
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            throw std::runtime_error("WSAStartup failed");
+    // HTTP/1.1 connections persist unless the client says otherwise;
+    // HTTP/1.0 ones only when the client asks for it.
+    static bool wantsKeepAlive(const HTTPRequest& request) {
+        bool keep_alive = request.version == "HTTP/1.1";
+        auto it = request.headers.find(HTTPHeaders::Connection);
+        if (it == request.headers.end()) {
+            return keep_alive;
+        }
+        std::string_view tokens = it->second;
+        while (!tokens.empty()) {
+            size_t comma = tokens.find(',');
+            std::string_view token = tokens.substr(0, comma);
+            tokens = comma == std::string_view::npos ? std::string_view() : tokens.substr(comma + 1);
+            size_t first = token.find_first_not_of(" \t");
+            if (first == std::string_view::npos) continue;
+            token = token.substr(first, token.find_last_not_of(" \t") - first + 1);
+            if (equalsIgnoreCase(token, "close")) return false;
+            if (equalsIgnoreCase(token, "keep-alive")) keep_alive = true;
+        }
+        return keep_alive;
+    }
+
+    // Returns false if the handler threw.
+    bool dispatch(const Route* route, const HTTPRequest& request, HTTPResponse& response) {
+        if (route != nullptr && route->handler) {
+            return runHandler(route->handler, request, response);
+        } else {
+            response.status_code = 404;
+            response.status_message = "Not Found";
+            response.setContent("<html><body><h1>404 Not Found</h1></body></html>");
         }
+        return true;
+    }
+
+    // Runs handler, turning an exception into a 500; returns false then.
+    static bool runHandler(const std::function<void(const HTTPRequest&, HTTPResponse&)>& handler,
+                           const HTTPRequest& request, HTTPResponse& response) {
+        if (!handler) return true;
+        try {
+            handler(request, response);
+        } catch (const std::exception& e) {
+            std::cerr << "Handler error: " << e.what() << std::endl;
+            setInternalError(response);
+            return false;
+        }
+        return true;
+    }
+
+    static void setInternalError(HTTPResponse& response) {
+        response = HTTPResponse();
+        response.status_code = 500;
+        response.status_message = "Internal Server Error";
+        response.setContent("<html><body><h1>500 Internal Server Error</h1></body></html>");
+    }
+
+    // Answers from the in-memory cache when the file fits, otherwise with
+    // a sendfile body. Either way conditional requests get 304.
+    void serveStaticFile(const std::string& file_path, const std::string& content_type,
+                         const HTTPRequest& req, HTTPResponse& res) {
+        std::shared_ptr<const StaticFileCache::Entry> entry = static_cache->get(file_path, content_type);
+        if (entry) {
+            res.headers["ETag"] = entry->etag;
+            res.headers["Last-Modified"] = entry->last_modified;
+            if (entry->gzip || entry->brotli) {
+                res.headers["Vary"] = "Accept-Encoding";
+            }
+            if (isNotModified(req, entry->etag, entry->mtime)) {
+                res.status_code = 304;
+                res.status_message = "Not Modified";
+                return;
+            }
+            std::string_view accept = req.headers.get(HTTPHeaders::AcceptEncoding);
+            if (entry->brotli && acceptsEncoding(accept, "br")) {
+                res.setSharedContent(entry->brotli, entry->content_type);
+                res.headers["Content-Encoding"] = "br";
+            } else if (entry->gzip && acceptsEncoding(accept, "gzip")) {
+                res.setSharedContent(entry->gzip, entry->content_type);
+                res.headers["Content-Encoding"] = "gzip";
+            } else {
+                res.setSharedContent(entry->data, entry->content_type);
+            }
+            return;
+        }
+
+        std::shared_ptr<FileBody> file = FileBody::open(file_path);
+        if (!file) {
+            res.status_code = 404;
+            res.status_message = "Not Found";
+            res.setContent("<html><body><h1>404 Not Found</h1></body></html>");
+            return;
+        }
+        std::string etag = StaticFileCache::makeETag(file->size(), file->modifiedTime());
+        res.headers["ETag"] = etag;
+        res.headers["Last-Modified"] = formatHttpDate(file->modifiedTime());
+        if (isNotModified(req, etag, file->modifiedTime())) {
+            res.status_code = 304;
+            res.status_message = "Not Modified";
+            return;
+        }
+        res.file = file;
+        res.headers["Content-Type"] = content_type;
+        res.headers.set("Content-Length", file->size());
+    }
+
+    // If-None-Match wins over If-Modified-Since when both are present.
+    static bool isNotModified(const HTTPRequest& req, const std::string& etag, time_t mtime) {
+        auto if_none_match = req.headers.find(HTTPHeaders::IfNoneMatch);
+        if (if_none_match != req.headers.end()) {
+            std::string_view candidates = if_none_match->second;
+            while (!candidates.empty()) {
+                size_t comma = candidates.find(',');
+                std::string_view candidate = candidates.substr(0, comma);
+                candidates = comma == std::string_view::npos ? std::string_view() : candidates.substr(comma + 1);
+                size_t first = candidate.find_first_not_of(" \t");
+                if (first == std::string_view::npos) continue;
+                candidate = candidate.substr(first, candidate.find_last_not_of(" \t") - first + 1);
+                if (candidate.substr(0, 2) == "W/") candidate.remove_prefix(2);
+                if (candidate == "*" || candidate == etag) return true;
+            }
+            return false;
+        }
+        auto if_modified_since = req.headers.find(HTTPHeaders::IfModifiedSince);
+        time_t since;
+        return if_modified_since != req.headers.end() && parseHttpDate(if_modified_since->second, since) &&
+               mtime <= since;
+    }
+
+    // head_only answers a HEAD request: the head still describes the body.
+    static void queueResponse(Connection& conn, HTTPResponse& response, bool head_only = false) {
+        std::string head = conn.output.takeBuffer();
+        response.serializeHead(head);
+        conn.output.push(std::move(head));
+        if (head_only) {
+            return;
+        }
+        if (response.file) {
+            conn.output.push(std::move(response.file));
+        } else if (response.shared_body) {
+            conn.output.push(std::move(response.shared_body));
+        } else if (!response.body.empty()) {
+            conn.output.push(std::move(response.body));
+            // Hand the response a recycled buffer so its next body reuses capacity.
+            response.body = conn.output.takeBuffer();
+        }
+    }
+
+    // Writes as much of conn.output as the socket takes.
+    OutputQueue::FlushResult sendOutput(Connection& conn) {
+        size_t written = 0;
+        OutputQueue::FlushResult result = writeOutput(conn, written);
+        if (written > 0) {
+            conn.last_active = std::chrono::steady_clock::now();
+            conn.worker->metrics.bytes_sent.add(written);
+        }
+        return result;
+    }
+
+    // Through OpenSSL unless the kernel encrypts, through the ring, or as
+    // one gathering write.
+    static OutputQueue::FlushResult writeOutput(Connection& conn, size_t& written) {
+#ifdef WEBSERVER_WITH_OPENSSL
+        if (conn.tls && !conn.tls->kernelSend()) return conn.output.flush(*conn.tls, written);
+#endif
+#ifdef WEBSERVER_HAVE_IO_URING
+        if (ringIO(conn)) return sendThroughRing(conn, written);
+#endif
+        return conn.output.flush(conn.socket, written);
+    }
+
+#ifdef WEBSERVER_HAVE_IO_URING
+    // Takes the result of the send the ring finished and starts the next,
+    // so the queue drains one completion at a time: Blocked until then,
+    // while the bytes being sent stay queued.
+    static OutputQueue::FlushResult sendThroughRing(Connection& conn, size_t& written) {
+        EventLoop& loop = *conn.worker->loop;
+        written = 0;
+        if (loop.sending(conn.watcher)) return OutputQueue::Blocked;
+        long result;
+        if (loop.sendFinished(conn.watcher, result)) {
+            if (result < 0) return OutputQueue::Failed;
+            conn.output.advance((size_t)result);
+            written = (size_t)result;
+        }
+        if (conn.output.empty()) return OutputQueue::Done;
+
+        iovec buffers[OutputQueue::max_batch];
+        bool whole;
+        size_t count = conn.output.front(buffers, whole);
+        if (count == 0) return OutputQueue::Failed;
+        // The last bytes before a close take the close with them.
+        bool then_close = whole && conn.close_after_write && !conn.waiting && !conn.stream && !conn.h2;
+        loop.send(conn.watcher, buffers, count, then_close);
+        return OutputQueue::Blocked;
+    }
 #endif
 
-        server_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_socket == INVALID_SOCKET) {
-            throw std::runtime_error("Could not create socket");
+    void flushOutput(Connection& conn) {
+        if (conn.h2) {
+            flushHttp2(conn);
+            return;
+        }
+        OutputQueue::FlushResult result = sendOutput(conn);
+        if (result == OutputQueue::Blocked) {
+            conn.worker->loop->modify(conn.watcher, EventLoop::Writable);
+            return;
+        }
+        if (result == OutputQueue::Failed) {
+            conn.worker->metrics.connection_errors.add();
+            closeConnection(conn);
+            return;
         }
 
-        int opt = 1;
-        if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)) == SOCKET_ERROR) {
-            throw std::runtime_error("setsockopt failed");
+        // Responses are written once the queue drains, or for a stream, once it ends.
+        if (!conn.unsent.empty() && (!conn.stream || conn.stream->finished())) {
+            RouteMetrics* routes = conn.worker->metrics.routes.get();
+            for (const auto& queued : conn.unsent) {
+                routes[queued.first].write.record(conn.last_active - queued.second);
+            }
+            conn.unsent.clear();
+        }
+        if constexpr (tracing_built) {
+            if (!conn.traced_unsent.empty() && (!conn.stream || conn.stream->finished())) traceSent(conn);
         }
 
-        sockaddr_in server_addr;
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_addr.s_addr = INADDR_ANY;
-        server_addr.sin_port = htons(port);
+        if (conn.stream) {
+            if (!conn.stream->finished()) {
+                conn.worker->loop->modify(conn.watcher, conn.input.size() < max_pending_output ? EventLoop::Readable : 0);
+                if (!conn.stream->hasPending()) {
+                    drainStream(conn);
+                }
+                return;
+            }
+            std::shared_ptr<ResponseStream> stream = std::move(conn.stream);
+            if (stream->incomplete()) {
+                conn.close_after_write = true;
+            }
+            stream->detach(false);
+        }
 
-        if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-            throw std::runtime_error("Bind failed");
+        if (conn.close_after_write && !conn.waiting) {
+            closeConnection(conn);
+            return;
         }
+        conn.worker->loop->modify(conn.watcher, conn.waiting ? 0 : EventLoop::Readable);
 
-        if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR) {
-            throw std::runtime_error("Listen failed");
+        // Requests that arrived while the socket was blocked are still buffered.
+        if (!conn.input.empty()) {
+            processInput(conn);
+            if (!conn.output.empty()) {
+                flushOutput(conn);
+            }
         }
+    }
 
-        std::cout << "Server started on port " << port << std::endl;
+    void closeConnection(Connection& conn) {
+        if (conn.closed) return;
+        conn.closed = true;
+        if (conn.upstream != nullptr) {
+            closeUpstream(*conn.upstream);
+        }
+        if (conn.stream) {
+            std::shared_ptr<ResponseStream> stream = std::move(conn.stream);
+            stream->detach(true);
+        }
+        if (conn.h2) conn.h2->closeAll();
+        Worker& worker = *conn.worker;
+        bool ring_closes = false;
+#ifdef WEBSERVER_HAVE_IO_URING
+        ring_closes = ringIO(conn) && worker.loop->closing(conn.watcher);
+#endif
+        worker.loop->remove(conn.watcher);
+        worker.loop->cancel(conn.timeout);
+#ifdef WEBSERVER_WITH_OPENSSL
+        if (conn.tls) conn.tls->shutdown();
+#endif
+        if (!ring_closes) closesocket(conn.socket);
+        worker.metrics.closes.add();
+        auto it = worker.connections.find(conn.socket);
+        if (it != worker.connections.end()) {
+            // Freed after the current poll() so pending events never see a dangling watcher.
+            worker.closed_connections.push_back(std::move(it->second));
+            worker.connections.erase(it);
+        }
     }
 
 public:
-    WebServer(int port) : port(port), running(false) {}
+    WebServer(int port)
+        : server_socket(INVALID_SOCKET), port(port), running(false), drain_timeout(30000), ready_fd(-1),
+          worker_count(1), pin_workers(true),
+          keep_alive_timeout(5000), header_timeout(10000), body_timeout(30000), write_timeout(30000),
+          max_connections(0), max_inflight_requests(0), max_queue_depth(0), retry_after(1),
+          max_requests_per_connection(1000),
+          max_body_size(1024 * 1024), handler_threads(0), use_io_uring(false), http2(false),
+          compression(false), compress_min_size(1024), compress_max_size(8 * 1024 * 1024),
+          compressible_types({"text/", "application/json", "application/javascript", "application/xml",
+                              "image/svg+xml", "+json", "+xml"}),
+          metrics_enabled(false), access_log_level(AccessLog::Info), access_log_sample(1),
+          static_cache(std::make_shared<StaticFileCache>(64 * 1024 * 1024, 1024 * 1024)) {
+        route_labels.emplace_back("", "unmatched");
+        method_not_allowed.handler = [this](const HTTPRequest& req, HTTPResponse& res) {
+            res.status_code = 405;
+            res.status_message = "Method Not Allowed";
+            res.headers["Allow"] = routes.allowedMethods(req.path);
+            res.setContent("<html><body><h1>405 Method Not Allowed</h1></body></html>");
+        };
+    }
 
     ~WebServer() {
         stop();
@@ -143,95 +10425,396 @@ public:
 #endif
     }
 
+    // Number of event-loop threads start() runs, including the calling
+    // thread. Routes must all be registered before start().
+    void setWorkerCount(size_t count) {
+        worker_count = count == 0 ? std::max(1u, std::thread::hardware_concurrency()) : count;
+    }
+
+    void setCpuPinning(bool enabled) {
+        pin_workers = enabled;
+    }
+
+    // Drive the event loops through io_uring instead of epoll (Linux 5.11
+    // or later): the ring then also accepts, receives and sends (splicing
+    // files) for plain connections, while TLS and proxy sockets are only
+    // polled through it. Falls back to the default backend where it is
+    // missing.
+    void setIoUring(bool enabled) {
+        use_io_uring = enabled;
+    }
+
+    // Connections idle between requests for this long are closed.
+    void setKeepAliveTimeout(std::chrono::milliseconds timeout) {
+        keep_alive_timeout = timeout;
+    }
+
+    // Longest a client may take to send a request head, counted from its
+    // first byte, so trickling it in a byte at a time does not help.
+    // It also bounds how long a new connection may stay silent.
+    void setHeaderTimeout(std::chrono::milliseconds timeout) {
+        header_timeout = timeout;
+    }
+
+    // Longest gap allowed between reads while receiving a request body.
+    void setBodyTimeout(std::chrono::milliseconds timeout) {
+        body_timeout = timeout;
+    }
+
+    // Longest a queued response may wait without the client taking any of it.
+    void setWriteTimeout(std::chrono::milliseconds timeout) {
+        write_timeout = timeout;
+    }
+
+    // How long stop() and restart() let open connections finish before
+    // closing them (30 seconds by default).
+    void setDrainTimeout(std::chrono::milliseconds timeout) {
+        drain_timeout = timeout;
+    }
+
+    // Open connections each worker keeps; past it, new ones get a 503
+    // and are closed straight away. 0 means no limit.
+    void setMaxConnections(size_t count) {
+        max_connections = count;
+    }
+
+    // Requests each worker lets wait on the handler pool or a coroutine
+    // at once; further requests for such routes get a 503 without running.
+    // 0 means no limit.
+    void setMaxInflightRequests(size_t count) {
+        max_inflight_requests = count;
+    }
+
+    // Jobs allowed to queue for a handler thread. Above it, offloaded
+    // requests get a 503 and workers stop accepting connections until the
+    // queue is down to half. 0 means no limit.
+    void setMaxQueueDepth(size_t depth) {
+        max_queue_depth = depth;
+    }
+
+#ifdef WEBSERVER_WITH_OPENSSL
+    // Serves HTTPS with a PEM certificate chain and private key. Session
+    // tickets work across workers; with kTLS (the Linux "tls" module and
+    // an OpenSSL built for it) static files are still sent with sendfile().
+    void setTls(const std::string& cert_file, const std::string& key_file) {
+        tls_cert_file = cert_file;
+        tls_key_file = key_file;
+    }
+#endif
+
+    // Sent as Retry-After with every overload 503.
+    void setRetryAfter(std::chrono::seconds delay) {
+        retry_after = delay;
+    }
+
+    // Speaks HTTP/2 to clients that ask for it: by ALPN over TLS, and in
+    // cleartext with prior knowledge or an h2c upgrade. Every stream is
+    // answered by the same routes as an HTTP/1 request.
+    void setHttp2(bool enabled) {
+        http2 = enabled;
+    }
+
+    // The response to the n-th request on a connection carries
+    // "Connection: close".
+    void setMaxRequestsPerConnection(size_t count) {
+        max_requests_per_connection = count == 0 ? 1 : count;
+    }
+
+    // Memory budget for static files kept in RAM; 0 turns the cache off.
+    // Files over 1 MiB are always sent from disk.
+    void setStaticFileCacheSize(size_t bytes) {
+        static_cache->setCapacity(bytes);
+    }
+
+    // Largest body collected into HTTPRequest::body; bigger requests get
+    // 413 unless their route streams the body.
+    void setMaxBodySize(size_t size) {
+        max_body_size = size;
+    }
+
+    // Compresses in-memory response bodies of min_size to max_size bytes
+    // whose Content-Type is compressible, with the best coding the client
+    // accepts. Only codecs built in through WEBSERVER_WITH_ZLIB, _BROTLI or
+    // _ZSTD are offered; a build with none sends everything uncompressed.
+    void setCompression(bool enabled, size_t min_size = 1024, size_t max_size = 8 * 1024 * 1024) {
+        compression = enabled;
+        compress_min_size = min_size;
+        compress_max_size = max_size;
+    }
+
+    // Content types setCompression() applies to: "text/" matches by
+    // prefix, "+json" by suffix, anything else the exact media type.
+    void setCompressibleTypes(std::vector<std::string> types) {
+        compressible_types = std::move(types);
+    }
+
+    // Serves Prometheus metrics at path: connection, byte, status and error
+    // counters plus parse/handler/write latency histograms per route.
+    // Workers count on their own, and a scrape adds them up. Call it
+    // before start(); the timing it turns on costs a few clock reads per
+    // request.
+    void enableMetrics(const std::string& path = "/metrics") {
+        metrics_enabled = true;
+        addRoute("GET", path, [this](const HTTPRequest&, HTTPResponse& res) {
+            std::string text;
+            renderMetrics(text);
+            res.setContent(text, "text/plain; version=0.0.4; charset=utf-8");
+        });
+    }
+
+    // Writes one line per response to path, or stdout for "" and "-":
+    // client address, time, request line, status, body bytes and latency
+    // in microseconds. Workers pass lines to a background thread through
+    // lock-free rings, so a request never waits on log I/O; if the writer
+    // falls behind, lines are dropped and counted instead. The file moves
+    // to path.1 (then path.2, up to max_files) when it reaches
+    // max_file_size. Call before start().
+    void setAccessLog(const std::string& path, size_t max_file_size = 64 * 1024 * 1024, size_t max_files = 5) {
+        access_log.reset(new AccessLog(path, max_file_size, max_files));
+    }
+
+    // Responses the access log keeps: errors at or above level, and one
+    // in sample_every of the rest when level is Info.
+    void setAccessLogFilter(AccessLog::Level level, uint32_t sample_every = 1) {
+        access_log_level = level;
+        access_log_sample = sample_every;
+    }
+
+#ifdef WEBSERVER_WITH_TRACING
+    // Traces one in sample_every requests on each worker through accept,
+    // receive, parse, route lookup, handler, serialization and send, and
+    // writes the spans to path in format. Spans are timed with
+    // traceClock() into a lock-free ring per worker that a background
+    // thread drains; if it falls behind, spans are dropped and counted.
+    // An HTTP/2 stream's trace ends once its response is queued, as its
+    // frames share the connection's writes with other streams. Call
+    // before start().
+    void setTracing(const std::string& path, Tracer::Format format = Tracer::ChromeTrace, uint32_t sample_every = 100) {
+        tracer.reset(new Tracer(path, format, sample_every));
+    }
+#endif
+
+    // Threads that run routes added with addOffloadedRoute(). With 0, the
+    // default, those routes run inline on the event loop like any other.
+    void setHandlerThreads(size_t count) {
+        handler_threads = count;
+    }
+
+    // path is a pattern: "/users/:id" captures one segment, "/files/*rest"
+    // captures the remainder; handlers read them with req.param("id").
+    // Without a method the handler answers every method.
     void addRoute(const std::string& path, std::function<void(const HTTPRequest&, HTTPResponse&)> handler) {
-        routes[path] = handler;
+        addRoute("", path, handler);
+    }
+
+    void addRoute(const std::string& method, const std::string& path,
+                  std::function<void(const HTTPRequest&, HTTPResponse&)> handler) {
+        Route route;
+        route.handler = handler;
+        addRouteEntry(method, path, route);
+    }
+
+#ifdef WEBSERVER_HAVE_COROUTINES
+    // Coroutine handlers return Task<> and may co_await AsyncSocket
+    // operations, sleepFor() and other Tasks while the loop keeps serving
+    // other connections:
+    //
+    //   server.addRoute("/upstream", [](const HTTPRequest&, HTTPResponse& res) -> Task<> {
+    //       AsyncSocket backend;
+    //       if (co_await backend.connect("127.0.0.1", 9000)) { ... }
+    //   });
+    //
+    // The request and response stay valid until the task finishes.
+    template <class Handler, class = std::enable_if_t<std::is_same_v<
+                                 std::invoke_result_t<Handler&, const HTTPRequest&, HTTPResponse&>, Task<>>>>
+    void addRoute(const std::string& path, Handler handler) {
+        addRoute("", path, std::move(handler));
+    }
+
+    template <class Handler, class = std::enable_if_t<std::is_same_v<
+                                 std::invoke_result_t<Handler&, const HTTPRequest&, HTTPResponse&>, Task<>>>>
+    void addRoute(const std::string& method, const std::string& path, Handler handler) {
+        Route route;
+        route.async_handler = std::move(handler);
+        addRouteEntry(method, path, route);
+    }
+#endif
+
+    // Route for handlers that block or burn CPU (database calls, heavy
+    // serialization). They run on the handler pool and their response is
+    // sent by the connection's own event loop; cheap routes should use
+    // addRoute() and skip the thread hop.
+    void addOffloadedRoute(const std::string& path, std::function<void(const HTTPRequest&, HTTPResponse&)> handler) {
+        addOffloadedRoute("", path, handler);
+    }
+
+    void addOffloadedRoute(const std::string& method, const std::string& path,
+                           std::function<void(const HTTPRequest&, HTTPResponse&)> handler) {
+        Route route;
+        route.handler = handler;
+        route.offload = true;
+        addRouteEntry(method, path, route);
+    }
+
+    // Route whose GET and HEAD responses are kept for options.ttl and
+    // served to every request with the same target and vary headers, for
+    // handlers whose output changes slowly. Concurrent misses run the
+    // handler once. Responses that set cookies or forbid caching with
+    // Cache-Control are sent but not kept.
+    void addCachedRoute(const std::string& path, std::function<void(const HTTPRequest&, HTTPResponse&)> handler,
+                        const CacheOptions& options) {
+        addCachedRoute("", path, handler, options);
+    }
+
+    void addCachedRoute(const std::string& method, const std::string& path,
+                        std::function<void(const HTTPRequest&, HTTPResponse&)> handler, const CacheOptions& options) {
+        Route route;
+        route.handler = handler;
+        route.offload = options.offload;
+        route.cache = std::make_shared<ResponseCache>(options);
+        response_caches.push_back(route.cache);
+        addRouteEntry(method, path, route);
+    }
+
+    // Route whose request body is handed to a BodyStream as it arrives
+    // instead of being collected into HTTPRequest::body. The factory runs
+    // once the request head has been parsed.
+    void addStreamingRoute(const std::string& path, std::function<BodyStream(const HTTPRequest&)> factory) {
+        addStreamingRoute("", path, factory);
+    }
+
+    void addStreamingRoute(const std::string& method, const std::string& path,
+                           std::function<BodyStream(const HTTPRequest&)> factory) {
+        Route route;
+        route.stream_handler = factory;
+        addRouteEntry(method, path, route);
     }
 
     void addStaticFileRoute(const std::string& path, const std::string& file_path) {
-        routes[path] = [file_path](const HTTPRequest& req, HTTPResponse& res) {
-            std::ifstream file(file_path, std::ios::binary);
-            if (file.is_open()) {
-                std::stringstream buffer;
-                buffer << file.rdbuf();
-                file.close();
-                
-                std::string content_type = "text/plain";
-                auto hasExtension = [](const std::string &str, const std::string &ext) -> bool {
-                    if (str.length() < ext.length()) return false;
-                    return str.compare(str.length() - ext.length(), ext.length(), ext) == 0;
-                };
-                
-                if (hasExtension(file_path, ".html") || hasExtension(file_path, ".htm")) {
-                    content_type = "text/html";
-                } else if (hasExtension(file_path, ".css")) {
-                    content_type = "text/css";
-                } else if (hasExtension(file_path, ".js")) {
-                    content_type = "application/javascript";
-                } else if (hasExtension(file_path, ".json")) {
-                    content_type = "application/json";
-                } else if (hasExtension(file_path, ".png")) {
-                    content_type = "image/png";
-                } else if (hasExtension(file_path, ".jpg") || hasExtension(file_path, ".jpeg")) {
-                    content_type = "image/jpeg";
-                } else if (hasExtension(file_path, ".gif")) {
-                    content_type = "image/gif";
-                }
-                
-                res.setContent(buffer.str(), content_type);
-            } else {
-                res.status_code = 404;
-                res.status_message = "Not Found";
-                res.setContent("<html><body><h1>404 Not Found</h1></body></html>");
+        std::string content_type(mimeTypeFor(file_path));
+
+        Route route;
+        route.handler = [this, file_path, content_type](const HTTPRequest& req, HTTPResponse& res) {
+            serveStaticFile(file_path, content_type, req, res);
+        };
+        addRouteEntry("", path, route);
+    }
+
+    // Serves the tree under directory at url_prefix, e.g. "/static" ->
+    // "public" maps /static/css/site.css to public/css/site.css. Paths are
+    // normalized first and anything resolving outside directory is refused.
+    void addStaticDirectory(const std::string& url_prefix, const std::string& directory) {
+        std::string prefix = url_prefix;
+        while (!prefix.empty() && prefix.back() == '/') prefix.pop_back();
+        if (!prefix.empty() && prefix[0] != '/') prefix.insert(prefix.begin(), '/');
+        std::string root = directory;
+        while (root.size() > 1 && (root.back() == '/' || root.back() == '\\')) root.pop_back();
+
+        Route route;
+        route.handler = [this, root](const HTTPRequest& req, HTTPResponse& res) {
+            std::string relative;
+            if (!normalizeRelativePath(req.param("path"), relative)) {
+                res.status_code = 400;
+                res.status_message = "Bad Request";
+                res.setContent("<html><body><h1>400 Bad Request</h1></body></html>");
+                return;
             }
+            std::string file_path = root + "/" + relative;
+            serveStaticFile(file_path, std::string(mimeTypeFor(file_path)), req, res);
         };
+        if (!prefix.empty()) {
+            addRouteEntry("", prefix, route);
+        }
+        addRouteEntry("", prefix + "/*path", route);
+    }
+
+    // Forwards every request under url_prefix, any method, to one of
+    // options.backends ("host:port") over HTTP/1.1, and streams the answer
+    // back. The path is passed on unchanged, prefix included. Each worker
+    // keeps up to options.max_idle connections per backend open between
+    // requests; with a health_path, the first worker checks every backend
+    // each health_interval and takes those that fail out of rotation.
+    void addProxyRoute(const std::string& url_prefix, const ProxyOptions& options) {
+        if (options.backends.empty()) {
+            throw std::runtime_error("Proxy route " + url_prefix + " has no backends");
+        }
+        std::shared_ptr<ProxyGroup> group = std::make_shared<ProxyGroup>();
+        group->options = options;
+        group->index = proxy_groups.size();
+        for (const std::string& name : options.backends) {
+            group->backends.emplace_back(new ProxyBackend());
+            group->backends.back()->name = name;
+        }
+        proxy_groups.push_back(group);
+
+        std::string prefix = url_prefix;
+        while (!prefix.empty() && prefix.back() == '/') prefix.pop_back();
+        if (!prefix.empty() && prefix[0] != '/') prefix.insert(prefix.begin(), '/');
+        Route route;
+        route.proxy = group;
+        addRouteEntry("", prefix.empty() ? "/" : prefix, route);
+        addRouteEntry("", prefix + "/*path", route);
     }
 
     void start() {
         try {
+            std::lock_guard<std::mutex> lock(lifecycle_mutex);
             initializeSocket();
-            running = true;
-
-            while (running) {
-                sockaddr_in client_addr;
-                socklen_t client_addr_size = sizeof(client_addr);
-                
-                SOCKET client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_addr_size);
-                if (client_socket == INVALID_SOCKET) {
-                    std::cerr << "Accept failed" << std::endl;
-                    continue;
+            createWorkers();
+            if (access_log) {
+                access_log->setFilter(access_log_level, access_log_sample);
+                access_log->start(workers.size());
+                for (size_t i = 0; i < workers.size(); i++) {
+                    workers[i]->log_ring = access_log->ring(i);
                 }
-
-                char client_ip[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-                std::cout << "Client connected: " << client_ip << std::endl;
-
-                const int buffer_size = 8192;
-                char buffer[buffer_size] = {0};
-                int bytes_received = recv(client_socket, buffer, buffer_size - 1, 0);
-                
-                if (bytes_received > 0) {
-                    std::string request_str(buffer, bytes_received);
-                    HTTPRequest request;
-                    request.parse(request_str);
-
-                    HTTPResponse response;
-                    
-                    if (routes.find(request.path) != routes.end()) {
-                        routes[request.path](request, response);
-                    } else {
-                        response.status_code = 404;
-                        response.status_message = "Not Found";
-                        response.setContent("<html><body><h1>404 Not Found</h1></body></html>");
+            }
+            if constexpr (tracing_built) {
+                if (tracer) {
+                    tracer->start(workers.size());
+                    for (size_t i = 0; i < workers.size(); i++) {
+                        workers[i]->trace_ring = tracer->ring(i);
                     }
-
-                    std::string response_str = response.toString();
-                    send(client_socket, response_str.c_str(), response_str.size(), 0);
                 }
-
-                closesocket(client_socket);
             }
+            running = true;
         } catch (const std::exception& e) {
             std::cerr << "Server error: " << e.what() << std::endl;
+            workers.clear();
+            if (server_socket != INVALID_SOCKET) {
+                closesocket(server_socket);
+                server_socket = INVALID_SOCKET;
+            }
+            return;
+        }
+
+        handler_pool.start(handler_threads);
+        for (size_t i = 1; i < workers.size(); i++) {
+            Worker* worker = workers[i].get();
+            worker->thread = std::thread([this, worker]() { runWorker(*worker); });
+        }
+        signalReady();
+        runWorker(*workers[0]);
+
+        for (auto& worker : workers) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
+        }
+        std::lock_guard<std::mutex> lock(lifecycle_mutex);
+        for (auto& worker : workers) {
+            if (worker->owns_socket) {
+                closesocket(worker->server_socket);
+            }
+        }
+        // Jobs still queued post to the workers, so they must outlive the pool.
+        handler_pool.stop();
+        workers.clear();
+        inherited_listeners.clear();
+        if (access_log) {
+            access_log->stop();
+        }
+        if constexpr (tracing_built) {
+            if (tracer) tracer->stop();
         }
 
         if (server_socket != INVALID_SOCKET) {
@@ -240,17 +10823,134 @@ public:
         }
     }
 
+    // Stops taking connections and lets those open finish, for up to the
+    // drain timeout; start() returns once they are done. Safe to call from
+    // any thread.
     void stop() {
+        std::lock_guard<std::mutex> lock(lifecycle_mutex);
+        wakeWorkers();
+    }
+
+#ifndef _WIN32
+    // Zero-downtime reload or upgrade: starts argv[0] (a path, not looked
+    // up in PATH) with argv as a new server process that takes over the
+    // listening sockets, waits until it is serving, then drains this one
+    // as stop() does. The kernel's accept queues belong to the sockets, so
+    // no connection is refused in between and the two accept side by side
+    // until this one stops. The new process must run a WebServer on the
+    // same port, best with the same worker count. Returns false, and this
+    // server keeps serving, when the new process fails to start or is not
+    // serving within startup_timeout. Call it from outside the workers,
+    // e.g. from a thread waiting for SIGHUP.
+    bool restart(char* const argv[], std::chrono::milliseconds startup_timeout = std::chrono::seconds(10)) {
+        std::lock_guard<std::mutex> lock(lifecycle_mutex);
+        if (!running) return false;
+        std::vector<int> keep;
+        std::string listen_fds;
+        for (const auto& worker : workers) {
+            if (std::find(keep.begin(), keep.end(), worker->server_socket) != keep.end()) continue;
+            keep.push_back(worker->server_socket);
+            listen_fds.append(listen_fds.empty() ? "" : ",").append(std::to_string(worker->server_socket));
+        }
+        int ready[2];
+        if (pipe(ready) != 0) return false;
+        fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+        keep.push_back(ready[1]);
+        std::sort(keep.begin(), keep.end());
+
+        // Everything the child needs is built here: between fork() and exec
+        // it may only make async-signal-safe calls.
+        std::vector<std::string> env;
+        for (char** var = environ; *var != nullptr; var++) {
+            if (strncmp(*var, "WEBSERVER_LISTEN_FDS=", 21) != 0 && strncmp(*var, "WEBSERVER_READY_FD=", 19) != 0) {
+                env.push_back(*var);
+            }
+        }
+        env.push_back("WEBSERVER_LISTEN_FDS=" + listen_fds);
+        env.push_back("WEBSERVER_READY_FD=" + std::to_string(ready[1]));
+        std::vector<char*> envp;
+        for (std::string& var : env) envp.push_back(&var[0]);
+        envp.push_back(nullptr);
+        rlimit limit;
+        int max_fd = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY ? (int)limit.rlim_cur - 1
+                                                                                              : 65535;
+
+        pid_t child = fork();
+        if (child == 0) {
+            // The new process gets the listeners and the pipe, and none of
+            // this one's connections, which would otherwise stay open.
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, nullptr);
+            int next = 3;
+            for (int fd : keep) {
+                closeFds(next, fd - 1);
+                fcntl(fd, F_SETFD, 0);
+                next = fd + 1;
+            }
+            closeFds(next, max_fd);
+            execve(argv[0], argv, envp.data());
+            _exit(127);
+        }
+        close(ready[1]);
+        char byte = 0;
+        pollfd readiness{ready[0], POLLIN, 0};
+        bool serving = child > 0 && ::poll(&readiness, 1, (int)startup_timeout.count()) == 1 &&
+                       read(ready[0], &byte, 1) == 1;
+        close(ready[0]);
+        if (!serving) {
+            std::cerr << "Restart failed: " << argv[0] << " did not start serving" << std::endl;
+            if (child > 0) {
+                kill(child, SIGKILL);
+                waitpid(child, nullptr, 0);
+            }
+            return false;
+        }
+        wakeWorkers();
+        return true;
+    }
+#endif
+
+private:
+    void wakeWorkers() {
         running = false;
-        if (server_socket != INVALID_SOCKET) {
-            closesocket(server_socket);
-            server_socket = INVALID_SOCKET;
+        for (auto& worker : workers) {
+            worker->loop->wakeup();
+        }
+    }
+
+#ifndef _WIN32
+    // close() on every descriptor in [first, last]; async-signal-safe.
+    static void closeFds(int first, int last) {
+        if (first > last) return;
+#if defined(__linux__) && defined(SYS_close_range)
+        if (syscall(SYS_close_range, (unsigned)first, (unsigned)last, 0) == 0) return;
+#endif
+        for (int fd = first; fd <= last; fd++) close(fd);
+    }
+#endif
+
+    // Tells the process that started this one with restart() that this
+    // one is serving, so it can start draining.
+    void signalReady() {
+#ifndef _WIN32
+        if (ready_fd < 0) return;
+        char byte = 1;
+        if (write(ready_fd, &byte, 1) != 1) {
+            std::cerr << "Could not tell the old process this one is serving" << std::endl;
         }
+        close(ready_fd);
+        ready_fd = -1;
+#endif
     }
 };
 
 // 示例用法
-int main() {
+// Define WEBSERVER_NO_MAIN to include this file from another program,
+// as the benchmarks in bench/ do.
+#ifndef WEBSERVER_NO_MAIN
+int main(int argc, char* argv[]) {
+    (void)argc;
     try {
         WebServer server(8080);
         
@@ -263,7 +10963,26 @@ int main() {
         });
         
         server.addStaticFileRoute("/index.html", "public/index.html");
+        server.addStaticDirectory("/static", "public");
         
+#ifndef _WIN32
+        // SIGTERM and SIGINT drain and exit; SIGHUP starts the binary anew
+        // on the same sockets first, e.g. after it was replaced on disk.
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        std::thread([&server, signals, argv]() {
+            int signal = 0;
+            while (sigwait(&signals, &signal) == 0) {
+                if (signal != SIGHUP || server.restart(argv)) break;
+            }
+            server.stop();
+        }).detach();
+#endif
+
         std::cout << "Starting server on port 8080..." << std::endl;
         server.start();
     } catch (const std::exception& e) {
@@ -273,3 +10992,4 @@ int main() {
     
     return 0;
 }
+#endif